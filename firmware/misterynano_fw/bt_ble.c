@@ -210,9 +210,11 @@ static u8_t gatt_read_hid_report_descriptor_cb(struct bt_conn *conn, u8_t err,
 
     // search for gamepad usage in report descriptor
     uint16_t rbytes = 0;
+    hid_parser_t parser;
+    hid_parser_init(&parser);
     do {    
       hid_report_t hid_report;
-      if(parse_report_descriptor(rd->data+rbytes, rd->len-rbytes, &hid_report, &rbytes)) {
+      if(parse_report_descriptor(rd->data+rbytes, rd->len-rbytes, &hid_report, &rbytes, &parser)) {
 	// we really need a report id to distinguish the reports
 	if(hid_report.report_id_present) {	
 	  printf("Report type %d ok, id=%d\r\n", hid_report.type, hid_report.report_id);
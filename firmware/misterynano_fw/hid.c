@@ -0,0 +1,584 @@
+// hid.c
+//
+// translation of usb hid reports into the core's keyboard, mouse
+// and joystick events. This is kept free of any usb stack specific
+// code so it can also be built and run on a PC (see hid_replay.c)
+
+#ifndef SDL
+#include <FreeRTOS.h>
+#include <queue.h>
+#include <task.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hidparser.h"
+#include "hid.h"
+#ifndef SDL
+#include "osd.h"
+#else
+// the replay tool has no display, only the osd's visibility is used
+int osd_is_visible(struct osd_S *);
+#endif
+#include "sysctrl.h"   // for core_id
+#include "menu.h"      // for event codes
+
+#ifndef SDL
+// queue to send messages to OSD thread
+extern QueueHandle_t xQueue;
+
+static void hid_menu_event(unsigned long msg) {
+  xQueueSendToBackFromISR(xQueue, &msg,  ( TickType_t ) 0);
+}
+
+// mouse movement is collected by the usb threads and sent by the
+// mouse thread
+#define HID_LOCK()    taskENTER_CRITICAL()
+#define HID_UNLOCK()  taskEXIT_CRITICAL()
+#else
+// the PC replay tool records menu events instead
+extern void hid_menu_event(unsigned long msg);
+
+#define HID_LOCK()
+#define HID_UNLOCK()
+#endif
+
+// the osd is needed to check whether key events go to the menu
+static struct osd_S *hid_osd = NULL;
+
+void hid_register_osd(struct osd_S *osd) {
+  hid_osd = osd;
+}
+
+// print data in a format understood by hid_replay
+bool hid_trace = false;
+
+void hid_trace_dump(const char *dev, int index, char type, const unsigned char *data, int len) {
+  printf("@%s%d %c", dev, index, type);
+  for(int i=0;i<len;i++) printf(" %02x", data[i]);
+  printf("\r\n");
+}
+
+// include the keyboard mappings
+#include "atari_st.h"
+#include "c64.h"
+#include "vic20.h"
+#include "amiga.h"
+#include "a2600.h"
+
+// all keymaps cover the usb key codes 0x00 to 0x64
+#define KEYMAP_SIZE 0x65
+
+const unsigned char *keymap[] = {
+  NULL,             // id 0: unknown core
+  keymap_atarist,   // id 1: atari st
+  keymap_c64,       // id 2: c64
+  keymap_vic20,     // id 3: vic20
+  keymap_amiga,     // id 4: amiga
+  keymap_a2600      // id 5: a2600
+};
+
+const unsigned char *modifier[] = {
+  NULL,             // id 0: unknown core
+  modifier_atarist, // id 1: atari st
+  modifier_c64,     // id 2: c64
+  modifier_vic20,   // id 3: vic20
+  modifier_amiga,   // id 4: amiga
+  modifier_a2600    // id 5: a2600
+};
+
+// set if the core's hid implementation understands SPI_HID_BATCH
+bool hid_batch_supported = false;
+
+// set if the core's hid implementation understands SPI_HID_IRQ
+bool hid_vbl_supported = false;
+static bool hid_vbl_armed = false;
+static bool hid_vbl_missed = false;   // arm requested while armed
+
+unsigned char hid_mouse_sync = HID_MOUSE_SYNC_OFF;
+
+void hid_batch_begin(hid_batch_t *batch, spi_t *spi) {
+  batch->spi = spi;
+  batch->len = 0;
+}
+
+void hid_batch_flush(hid_batch_t *batch) {
+  if(!batch->len) return;
+  
+  spi_t *spi = batch->spi;
+  if(hid_batch_supported) {
+    // send all records in one go
+    spi_begin_prio(spi, SPI_PRIO_INPUT);
+    spi_tx_u08(spi, SPI_TARGET_HID);
+    spi_tx_u08(spi, SPI_HID_BATCH);
+    for(int i=0;i<batch->len;i++)
+      spi_tx_u08(spi, batch->data[i]);
+    spi_end(spi);
+  } else {
+    // older cores need one transaction per record
+    for(int i=0;i<batch->len;i+=1+(batch->data[i]&15)) {
+      spi_begin_prio(spi, SPI_PRIO_INPUT);
+      spi_tx_u08(spi, SPI_TARGET_HID);
+      spi_tx_u08(spi, batch->data[i]>>4);
+      for(int j=0;j<(batch->data[i]&15);j++)
+	spi_tx_u08(spi, batch->data[i+1+j]);
+      spi_end(spi);
+    }
+  }
+  batch->len = 0;
+}
+
+void hid_batch_add(hid_batch_t *batch, unsigned char cmd, const unsigned char *data, int len) {
+  // the record header only has four bits each for command and length.
+  // Anything larger is sent on its own, keeping the order of events
+  if(cmd > 15 || len > 15) {
+    hid_batch_flush(batch);
+    
+    spi_t *spi = batch->spi;
+    spi_begin_prio(spi, SPI_PRIO_INPUT);
+    spi_tx_u08(spi, SPI_TARGET_HID);
+    spi_tx_u08(spi, cmd);
+    for(int i=0;i<len;i++)
+      spi_tx_u08(spi, data[i]);
+    spi_end(spi);
+    return;
+  }
+  
+  // flush early if the record doesn't fit anymore
+  if(batch->len + 1 + len > HID_BATCH_MAX)
+    hid_batch_flush(batch);
+
+  batch->data[batch->len++] = (cmd << 4) | len;
+  memcpy(batch->data + batch->len, data, len);
+  batch->len += len;
+}
+
+void kbd_tx(hid_batch_t *batch, unsigned char byte) {
+  printf("KBD: %02x\r\n", byte);
+  hid_batch_add(batch, SPI_HID_KEYBOARD, &byte, 1);
+}
+
+// the c64 core can use the numerical pad on the keyboard to
+// emulate a joystick
+void kbd_num2joy(hid_batch_t *batch, char state, unsigned char code) {
+  static unsigned char kbd_joy_state = 0;
+  static unsigned char kbd_joy_state_last = 0;
+  
+  // mapping:
+  // keycode 5a = KP 2 = down
+  // keycode 5c = KP 4 = left
+  // keycode 5e = KP 6 = right
+  // keycode 60 = KP 8 = up
+  // keycode 62 = KP 0 = fire
+  // keycode 63 = KP . and delete = 2nd trigger button
+  // keycode 44 = F11 = Restore Key
+  // keycode 4b = Page Up = Tape Play Key
+  
+  if(state == 0)
+    // start parsing a new set of keys
+    kbd_joy_state = 0;
+  else if(state == 1) {
+    // collect key/btn states
+    if(code == 0x5e) kbd_joy_state |= 0x01;
+    if(code == 0x5c) kbd_joy_state |= 0x02;
+    if(code == 0x5a) kbd_joy_state |= 0x04;
+    if(code == 0x60) kbd_joy_state |= 0x08;
+    if(code == 0x62) kbd_joy_state |= 0x10;
+    if(code == 0x63) kbd_joy_state |= 0x20;
+    if(code == 0x44) kbd_joy_state |= 0x40;
+    if(code == 0x4b) kbd_joy_state |= 0x80;
+  } else if(state == 2) {
+    // submit if state has changed
+    if(kbd_joy_state != kbd_joy_state_last) {
+      
+      printf("KP Joy: %02x\r\n", kbd_joy_state);
+
+      // report this as joystick 0x80 as js0-x are USB joysticks
+      unsigned char js[] = { 0x80, kbd_joy_state };
+      hid_batch_add(batch, SPI_HID_JOYSTICK, js, sizeof(js));
+      
+      kbd_joy_state_last = kbd_joy_state;
+    }
+  }
+}
+  
+// read eight bits at any bit offset from a report of nbytes length.
+// Bits beyond the end of the report read as zero
+static inline uint8_t kbd_get_byte(const unsigned char *p, int nbytes, uint16_t offset) {
+  if(offset/8 >= nbytes) return 0;
+  uint16_t v = p[offset/8];
+  if((offset & 7) && offset/8+1 < nbytes) v |= p[offset/8+1] << 8;
+  return v >> (offset & 7);
+}
+
+// set up to eight key bits in the key bitmap
+static inline void kbd_set_bits(uint32_t *keys, uint16_t code, uint8_t bits) {
+  if(code >= 256) return;
+  keys[code/32] |= (uint32_t)bits << (code%32);
+  if((code%32) > 24 && code/32 < 7)
+    keys[code/32+1] |= bits >> (32-(code%32));
+}
+
+static void kbd_key_event(hid_batch_t *batch, unsigned char code, bool pressed) {
+  // codes beyond the keymaps don't exist in the cores
+  if(code >= KEYMAP_SIZE) return;
+  
+  // key released?
+  if(!pressed) {
+    if(!osd_is_visible(hid_osd))
+      kbd_tx(batch, 0x80 | keymap[core_id][code]);
+    return;
+  }
+  
+  // key pressed
+  unsigned long msg = 0;
+
+  // F12 toggles the OSD state. Therefore F12 must never be forwarded
+  // to the core and thus must have an empty entry in the keymap. ESC
+  // can only close the OSD.
+
+  // Caution: Since the OSD closes on the press event, the following
+  // release event will be sent into the core. The core should thus
+  // cope with release events that did not have a press event before
+  if(code == 0x45 || (osd_is_visible(hid_osd) && code == 0x29))
+    msg = osd_is_visible(hid_osd)?MENU_EVENT_HIDE:MENU_EVENT_SHOW;
+  else {
+    if(!osd_is_visible(hid_osd))
+      kbd_tx(batch, keymap[core_id][code]);
+    else {
+      // check if cursor up/down or space has been pressed
+      if(code == 0x51) msg = MENU_EVENT_DOWN;      
+      if(code == 0x52) msg = MENU_EVENT_UP;
+      if(code == 0x4e) msg = MENU_EVENT_PGDOWN;      
+      if(code == 0x4b) msg = MENU_EVENT_PGUP;
+      if((code == 0x2c) || (code == 0x28))
+	msg = MENU_EVENT_SELECT;
+    }
+  }
+  
+  if(msg) hid_menu_event(msg);
+}
+
+// Keyboard reports are translated into a bitmap of all 256 possible key
+// codes, regardless whether the keyboard reports an array of key codes
+// (boot keyboards) or a bitmap (NKRO keyboards). Changes are then
+// detected by comparing the previous and the current bitmap.
+void kbd_parse(spi_t *spi, hid_report_t *report, struct hid_kbd_state_S *state,
+	       const unsigned char *buffer, int nbytes) {
+  uint32_t keys[8] = { 0 };
+  
+  // make sure the report is long enough for modifiers and keys
+  uint16_t keys_bits = report->keyboard.keys_count * (report->keyboard.keys_bitmap?1:8);
+  if((report->keyboard.modifier_offset >= 0 &&
+      nbytes*8 < report->keyboard.modifier_offset + 8) ||
+     nbytes*8 < report->keyboard.keys_offset + keys_bits)
+    return;
+
+  if(report->keyboard.keys_bitmap) {
+    for(int i=0;i<report->keyboard.keys_count;i+=8) {
+      uint8_t bits = kbd_get_byte(buffer, nbytes, report->keyboard.keys_offset + i);
+      if(report->keyboard.keys_count - i < 8)
+	bits &= 0xff >> (8 - (report->keyboard.keys_count - i));
+      kbd_set_bits(keys, report->keyboard.keys_first + i, bits);
+    }
+  } else {
+    for(int i=0;i<report->keyboard.keys_count;i++) {
+      uint8_t code = kbd_get_byte(buffer, nbytes, report->keyboard.keys_offset + 8*i);
+      // keep the previous state if the keyboard reports a rollover error
+      if(code == 0x01) return;
+      if(code) keys[code/32] |= 1u << (code%32);
+    }
+  }
+
+  // the modifiers (key codes e0 to e7) are treated as keys as well
+  if(report->keyboard.modifier_offset >= 0)
+    keys[7] |= kbd_get_byte(buffer, nbytes, report->keyboard.modifier_offset);
+  
+  hid_batch_t batch;
+  hid_batch_begin(&batch, spi);
+  
+  // check if modifier have changed
+  uint8_t mod_changed = (keys[7] ^ state->last_keys[7]) & 0xff;
+  if(mod_changed && !osd_is_visible(hid_osd)) {
+    for(int i=0;i<8;i++) {
+      if(modifier[core_id][i] && (mod_changed & (1<<i))) {
+	// modifier pressed or released?
+	if(keys[7] & (1<<i)) kbd_tx(&batch, modifier[core_id][i]);
+	else                 kbd_tx(&batch, 0x80 | modifier[core_id][i]);
+      }
+    }
+  }
+
+  // check if regular keys have changed
+  for(int w=0;w<8;w++) {
+    uint32_t changed = keys[w] ^ state->last_keys[w];
+    if(w == 7) changed &= ~0xff;    // modifiers have already been handled
+    
+    while(changed) {
+      int bit = __builtin_ctz(changed);
+      kbd_key_event(&batch, 32*w+bit, keys[w] & (1u<<bit));
+      changed &= changed-1;
+    }
+  }
+  memcpy(state->last_keys, keys, sizeof(keys));
+
+  // C64 uses some keys for joystick emulation
+  if(core_id == CORE_ID_C64||core_id == CORE_ID_VIC20||core_id == CORE_ID_A2600) {
+    kbd_num2joy(&batch, 0, 0);
+    for(int w=0;w<4;w++) {
+      uint32_t pressed = keys[w];
+      while(pressed) {
+	kbd_num2joy(&batch, 1, 32*w+__builtin_ctz(pressed));
+	pressed &= pressed-1;
+      }
+    }
+    
+    // check if numpad joystick has changed state and send message if so
+    kbd_num2joy(&batch, 2, 0);
+  }
+
+  hid_batch_flush(&batch);
+}
+
+// accumulated movement is limited to what the core can
+// consume within a few frames
+#define HID_MOUSE_MAX  1024
+
+static inline int16_t mouse_clamp(int v, int limit) {
+  if(v >  limit) return  limit;
+  if(v < -limit) return -limit;
+  return v;
+}
+
+void mouse_parse(spi_t *spi, hid_report_t *report, struct hid_mouse_state_S *state,
+		 const unsigned char *buffer, int nbytes) {
+  // we expect at least three bytes:
+  if(nbytes < 3) return;
+  
+  //  printf("MOUSE:"); for(int i=0;i<nbytes;i++) printf(" %02x", buffer[i]); printf("\r\n");
+  
+  // collect info about the two axes
+  int16_t a[2];
+  for(int i=0;i<2;i++)
+    a[i] = hid_field_get(&report->joystick_mouse.plan.axis[i], buffer);
+
+  // ... and two buttons
+  uint8_t btns = hid_buttons_get(report, buffer) & 3;
+
+  HID_LOCK();
+  state->dx = mouse_clamp(state->dx + a[0], HID_MOUSE_MAX);
+  state->dy = mouse_clamp(state->dy + a[1], HID_MOUSE_MAX);
+  state->btns = btns;
+  bool btns_changed = btns != state->btns_sent;
+  HID_UNLOCK();
+
+  // button changes are sent immediately together with any movement
+  // that happened before
+  if(hid_mouse_sync == HID_MOUSE_SYNC_OFF || btns_changed)
+    mouse_flush(spi, state);
+  else if(hid_mouse_sync == HID_MOUSE_SYNC_VBL && hid_vbl_supported)
+    hid_vbl_arm(spi);
+}
+
+// send the accumulated movement to the core. Returns true if movement
+// is left which didn't fit into the eight bit fields
+bool mouse_flush(spi_t *spi, struct hid_mouse_state_S *state) {
+  HID_LOCK();
+  int8_t dx = mouse_clamp(state->dx, 127);
+  int8_t dy = mouse_clamp(state->dy, 127);
+  state->dx -= dx;
+  state->dy -= dy;
+  bool changed = dx || dy || (state->btns != state->btns_sent);
+  unsigned char btns = state->btns_sent = state->btns;
+  bool pending = state->dx || state->dy;
+  HID_UNLOCK();
+
+  if(changed) {
+    hid_batch_t batch;
+    hid_batch_begin(&batch, spi);
+    unsigned char m[] = { btns, dx, dy };
+    hid_batch_add(&batch, SPI_HID_MOUSE, m, sizeof(m));
+    hid_batch_flush(&batch);
+  }
+
+  return pending;
+}
+
+// request a single interrupt at the next vertical blank
+void hid_vbl_arm(spi_t *spi) {
+  HID_LOCK();
+  bool armed = hid_vbl_armed;
+  hid_vbl_armed = true;
+  // the interrupt may already have fired without hid_vbl_event()
+  // having run yet
+  if(armed) hid_vbl_missed = true;
+  HID_UNLOCK();
+  if(armed) return;
+  
+  spi_begin_prio(spi, SPI_PRIO_INPUT);
+  spi_tx_u08(spi, SPI_TARGET_HID);
+  spi_tx_u08(spi, SPI_HID_IRQ);
+  spi_tx_u08(spi, 0x01);
+  spi_end(spi);
+}
+
+// the requested vertical blank interrupt has happened
+void hid_vbl_event(spi_t *spi) {
+  HID_LOCK();
+  bool rearm = hid_vbl_missed;
+  hid_vbl_armed = false;
+  hid_vbl_missed = false;
+  HID_UNLOCK();
+
+  // movement reported meanwhile needs another interrupt
+  if(rearm) hid_vbl_arm(spi);
+}
+
+void joystick_parse(spi_t *spi, hid_report_t *report, struct hid_joystick_state_S *state,
+		    const unsigned char *buffer, int nbytes) {
+  (void)nbytes;   // the report size has been checked by hid_parse
+  //  printf("joystick: %d %02x %02x %02x %02x\r\n", nbytes,
+  //  	 buffer[0]&0xff, buffer[1]&0xff, buffer[2]&0xff, buffer[3]&0xff);
+
+  // collect info about the two axes
+  int a[2];
+  for(int i=0;i<2;i++)
+    a[i] = hid_field_get(&report->joystick_mouse.plan.axis[i], buffer);
+
+  // ... and four buttons and the eight extra buttons
+  uint16_t btns = hid_buttons_get(report, buffer);
+  unsigned char joy = (btns & 0x0f) << 4;
+  unsigned char btn_extra = btns >> 4;
+
+  // map directions to digital
+  if(a[0] > 0xc0) joy |= 0x01;
+  if(a[0] < 0x40) joy |= 0x02;
+  if(a[1] > 0xc0) joy |= 0x04;
+  if(a[1] < 0x40) joy |= 0x08;
+
+  int ax = 0;
+  int ay = 0;
+  ax = a[0];
+  ay = a[1];
+
+  if((joy != state->last_state) ||
+     (ax != state->last_state_x) ||
+     (ay != state->last_state_y) ||
+     (btn_extra != state->last_state_btn_extra)) {
+    state->last_state = joy;
+    state->last_state_x = ax;
+    state->last_state_y = ay;
+    state->last_state_btn_extra = btn_extra;
+
+    printf("JOY%d: %02x A0 %02x A1 %02x B %02x\r\n", state->js_index, joy, ax, ay, btn_extra);
+  
+    hid_batch_t batch;
+    hid_batch_begin(&batch, spi);
+    unsigned char js[] = {
+      state->js_index, joy,
+      ax,           // e.g. gamepad X
+      ay,           // e.g. gamepad Y
+      btn_extra     // e.g. gamepad extra buttons
+    };
+    hid_batch_add(&batch, SPI_HID_JOYSTICK, js, sizeof(js));
+    hid_batch_flush(&batch);
+  }
+}
+
+// media keys as found on e.g. the Rii keyboard/touch combos are
+// used as a joystick
+void consumer_parse(spi_t *spi, hid_report_t *report, struct hid_consumer_state_S *state,
+		    const unsigned char *buffer, int nbytes) {
+  unsigned char joy = 0;
+
+  for(int i=0;i<report->consumer.count;i++) {
+    uint16_t offset = report->consumer.offset + i * report->consumer.size;
+    uint16_t code = kbd_get_byte(buffer, nbytes, offset);
+    if(report->consumer.size == 16) code |= kbd_get_byte(buffer, nbytes, offset+8) << 8;
+
+    if(code == 0xcd) joy |= 0x10;      // cd == play/pause  -> center
+    if(code == 0xe9) joy |= 0x08;      // e9 == V+          -> up
+    if(code == 0xea) joy |= 0x04;      // ea == V-          -> down
+    if(code == 0xb6) joy |= 0x02;      // b6 == skip prev   -> left
+    if(code == 0xb5) joy |= 0x01;      // b5 == skip next   -> right
+  }
+
+  if(joy == state->last_state)
+    return;
+  state->last_state = joy;
+  
+  printf("Media Joy: %02x %02x\r\n", 0, joy);
+  
+  hid_batch_t batch;
+  hid_batch_begin(&batch, spi);
+  unsigned char js[] = { 0, joy };  // media keys always report as joystick 0
+  hid_batch_add(&batch, SPI_HID_JOYSTICK, js, sizeof(js));
+  hid_batch_flush(&batch);
+}
+
+// route a raw report as received from a hid device to the parser
+// matching its report id
+void hid_parse(spi_t *spi, hid_reports_t *reports, struct hid_state_S *state,
+	       const unsigned char *buffer, int nbytes) {
+  hid_report_t *report = hid_report_find(reports, buffer, nbytes);
+  if(!report) return;
+
+  state += report - reports->report;
+  
+  // skip report id
+  if(reports->report_id_present) {
+    buffer++; nbytes--;
+  }
+  
+  if(nbytes != report->report_size)
+    return;
+
+  switch(report->type) {
+  case REPORT_TYPE_KEYBOARD:
+    kbd_parse(spi, report, &state->keyboard, buffer, nbytes);
+    break;
+    
+  case REPORT_TYPE_MOUSE:
+    mouse_parse(spi, report, &state->mouse, buffer, nbytes);
+    break;
+    
+  case REPORT_TYPE_JOYSTICK:
+    joystick_parse(spi, report, &state->joystick, buffer, nbytes);
+    break;
+    
+  case REPORT_TYPE_CONSUMER:
+    consumer_parse(spi, report, &state->consumer, buffer, nbytes);
+    break;
+  }
+}
+
+void xbox_parse(spi_t *spi, struct hid_xbox_state_S *state,
+		const unsigned char *buffer, int nbytes) {
+  // verify length field
+  if(nbytes < XBOX_REPORT_SIZE || buffer[0] != 0 || buffer[1] != 20)
+    return;
+
+  // the xbox controller sends the direction bits in exactly the
+  // reversed order than we expect ...
+  unsigned char joy =
+    ((buffer[2] & 0x01)<<3) | ((buffer[2] & 0x02)<<1) |
+    ((buffer[2] & 0x04)>>1) | ((buffer[2] & 0x08)>>3) |
+    (buffer[3] & 0xf0);
+  
+  // submit if state has changed
+  if(joy != state->last_state) {
+    
+    printf("XBOX Joy%d: %02x\r\n", state->js_index, joy);
+  
+    hid_batch_t batch;
+    hid_batch_begin(&batch, spi);
+    unsigned char js[] = { state->js_index, joy };
+    hid_batch_add(&batch, SPI_HID_JOYSTICK, js, sizeof(js));
+    hid_batch_flush(&batch);
+    
+    state->last_state = joy;
+  }
+}
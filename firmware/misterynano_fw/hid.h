@@ -5,12 +5,39 @@
 
 #include <stdbool.h>
 #include "hidparser.h"
+#include "spi.h"
+
+struct osd_S;   // see osd.h
+
+#define XBOX_REPORT_SIZE 20
+
+// All events derived from one report are collected in a batch and are
+// sent to the core in a single SPI transaction. Each record consists of
+// a header byte (SPI_HID_xxx command in the upper, payload length in the
+// lower nibble) followed by the payload bytes.
+#define HID_BATCH_MAX   64
+
+typedef struct {
+  spi_t *spi;
+  int len;
+  unsigned char data[HID_BATCH_MAX];
+} hid_batch_t;
+
+void hid_batch_begin(hid_batch_t *batch, spi_t *spi);
+void hid_batch_add(hid_batch_t *batch, unsigned char cmd, const unsigned char *data, int len);
+void hid_batch_flush(hid_batch_t *batch);
+
+// set if the core's hid implementation understands SPI_HID_BATCH
+extern bool hid_batch_supported;
 
 struct hid_kbd_state_S {
-  unsigned char last_report[8];	
+  uint32_t last_keys[8];           // bitmap of all keys incl. modifiers
 };
 
 struct hid_mouse_state_S {
+  int16_t dx, dy;                  // movement not yet sent to the core
+  unsigned char btns;              // current buttons
+  unsigned char btns_sent;         // buttons last sent to the core
 };
 
 struct hid_joystick_state_S {
@@ -21,9 +48,57 @@ struct hid_joystick_state_S {
   unsigned char last_state_btn_extra;
 };
 
+struct hid_consumer_state_S {
+  unsigned char last_state;
+};
+
+// parser state of one report. A device has one per usable report
+struct hid_state_S {
+  union {
+    struct hid_kbd_state_S keyboard;
+    struct hid_mouse_state_S mouse;
+    struct hid_joystick_state_S joystick;
+    struct hid_consumer_state_S consumer;
+  };
+};
+
+struct hid_xbox_state_S {
+  unsigned char last_state;
+  unsigned char js_index;
+};
+
+void hid_register_osd(struct osd_S *osd);
+
 // parsers are re-used from usb_host
 void kbd_parse(spi_t *spi, hid_report_t *report, struct hid_kbd_state_S *state, const unsigned char *buffer, int nbytes);
 void mouse_parse(spi_t *spi, hid_report_t *report, struct hid_mouse_state_S *state, const unsigned char *buffer, int nbytes);
 void joystick_parse(spi_t *spi, hid_report_t *report, struct hid_joystick_state_S *state, const unsigned char *buffer, int nbytes);
 
+void consumer_parse(spi_t *spi, hid_report_t *report, struct hid_consumer_state_S *state, const unsigned char *buffer, int nbytes);
+
+// set if the core can raise an interrupt at the start of each
+// vertical blank (SPI_HID_IRQ)
+extern bool hid_vbl_supported;
+
+// Mouse movement is accumulated and sent to the core once per video
+// frame or at a fixed rate. Button changes are always sent immediately
+#define HID_MOUSE_SYNC_OFF    0   // send each usb report
+#define HID_MOUSE_SYNC_VBL    1   // send at vertical blank (or 50Hz)
+#define HID_MOUSE_SYNC_100HZ  2
+#define HID_MOUSE_SYNC_50HZ   3
+
+extern unsigned char hid_mouse_sync;
+bool mouse_flush(spi_t *spi, struct hid_mouse_state_S *state);
+void hid_vbl_arm(spi_t *spi);
+void hid_vbl_event(spi_t *spi);
+
+// state points to an array of MAX_REPORTS entries
+void hid_parse(spi_t *spi, hid_reports_t *reports, struct hid_state_S *state, const unsigned char *buffer, int nbytes);
+void xbox_parse(spi_t *spi, struct hid_xbox_state_S *state, const unsigned char *buffer, int nbytes);
+
+// when enabled, descriptors and reports are dumped to the console
+// in a format that can be fed into hid_replay
+extern bool hid_trace;
+void hid_trace_dump(const char *dev, int index, char type, const unsigned char *data, int len);
+
 #endif // HID_H
@@ -0,0 +1,313 @@
+/*
+  hid_bench.c
+
+  Host side microbenchmark of the HID report extraction. Recorded
+  report descriptors are parsed by the firmware's hidparser.c and
+  reports are then run through the previous bit walking extraction
+  and through the precompiled extraction plan. Both results are
+  compared and the time per report is printed.
+
+  A keyboard/mouse/consumer combo descriptor checks that reports of
+  later collections are found with the global items inherited from
+  earlier ones.
+
+  Build and run with "make hid_bench".
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hidparser.h"
+
+#define ROUNDS   1000000
+
+// standard three button mouse with wheel, 8 bit signed axes
+static const uint8_t desc_mouse[] = {
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09,
+  0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+  0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03, 0x05, 0x01, 0x09, 0x30,
+  0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03,
+  0x81, 0x06, 0xc0, 0xc0
+};
+
+static const uint8_t reports_mouse[][4] = {
+  { 0x00, 0x01, 0x00, 0x00 }, { 0x00, 0xff, 0x02, 0x00 },
+  { 0x01, 0x00, 0x00, 0x00 }, { 0x03, 0x80, 0x7f, 0x01 },
+};
+
+// generic usb gamepad (DragonRise), byte aligned axes and 12 buttons
+static const uint8_t desc_gamepad[] = {
+  0x05, 0x01, 0x09, 0x04, 0xa1, 0x01, 0xa1, 0x02, 0x75, 0x08, 0x95, 0x05,
+  0x15, 0x00, 0x26, 0xff, 0x00, 0x35, 0x00, 0x46, 0xff, 0x00, 0x09, 0x30,
+  0x09, 0x30, 0x09, 0x30, 0x09, 0x30, 0x09, 0x31, 0x81, 0x02, 0x75, 0x04,
+  0x95, 0x01, 0x25, 0x07, 0x46, 0x3b, 0x01, 0x65, 0x14, 0x09, 0x39, 0x81,
+  0x42, 0x65, 0x00, 0x75, 0x01, 0x95, 0x0c, 0x25, 0x01, 0x45, 0x01, 0x05,
+  0x09, 0x19, 0x01, 0x29, 0x0c, 0x81, 0x02, 0x06, 0x00, 0xff, 0x75, 0x01,
+  0x95, 0x08, 0x25, 0x01, 0x45, 0x01, 0x09, 0x01, 0x81, 0x02, 0xc0, 0xa1,
+  0x02, 0x75, 0x08, 0x95, 0x07, 0x46, 0xff, 0x00, 0x26, 0xff, 0x00, 0x09,
+  0x02, 0x91, 0x02, 0xc0, 0xc0
+};
+
+static const uint8_t reports_gamepad[][8] = {
+  { 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x0f, 0x00, 0x00 },
+  { 0x00, 0x7f, 0x7f, 0x7f, 0x7f, 0x2f, 0x00, 0x00 },
+  { 0x7f, 0x7f, 0x7f, 0x7f, 0xff, 0x0f, 0x0c, 0x00 },
+  { 0xff, 0x7f, 0x7f, 0x7f, 0x00, 0x1f, 0x01, 0x00 },
+};
+
+// flight stick (Logitech Extreme 3D Pro), 10 bit axes spanning bytes
+static const uint8_t desc_flightstick[] = {
+  0x05, 0x01, 0x09, 0x04, 0xa1, 0x01, 0xa1, 0x02, 0x15, 0x00, 0x26, 0xff,
+  0x03, 0x35, 0x00, 0x46, 0xff, 0x03, 0x65, 0x00, 0x75, 0x0a, 0x95, 0x02,
+  0x09, 0x30, 0x09, 0x31, 0x81, 0x02, 0x75, 0x04, 0x95, 0x01, 0x25, 0x07,
+  0x46, 0x3b, 0x01, 0x66, 0x14, 0x00, 0x09, 0x39, 0x81, 0x42, 0x15, 0x00,
+  0x26, 0xff, 0x00, 0x35, 0x00, 0x46, 0xff, 0x00, 0x75, 0x08, 0x95, 0x01,
+  0x09, 0x35, 0x81, 0x02, 0x66, 0x00, 0x00, 0x95, 0x08, 0x75, 0x01, 0x25,
+  0x01, 0x45, 0x01, 0x05, 0x09, 0x19, 0x01, 0x29, 0x08, 0x81, 0x02, 0x06,
+  0x00, 0xff, 0x95, 0x01, 0x75, 0x08, 0x26, 0xff, 0x00, 0x46, 0xff, 0x00,
+  0x09, 0x01, 0x81, 0x02, 0x05, 0x01, 0x26, 0xff, 0x00, 0x46, 0xff, 0x00,
+  0x95, 0x01, 0x75, 0x08, 0x09, 0x36, 0x81, 0x02, 0x05, 0x09, 0x19, 0x09,
+  0x29, 0x0c, 0x95, 0x04, 0x75, 0x01, 0x25, 0x01, 0x45, 0x01, 0x81, 0x02,
+  0x95, 0x04, 0x81, 0x01, 0xc0, 0xa1, 0x02, 0x26, 0xff, 0x00, 0x46, 0xff,
+  0x00, 0x95, 0x04, 0x75, 0x08, 0x09, 0x01, 0xb1, 0x02, 0xc0, 0xc0
+};
+
+static const uint8_t reports_flightstick[][8] = {
+  { 0xff, 0xf1, 0xc7, 0x08, 0x80, 0x00, 0x80, 0x00 },
+  { 0x00, 0xf0, 0xc7, 0x08, 0x80, 0x01, 0x80, 0x00 },
+  { 0xff, 0x01, 0xc0, 0x08, 0x80, 0x00, 0x80, 0x00 },
+  { 0xfe, 0xf1, 0xff, 0x28, 0x80, 0x00, 0x80, 0x04 },
+};
+
+static const struct device_S {
+  const char *name;
+  const uint8_t *desc;
+  int desc_len;
+  const uint8_t *reports;
+  int report_len;
+  int reports_num;
+} devices[] = {
+  { "mouse", desc_mouse, sizeof(desc_mouse),
+    reports_mouse[0], sizeof(reports_mouse[0]), 4 },
+  { "gamepad", desc_gamepad, sizeof(desc_gamepad),
+    reports_gamepad[0], sizeof(reports_gamepad[0]), 4 },
+  { "flightstick", desc_flightstick, sizeof(desc_flightstick),
+    reports_flightstick[0], sizeof(reports_flightstick[0]), 4 },
+  { NULL, NULL, 0, NULL, 0, 0 }
+};
+
+// keyboard, mouse and consumer control combo. The mouse collection
+// inherits the report size of its axes from the keyboard collection,
+// the consumer collection carries two reports
+static const uint8_t desc_combo[] = {
+  // keyboard, report id 1
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x85, 0x01, 0x05, 0x07, 0x19, 0xe0,
+  0x29, 0xe7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+  0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x06, 0x75, 0x08, 0x15, 0x00,
+  0x25, 0x65, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0,
+  // mouse, report id 2, no report size before the axes
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xa1, 0x00,
+  0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7f, 0x95, 0x02, 0x81, 0x06,
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03,
+  0x75, 0x01, 0x81, 0x02, 0x95, 0x05, 0x81, 0x03, 0xc0, 0xc0,
+  // consumer control, report ids 3 and 5
+  0x05, 0x0c, 0x09, 0x01, 0xa1, 0x01, 0x85, 0x03, 0x15, 0x00, 0x26, 0x3c,
+  0x02, 0x19, 0x00, 0x2a, 0x3c, 0x02, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+  0x85, 0x05, 0x75, 0x08, 0x95, 0x02, 0x26, 0xff, 0x00, 0x19, 0x00, 0x2a,
+  0xff, 0x00, 0x81, 0x00, 0xc0
+};
+
+static int test_combo(void) {
+  hid_reports_t r;
+  uint8_t id;
+  hid_report_t *rep;
+  int errors = 0;
+
+  printf("==== combo ====\n");
+  if(parse_report_descriptors((uint8_t*)desc_combo, sizeof(desc_combo), &r) != 4) {
+    printf("combo: %d usable reports, expected 4\n", r.reports);
+    return 1;
+  }
+
+  id = 1;
+  rep = hid_report_find(&r, &id, 1);
+  if(!rep || rep->type != REPORT_TYPE_KEYBOARD || rep->report_size != 8 ||
+     rep->keyboard.modifier_offset != 0 || rep->keyboard.keys_offset != 16 || rep->keyboard.keys_count != 6) {
+    printf("combo: keyboard report 1 not found\n");
+    errors++;
+  }
+
+  id = 2;
+  rep = hid_report_find(&r, &id, 1);
+  if(!rep || rep->type != REPORT_TYPE_MOUSE || rep->report_size != 3 ||
+     rep->joystick_mouse.axis[0].offset != 0 || rep->joystick_mouse.axis[0].size != 8 ||
+     rep->joystick_mouse.axis[1].offset != 8 || rep->joystick_mouse.axis[1].size != 8 ||
+     rep->joystick_mouse.button[0].byte_offset != 2 || rep->joystick_mouse.button[0].bitmask != 1) {
+    printf("combo: mouse report 2 not found\n");
+    errors++;
+  }
+
+  // both consumer reports start right after their id
+  id = 3;
+  rep = hid_report_find(&r, &id, 1);
+  if(!rep || rep->type != REPORT_TYPE_CONSUMER || rep->consumer.offset != 0 ||
+     rep->consumer.size != 16 || rep->consumer.count != 1) {
+    printf("combo: consumer report 3 not found\n");
+    errors++;
+  }
+
+  id = 5;
+  rep = hid_report_find(&r, &id, 1);
+  if(!rep || rep->type != REPORT_TYPE_CONSUMER || rep->consumer.offset != 0 ||
+     rep->consumer.size != 8 || rep->consumer.count != 2) {
+    printf("combo: consumer report 5 not found\n");
+    errors++;
+  }
+
+  if(!errors) printf("combo: ok\n");
+  return errors;
+}
+
+// --------------- previous extraction as used by usb_host.c --------------
+
+// collect bits from byte stream and assemble them into a signed word
+static uint16_t collect_bits(const uint8_t *p, uint16_t offset, uint8_t size, bool is_signed) {
+  // mask unused bits of first byte
+  uint8_t mask = 0xff << (offset&7);
+  uint8_t byte = offset/8;
+  uint8_t bits = size;
+  uint8_t shift = offset&7;
+
+  uint16_t rval = (p[byte++] & mask) >> shift;
+  mask = 0xff;
+  shift = 8-shift;
+  bits -= shift;
+
+  // first byte already contained more bits than we need
+  if(shift > size) {
+    // mask unused bits
+    rval &= (1<<size)-1;
+  } else {
+    // further bytes if required
+    while(bits) {
+      mask = (bits<8)?(0xff>>(8-bits)):0xff;
+      rval += (p[byte++] & mask) << shift;
+      shift += 8;
+      bits -= (bits>8)?8:bits;
+    }
+  }
+
+  if(is_signed) {
+    // do sign expansion
+    uint16_t sign_bit = 1<<(size-1);
+    if(rval & sign_bit) {
+      while(sign_bit) {
+	rval |= sign_bit;
+	sign_bit <<= 1;
+      }
+    }
+  }
+
+  return rval;
+}
+
+static void extract_old(const hid_report_t *report, const uint8_t *buffer, int a[2], uint16_t *btns) {
+  for(int i=0;i<2;i++) {
+    bool is_signed = report->joystick_mouse.axis[i].logical.min >
+      report->joystick_mouse.axis[i].logical.max;
+
+    a[i] = collect_bits(buffer, report->joystick_mouse.axis[i].offset,
+			report->joystick_mouse.axis[i].size, is_signed);
+  }
+
+  *btns = 0;
+  for(int i=0;i<MAX_BUTTONS;i++)
+    if(buffer[report->joystick_mouse.button[i].byte_offset] &
+       report->joystick_mouse.button[i].bitmask)
+      *btns |= (1<<i);
+}
+
+// ----------------- precompiled extraction plan ------------------
+
+static void extract_new(const hid_report_t *report, const uint8_t *buffer, int a[2], uint16_t *btns) {
+  for(int i=0;i<2;i++)
+    a[i] = hid_field_get(&report->joystick_mouse.plan.axis[i], buffer);
+
+  *btns = hid_buttons_get(report, buffer);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(void (*extract)(const hid_report_t *, const uint8_t *, int [2], uint16_t *),
+		    const hid_report_t *report, const struct device_S *dev) {
+  volatile int sink = 0;
+  double start = now();
+  for(int r=0;r<ROUNDS;r++) {
+    int a[2];
+    uint16_t btns;
+    extract(report, dev->reports + (r % dev->reports_num) * dev->report_len, a, &btns);
+    sink += a[0] + a[1] + btns;
+  }
+  return (now() - start) * 1e9 / ROUNDS;
+}
+
+int main(void) {
+  int errors = 0;
+
+  for(const struct device_S *dev = devices; dev->name; dev++) {
+    hid_report_t report;
+
+    printf("==== %s ====\n", dev->name);
+    if(!parse_report_descriptor((uint8_t*)dev->desc, dev->desc_len, &report, NULL, NULL)) {
+      printf("%s: descriptor not usable\n", dev->name);
+      errors++;
+      continue;
+    }
+
+    // the recorded reports must not be shorter than the parsed report
+    if(dev->report_len < report.report_size) {
+      printf("%s: report size mismatch %d/%d\n", dev->name, dev->report_len, report.report_size);
+      errors++;
+      continue;
+    }
+
+    // compare both paths for all recorded reports plus a set of
+    // pseudo random ones
+    uint8_t buffer[dev->report_len];
+    srand(42);
+    for(int r=0;r<dev->reports_num+10000;r++) {
+      if(r < dev->reports_num)
+	memcpy(buffer, dev->reports + r * dev->report_len, dev->report_len);
+      else
+	for(int i=0;i<dev->report_len;i++) buffer[i] = rand();
+
+      int a_old[2], a_new[2];
+      uint16_t b_old, b_new;
+      extract_old(&report, buffer, a_old, &b_old);
+      extract_new(&report, buffer, a_new, &b_new);
+
+      if(a_old[0] != a_new[0] || a_old[1] != a_new[1] || b_old != b_new) {
+	if(errors++ < 10)
+	  printf("%s: mismatch in report %d: old %04x/%04x/%03x new %04x/%04x/%03x\n",
+		 dev->name, r, a_old[0], a_old[1], b_old, a_new[0], a_new[1], b_new);
+      }
+    }
+
+    double t_old = bench(extract_old, &report, dev);
+    double t_new = bench(extract_new, &report, dev);
+    printf("%s: old %.1f ns/report, new %.1f ns/report\n", dev->name, t_old, t_new);
+  }
+
+  errors += test_combo();
+
+  printf("%d errors\n", errors);
+  return errors?1:0;
+}
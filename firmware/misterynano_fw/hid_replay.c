@@ -0,0 +1,307 @@
+/*
+  hid_replay.c
+
+  PC side replay of usb hid traces. Report descriptors and reports
+  captured on the device with the "hidtrace on" console command are
+  fed through the firmware's hidparser.c and hid.c. All SPI
+  transactions and menu events the parsers emit are printed, so the
+  output of a trace can be compared against a previous run when
+  parsers are changed or new devices are to be supported.
+
+  Trace lines look like "@hid0 D 05 01 09 ..." (report descriptor)
+  or "@hid0 R 01 00 ff ..." (report). All other lines are ignored,
+  so a console log can be used directly.
+
+  Usage: hid_replay [-c core_id] [-l] [-f reports] [-b rounds] trace.log
+    -c  core id to select the keymap (default 1, Atari ST)
+    -l  legacy core without SPI_HID_BATCH support
+    -f  accumulate mouse movement and flush it every n reports as
+        the mouse thread would do on every video frame
+    -b  additionally replay the trace silently n times and print
+        the parse time per report
+
+  Build with "make hid_replay".
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "hidparser.h"
+#include "hid.h"
+#include "sysctrl.h"
+#include "menu.h"
+
+#define MAX_DEVICES  8
+#define MAX_LINE     1024
+
+unsigned char core_id = CORE_ID_ATARI_ST;
+
+static bool quiet = false;
+static int frame_reports = 0;
+
+// ------------------- fake spi recording all bytes ---------------------
+
+static spi_t spi;
+static unsigned char spi_buf[256];
+static int spi_len;
+
+void spi_begin_prio(spi_t *spi, unsigned char prio) {
+  (void)spi; (void)prio;
+  spi_len = 0;
+}
+
+unsigned char spi_tx_u08(spi_t *spi, unsigned char b) {
+  (void)spi;
+  if(spi_len < (int)sizeof(spi_buf)) spi_buf[spi_len++] = b;
+  return 0;
+}
+
+void spi_end(spi_t *spi) {
+  (void)spi;
+  if(quiet) return;
+  printf("  SPI:");
+  for(int i=0;i<spi_len;i++) printf(" %02x", spi_buf[i]);
+  printf("\n");
+}
+
+// ------------- osd state as controlled by the menu events -------------
+
+static int osd_visible = 0;
+
+int osd_is_visible(struct osd_S *osd) {
+  (void)osd;
+  return osd_visible;
+}
+
+void hid_menu_event(unsigned long msg) {
+  if(msg == MENU_EVENT_SHOW) osd_visible = 1;
+  if(msg == MENU_EVENT_HIDE) osd_visible = 0;
+  if(!quiet) printf("  MENU: %lu\n", msg);
+}
+
+// ---------------------------- devices ---------------------------------
+
+static struct device_S {
+  char name[16];
+  bool is_xbox;
+  bool usable;
+  hid_reports_t reports;
+  struct hid_state_S state[MAX_REPORTS];
+  struct hid_xbox_state_S xbox;
+} devices[MAX_DEVICES];
+
+static int devices_num = 0;
+
+// parse statistics survive the device resets between replay rounds
+static unsigned long dev_reports[MAX_DEVICES];
+static double dev_time[MAX_DEVICES];
+
+static unsigned js_map = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct device_S *device_get(const char *name) {
+  for(int i=0;i<devices_num;i++)
+    if(!strcmp(devices[i].name, name))
+      return &devices[i];
+
+  if(devices_num == MAX_DEVICES) return NULL;
+
+  struct device_S *dev = &devices[devices_num++];
+  memset(dev, 0, sizeof(*dev));
+  snprintf(dev->name, sizeof(dev->name), "%s", name);
+  dev->is_xbox = !strncmp(name, "xbox", 4);
+  return dev;
+}
+
+// assign the lowest free joystick index just like usb_host.c does
+static unsigned char js_alloc(void) {
+  unsigned char idx = 0;
+  while(js_map & (1<<idx)) idx++;
+  js_map |= 1<<idx;
+  return idx;
+}
+
+static void descriptor(struct device_S *dev, unsigned char *data, int len) {
+  if(dev->usable) {
+    if(dev->is_xbox) js_map &= ~(1<<dev->xbox.js_index);
+    else
+      for(int r=0;r<dev->reports.reports;r++)
+	if(dev->reports.report[r].type == REPORT_TYPE_JOYSTICK)
+	  js_map &= ~(1<<dev->state[r].joystick.js_index);
+  }
+
+  memset(dev->state, 0, sizeof(dev->state));
+  memset(&dev->xbox, 0, sizeof(dev->xbox));
+
+  if(dev->is_xbox) {
+    dev->usable = true;
+    dev->xbox.js_index = js_alloc();
+    if(!quiet) printf("%s: xbox pad, joystick %d\n", dev->name, dev->xbox.js_index);
+    return;
+  }
+
+  dev->usable = parse_report_descriptors(data, len, &dev->reports);
+  if(!dev->usable) {
+    if(!quiet) printf("%s: descriptor not usable\n", dev->name);
+    return;
+  }
+
+  for(int r=0;r<dev->reports.reports;r++) {
+    hid_report_t *report = &dev->reports.report[r];
+    if(report->type == REPORT_TYPE_JOYSTICK)
+      dev->state[r].joystick.js_index = js_alloc();
+
+    if(!quiet) printf("%s: type %d, id %d, size %d\n", dev->name, report->type,
+		      report->report_id_present?report->report_id:-1,
+		      report->report_size);
+  }
+}
+
+static void report(struct device_S *dev, unsigned char *data, int len) {
+  if(!dev->usable) return;
+
+  if(!quiet) {
+    printf("%s:", dev->name);
+    for(int i=0;i<len;i++) printf(" %02x", data[i]);
+    printf("\n");
+  }
+
+  double start = now();
+  if(dev->is_xbox) xbox_parse(&spi, &dev->xbox, data, len);
+  else             hid_parse(&spi, &dev->reports, dev->state, data, len);
+  dev_time[dev-devices] += now() - start;
+  dev_reports[dev-devices]++;
+}
+
+// send accumulated mouse movement like the firmware's mouse thread
+static void mouse_frame(void) {
+  for(int i=0;i<devices_num;i++) {
+    if(devices[i].is_xbox || !devices[i].usable) continue;
+    
+    for(int r=0;r<devices[i].reports.reports;r++)
+      if(devices[i].reports.report[r].type == REPORT_TYPE_MOUSE)
+	mouse_flush(&spi, &devices[i].state[r].mouse);
+  }
+}
+
+static int replay(FILE *file) {
+  char line[MAX_LINE];
+  int lines = 0;
+
+  // reset everything to the state of a freshly booted device
+  devices_num = 0;
+  js_map = 0;
+  osd_visible = 0;
+  rewind(file);
+
+  while(fgets(line, sizeof(line), file)) {
+    char name[16], type;
+    int n;
+
+    // skip everything that's not a trace line
+    char *p = strchr(line, '@');
+    if(!p || sscanf(p+1, "%15s %c%n", name, &type, &n) != 2)
+      continue;
+    p += 1+n;
+
+    unsigned char data[MAX_LINE/3];
+    int len = 0;
+    unsigned int byte;
+    while(len < (int)sizeof(data) && sscanf(p, "%x%n", &byte, &n) == 1) {
+      data[len++] = byte;
+      p += n;
+    }
+
+    struct device_S *dev = device_get(name);
+    if(!dev) continue;
+
+    if(type == 'D') descriptor(dev, data, len);
+    if(type == 'R') report(dev, data, len);
+    lines++;
+
+    if(frame_reports && !(lines % frame_reports)) {
+      if(!quiet) printf("FRAME\n");
+      mouse_frame();
+    }
+  }
+
+  return lines;
+}
+
+int main(int argc, char **argv) {
+  int rounds = 0;
+  int opt;
+
+  // replay against a current core unless told otherwise
+  hid_batch_supported = true;
+
+  while((opt = getopt(argc, argv, "c:lf:b:")) != -1) {
+    switch(opt) {
+    case 'c': core_id = atoi(optarg); break;
+    case 'l': hid_batch_supported = false; break;
+    case 'f':
+      frame_reports = atoi(optarg);
+      hid_mouse_sync = HID_MOUSE_SYNC_50HZ;
+      break;
+    case 'b': rounds = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-c core_id] [-l] [-f reports] [-b rounds] trace.log\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if(optind >= argc) {
+    fprintf(stderr, "Usage: %s [-c core_id] [-l] [-f reports] [-b rounds] trace.log\n", argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(argv[optind], "r");
+  if(!file) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  if(!replay(file)) {
+    fprintf(stderr, "%s: no trace lines found\n", argv[optind]);
+    return 1;
+  }
+
+  if(rounds) {
+    // the parsers themselves print debug output. Silence stdout
+    // while benchmarking
+    fflush(stdout);
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    quiet = true;
+
+    memset(dev_reports, 0, sizeof(dev_reports));
+    memset(dev_time, 0, sizeof(dev_time));
+    for(int r=0;r<rounds;r++)
+      replay(file);
+
+    fflush(stdout);
+    dup2(saved, 1);
+    close(null);
+    close(saved);
+
+    for(int i=0;i<devices_num;i++)
+      if(dev_reports[i])
+	printf("%s: %lu reports, %.1f ns/report\n", devices[i].name,
+	       dev_reports[i], dev_time[i] * 1e9 / dev_reports[i]);
+  }
+
+  fclose(file);
+  return 0;
+}
@@ -27,6 +27,7 @@ typedef struct {
 #define JOY_MOUSE_REQ_BTN_1   0x08
 #define JOYSTICK_COMPLETE     (JOY_MOUSE_REQ_AXIS_X | JOY_MOUSE_REQ_AXIS_Y | JOY_MOUSE_REQ_BTN_0)
 #define MOUSE_COMPLETE        (JOY_MOUSE_REQ_AXIS_X | JOY_MOUSE_REQ_AXIS_Y | JOY_MOUSE_REQ_BTN_0 | JOY_MOUSE_REQ_BTN_1)
+#define CONSUMER_REQ_ARRAY    0x10
 
 #define USAGE_PAGE_GENERIC_DESKTOP  1
 #define USAGE_PAGE_SIMULATION       2
@@ -59,6 +60,81 @@ typedef struct {
 #define USAGE_WHEEL   56
 #define USAGE_HAT     57
 
+#define USAGE_CONSUMER_CONTROL  1
+
+// precompile a field from its bit offset and size
+static void field_compile(hid_field_t *f, uint16_t offset, uint8_t size, bool is_signed) {
+	// only the lower 16 bits of larger fields are being used
+	if(size > 16) {
+		size = 16;
+		is_signed = false;
+	}
+
+	f->byte = offset/8;
+	f->shift = offset&7;
+	f->bytes = (f->shift + size + 7)/8;
+	f->is_signed = is_signed;
+	f->mask = (1ul << size) - 1;
+
+	if(!size)                          f->type = HID_FIELD_NONE;
+	else if(!f->shift && size == 8)    f->type = is_signed?HID_FIELD_S8:HID_FIELD_U8;
+	else if(!f->shift && size == 16)   f->type = HID_FIELD_U16;
+	else                               f->type = HID_FIELD_BITS;
+}
+
+// derive the extraction plan of a joystick or mouse report
+static void report_compile(hid_report_t *conf) {
+	uint8_t i;
+
+	// a logical minimum above the maximum indicates a signed axis
+	for(i=0;i<MAX_AXES;i++)
+		field_compile(&conf->joystick_mouse.plan.axis[i],
+			      conf->joystick_mouse.axis[i].offset,
+			      conf->joystick_mouse.axis[i].size,
+			      conf->joystick_mouse.axis[i].logical.min >
+			      conf->joystick_mouse.axis[i].logical.max);
+
+	field_compile(&conf->joystick_mouse.plan.hat,
+		      conf->joystick_mouse.hat.offset,
+		      conf->joystick_mouse.hat.size, false);
+
+	// combine buttons on consecutive bits into runs
+	hid_button_run_t *run = conf->joystick_mouse.plan.button_run;
+	uint16_t start = 0;
+	uint8_t count = 0;
+	conf->joystick_mouse.plan.button_runs = 0;
+	for(i=0;i<=MAX_BUTTONS;i++) {
+		uint16_t bit = 0;
+		uint8_t mask = (i<MAX_BUTTONS)?conf->joystick_mouse.button[i].bitmask:0;
+		if(mask) {
+			bit = 8*conf->joystick_mouse.button[i].byte_offset;
+			while(!(mask & 1)) { mask >>= 1; bit++; }
+
+			// button directly follows the current run
+			if(count && bit == start+count) {
+				count++;
+				continue;
+			}
+		}
+
+		// close current run
+		if(count) {
+			field_compile(&run->field, start, count, false);
+			hidp_debugf("  (BUTTON RUN %d-%d @ %d)", run->first, run->first+count-1, start);
+			conf->joystick_mouse.plan.button_runs++;
+			run++;
+			count = 0;
+		}
+
+		// and start a new one
+		if(mask) {
+			run->first = i;
+			start = bit;
+			count = 1;
+		}
+	}
+}
+
 // check if the current report 
 bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t *conf) {
 	hidp_debugf("  - total bit count: %d (%d bytes, %d bits)", 
@@ -69,8 +145,11 @@ bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t
 	// check if something useful was detected
 	if( ((conf->type == REPORT_TYPE_JOYSTICK) && ((report_complete & JOYSTICK_COMPLETE) == JOYSTICK_COMPLETE)) ||
 	    ((conf->type == REPORT_TYPE_MOUSE)    && ((report_complete & MOUSE_COMPLETE) == MOUSE_COMPLETE)) ||
+	    ((conf->type == REPORT_TYPE_CONSUMER) && (report_complete & CONSUMER_REQ_ARRAY)) ||
 	    ((conf->type == REPORT_TYPE_KEYBOARD))) {
 	hidp_debugf("  - report %d is usable", conf->report_id);
+	if(conf->type == REPORT_TYPE_JOYSTICK || conf->type == REPORT_TYPE_MOUSE)
+		report_compile(conf);
 	return true;
 	}
 
@@ -78,22 +157,41 @@ bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t
 	return false;
 }
 
-bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes) {
-	int8_t app_collection = 0;
-	int8_t phys_log_collection = 0;
-	uint8_t skip_collection = 0;
-	int8_t generic_desktop = -1;   // depth at which first gen_desk was found
-	uint8_t collection_depth = 0;
+void hid_parser_init(hid_parser_t *p) {
+	memset(p, 0, sizeof(hid_parser_t));
+	p->generic_desktop = -1;
+}
+
+// start a new report of the current application collection
+static void report_start(hid_report_t *conf, const hid_parser_t *p) {
+	memset(conf, 0, sizeof(hid_report_t));
+	conf->type = p->type;
+	conf->report_id_present = p->report_id_present;
+	conf->report_id = p->report_id;
+
+	// assume boot keyboard key array unless the descriptor
+	// tells otherwise. Modifiers only exist if declared
+	if(conf->type == REPORT_TYPE_KEYBOARD) {
+		conf->keyboard.modifier_offset = -1;
+		conf->keyboard.keys_offset = 16;
+		conf->keyboard.keys_count = 6;
+	}
+}
+
+bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes,
+			     hid_parser_t *p) {
+	hid_parser_t parser;
+	if(!p) {
+		hid_parser_init(&parser);
+		p = &parser;
+	}
 
 	uint8_t i;
 
 	//
 	uint8_t buttons = 0;
-	uint8_t report_size, report_count;
 	uint16_t bit_count = 0, usage_count = 0;
-	uint16_t logical_minimum=0, logical_maximum=0;
-	uint16_t physical_minimum=0, physical_maximum=0;
-	memset(conf, 0, sizeof(hid_report_t));
+	report_start(conf, p);
 
 	// mask used to check of all required components have been found, so
 	// that e.g. both axes and the button of a joystick are ready to be used
@@ -104,9 +202,10 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 	uint8_t btns = 0;
 	int8_t hat = -1;
 
-	for (i=0; i<MAX_AXES; i++) axis[i] = -1;
+	// keyboard components
+	uint32_t usage_minimum = 0;
 
-	conf->type = REPORT_TYPE_NONE;
+	for (i=0; i<MAX_AXES; i++) axis[i] = -1;
 
 	while(rep_size) {
 		// extract short item
@@ -142,22 +241,22 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 		//    hidp_extreme_debugf("Value = %d (%u)\n", value, value);
 
 		// we are currently skipping an unknown/unsupported collection) 
-		if(skip_collection) {
+		if(p->skip_collection) {
 			if(!type) {  // main item
 				// any new collection increases the depth of collections to skip
 				if(tag == 10) {
-					skip_collection++;
-					collection_depth++;
+					p->skip_collection++;
+					p->collection_depth++;
 				}
 
 				// any end collection decreases it
 				if(tag == 12) {
-					skip_collection--;
-					collection_depth--;
+					p->skip_collection--;
+					p->collection_depth--;
 
 					// leaving the depth the generic desktop was valid for
-					if(generic_desktop > collection_depth)
-						generic_desktop = -1;
+					if(p->generic_desktop > p->collection_depth)
+						p->generic_desktop = -1;
 				}
 			}
 
@@ -177,7 +276,7 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 						// scan for up to four buttons
 							char b;
 							for(b=0;b<12;b++) {
-								if(report_count > buttons) {
+								if(p->report_count > buttons) {
 								uint16_t this_bit = bit_count+b;
 
 									hidp_debugf("BUTTON%d @ %d (byte %d, mask %d)", buttons, 
@@ -192,7 +291,7 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 							// we found at least one button which is all we want to accept this as a valid 
 							// joystick
 							report_complete |= JOY_MOUSE_REQ_BTN_0;
-							if(report_count > 1) report_complete |= JOY_MOUSE_REQ_BTN_1;
+							if(p->report_count > 1) report_complete |= JOY_MOUSE_REQ_BTN_1;
 						}
 					}
 
@@ -200,16 +299,16 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 					char c;
 					for(c=0;c<MAX_AXES;c++) {
 						if(axis[c] >= 0) {
-							uint16_t cnt = bit_count + report_size * axis[c];
+							uint16_t cnt = bit_count + p->report_size * axis[c];
 							hidp_debugf("  (%c-AXIS @ %d (byte %d, bit %d))", 'X'+c,
 							  cnt, cnt/8, cnt&7);
 
 							if((conf->type == REPORT_TYPE_JOYSTICK) || (conf->type == REPORT_TYPE_MOUSE)) {
 								// save in joystick report
 								conf->joystick_mouse.axis[c].offset = cnt;
-								conf->joystick_mouse.axis[c].size = report_size;
-								conf->joystick_mouse.axis[c].logical.min = logical_minimum;
-								conf->joystick_mouse.axis[c].logical.max = logical_maximum;
+								conf->joystick_mouse.axis[c].size = p->report_size;
+								conf->joystick_mouse.axis[c].logical.min = p->logical_minimum;
+								conf->joystick_mouse.axis[c].logical.max = p->logical_maximum;
 								if(c==0) report_complete |= JOY_MOUSE_REQ_AXIS_X;
 								if(c==1) report_complete |= JOY_MOUSE_REQ_AXIS_Y;
 							}
@@ -218,24 +317,60 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 
 					// handle found hat
 					if(hat >= 0) {
-						uint16_t cnt = bit_count + report_size * hat;
+						uint16_t cnt = bit_count + p->report_size * hat;
 						hidp_debugf("  (HAT @ %d (byte %d, bit %d), size %d)",
-						  cnt, cnt/8, cnt&7, report_size);
+						  cnt, cnt/8, cnt&7, p->report_size);
 						if(conf->type == REPORT_TYPE_JOYSTICK) {
 							conf->joystick_mouse.hat.offset = cnt;
-							conf->joystick_mouse.hat.size = report_size;
-							conf->joystick_mouse.hat.logical.min = logical_minimum;
-							conf->joystick_mouse.hat.logical.max = logical_maximum;
-							conf->joystick_mouse.hat.physical.min = physical_minimum;
-							conf->joystick_mouse.hat.physical.max = physical_maximum;
+							conf->joystick_mouse.hat.size = p->report_size;
+							conf->joystick_mouse.hat.logical.min = p->logical_minimum;
+							conf->joystick_mouse.hat.logical.max = p->logical_maximum;
+							conf->joystick_mouse.hat.physical.min = p->physical_minimum;
+							conf->joystick_mouse.hat.physical.max = p->physical_maximum;
 						}
 					}
 
+					// handle keyboard modifiers and keys
+					if((conf->type == REPORT_TYPE_KEYBOARD) &&
+					   (p->usage_page == USAGE_PAGE_KEYBOARD) && !(value & 1)) {
+						if(p->report_size == 1 && usage_minimum == 0xe0 && p->report_count == 8) {
+							hidp_debugf("  (MODIFIERS @ %d)", bit_count);
+							conf->keyboard.modifier_offset = bit_count;
+						} else if(p->report_size == 1 && (value & 2)) {
+							// one bit per key as used by NKRO keyboards
+							hidp_debugf("  (KEY BITMAP %d-%d @ %d)", usage_minimum,
+								    usage_minimum+p->report_count-1, bit_count);
+							conf->keyboard.keys_offset = bit_count;
+							conf->keyboard.keys_count = p->report_count;
+							conf->keyboard.keys_first = usage_minimum;
+							conf->keyboard.keys_bitmap = 1;
+						} else if(p->report_size == 8 && !(value & 2)) {
+							// array of key codes as used by boot keyboards
+							hidp_debugf("  (KEY ARRAY[%d] @ %d)", p->report_count, bit_count);
+							conf->keyboard.keys_offset = bit_count;
+							conf->keyboard.keys_count = p->report_count;
+							conf->keyboard.keys_bitmap = 0;
+						}
+					}
+
+					// handle consumer control usage codes. Only arrays are
+					// supported, bitmaps of individual usages are ignored
+					if((conf->type == REPORT_TYPE_CONSUMER) &&
+					   (p->usage_page == USAGE_PAGE_CONSUMER) && !(value & 3) &&
+					   (p->report_size == 8 || p->report_size == 16)) {
+						hidp_debugf("  (CONSUMER ARRAY[%d] @ %d)", p->report_count, bit_count);
+						conf->consumer.offset = bit_count;
+						conf->consumer.size = p->report_size;
+						conf->consumer.count = p->report_count;
+						report_complete |= CONSUMER_REQ_ARRAY;
+					}
+
 					hidp_extreme_debugf("INPUT(%d)", value);
 
 					// reset for next inputs
-					bit_count += report_count * report_size;
+					bit_count += p->report_count * p->report_size;
 					usage_count = 0;
+					usage_minimum = 0;
 					btns = 0;
 					for (i=0; i<MAX_AXES; i++) axis[i] = -1;
 					hat = -1;
@@ -251,38 +386,41 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 
 				case 10:
 					hidp_extreme_debugf("COLLECTION(%d)", value);
-					collection_depth++;
+					p->collection_depth++;
 					usage_count = 0;
 
 					if(value == 1) {   // app collection
 						hidp_extreme_debugf("  -> application");
-						app_collection++;
+						p->app_collection++;
 					} else if(value == 0) {  // physical collection
 						hidp_extreme_debugf("  -> physical");
-						phys_log_collection++;
+						p->phys_log_collection++;
 					} else if(value == 2) {  // logical collection
 						hidp_extreme_debugf("  -> logical");
-						phys_log_collection++;
+						p->phys_log_collection++;
 					} else {
 						hidp_extreme_debugf("skipping unsupported collection");
-						skip_collection++;
+						p->skip_collection++;
 					}
 					break;
 
 				case 12:
 					hidp_extreme_debugf("END_COLLECTION(%d)", value);
-					collection_depth--;
+					p->collection_depth--;
 
 					// leaving the depth the generic desktop was valid for
-					if(generic_desktop > collection_depth)
-						generic_desktop = -1;
+					if(p->generic_desktop > p->collection_depth)
+						p->generic_desktop = -1;
 
-					if(phys_log_collection) {
+					if(p->phys_log_collection) {
 						hidp_extreme_debugf("  -> phys/log end");
-						phys_log_collection--;
-					} else if(app_collection) {
+						p->phys_log_collection--;
+					} else if(p->app_collection) {
 						hidp_extreme_debugf("  -> app end");
-						app_collection--;
+						p->app_collection--;
+
+						// the next collection starts with its own usage
+						p->type = REPORT_TYPE_NONE;
 
 						// check if report is usable and stop parsing if it is
 						if(report_is_usable(bit_count, report_complete, conf)) {
@@ -291,6 +429,8 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 							// retry with next report
 							bit_count = 0;
 							report_complete = 0;
+							buttons = 0;
+							report_start(conf, p);
 						}
 
 					} else {
@@ -311,6 +451,7 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 				switch(tag) {
 				case 0:
 					hidp_extreme_debugf("USAGE_PAGE(%d/0x%x)", value, value);
+					p->usage_page = value;
 
 					if(value == USAGE_PAGE_KEYBOARD) {
 						hidp_extreme_debugf(" -> Keyboard");
@@ -326,8 +467,8 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 					} else if(value == USAGE_PAGE_GENERIC_DESKTOP) {
 						hidp_extreme_debugf(" -> Generic Desktop");
 
-						if(generic_desktop < 0)
-							generic_desktop = collection_depth;
+						if(p->generic_desktop < 0)
+							p->generic_desktop = p->collection_depth;
 					} else
 						hidp_extreme_debugf(" -> UNSUPPORTED USAGE_PAGE");
 
@@ -335,22 +476,22 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 
 				case 1:
 					hidp_extreme_debugf("LOGICAL_MINIMUM(%d/%d)", value, (int16_t)value);
-					logical_minimum = value;
+					p->logical_minimum = value;
 					break;
 
 				case 2:
 					hidp_extreme_debugf("LOGICAL_MAXIMUM(%d)", value);
-					logical_maximum = value;
+					p->logical_maximum = value;
 					break;
 
 				case 3:
 					hidp_extreme_debugf("PHYSICAL_MINIMUM(%d/%d)", value, (int16_t)value);
-					physical_minimum = value;
+					p->physical_minimum = value;
 					break;
 
 				case 4:
 					hidp_extreme_debugf("PHYSICAL_MAXIMUM(%d)", value);
-					physical_maximum = value;
+					p->physical_maximum = value;
 					break;
 
 				case 5:
@@ -363,18 +504,34 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 
 				case 7:
 					hidp_extreme_debugf("REPORT_SIZE(%d)", value);
-					report_size = value;
+					p->report_size = value;
 					break;
 
 				case 8:
 					hidp_extreme_debugf("REPORT_ID(%d)", value);
+
+					// the inputs collected so far belong to the previous
+					// report id. That report ends here
+					if(bit_count && p->report_id_present && value != p->report_id) {
+						bool usable = report_is_usable(bit_count, report_complete, conf);
+						p->report_id = value;
+						if(usable) return true;
+
+						bit_count = 0;
+						report_complete = 0;
+						buttons = 0;
+						report_start(conf, p);
+					}
+
+					p->report_id_present = 1;
+					p->report_id = value;
 					conf->report_id_present = 1;
 					conf->report_id = value;
 					break;
 
 				case 9:
 					hidp_extreme_debugf("REPORT_COUNT(%d)", value);
-					report_count = value;
+					p->report_count = value;
 					break;
 
 				default:
@@ -391,25 +548,34 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 					// we only support mice, keyboards and joysticks
 					hidp_extreme_debugf("USAGE(%d/0x%x)", value, value);
 
-					if( !collection_depth && (value == USAGE_KEYBOARD)) {
+					if( !p->collection_depth && (value == USAGE_KEYBOARD)) {
 						// usage(keyboard) is always allowed
 						hidp_debugf(" -> Keyboard");
-						conf->type = REPORT_TYPE_KEYBOARD;
-					} else if(!collection_depth && (value == USAGE_MOUSE)) {
+						p->type = REPORT_TYPE_KEYBOARD;
+						report_start(conf, p);
+					} else if(!p->collection_depth && (p->usage_page == USAGE_PAGE_CONSUMER) &&
+						  (value == USAGE_CONSUMER_CONTROL)) {
+						// media keys etc, e.g. on keyboard and touchpad combos
+						hidp_debugf(" -> Consumer Control");
+						p->type = REPORT_TYPE_CONSUMER;
+						report_start(conf, p);
+					} else if(!p->collection_depth && (value == USAGE_MOUSE)) {
 						// usage(mouse) is always allowed
 						hidp_debugf(" -> Mouse");
-						conf->type = REPORT_TYPE_MOUSE;
-					} else if(!collection_depth && 
+						p->type = REPORT_TYPE_MOUSE;
+						report_start(conf, p);
+					} else if(!p->collection_depth && 
 						((value == USAGE_GAMEPAD) || (value == USAGE_JOYSTICK))) {
 							hidp_extreme_debugf(" -> Gamepad/Joystick");
 							hidp_debugf("Gamepad/Joystick usage found");
-							conf->type = REPORT_TYPE_JOYSTICK;
-					} else if(value == USAGE_POINTER && app_collection) {
+							p->type = REPORT_TYPE_JOYSTICK;
+							report_start(conf, p);
+					} else if(value == USAGE_POINTER && p->app_collection) {
 						// usage(pointer) is allowed within the application collection
 
 						hidp_debugf(" -> Pointer");
 
-					} else if(((value >= USAGE_X && value <= USAGE_RZ) || value == USAGE_WHEEL) && app_collection) {
+					} else if(((value >= USAGE_X && value <= USAGE_RZ) || value == USAGE_WHEEL) && p->app_collection) {
 						// usage(x) and usage(y) are allowed within the app collection
 						hidp_extreme_debugf(" -> axis usage");
 
@@ -436,7 +602,7 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 								axis[2] = usage_count;
 							}
 						}
-					} else if((value == USAGE_HAT) && app_collection) {
+					} else if((value == USAGE_HAT) && p->app_collection) {
 						// usage(hat) is allowed within the app collection
 						hidp_extreme_debugf(" -> hat usage");
 
@@ -455,6 +621,7 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 
 				case 1:
 					hidp_extreme_debugf("USAGE_MINIMUM(%d)", value);
+					usage_minimum = value;
 					usage_count -= (value-1);
 					break;
 
@@ -482,3 +649,39 @@ bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf
 	// if we get here then no usable setup was found
 	return false;
 }
+
+// collect all usable reports of an interface and build the table
+// to route incoming reports by their report id
+uint8_t parse_report_descriptors(uint8_t *rep, uint16_t rep_size, hid_reports_t *reports) {
+	uint16_t offset = 0;
+	hid_parser_t parser;
+
+	memset(reports, 0, sizeof(hid_reports_t));
+	hid_parser_init(&parser);
+
+	while(offset < rep_size && reports->reports < MAX_REPORTS) {
+		hid_report_t *conf = &reports->report[reports->reports];
+		uint16_t rbytes = 0;
+
+		if(!parse_report_descriptor(rep+offset, rep_size-offset, conf, &rbytes, &parser))
+			break;
+		offset += rbytes;
+
+		// either all or no reports of an interface carry an id
+		if(conf->report_id_present) {
+			reports->report_id_present = 1;
+			if(reports->index[conf->report_id]) {
+				hidp_debugf("  - duplicate report id %d ignored", conf->report_id);
+				continue;
+			}
+			reports->index[conf->report_id] = reports->reports+1;
+		}
+		reports->reports++;
+
+		if(!reports->report_id_present)
+			break;
+	}
+
+	hidp_debugf("  - %d usable report(s)", reports->reports);
+	return reports->reports;
+}
@@ -5,13 +5,44 @@
 #define REPORT_TYPE_MOUSE    1
 #define REPORT_TYPE_KEYBOARD 2
 #define REPORT_TYPE_JOYSTICK 3
+#define REPORT_TYPE_CONSUMER 4
+
+// max number of usable reports per interface
+#define MAX_REPORTS 4
 
 #define MAX_AXES 4
+#define MAX_BUTTONS 12
+
+// field types of the precompiled extraction plan
+#define HID_FIELD_NONE   0   // not present, always reads as 0
+#define HID_FIELD_U8     1   // byte aligned unsigned 8 bit
+#define HID_FIELD_S8     2   // byte aligned signed 8 bit
+#define HID_FIELD_U16    3   // byte aligned 16 bit little endian
+#define HID_FIELD_BITS   4   // anything else, shifted and masked
+
+// one field of a report, precompiled from its bit offset and size
+typedef struct {
+  uint8_t type;                  // HID_FIELD_...
+  uint8_t byte;                  // first byte of the field
+  uint8_t bytes: 2;              // number of bytes to fetch (1..3)
+  uint8_t is_signed: 1;          // sign expand bit fields
+  uint8_t shift: 3;              // bit position within first byte
+  uint16_t mask;                 // mask after shifting
+} hid_field_t;
+
+// buttons are gathered as runs of consecutive bits
+typedef struct {
+  hid_field_t field;
+  uint8_t first;                 // index of the first button in this run
+} hid_button_run_t;
 
-// currently only joysticks are supported
+// one usable report and the plan to extract its fields. Mice and
+// joysticks share the axes/hat/button plan, keyboards are described
+// by their modifier byte and key array or NKRO bitmap and consumer
+// controls by their usage code array
 typedef struct {
-  uint8_t type: 2;               // REPORT_TYPE_...
-  uint8_t report_id_present: 1;  // REPORT_TYPE_...
+  uint8_t type: 3;               // REPORT_TYPE_...
+  uint8_t report_id_present: 1;  // report is prefixed with its id
   uint8_t report_id;
   uint8_t report_size;
 
@@ -29,7 +60,7 @@ typedef struct {
       struct {
 	uint8_t byte_offset;
 	uint8_t bitmask;
-      } button[12];             // 12 buttons max
+      } button[MAX_BUTTONS];    // 12 buttons max
       
       struct {
 	uint16_t offset;
@@ -43,10 +74,107 @@ typedef struct {
 	  uint16_t max;
 	} physical;
       } hat;                   // 1 hat (joystick only)
+
+      // extraction plan derived from the above when the report is
+      // found to be usable
+      struct {
+	hid_field_t axis[MAX_AXES];
+	hid_field_t hat;
+	uint8_t button_runs;
+	hid_button_run_t button_run[MAX_BUTTONS];
+      } plan;
     } joystick_mouse;
+
+    struct {
+      int16_t modifier_offset;       // bit offset of the eight modifier bits, -1 if none
+      uint16_t keys_offset;          // bit offset of the key array or bitmap
+      uint8_t keys_count;            // number of array entries or bitmap bits
+      uint8_t keys_first;            // key code of the first bitmap bit
+      uint8_t keys_bitmap: 1;        // keys are reported as bitmap (NKRO)
+    } keyboard;
+
+    struct {
+      uint16_t offset;               // bit offset of the usage code array
+      uint8_t size;                  // bits per usage code
+      uint8_t count;                 // number of array entries
+    } consumer;
   };
 } hid_report_t;
 
-bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes);
+// all usable reports of an interface. Incoming reports are routed
+// to their description through the report id
+typedef struct {
+  uint8_t reports;               // number of usable reports
+  uint8_t report_id_present: 1;  // reports are prefixed with their id
+  uint8_t index[256];            // report id -> report+1, 0 if unused
+  hid_report_t report[MAX_REPORTS];
+} hid_reports_t;
+
+// parser state carried from one report of a descriptor to the next.
+// Global items stay valid until redefined, also across collections
+typedef struct {
+  // global items
+  uint32_t usage_page;
+  uint16_t logical_minimum, logical_maximum;
+  uint16_t physical_minimum, physical_maximum;
+  uint8_t report_size, report_count;
+  uint8_t report_id_present: 1;
+  uint8_t report_id;
+
+  // collections the parser is in
+  uint8_t type;                  // REPORT_TYPE_... of the application collection
+  int8_t app_collection;
+  int8_t phys_log_collection;
+  uint8_t skip_collection;
+  int8_t generic_desktop;        // depth at which first gen_desk was found
+  uint8_t collection_depth;
+} hid_parser_t;
+
+void hid_parser_init(hid_parser_t *p);
+
+// returns the next usable report. Without parser state the descriptor
+// is parsed from its beginning
+bool parse_report_descriptor(uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes,
+			     hid_parser_t *p);
+uint8_t parse_report_descriptors(uint8_t *rep, uint16_t rep_size, hid_reports_t *reports);
+
+// find the description of a received report, NULL if there is none
+static inline hid_report_t *hid_report_find(hid_reports_t *r, const uint8_t *p, int len) {
+  if(!r->report_id_present) return r->reports?&r->report[0]:NULL;
+  if(!len || !r->index[p[0]]) return NULL;
+  return &r->report[r->index[p[0]]-1];
+}
+
+// extract a single value from a report using the precompiled plan
+static inline uint16_t hid_field_get(const hid_field_t *f, const uint8_t *p) {
+  switch(f->type) {
+  case HID_FIELD_U8:
+    return p[f->byte];
+  case HID_FIELD_S8:
+    return (int8_t)p[f->byte];
+  case HID_FIELD_U16:
+    return p[f->byte] | (p[f->byte+1] << 8);
+  case HID_FIELD_BITS: {
+    uint32_t v = p[f->byte];
+    if(f->bytes > 1) v |= p[f->byte+1] << 8;
+    if(f->bytes > 2) v |= (uint32_t)p[f->byte+2] << 16;
+    v = (v >> f->shift) & f->mask;
+    // sign expansion
+    if(f->is_signed && (v & (f->mask ^ (f->mask >> 1))))
+      v |= ~f->mask;
+    return v;
+  }
+  }
+  return 0;
+}
+
+// gather all buttons into one word, bit 0 being the first button
+static inline uint16_t hid_buttons_get(const hid_report_t *r, const uint8_t *p) {
+  uint16_t btns = 0;
+  for(int i=0;i<r->joystick_mouse.plan.button_runs;i++)
+    btns |= hid_field_get(&r->joystick_mouse.plan.button_run[i].field, p) <<
+      r->joystick_mouse.plan.button_run[i].first;
+  return btns;
+}
 
 #endif // HIDPARSER_H
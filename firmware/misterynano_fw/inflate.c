@@ -0,0 +1,261 @@
+//
+// inflate.c - small streaming decoder for deflate compressed data
+//
+// Follows the structure of Mark Adler's puff.c. Huffman codes are
+// decoded bit by bit, which is slower than table driven decoders but
+// needs only a few hundred bytes of tables. The output goes through a
+// 32k window which also serves as the history for back references.
+//
+
+#include <string.h>
+#include "inflate.h"
+
+#define MAXBITS   15     // max bits in a code
+#define MAXLCODES 286    // max number of literal/length codes
+#define MAXDCODES 30     // max number of distance codes
+#define FIXLCODES 288    // number of fixed literal/length codes
+
+typedef struct {
+  short count[MAXBITS+1];      // number of symbols of each length
+  short symbol[FIXLCODES];     // symbols ordered by length
+} huffman_t;
+
+static int inflate_byte(inflate_t *s) {
+  if(s->in_pos == s->in_len) {
+    s->in_len = s->read(s->ctx, s->in, sizeof(s->in));
+    s->in_pos = 0;
+    if(s->in_len <= 0) {
+      s->in_len = 0;
+      s->err = 1;   // input ended within the stream
+      return 0;
+    }
+  }
+  return s->in[s->in_pos++];
+}
+
+static int inflate_bits(inflate_t *s, int need) {
+  while(s->bitcnt < need) {
+    s->bitbuf |= (unsigned long)inflate_byte(s) << s->bitcnt;
+    s->bitcnt += 8;
+  }
+
+  int val = s->bitbuf & ((1UL << need) - 1);
+  s->bitbuf >>= need;
+  s->bitcnt -= need;
+  return val;
+}
+
+static int inflate_flush(inflate_t *s) {
+  if(s->wpos && s->write(s->ctx, s->window, s->wpos))
+    s->err = 1;
+  s->wpos = 0;
+  return s->err;
+}
+
+static void inflate_put(inflate_t *s, unsigned char c) {
+  s->window[s->wpos++] = c;
+  s->total++;
+  if(s->wpos == INFLATE_WINDOW)
+    inflate_flush(s);
+}
+
+static int inflate_stored(inflate_t *s) {
+  // discard leftover bits of the current byte
+  s->bitbuf = 0;
+  s->bitcnt = 0;
+
+  unsigned int len = inflate_byte(s);
+  len |= inflate_byte(s) << 8;
+  unsigned int nlen = inflate_byte(s);
+  nlen |= inflate_byte(s) << 8;
+  if(len != (~nlen & 0xffff)) return -1;
+
+  while(len-- && !s->err)
+    inflate_put(s, inflate_byte(s));
+
+  return s->err?-1:0;
+}
+
+static int inflate_decode(inflate_t *s, const huffman_t *h) {
+  int code = 0, first = 0, index = 0;
+
+  for(int len=1;len<=MAXBITS;len++) {
+    code |= inflate_bits(s, 1);
+    int count = h->count[len];
+    if(code - count < first)
+      return h->symbol[index + (code - first)];
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;   // ran out of codes
+}
+
+// create the decoding tables from the code lengths. Returns 0 for a
+// complete code, > 0 for an incomplete one and < 0 if over-subscribed
+static int inflate_construct(huffman_t *h, const short *length, int n) {
+  short offs[MAXBITS+1];
+
+  memset(h->count, 0, sizeof(h->count));
+  for(int symbol=0;symbol<n;symbol++)
+    h->count[length[symbol]]++;
+  if(h->count[0] == n) return 0;   // no codes
+
+  int left = 1;
+  for(int len=1;len<=MAXBITS;len++) {
+    left <<= 1;
+    left -= h->count[len];
+    if(left < 0) return left;
+  }
+
+  offs[1] = 0;
+  for(int len=1;len<MAXBITS;len++)
+    offs[len+1] = offs[len] + h->count[len];
+
+  for(int symbol=0;symbol<n;symbol++)
+    if(length[symbol])
+      h->symbol[offs[length[symbol]]++] = symbol;
+
+  return left;
+}
+
+static int inflate_codes(inflate_t *s, const huffman_t *lencode, const huffman_t *distcode) {
+  static const short lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+  static const short lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+  static const short dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+  static const short dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+  int symbol;
+  do {
+    symbol = inflate_decode(s, lencode);
+    if(symbol < 0 || s->err) return -1;
+
+    if(symbol < 256)
+      inflate_put(s, symbol);
+    else if(symbol > 256) {
+      // length and distance of a back reference
+      symbol -= 257;
+      if(symbol >= 29) return -1;
+      int len = lbase[symbol] + inflate_bits(s, lext[symbol]);
+
+      symbol = inflate_decode(s, distcode);
+      if(symbol < 0 || symbol >= 30) return -1;
+      unsigned long dist = dbase[symbol] + inflate_bits(s, dext[symbol]);
+      if(dist > s->total) return -1;
+
+      // the window is a ring, so the history is always the last 32k
+      while(len-- && !s->err)
+	inflate_put(s, s->window[(s->wpos - dist) & (INFLATE_WINDOW-1)]);
+    }
+  } while(symbol != 256 && !s->err);
+
+  return s->err?-1:0;
+}
+
+static int inflate_fixed(inflate_t *s) {
+  static int init = 0;
+  static huffman_t lencode, distcode;
+
+  if(!init) {
+    short lengths[FIXLCODES];
+    int symbol;
+
+    for(symbol=0;symbol<144;symbol++)       lengths[symbol] = 8;
+    for(;symbol<256;symbol++)               lengths[symbol] = 9;
+    for(;symbol<280;symbol++)               lengths[symbol] = 7;
+    for(;symbol<FIXLCODES;symbol++)         lengths[symbol] = 8;
+    inflate_construct(&lencode, lengths, FIXLCODES);
+
+    for(symbol=0;symbol<MAXDCODES;symbol++) lengths[symbol] = 5;
+    inflate_construct(&distcode, lengths, MAXDCODES);
+    init = 1;
+  }
+
+  return inflate_codes(s, &lencode, &distcode);
+}
+
+static int inflate_dynamic(inflate_t *s) {
+  static const short order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  short lengths[MAXLCODES+MAXDCODES];
+  huffman_t lencode, distcode;
+
+  int nlen = inflate_bits(s, 5) + 257;
+  int ndist = inflate_bits(s, 5) + 1;
+  int ncode = inflate_bits(s, 4) + 4;
+  if(nlen > MAXLCODES || ndist > MAXDCODES) return -1;
+
+  // code lengths of the code length code
+  int index;
+  for(index=0;index<ncode;index++) lengths[order[index]] = inflate_bits(s, 3);
+  for(;index<19;index++)           lengths[order[index]] = 0;
+  if(inflate_construct(&lencode, lengths, 19) != 0) return -1;
+
+  // literal/length and distance code lengths
+  index = 0;
+  while(index < nlen + ndist) {
+    int symbol = inflate_decode(s, &lencode);
+    if(symbol < 0 || s->err) return -1;
+
+    if(symbol < 16)
+      lengths[index++] = symbol;
+    else {
+      int len = 0, repeat;
+      if(symbol == 16) {
+	if(!index) return -1;   // nothing to repeat
+	len = lengths[index-1];
+	repeat = 3 + inflate_bits(s, 2);
+      } else if(symbol == 17)
+	repeat = 3 + inflate_bits(s, 3);
+      else
+	repeat = 11 + inflate_bits(s, 7);
+
+      if(index + repeat > nlen + ndist) return -1;
+      while(repeat--) lengths[index++] = len;
+    }
+  }
+
+  // the end of block code must be present
+  if(!lengths[256]) return -1;
+
+  // incomplete codes are only allowed for a single length 1 code
+  int err = inflate_construct(&lencode, lengths, nlen);
+  if(err < 0 || (err > 0 && nlen - lencode.count[0] != 1)) return -1;
+  err = inflate_construct(&distcode, lengths + nlen, ndist);
+  if(err < 0 || (err > 0 && ndist - distcode.count[0] != 1)) return -1;
+
+  return inflate_codes(s, &lencode, &distcode);
+}
+
+int inflate_run(inflate_t *s) {
+  s->in_pos = s->in_len = 0;
+  s->bitbuf = 0;
+  s->bitcnt = 0;
+  s->err = 0;
+  s->wpos = 0;
+  s->total = 0;
+
+  int last, ret;
+  do {
+    last = inflate_bits(s, 1);
+    int type = inflate_bits(s, 2);
+
+    if(type == 0)      ret = inflate_stored(s);
+    else if(type == 1) ret = inflate_fixed(s);
+    else if(type == 2) ret = inflate_dynamic(s);
+    else               ret = -1;
+  } while(!last && !ret && !s->err);
+
+  if(ret || inflate_flush(s)) return -1;
+  return 0;
+}
@@ -0,0 +1,35 @@
+//
+// inflate.h - small streaming decoder for deflate compressed data
+//
+// Decodes raw deflate streams (RFC 1951) as found in gzip and zip files
+// with constant memory. Input is pulled via the read callback and the
+// output is passed to the write callback in chunks of up to 32k.
+//
+
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#define INFLATE_WINDOW  32768
+
+typedef struct {
+  // returns number of bytes read, 0 at the end of the input
+  int (*read)(void *ctx, unsigned char *buf, int len);
+  // returns 0 on success
+  int (*write)(void *ctx, const unsigned char *buf, int len);
+  void *ctx;
+
+  unsigned char in[512];
+  int in_pos, in_len;
+  unsigned long bitbuf;
+  int bitcnt;
+  int err;
+
+  unsigned char *window;       // INFLATE_WINDOW bytes, allocated by the caller
+  unsigned int wpos;
+  unsigned long total;         // bytes decoded
+} inflate_t;
+
+// decode the entire stream, returns 0 on success
+int inflate_run(inflate_t *s);
+
+#endif // INFLATE_H
@@ -97,6 +97,9 @@ static void osd_task(void *parms) {
 #include "bflb_flash.h"
 #include "bflb_clock.h"
 #include "mem.h"
+#ifdef CONFIG_SHELL
+#include "shell.h"
+#endif
 
 extern void log_start(void);
 extern void bl_show_flashinfo(void);
@@ -320,6 +323,12 @@ int main(void) {
   
   usb_host(spi); 
 
+#if defined(CONFIG_SHELL) && defined(M0S_DOCK)
+  // only the M0S dock has a console rx line for the shell,
+  // e.g. for the "hidtrace" command
+  shell_init_with_task(uart0);
+#endif
+
   // start a thread for the on screen display    
   xTaskCreate(osd_task, (char *)"osd_task", 2048, spi, configMAX_PRIORITIES-3, &osd_handle);
   
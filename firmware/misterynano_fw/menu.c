@@ -9,7 +9,9 @@
 
 #include "sdc.h"
 #include "menu.h"
+#include "osd.h"
 #include "sysctrl.h"
+#include "usb.h"         // for mouse sync
 
 // this is the u8g2_font_helvR08_te with any trailing
 // spaces removed
@@ -32,7 +34,7 @@
 static const char main_form_atari_st[] =
   "MiSTeryNano,;"                       // main form has no parent
   // --------
-  "F,Disk A:,0|st;"                     // fileselector for Disk A:
+  "F,Disk A:,0|st+msa+gz+zip;"          // fileselector for Disk A:
   "S,System,1;"                         // System submenu is form 1
   "S,Drives,2;"                         // Storage submenu
   "S,Settings,3;"                       // Settings submenu is form 3
@@ -52,11 +54,16 @@ static const char system_form_atari_st[] =
 static const char storage_form_atari_st[] =
   "Drives,0|3;"                         // return to form 0, entry 3
   // --------
-  "F,Disk A:,0|st;"                     // fileselector for Disk A:
-  "F,Disk B:,1|st;"                     // fileselector for Disk B:
-  "F,ACSI #0:,2|hd+img;"                // fileselector for ACSI 0
-  "F,ACSI #1:,3|hd+img;"                // fileselector for ACSI 1
-  "L,Disk prot.:,None|A:|B:|Both,P;";   // Enable/Disable Floppy write protection
+  "F,Disk A:,0|st+msa+gz+zip;"          // fileselector for Disk A:
+  "F,Disk B:,1|st+msa+gz+zip;"          // fileselector for Disk B:
+  "F,ACSI #0:,2|hd+img+gz+zip;"         // fileselector for ACSI 0
+  "F,ACSI #1:,3|hd+img+gz+zip;"         // fileselector for ACSI 1
+  "D,Defragment,2|st+hd+img;"           // defragment images, ACSI 0's directory
+  "L,Disk prot.:,None|A:|B:|Both,P;"    // Enable/Disable Floppy write protection
+  "L,Disk speed:,Normal|Turbo 2x|Turbo 4x|Turbo 8x,D;"  // floppy turbo modes
+  "L,Overlay:,Off|On,Y;"                // redirect writes into <image>.ovl
+  "B,Commit overlays,C;"                // write overlays into the images
+  "B,Discard overlays,D;";              // drop all copy-on-write overlays
 
 static const char settings_form_atari_st[] =
   "Settings,0|4;"                       // return to form 0, entry 4
@@ -64,13 +71,23 @@ static const char settings_form_atari_st[] =
   "L,Screen:,Normal|Wide,W;"
   "L,Scanlines:,None|25%|50%|75%,S;"
   "L,Volume:,Mute|33%|66%|100%,A;"
+  "S,USB,4;"                            // USB submenu is form 4
   "B,Save settings,S;";
 
+static const char usb_form_atari_st[] =
+  "USB,3|4;"                            // return to form 3, entry 4
+  // --------
+  "L,Mouse sync:,Off|Frame|100Hz|50Hz,U;" // mouse movement rate
+  "L,Keyb. poll:,Auto|1ms|2ms|4ms|8ms|16ms,K;" // USB polling intervals
+  "L,Mouse poll:,Auto|1ms|2ms|4ms|8ms|16ms,O;"
+  "L,Pad poll:,Auto|1ms|2ms|4ms|8ms|16ms,G;";
+
 static const char *forms_atari_st[] = {
   main_form_atari_st,
   system_form_atari_st,
   storage_form_atari_st,
-  settings_form_atari_st
+  settings_form_atari_st,
+  usb_form_atari_st
 };
 
 // variable ids must match the ones in the menu string
@@ -82,9 +99,15 @@ menu_variable_t variables_atari_st[] = {
   { 'A', { 1 }},    // default volume = 33%
   { 'W', { 0 }},    // default normal (4:3) screen
   { 'P', { 0 }},    // default no floppy write protected
+  { 'D', { 0 }},    // default normal floppy speed
   { 'Q', { 0 }},    // default cubase dongle not enabled
   { 'J', { 0 }},    // default mouse USB, DB9 connector joystick
   { 'T', { 0 }},    // default primary TOS slot
+  { 'U', { 1 }},    // default mouse sync to video frames
+  { 'K', { 0 }},    // default keyboard polling as requested by device
+  { 'O', { 0 }},    // default mouse polling as requested by device
+  { 'G', { 0 }},    // default pad polling as requested by device
+  { 'Y', { 0 }},    // default no overlays, images are written directly
   { '\0',{ 0 }}
 };
 
@@ -95,7 +118,7 @@ menu_variable_t variables_atari_st[] = {
 static const char main_form_c64[] =
   "C64Nano,;"                           // main form has no parent
   // --------
-  "F,Floppy 8:,0|d64+g64;"              // fileselector for Floppy 8:
+  "F,Floppy 8:,0|d64+g64+gz+zip;"       // fileselector for Floppy 8:
   "S,System,1;"                         // System submenu is form 1
   "S,Storage,2;"                        // Storage submenu
   "S,Settings,3;"                       // Settings submenu is form 2
@@ -132,7 +155,7 @@ static const char system_form_c64[] =
 static const char storage_form_c64[] =
   "Storage,0|3;"                        // return to form 0, entry 3
   // --------
-  "F,Floppy 8:,0|d64+g64;"              // fileselector for Disk Drive 8:
+  "F,Floppy 8:,0|d64+g64+gz+zip;"       // fileselector for Disk Drive 8:
   "F,CRT ROM:,1|crt;"                   // fileselector for CRT
   "F,PRG BASIC:,2|prg;"                 // fileselector for PRG
   "F,C64 Kernal:,3|bin;"                // fileselector for Kernal ROM
@@ -191,7 +214,7 @@ menu_variable_t variables_c64[] = {
 static const char main_form_vic20[] =
   "VIC20Nano,;"                         // main form has no parent
   // --------
-  "F,Floppy 8:,0|d64+g64;"              // fileselector for Floppy 8:
+  "F,Floppy 8:,0|d64+g64+gz+zip;"       // fileselector for Floppy 8:
   "S,System,1;"                         // System submenu is form 1
   "S,Storage,2;"                        // Storage submenu
   "S,Settings,3;"                       // Settings submenu is form 2
@@ -217,7 +240,7 @@ static const char system_form_vic20[] =
 static const char storage_form_vic20[] =
   "Storage,0|3;"                        // return to form 0, entry 3
   // --------
-  "F,Floppy 8:,0|d64+g64;"              // fileselector for Disk Drive 8:
+  "F,Floppy 8:,0|d64+g64+gz+zip;"       // fileselector for Disk Drive 8:
   "F,CRT ROM:,1|prg+crt;"               // fileselector for CRT (special VIC20 prg)
   "F,PRG BASIC:,2|prg;"                 // fileselector for PRG
   "F,VIC20 Kernal:,3|bin;"              // fileselector for Kernal ROM
@@ -265,7 +288,7 @@ menu_variable_t variables_vic20[] = {
 static const char main_form_amiga[] =
   "NanoMig,;"                           // main form has no parent
   // --------
-  "F,Floppy DF0:,0|adf;"                // fileselector for DF0
+  "F,Floppy DF0:,0|adf+gz+zip;"         // fileselector for DF0
   "S,System,1;"                         // System submenu is #1
   "S,Storage,2;"                        // Storage submenu is #2
   "S,Settings,3;"                       // Settings submenu is #3
@@ -284,7 +307,7 @@ static const char system_form_amiga[] =
   // --------
   "L,Drives:,1|2|3|4,D;"                // Floppy Drives
   "L,Speed:,Normal|Fast,S;"             // Floppy Speed
-  "F,Floppy DF0,0|adf;"                 // image selector
+  "F,Floppy DF0,0|adf+gz+zip;"          // image selector
   "F,Floppy DF1,1|adf;" 
   "F,Floppy DF2,2|adf;" 
   "F,Floppy DF3,3|adf;"; 
@@ -398,6 +421,23 @@ static const char *settings_file[] = {
   CARD_MOUNTPOINT "/atari2600.ini" // core id = 5
 };
 
+// some variables configure the MCU rather than the core
+static void menu_mcu_set_val(char id, int val) {
+#ifndef SDL
+  if(core_id != CORE_ID_ATARI_ST) return;
+  
+  if(id == 'U') usb_mouse_sync(val);
+
+  // polling intervals Auto, 1, 2, 4, 8 or 16ms
+  if(id == 'K') usb_poll_interval(USB_POLL_KEYBOARD, val?1<<(val-1):0);
+  if(id == 'O') usb_poll_interval(USB_POLL_MOUSE, val?1<<(val-1):0);
+  if(id == 'G') usb_poll_interval(USB_POLL_PAD, val?1<<(val-1):0);
+
+  // overlays are used for images inserted afterwards
+  if(id == 'Y') sdc_set_overlays(val);
+#endif
+}
+
 static int iswhite(char c) {
   return c == ' ' || c == '\r' || c == '\n' || c == '\t';
 }
@@ -455,6 +495,18 @@ static int menu_settings_load(menu_t *menu) {
 	  }
 	}
 	  
+#ifndef SDL
+	// check for device specific usb polling intervals
+	// 'usbpoll 045e:028e=1' style lines
+	if(strncasecmp(buffer, "usbpoll ", 8) == 0) {
+	  unsigned int vid, pid, ms;
+	  if(sscanf(buffer+8, " %x:%x = %u", &vid, &pid, &ms) == 3) {
+	    printf("usbpoll %04x:%04x = %u\r\n", vid, pid, ms);
+	    usb_poll_device_set(vid, pid, ms);
+	  }
+	}
+#endif
+
 	// check for variables
 	if(strncasecmp(buffer, "var ", 4) == 0) {
 	  
@@ -514,6 +566,18 @@ static void menu_settings_save(menu_t *menu) {
       f_puts(str, &file);
     }
 
+#ifndef SDL
+    // write device specific usb polling intervals
+    uint16_t vid, pid;
+    unsigned char ms;
+    for(int i=0;usb_poll_device_get(i, &vid, &pid, &ms);i++) {
+      if(!i) f_puts("\n; usb polling intervals\n", &file);
+      char str[24];
+      sprintf(str, "usbpoll %04x:%04x=%d\n", vid, pid, ms);
+      f_puts(str, &file);
+    }
+#endif
+
     // write image file names
     f_puts("\n; image files\n", &file);
 
@@ -644,6 +708,10 @@ menu_t *menu_init(u8g2_t *u8g2)
       }
     }
   
+    // some MCU settings like the overlays affect the images mounted below
+    for(int i=0;menu.vars[i].id;i++)
+      menu_mcu_set_val(menu.vars[i].id, menu.vars[i].value);
+  
     // try to mount (default) images
     for(int drive=0;drive<MAX_DRIVES;drive++) {
       char *name = sdc_get_image_name(drive);
@@ -660,8 +728,10 @@ menu_t *menu_init(u8g2_t *u8g2)
     printf("SD wasn't ready, not loading settings\r\n");
    
   // send initial values for all variables
-  for(int i=0;menu.vars[i].id;i++)
+  for(int i=0;menu.vars[i].id;i++) {
     sys_set_val(menu.osd->spi, menu.vars[i].id, menu.vars[i].value);
+    menu_mcu_set_val(menu.vars[i].id, menu.vars[i].value);
+  }
 
   // release the core's reset, so it can start
   // and cold reset the core, just in case ...
@@ -758,6 +828,7 @@ static void menu_variable_set(menu_t *menu, const char *s, int val) {
 
       // also set this in the core
       sys_set_val(menu->osd->spi, id, val);
+      menu_mcu_set_val(id, val);
 
       if(core_id == CORE_ID_ATARI_ST) {      
 	// trigger cold reset if memory, chipset or TOS have been changed a
@@ -869,7 +940,7 @@ static void menu_draw_entry(menu_t *menu, int y, const char *s) {
   }
   
   // some entries have a small icon to the right    
-  if(s[0] == 'S')
+  if(s[0] == 'S' || s[0] == 'D')
     u8g2_DrawXBM(MENU2U8G2(menu), hl_w-8, ypos-8, 8, 8, icn_right_bits);    
   if(s[0] == 'F') {
     // icon depends if floppy is inserted
@@ -950,6 +1021,26 @@ static void menu_fs_draw_entry(menu_t *menu, int row, sdc_dir_entry_t *entry) {
     u8g2_DrawButtonFrame(MENU2U8G2(menu), 0, y, U8G2_BTN_INV, width, 1, 1);     
 }
 
+// show the progress while an image is being defragmented
+static void menu_defrag_progress(void *data, int percent) {
+  menu_t *menu = (menu_t*)data;
+  int width = u8g2_GetDisplayWidth(MENU2U8G2(menu));
+  char str[8];
+  
+  u8g2_ClearBuffer(MENU2U8G2(menu));
+  u8g2_SetFont(MENU2U8G2(menu), u8g2_font_helvB08_tr);
+  u8g2_DrawStr(MENU2U8G2(menu), 1, 9, "Defragmenting");
+  u8g2_DrawHLine(MENU2U8G2(menu), 0, 13, width);
+  u8g2_SetFont(MENU2U8G2(menu), font_helvR08_te);
+
+  // progress bar and percentage
+  u8g2_DrawFrame(MENU2U8G2(menu), 0, 30, width, 10);
+  u8g2_DrawBox(MENU2U8G2(menu), 2, 32, (width-4) * percent / 100, 6);
+  sprintf(str, "%d%%", percent);
+  u8g2_DrawStr(MENU2U8G2(menu), (width - u8g2_GetStrWidth(MENU2U8G2(menu), str))/2, 53, str);
+  u8g2_SendBuffer(MENU2U8G2(menu));
+}
+
 // file selector events
 #define FSEL_INIT   0
 #define FSEL_DRAW   1
@@ -964,11 +1055,13 @@ static void menu_fileselector(menu_t *menu, int event) {
   static int parent;
   static int drive;
   static const char *exts;
+  static char defrag;            // selected images are defragmented
   
   if(event == FSEL_INIT) {
     // init
     s = menu->forms[menu->form];
     for(int i=0;i<menu->entry;i++) s = strchr(s, ';')+1;
+    defrag = (*s == 'D');
 
     // get extensions
     exts = menu_get_substr(menu, s, 2, 1);
@@ -1003,6 +1096,23 @@ static void menu_fileselector(menu_t *menu, int event) {
   } else if(event == FSEL_DRAW) {
     // draw
     menu_draw_title(menu, menu_get_str(menu, s, MENU_ENTRY_INDEX_LABEL));
+
+    // tell the defragment selector if the selected image is fragmented.
+    // The fragments are only counted once per entry as this walks the FAT
+    if(defrag && menu->entry && !dir->files[menu->entry - 1].is_dir) {
+      sdc_dir_entry_t *entry = &(dir->files[menu->entry - 1]);
+      if(!entry->frags) {
+	entry->frags = sdc_image_fragments(drive, entry->name);
+	if(!entry->frags) entry->frags = -1;   // don't try again
+      }
+      
+      if(entry->frags > 1) {
+	char str[16];
+	sprintf(str, "%d extents", entry->frags);
+	u8g2_DrawStr(MENU2U8G2(menu), u8g2_GetDisplayWidth(MENU2U8G2(menu)) -
+		     u8g2_GetStrWidth(MENU2U8G2(menu), str) - 1, 9, str);
+      }
+    }
     
     // draw up to four files
     menu->fs_scroll_entry = NULL;  // assume no scrolling needed
@@ -1056,6 +1166,10 @@ static void menu_fileselector(menu_t *menu, int event) {
 	    }
 	  }
 	}
+      } else if(defrag) {
+	// rewrite the image into one contiguous run of clusters
+	if(entry->frags > 1 && !sdc_image_defrag(drive, entry->name, menu_defrag_progress, menu))
+	  entry->frags = 0;   // count again
       } else {
 	// request insertion of this image
 	sdc_image_open(drive, entry->name);
@@ -1129,7 +1243,8 @@ static void menu_select(menu_t *menu) {
   
   switch(*s) {
   case 'F':
-    // user has choosen a file selector
+  case 'D':
+    // user has choosen a file selector or the defragmentation
     menu_fileselector(menu, FSEL_INIT);
     break;
     
@@ -1153,6 +1268,12 @@ static void menu_select(menu_t *menu) {
     if(id == 'S')
       menu_settings_save(menu);
 
+    // write the overlays into the images or throw them away
+    if(id == 'C')
+      sdc_overlay_commit();
+    if(id == 'D')
+      sdc_overlay_discard();
+
     // normal reset
     if(id == 'R') {    
       sys_set_val(menu->osd->spi, 'R', 1);
@@ -1,9 +1,11 @@
 #ifndef MENU_H
 #define MENU_H
 
-#include "osd.h"
 #include "sdc.h"
 
+struct osd_S;         // see osd.h
+struct u8g2_struct;   // u8g2_t
+
 #define MENU_EVENT_NONE   0
 #define MENU_EVENT_UP     1
 #define MENU_EVENT_DOWN   2
@@ -25,7 +27,7 @@ typedef struct {
 } menu_variable_t;
 
 typedef struct {
-  osd_t *osd; 
+  struct osd_S *osd; 
   const char **forms;
   menu_variable_t *vars;
   int form;
@@ -43,7 +45,7 @@ menu_t *menu_init(spi_t *spi);
 #else
 #define pdMS_TO_TICKS(a) (a)
 extern void vTaskDelay(int);
-menu_t *menu_init(u8g2_t *u8g2);
+menu_t *menu_init(struct u8g2_struct *u8g2);
 #endif
 
 void menu_do(menu_t *, int);
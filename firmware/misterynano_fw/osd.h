@@ -12,7 +12,7 @@
 #define OSD_INVISIBLE  0
 #define OSD_VISIBLE    (!OSD_INVISIBLE)
 
-typedef struct {
+typedef struct osd_S {
   char state;
   spi_t *spi;
   u8g2_t u8g2;
@@ -10,6 +10,9 @@
 #include "menu.h"
 #include "sdc.h"
 
+// number of 8x8 tiles sent in one spi transfer
+#define OSD_TILE_CHUNK  4
+
 static const u8x8_display_info_t u8x8_mn_128x64_info =
   { 0, 1, 0, 0, 0, 0, 0, 0, 4000000UL, 1, 0, 0, 0, 16, 8, 0, 0, 128, 64 };
 
@@ -45,17 +48,21 @@ uint8_t u8x8_d_mn_128x64(u8x8_t *u8g2, uint8_t msg, uint8_t arg_int, void *arg_p
         c = ((u8x8_tile_t *)arg_ptr)->cnt;
         ptr = ((u8x8_tile_t *)arg_ptr)->tile_ptr;
 
-	spi_begin(spi);
+	// send the tiles in chunks, so the bus isn't blocked for a
+	// whole row
+	for(int t=0;t<c;t+=OSD_TILE_CHUNK) {
+	  spi_begin_prio(spi, SPI_PRIO_OSD);
       
-	/* send data */
-	spi_tx_u08(spi, SPI_TARGET_OSD);
-	spi_tx_u08(spi, SPI_OSD_WRITE);           // command byte data
-	spi_tx_u08(spi, ((y/8)<<4)+x/8); // tile address
+	  /* send data */
+	  spi_tx_u08(spi, SPI_TARGET_OSD);
+	  spi_tx_u08(spi, SPI_OSD_WRITE);           // command byte data
+	  spi_tx_u08(spi, ((y/8)<<4)+(x/8)+t); // tile address
 
-	for(int i=0;i<c*8;i++)
-	  spi_tx_u08(spi, ptr[i]);
+	  for(int i=t*8;i<c*8 && i<(t+OSD_TILE_CHUNK)*8;i++)
+	    spi_tx_u08(spi, ptr[i]);
 
-	spi_end(spi);
+	  spi_end(spi);
+	}
 	
         arg_int--;
 	x+=c*8;
@@ -90,7 +97,7 @@ void osd_enable(osd_t *osd, char en) {
   osd->state = en;
   
   // show/hide OSD
-  spi_begin(osd->spi);  
+  spi_begin_prio(osd->spi, SPI_PRIO_OSD);  
   spi_tx_u08(osd->spi, SPI_TARGET_OSD);
   spi_tx_u08(osd->spi, SPI_OSD_ENABLE);  // enable/disable command
   spi_tx_u08(osd->spi, en);    // enable
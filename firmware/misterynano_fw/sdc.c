@@ -4,6 +4,7 @@
 //
 
 #include "sdc.h"
+#include "vimage.h"
 #include <ff.h>
 #include <stdlib.h>
 #include <diskio.h>
@@ -14,8 +15,13 @@
 // enable to use old way to determine cluster position
 // #define USE_FSEEK
 
+// max number of bytes sent or received in one spi transfer. Longer
+// transfers are split, so other bus users don't have to wait too long
+#define SDC_CHUNK  64
+
 static spi_t *spi = NULL;
 static int sdc_ready = 0;
+static int sdc_chunked = 0;   // core supports SPI_SDC_CONTINUE
 static SemaphoreHandle_t sdc_sem;
 
 static FATFS fs;
@@ -23,11 +29,57 @@ static FATFS fs;
 static FIL fil[MAX_DRIVES];
 static DWORD *lktbl[MAX_DRIVES];
 
+// last run of consecutive sectors translated per drive. Multi sector
+// requests (e.g. ACSI) announce their length, so the whole run is
+// translated once and the following requests are served from here
+static struct {
+  unsigned long lba, dsector, count;
+  int overlay;    // run is in the overlay
+} run[MAX_DRIVES];
+
+// Copy-on-write overlays keep images unmodified. Writes go into the
+// sidecar <image>.ovl, which has room for every sector of the image
+// followed by a bitmap of the sectors written. Reads of sectors marked
+// there are served from the overlay, all others from the image itself
+#define OVERLAY_SUFFIX  ".ovl"
+
+static int sdc_overlays = 0;   // use overlays for images inserted from now on
+static int sdc_dirflags = 0;   // core reports the direction of requests
+static int sdc_coredata = 0;   // core accepts sector data from the MCU
+
+static struct {
+  FIL fil;
+  DWORD *lktbl;
+  unsigned char *bitmap;       // one bit per image sector, NULL without overlay
+  unsigned long sectors;       // image size in sectors, the bitmap follows
+} ovl[MAX_DRIVES];
+
+#define OVL_TEST(d,s)  (ovl[d].bitmap[(s)>>3] & (1<<((s)&7)))
+
 static void sdc_spi_begin(spi_t *spi) {
-  spi_begin(spi);  
+  spi_begin_prio(spi, SPI_PRIO_DISK);  
   spi_tx_u08(spi, SPI_TARGET_SDC);
 }
 
+// end the current transfer and give other bus users a chance before
+// continuing where it was left off
+static void sdc_spi_continue(spi_t *spi) {
+  spi_end(spi);
+  sdc_spi_begin(spi);
+  spi_tx_u08(spi, SPI_SDC_CONTINUE);
+  spi_tx_u08(spi, 0);   // dummy
+}
+
+// wait for the core to return 0, with a chunked core only for a
+// limited number of bytes
+static int sdc_spi_wait(spi_t *spi, unsigned char mask) {
+  for(int i=0;!sdc_chunked || i<SDC_CHUNK;i++)
+    if(!(spi_tx_u08(spi, 0) & mask))
+      return 1;
+
+  return 0;
+}
+
 static LBA_t clst2sect(DWORD clst) {
   clst -= 2;
   if (clst >= fs.n_fatent - 2)   return 0;
@@ -77,10 +129,16 @@ int sdc_read_sector(unsigned long sector, unsigned char *buffer) {
   spi_tx_u08(spi, sector & 0xff);
 
   // todo: add timeout
-  while(spi_tx_u08(spi, 0));  // wait for ready
+  while(!sdc_spi_wait(spi, 0xff))  // wait for ready
+    sdc_spi_continue(spi);
 
   // read 512 bytes sector data
-  for(int i=0;i<512;i++) buffer[i] = spi_tx_u08(spi, 0);
+  for(int i=0;i<512;i++) {
+    if(sdc_chunked && i && !(i % SDC_CHUNK))
+      sdc_spi_continue(spi);
+    
+    buffer[i] = spi_tx_u08(spi, 0);
+  }
 
   spi_end(spi);
 
@@ -109,10 +167,16 @@ int sdc_write_sector(unsigned long sector, const unsigned char *buffer) {
   spi_tx_u08(spi, sector & 0xff);
 
   // write sector data
-  for(int i=0;i<512;i++) spi_tx_u08(spi, buffer[i]);  
+  for(int i=0;i<512;i++) {
+    if(sdc_chunked && i && !(i % SDC_CHUNK))
+      sdc_spi_continue(spi);
+    
+    spi_tx_u08(spi, buffer[i]);  
+  }
 
   // todo: add timeout
-  while(spi_tx_u08(spi, 0));  // wait for ready
+  while(!sdc_spi_wait(spi, 0xff))  // wait for ready
+    sdc_spi_continue(spi);
 
   spi_end(spi);
 
@@ -131,15 +195,19 @@ static int sdc_initialize() {
   return 0;
 }
 
+// fatfs reads and writes whole sectors of large transfers directly
+// from and to the caller's buffer, so count may be more than one
 static int sdc_read(BYTE *buff, LBA_t sector, UINT count) {
   printf("sdc_read(%p,%d,%d)\r\n", buff, sector, count);  
-  sdc_read_sector(sector, buff);
+  for(UINT i=0;i<count;i++)
+    sdc_read_sector(sector+i, buff+512*i);
   return 0;
 }
 
 static int sdc_write(const BYTE *buff, LBA_t sector, UINT count) {
   printf("sdc_write(%p,%d,%d)\r\n", buff, sector, count);  
-  sdc_write_sector(sector, buff);
+  for(UINT i=0;i<count;i++)
+    sdc_write_sector(sector+i, buff+512*i);
   return 0;
 }
 
@@ -191,6 +259,25 @@ static int fs_init() {
     return -1;
   }
   
+  // bit 0 is set by cores able to continue split transfers
+  sdc_chunked = status & 1;
+
+  // cores reporting the direction of requests end the status with the
+  // write flags and their complement
+  sdc_spi_begin(spi);  
+  spi_tx_u08(spi, SPI_SDC_STATUS);
+  for(int i=0;i<8;i++) spi_tx_u08(spi, 0);
+  unsigned char wflags = spi_tx_u08(spi, 0);
+  sdc_dirflags = (unsigned char)~wflags == spi_tx_u08(spi, 0);
+  spi_end(spi);
+
+  // cores able to take sector data from the MCU acknowledge a probe
+  sdc_spi_begin(spi);  
+  spi_tx_u08(spi, SPI_SDC_CORE_DATA);
+  spi_tx_u08(spi, 2);
+  sdc_coredata = spi_tx_u08(spi, 0) == 0x5a;
+  spi_end(spi);
+  
   char *type[] = { "UNKNOWN", "SDv1", "SDv2", "SDHCv2" };
   printf("SDC status: %02x\r\n", status);
   printf("  card status: %d\r\n", (status >> 4)&15);
@@ -213,6 +300,10 @@ static int fs_init() {
 static char *cwd[MAX_DRIVES] = { NULL, NULL, NULL, NULL };
 static char *image_name[MAX_DRIVES] = { NULL, NULL, NULL, NULL };
 
+// scratch files of archives are mounted read-only, writes would be
+// lost once the drive mounts another archive
+static char image_ro[MAX_DRIVES];
+
 void sdc_set_default(int drive, const char *name) {
   // a valid filename will currently always begin with /sd
   if(strncasecmp(name, CARD_MOUNTPOINT, strlen(CARD_MOUNTPOINT)) == 0) {
@@ -266,6 +357,79 @@ static DWORD clmt_clust(FIL *fp, FSIZE_t ofs) {
 }
 #endif
 
+// translate sector into a physical sector on the sd card
+static unsigned long sdc_translate(FIL *fp, unsigned long rsector) {
+#ifdef USE_FSEEK
+  f_lseek(fp, (rsector+1)*512);
+  // and add sector offset within cluster    
+  return clst2sect(fp->clust) + rsector%fs.csize;    
+#else
+  // derive cluster directly from table
+  return clst2sect(clmt_clust(fp, rsector*512)) + rsector%fs.csize;
+#endif
+}
+
+// translate a run of up to count sectors of the image or its overlay
+// and return the number of sectors that are also consecutive on the
+// sd card
+static unsigned long sdc_translate_run(int drive, FIL *fp, unsigned long rsector,
+				       unsigned long count, unsigned long *dsector) {
+  unsigned long size = fil[drive].obj.objsize / 512;
+  if(rsector + count > size) count = (rsector < size)?size - rsector:1;
+
+  *dsector = sdc_translate(fp, rsector);
+
+  // check cluster by cluster whether the run stays contiguous
+  unsigned long n = fs.csize - rsector%fs.csize;
+  while(n < count && sdc_translate(fp, rsector+n) == *dsector + n)
+    n += fs.csize;
+
+  return (n < count)?n:count;
+}
+
+// write one sector of the bitmap back into the overlay
+static void sdc_overlay_sync(int drive, unsigned long index) {
+  sdc_write_sector(sdc_translate(&ovl[drive].fil, ovl[drive].sectors + index),
+		   ovl[drive].bitmap + 512 * index);
+}
+
+static void sdc_overlay_close(int drive) {
+  if(!ovl[drive].bitmap) return;
+
+  f_close(&ovl[drive].fil);
+  free(ovl[drive].lktbl);
+  free(ovl[drive].bitmap);
+  ovl[drive].lktbl = NULL;
+  ovl[drive].bitmap = NULL;
+}
+
+void sdc_set_overlays(int enable) {
+  sdc_overlays = enable;
+}
+
+// answer the core's request with the given sector data or, without
+// data, just complete it
+static void sdc_core_data(const unsigned char *buffer) {
+  sdc_spi_begin(spi);  
+  spi_tx_u08(spi, SPI_SDC_CORE_DATA);
+  spi_tx_u08(spi, buffer?0:1);
+
+  if(buffer) {
+    for(int i=0;i<512;i++) {
+      if(sdc_chunked && i && !(i % SDC_CHUNK))
+	sdc_spi_continue(spi);
+    
+      spi_tx_u08(spi, buffer[i]);  
+    }
+  }
+
+  // wait until the core has the data
+  while(!sdc_spi_wait(spi, 0xff))
+    sdc_spi_continue(spi);
+
+  spi_end(spi);
+}
+
 int sdc_handle_event(void) {
   // printf("Handling SDC event\r\n");
 
@@ -276,6 +440,16 @@ int sdc_handle_event(void) {
   unsigned char request = spi_tx_u08(spi, 0);
   unsigned long rsector = 0;
   for(int i=0;i<4;i++) rsector = (rsector << 8) | spi_tx_u08(spi, 0); 
+  // number of consecutive sectors the core is going to request
+  unsigned long rcount = spi_tx_u08(spi, 0);
+  rcount = (rcount << 8) | spi_tx_u08(spi, 0);
+  if(!rcount) rcount = 1;
+  // the direction is only needed for overlays
+  unsigned char wflags = 0;
+  if(sdc_dirflags) {
+    wflags = spi_tx_u08(spi, 0);
+    spi_tx_u08(spi, 0);
+  }
   spi_end(spi);
 
   int drive = 0;               // 0 = Drive A:
@@ -286,6 +460,34 @@ int sdc_handle_event(void) {
   if(request == 32) drive = 5; // 5 = Drive D:
   
   if(request & 63) {
+    // images decoded by the MCU. Writes are ignored
+    if(vimage_is_open(drive)) {
+      // only used under the sdc lock
+      static unsigned char buffer[512];
+
+      sdc_lock();
+      if(wflags & request) {
+	printf("%s: write to lba %lu ignored\r\n", drivename(drive), rsector);
+	sdc_core_data(NULL);
+      } else if(vimage_read(drive, rsector, buffer)) {
+	printf("%s: read of lba %lu failed\r\n", drivename(drive), rsector);
+	sdc_core_data(NULL);
+      } else
+	sdc_core_data(buffer);
+      sdc_unlock();
+
+      return 0;
+    }
+
+    // drop writes to read-only images if the core allows so
+    if(image_ro[drive] && (wflags & request) && sdc_coredata) {
+      sdc_lock();
+      printf("%s: write to lba %lu ignored\r\n", drivename(drive), rsector);
+      sdc_core_data(NULL);
+      sdc_unlock();
+      return 0;
+    }
+
     if(!fil[drive].flag) {
       // no file selected
       // this should actually never happen as the core won't request
@@ -295,18 +497,33 @@ int sdc_handle_event(void) {
     
     // ---- figure out which physical sector to use ----
   
+    // with an overlay all writes and the reads of sectors written
+    // before go to the overlay, all other reads to the image. The core
+    // only checks the first sector of multi sector requests, sectors
+    // beyond the end of the image are not covered by the overlay
+    int write = (wflags & request) != 0;
+    
     // translate sector into a cluster number inside image
     sdc_lock();
-#ifdef USE_FSEEK
-    f_lseek(&fil[drive], (rsector+1)*512);
-    // and add sector offset within cluster    
-    unsigned long dsector = clst2sect(fil[drive].clust) + rsector%fs.csize;    
-#else
-    // derive cluster directly from table
-    unsigned long dsector = clst2sect(clmt_clust(&fil[drive], rsector*512)) + rsector%fs.csize;
-#endif
-    
-    printf("%s: lba %lu = %lu\r\n", drivename(drive), rsector, dsector);
+    int overlay = ovl[drive].bitmap && rsector < ovl[drive].sectors &&
+      (write || OVL_TEST(drive, rsector));
+    unsigned long dsector;
+    if(rsector >= run[drive].lba && rsector < run[drive].lba + run[drive].count &&
+       overlay == run[drive].overlay)
+      // part of the run translated before
+      dsector = run[drive].dsector + rsector - run[drive].lba;
+    else {
+      run[drive].lba = rsector;
+      run[drive].overlay = overlay;
+      run[drive].count = sdc_translate_run(drive, overlay?&ovl[drive].fil:&fil[drive],
+					   rsector, rcount, &run[drive].dsector);
+      dsector = run[drive].dsector;
+
+      if(run[drive].count > 1)
+	printf("%s: lba %lu = %lu (%lu sectors)\r\n", drivename(drive), rsector, dsector, run[drive].count);
+      else
+	printf("%s: lba %lu = %lu\r\n", drivename(drive), rsector, dsector);
+    }
 
     // send sector number to core, so it can read or write the right
     // sector from/to its local sd card
@@ -320,10 +537,17 @@ int sdc_handle_event(void) {
     // wait while core is busy to make sure we don't start
     // requesting data for ourselves while the core is still
     // doing its own io
-    while(spi_tx_u08(spi, 0) & 1);
+    while(!sdc_spi_wait(spi, 1))
+      sdc_spi_continue(spi);
     
     spi_end(spi);
 
+    // the first write of a sector marks it in the overlay
+    if(overlay && !OVL_TEST(drive, rsector)) {
+      ovl[drive].bitmap[rsector>>3] |= 1<<(rsector&7);
+      sdc_overlay_sync(drive, rsector >> 12);
+    }
+
     sdc_unlock();
   }
 
@@ -351,6 +575,262 @@ static int sdc_image_inserted(char drive, unsigned long size) {
   return 0;
 }
 
+static void sdc_tx_u32(spi_t *spi, unsigned long v) {
+  spi_tx_u08(spi, (v >> 24) & 0xff);
+  spi_tx_u08(spi, (v >> 16) & 0xff);
+  spi_tx_u08(spi, (v >> 8) & 0xff);
+  spi_tx_u08(spi, v & 0xff);
+}
+
+// Upload the extents of the image from the link table to the core, so
+// it can translate sector requests itself. If the table doesn't fit
+// the core keeps asking the MCU
+static void sdc_image_extents(int drive) {
+  // the core has tables for drives 0 to 3 only. Drives with an overlay
+  // are always translated by the MCU
+  if(drive > 3 || !fil[drive].cltbl || ovl[drive].bitmap) return;
+
+  // count fragments
+  int frags = 0;
+  for(DWORD *tbl = fil[drive].cltbl + 1; *tbl; tbl += 2)
+    frags++;
+  
+  sdc_spi_begin(spi);
+  spi_tx_u08(spi, SPI_SDC_EXTENTS);
+  spi_tx_u08(spi, drive);
+  // the core returns its table size and its complement. Older cores
+  // don't know the command and return the same byte twice
+  unsigned char size = spi_tx_u08(spi, 0);
+  unsigned char check = spi_tx_u08(spi, 0);
+
+  if((unsigned char)~size != check || frags+1 > size) {
+    spi_end(spi);
+    printf("%s: %d fragments, not translated by core\r\n", drivename(drive), frags);
+    return;
+  }
+
+  // this isn't split into chunks as it only happens once when
+  // an image is mounted
+  unsigned long lba = 0;
+  for(DWORD *tbl = fil[drive].cltbl + 1; *tbl; tbl += 2) {
+    sdc_tx_u32(spi, lba);
+    sdc_tx_u32(spi, clst2sect(tbl[1]));
+    lba += tbl[0] * fs.csize;
+  }
+  
+  // end marker
+  sdc_tx_u32(spi, (fil[drive].obj.objsize + 511) / 512);
+  sdc_tx_u32(spi, 0);
+  spi_end(spi);
+  
+  printf("%s: %d fragments translated by core\r\n", drivename(drive), frags);
+}
+
+// walk the FAT to create the link table of an image or overlay. The
+// table is returned and also installed in the file
+static DWORD *sdc_create_linkmap(FIL *fp) {
+  // try with a 16 entry link table
+  DWORD *tbl = malloc(16 * sizeof(DWORD));    
+  fp->cltbl = tbl;
+  tbl[0] = 16;
+    
+  if(f_lseek(fp, CREATE_LINKMAP)) {
+    // this isn't really a problem. But sector access will
+    // be slower
+    printf("Link table creation failed, "
+	   "required size: %d\r\n", tbl[0]);
+
+    // re-alloc sufficient memory
+    tbl = realloc(tbl, sizeof(DWORD) * tbl[0]);
+    fp->cltbl = tbl;
+
+    // and retry link table creation
+    if(f_lseek(fp, CREATE_LINKMAP)) {
+      printf("Link table creation finally failed, "
+	     "required size: %d\r\n", tbl[0]);
+      free(tbl);
+      fp->cltbl = NULL;
+      return NULL;
+    } else 
+      printf("Link table ok\r\n");
+  }
+  
+  return tbl;
+}
+
+// open or create the overlay of the image just opened in the drive
+static int sdc_overlay_open(int drive, const char *name) {
+  char oname[strlen(name) + sizeof(OVERLAY_SUFFIX)];
+  strcpy(oname, name);
+  strcat(oname, OVERLAY_SUFFIX);
+
+  // the bitmap occupies whole sectors behind the image's sectors
+  unsigned long sectors = (f_size(&fil[drive]) + 511) / 512;
+  UINT bmsize = 512 * ((sectors + 4095) / 4096);
+  FSIZE_t size = (FSIZE_t)512 * sectors + bmsize;
+  
+  FIL *fp = &ovl[drive].fil;
+  if(f_open(fp, oname, FA_OPEN_ALWAYS | FA_READ | FA_WRITE) != FR_OK)
+    return -1;
+
+  unsigned char *bitmap = malloc(bmsize);
+  UINT br;
+  if(bitmap && f_size(fp) == size && f_lseek(fp, size - bmsize) == FR_OK &&
+     f_read(fp, bitmap, bmsize, &br) == FR_OK && br == bmsize)
+    printf("%s: using overlay %s\r\n", drivename(drive), oname);
+  else if(bitmap) {
+    // a new overlay. Its sectors don't need to be cleared as only those
+    // marked in the bitmap are ever read
+    printf("%s: creating overlay %s\r\n", drivename(drive), oname);
+    sdc_extcache_drop(oname);
+    memset(bitmap, 0, bmsize);
+    f_lseek(fp, 0);
+    if(f_truncate(fp) != FR_OK ||
+       (f_expand(fp, size, 1) != FR_OK && f_lseek(fp, size) != FR_OK) ||
+       f_size(fp) != size || f_lseek(fp, size - bmsize) != FR_OK ||
+       f_write(fp, bitmap, bmsize, &br) != FR_OK || br != bmsize || f_sync(fp) != FR_OK) {
+      free(bitmap);
+      bitmap = NULL;
+    }
+  }
+
+  if(!bitmap || !(ovl[drive].lktbl = sdc_create_linkmap(fp))) {
+    printf("%s: overlay failed\r\n", drivename(drive));
+    free(bitmap);
+    f_close(fp);
+    return -1;
+  }
+  
+  ovl[drive].bitmap = bitmap;
+  ovl[drive].sectors = sectors;
+  return 0;
+}
+
+// Link tables of images mounted before are kept in a cache file, so
+// mounting doesn't have to walk the FAT again. An entry is only used if
+// path, start cluster, size and modification time still match. Images
+// rewritten e.g. on a PC are thus not mistaken for the cached ones. Files
+// written by the MCU itself all carry the same time stamp as there's no
+// rtc, so their entries are dropped whenever they are being recreated
+#define EXTCACHE_FILE     CARD_MOUNTPOINT "/.extents"
+#define EXTCACHE_ENTRIES  16
+
+typedef struct {
+  DWORD sclust;
+  DWORD size;
+  WORD fdate, ftime;
+  WORD len;     // length of path incl. terminating 0, path follows header
+  WORD words;   // size of link table, follows path
+} extcache_hdr_t;
+
+static int sdc_extcache_match(const extcache_hdr_t *hdr, FIL *fp, FILINFO *fno) {
+  return hdr->sclust == fp->obj.sclust && hdr->size == fp->obj.objsize &&
+    hdr->fdate == fno->fdate && hdr->ftime == fno->ftime;
+}
+
+static DWORD *sdc_extcache_load(const char *name, FIL *fp, FILINFO *fno) {
+  FIL cache;
+  if(f_open(&cache, EXTCACHE_FILE, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return NULL;
+
+  DWORD *tbl = NULL;
+  extcache_hdr_t hdr;
+  UINT br;
+  while(!tbl && f_read(&cache, &hdr, sizeof(hdr), &br) == FR_OK && br == sizeof(hdr)) {
+    if(!hdr.len) break;
+    char path[hdr.len];
+    if(f_read(&cache, path, hdr.len, &br) != FR_OK || br != hdr.len)
+      break;
+
+    if(sdc_extcache_match(&hdr, fp, fno) && !strncmp(path, name, hdr.len)) {
+      tbl = malloc(hdr.words * sizeof(DWORD));
+      if(tbl && (f_read(&cache, tbl, hdr.words * sizeof(DWORD), &br) != FR_OK ||
+		 br != hdr.words * sizeof(DWORD) || tbl[0] != hdr.words)) {
+	free(tbl);
+	tbl = NULL;
+	break;
+      }
+    } else
+      f_lseek(&cache, f_tell(&cache) + hdr.words * sizeof(DWORD));
+  }
+  
+  f_close(&cache);
+  return tbl;
+}
+
+// store the link table of fp for name. Without fp only the entry of
+// name is dropped
+static void sdc_extcache_store(const char *name, FIL *fp, FILINFO *fno) {
+  FIL cache;
+  UINT br;
+
+  // read the existing entries
+  char *old = NULL;
+  UINT olen = 0;
+  if(f_open(&cache, EXTCACHE_FILE, FA_OPEN_EXISTING | FA_READ) == FR_OK) {
+    olen = f_size(&cache);
+    old = malloc(olen);
+    if(!old || f_read(&cache, old, olen, &br) != FR_OK || br != olen)
+      olen = 0;
+    f_close(&cache);
+  }
+
+  // entries of other images are kept, the oldest ones are dropped once
+  // the cache is full. Headers are copied as entries aren't aligned
+  extcache_hdr_t hdr;
+  int entries = 0, others = 0;
+  for(UINT ofs = 0; ofs + sizeof(hdr) <= olen; ) {
+    memcpy(&hdr, old+ofs, sizeof(hdr));
+    UINT rlen = sizeof(hdr) + hdr.len + hdr.words * sizeof(DWORD);
+    if(ofs + rlen > olen) { olen = ofs; break; }
+    if(strncmp(old+ofs+sizeof(hdr), name, hdr.len)) others++;
+    entries++;
+    ofs += rlen;
+  }
+  int skip = others - (EXTCACHE_ENTRIES-1);
+
+  // nothing to drop
+  if(!fp && others == entries) {
+    free(old);
+    return;
+  }
+  
+  if(f_open(&cache, EXTCACHE_FILE, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+    free(old);
+    return;
+  }
+  
+  for(UINT ofs = 0; ofs + sizeof(hdr) <= olen; ) {
+    memcpy(&hdr, old+ofs, sizeof(hdr));
+    UINT rlen = sizeof(hdr) + hdr.len + hdr.words * sizeof(DWORD);
+    if(strncmp(old+ofs+sizeof(hdr), name, hdr.len) && skip-- <= 0)
+      f_write(&cache, old+ofs, rlen, &br);
+    ofs += rlen;
+  }
+  free(old);
+
+  if(!fp) {
+    f_close(&cache);
+    return;
+  }
+
+  // append the new entry
+  hdr.sclust = fp->obj.sclust;
+  hdr.size = fp->obj.objsize;
+  hdr.fdate = fno->fdate;
+  hdr.ftime = fno->ftime;
+  hdr.len = strlen(name)+1;
+  hdr.words = fp->cltbl[0];
+  f_write(&cache, &hdr, sizeof(hdr), &br);
+  f_write(&cache, name, hdr.len, &br);
+  f_write(&cache, fp->cltbl, hdr.words * sizeof(DWORD), &br);
+  f_close(&cache);
+}
+
+void sdc_extcache_drop(const char *name) {
+  sdc_extcache_store(name, NULL, NULL);
+}
+
 int sdc_image_open(int drive, char *name) {
   // tell core that the "disk" has been removed
   sdc_image_inserted(drive, 0);
@@ -360,6 +840,13 @@ int sdc_image_open(int drive, char *name) {
     free(image_name[drive]);
     image_name[drive] = NULL;
   }
+
+  // the overlay stays on the card for the next time the image is used
+  sdc_lock();
+  sdc_overlay_close(drive);
+  vimage_close(drive);
+  image_ro[drive] = 0;
+  sdc_unlock();
   
   // nothing to be inserted? Do nothing!
   if(!name) return 0;
@@ -370,7 +857,17 @@ int sdc_image_open(int drive, char *name) {
   strcat(fname, "/");
   strcat(fname, name);
 
+  // archives are mounted via the scratch file they are extracted to
+  int vtype = vimage_type(name);
+  const char *path = fname;
+  if(vtype == VIMAGE_GZIP || vtype == VIMAGE_ZIP)
+    if(!(path = vimage_extract(drive, fname)))
+      return -1;
+
   sdc_lock();
+
+  // forget about the previous image's translations
+  run[drive].count = 0;
   
   // close any previous image, especially free the link table
   if(fil[drive].cltbl) {
@@ -380,9 +877,25 @@ int sdc_image_open(int drive, char *name) {
     fil[drive].cltbl = NULL;
   }
   
-  printf("Mounting %s\r\n", fname);
+  printf("Mounting %s\r\n", path);
+
+  // MSA images are decoded by the MCU, which sends the sector data
+  // to the core
+  if(vtype == VIMAGE_MSA) {
+    long size = -1;
+    if(!sdc_coredata || !sdc_dirflags)
+      printf("%s: core doesn't support MSA images\r\n", drivename(drive));
+    else
+      size = vimage_open(drive, fname);
+    sdc_unlock();
+    if(size < 0) return -1;
 
-  if(f_open(&fil[drive], fname, FA_OPEN_EXISTING | FA_READ) != 0) {
+    image_name[drive] = strdup(name);
+    sdc_image_inserted(drive, size);
+    return 0;
+  }
+
+  if(f_open(&fil[drive], path, FA_OPEN_EXISTING | FA_READ) != 0) {
     printf("file open failed\r\n");
     sdc_unlock();
     return -1;
@@ -392,33 +905,46 @@ int sdc_image_open(int drive, char *name) {
     printf("File len = %ld, spc = %d, clusters = %d\r\n",
 	   (unsigned long)fil[drive].obj.objsize, fs.csize,
 	   (unsigned long)fil[drive].obj.objsize / 512 / fs.csize);      
+
+    // the modification time is part of the cache key
+    FILINFO fno;
+    if(f_stat(path, &fno) != FR_OK)
+      memset(&fno, 0, sizeof(fno));
     
-    // try with a 16 entry link table
-    lktbl[drive] = malloc(16 * sizeof(DWORD));    
-    fil[drive].cltbl = lktbl[drive];
-    lktbl[drive][0] = 16;
+    if((lktbl[drive] = sdc_extcache_load(path, &fil[drive], &fno))) {
+      // the image hasn't changed since the link table was cached
+      fil[drive].cltbl = lktbl[drive];
+      printf("Link table from cache\r\n");
+    } else if((lktbl[drive] = sdc_create_linkmap(&fil[drive])))
+      sdc_extcache_store(path, &fil[drive], &fno);
+    else {
+      sdc_unlock();
+      return -1;
+    }
+
+    if(path != fname) {
+      image_ro[drive] = 1;
+      if(!sdc_coredata || !sdc_dirflags)
+	printf("%s: core can't drop writes, they are lost with the next archive\r\n",
+	       drivename(drive));
+    }
     
-    if(f_lseek(&fil[drive], CREATE_LINKMAP)) {
-      // this isn't really a problem. But sector access will
-      // be slower
-      printf("Link table creation failed, "
-	     "required size: %d\r\n", lktbl[drive][0]);
-
-      // re-alloc sufficient memory
-      lktbl[drive] = realloc(lktbl[drive], sizeof(DWORD) * lktbl[drive][0]);
-
-      // and retry link table creation
-      if(f_lseek(&fil[drive], CREATE_LINKMAP)) {
-	printf("Link table creation finally failed, "
-	       "required size: %d\r\n", lktbl[drive][0]);
+    // overlays need the core to report the direction of requests. The
+    // scratch file of an archive is a copy anyway
+    if(sdc_overlays && path == fname) {
+      if(!sdc_dirflags)
+	printf("%s: core doesn't support overlays\r\n", drivename(drive));
+
+      // without its overlay the core would write into the image itself
+      if(!sdc_dirflags || sdc_overlay_open(drive, fname) != 0) {
+	printf("%s: not mounted without overlay\r\n", drivename(drive));
 	free(lktbl[drive]);
 	lktbl[drive] = NULL;
 	fil[drive].cltbl = NULL;
-
+	f_close(&fil[drive]);
 	sdc_unlock();
 	return -1;
-      } else 
-	printf("Link table ok\r\n");
+      }
     }
   }
 
@@ -429,10 +955,312 @@ int sdc_image_open(int drive, char *name) {
   
   // image has successfully been opened, so report image size to core
   sdc_image_inserted(drive, fil[drive].obj.objsize);
+  sdc_image_extents(drive);
   
   return 0;
 }
 
+// copy the sectors written into the overlays to the images or forget
+// about them. The core has to wait meanwhile, so it doesn't write into
+// the overlay while it's being processed
+static int sdc_overlay_finish(int commit) {
+  unsigned char *buffer = malloc(512);
+  int ret = buffer?0:-1;
+  
+  sdc_lock();
+  for(int drive=0;buffer && drive<MAX_DRIVES;drive++) {
+    if(!ovl[drive].bitmap) continue;
+
+    unsigned long written = 0;
+    for(unsigned long s=0;s<ovl[drive].sectors;s++) {
+      if(!OVL_TEST(drive, s)) continue;
+
+      if(commit) {
+	sdc_read_sector(sdc_translate(&ovl[drive].fil, s), buffer);
+	sdc_write_sector(sdc_translate(&fil[drive], s), buffer);
+      }
+      written++;
+    }
+
+    printf("%s: %s %lu sectors\r\n", drivename(drive), commit?"committed":"discarded", written);
+    if(!written) continue;
+    
+    memset(ovl[drive].bitmap, 0, 512 * ((ovl[drive].sectors + 4095) / 4096));
+    for(unsigned long i=0;i<(ovl[drive].sectors + 4095) / 4096;i++)
+      sdc_overlay_sync(drive, i);
+    run[drive].count = 0;
+
+    // discarding changes the disk behind the core's back. Inserting it
+    // again e.g. drops the floppy's track cache
+    if(!commit) {
+      sdc_image_inserted(drive, 0);
+      sdc_image_inserted(drive, f_size(&fil[drive]));
+    }
+  }
+  sdc_unlock();
+  
+  free(buffer);
+  return ret;
+}
+
+int sdc_overlay_commit(void) {
+  return sdc_overlay_finish(1);
+}
+
+int sdc_overlay_discard(void) {
+  return sdc_overlay_finish(0);
+}
+
+// number of fragments of an image in the drive's current directory, 0
+// if unknown. Only the size of the link table is determined, the
+// table itself isn't needed
+int sdc_image_fragments(int drive, const char *name) {
+  char fname[strlen(cwd[drive]) + strlen(name) + 2];
+  strcpy(fname, cwd[drive]);
+  strcat(fname, "/");
+  strcat(fname, name);
+
+  int frags = 0;
+  sdc_lock();
+
+  FIL fp;
+  if(f_open(&fp, fname, FA_OPEN_EXISTING | FA_READ) == FR_OK) {
+    // a table too small for even one fragment still reports the
+    // required size, which is two words per fragment plus two
+    DWORD tbl[2] = { 2, 0 };
+    fp.cltbl = tbl;
+    f_lseek(&fp, CREATE_LINKMAP);
+    frags = (tbl[0] - 2) / 2;
+    f_close(&fp);
+  }
+
+  sdc_unlock();
+  return frags;
+}
+
+// An image is defragmented by copying it into a temporary file that
+// f_expand allocates as one contiguous cluster run and by swapping that
+// in place of the original. The journal records the image and how far
+// the copy got, so an interrupted copy continues where it stopped the
+// next time the same image is defragmented and an interrupted swap is
+// completed by sdc_init()
+#define DEFRAG_FILE     CARD_MOUNTPOINT "/.defrag"
+#define DEFRAG_SUFFIX   ".dfr"
+#define DEFRAG_CHUNK    16          // sectors copied at once
+#define DEFRAG_SYNC     1024        // sectors between journal updates
+#define DEFRAG_SWAP     0xffffffff  // copy done, swapping files
+
+typedef struct {
+  DWORD sclust;   // start cluster and size of the original image
+  DWORD size;
+  DWORD done;     // sectors copied or DEFRAG_SWAP
+  WORD len;       // length of path incl. terminating 0, path follows header
+} defrag_hdr_t;
+
+static int sdc_defrag_journal(const char *name, FIL *fp, DWORD done) {
+  // the original may already be closed, its object id is still valid
+  FIL jfil;
+  UINT bw;
+  if(f_open(&jfil, DEFRAG_FILE, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    return -1;
+
+  defrag_hdr_t hdr = { fp->obj.sclust, fp->obj.objsize, done, strlen(name)+1 };
+  f_write(&jfil, &hdr, sizeof(hdr), &bw);
+  f_write(&jfil, name, hdr.len, &bw);
+  return (f_close(&jfil) == FR_OK && bw == hdr.len)?0:-1;
+}
+
+// read the journal, returns the path or NULL if there's none
+static char *sdc_defrag_journal_read(defrag_hdr_t *hdr) {
+  FIL jfil;
+  UINT br;
+  if(f_open(&jfil, DEFRAG_FILE, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return NULL;
+
+  char *name = NULL;
+  if(f_read(&jfil, hdr, sizeof(*hdr), &br) == FR_OK && br == sizeof(*hdr) && hdr->len) {
+    name = malloc(hdr->len);
+    if(name && (f_read(&jfil, name, hdr->len, &br) != FR_OK ||
+		br != hdr->len || name[hdr->len-1])) {
+      free(name);
+      name = NULL;
+    }
+  }
+  f_close(&jfil);
+  return name;
+}
+
+// replace the image by the defragmented copy. This is repeated after
+// a power loss, so the original may already be gone. Without the copy
+// the rename has already happened and only the journal is left
+static int sdc_defrag_swap(const char *name) {
+  char tname[strlen(name) + sizeof(DEFRAG_SUFFIX)];
+  strcpy(tname, name);
+  strcat(tname, DEFRAG_SUFFIX);
+
+  FILINFO fno;
+  if(f_stat(tname, &fno) != FR_OK) {
+    f_unlink(DEFRAG_FILE);
+    printf("Defrag: %s already swapped\r\n", name);
+    return 0;
+  }
+
+  f_unlink(name);
+  if(f_rename(tname, name) != FR_OK) {
+    printf("Defrag: renaming %s failed\r\n", tname);
+    return -1;
+  }
+  sdc_extcache_drop(name);
+  
+  f_unlink(DEFRAG_FILE);
+  printf("Defrag: %s done\r\n", name);
+  return 0;
+}
+
+// complete a swap interrupted by a power loss
+static void sdc_defrag_recover(void) {
+  defrag_hdr_t hdr;
+  char *name = sdc_defrag_journal_read(&hdr);
+  if(!name) return;
+
+  if(hdr.done == DEFRAG_SWAP) {
+    printf("Defrag: completing %s\r\n", name);
+    sdc_defrag_swap(name);
+  } else
+    printf("Defrag: %s interrupted after %lu sectors\r\n", name, (unsigned long)hdr.done);
+
+  free(name);
+}
+
+// copy one chunk of sectors. The file system is only locked per chunk,
+// so the core's disk requests are still being served
+static int sdc_defrag_copy(FIL *src, FIL *dst, BYTE *buffer, UINT len) {
+  UINT br, bw;
+  sdc_lock();
+  int ok = f_read(src, buffer, len, &br) == FR_OK && br == len &&
+    f_write(dst, buffer, len, &bw) == FR_OK && bw == len;
+  sdc_unlock();
+  return ok?0:-1;
+}
+
+int sdc_image_defrag(int drive, const char *name, void (*progress)(void *, int), void *data) {
+  char fname[strlen(cwd[drive]) + strlen(name) + 2];
+  strcpy(fname, cwd[drive]);
+  strcat(fname, "/");
+  strcat(fname, name);
+
+  char tname[sizeof(fname) + sizeof(DEFRAG_SUFFIX)];
+  strcpy(tname, fname);
+  strcat(tname, DEFRAG_SUFFIX);
+
+  // eject the image from all drives using it while it's being copied
+  int used = 0;
+  for(int i=0;i<MAX_DRIVES;i++) {
+    if(image_name[i] && cwd[i] && !strcmp(cwd[i], cwd[drive]) && !strcmp(image_name[i], name)) {
+      sdc_image_open(i, NULL);
+      used |= 1<<i;
+    }
+  }
+
+  printf("Defrag: %s\r\n", fname);
+
+  FIL src, dst;
+  BYTE *buffer = malloc(DEFRAG_CHUNK * 512);
+  int ret = -1, copied = 0;
+
+  sdc_lock();
+  if(!buffer || f_open(&src, fname, FA_OPEN_EXISTING | FA_READ) != FR_OK) {
+    sdc_unlock();
+    free(buffer);
+    return -1;
+  }
+
+  // continue an interrupted copy of the very same image
+  DWORD done = 0;
+  defrag_hdr_t hdr;
+  char *jname = sdc_defrag_journal_read(&hdr);
+  if(jname && !strcmp(jname, fname) && hdr.sclust == src.obj.sclust &&
+     hdr.size == src.obj.objsize && hdr.done != DEFRAG_SWAP &&
+     f_open(&dst, tname, FA_OPEN_EXISTING | FA_READ | FA_WRITE) == FR_OK) {
+    if(f_size(&dst) == f_size(&src)) {
+      done = hdr.done;
+      printf("Defrag: resuming after %lu sectors\r\n", (unsigned long)done);
+    } else
+      f_close(&dst);
+  } else if(jname && strcmp(jname, fname) && hdr.done != DEFRAG_SWAP) {
+    // drop the unfinished copy of another image
+    char oname[strlen(jname) + sizeof(DEFRAG_SUFFIX)];
+    strcpy(oname, jname);
+    strcat(oname, DEFRAG_SUFFIX);
+    f_unlink(oname);
+  }
+  free(jname);
+
+  if(!done) {
+    // the size is set right away, so the journal only needs to
+    // track the sectors copied
+    if(f_open(&dst, tname, FA_CREATE_ALWAYS | FA_READ | FA_WRITE) != FR_OK ||
+       f_expand(&dst, f_size(&src), 1) != FR_OK || f_sync(&dst) != FR_OK ||
+       sdc_defrag_journal(fname, &src, 0)) {
+      printf("Defrag: no contiguous space for %s\r\n", fname);
+      f_close(&dst);
+      f_unlink(tname);
+      goto out;
+    }
+  }
+
+  f_lseek(&src, done * 512);
+  f_lseek(&dst, done * 512);
+  sdc_unlock();
+
+  // copy through the multi sector path
+  DWORD sectors = (f_size(&src) + 511) / 512;
+  int percent = -1;
+  while(done < sectors) {
+    if(progress && percent != (int)(100ULL * done / sectors))
+      progress(data, percent = 100ULL * done / sectors);
+
+    UINT n = (sectors - done < DEFRAG_CHUNK)?sectors - done:DEFRAG_CHUNK;
+    UINT len = (done + n == sectors)?f_size(&src) - done * 512:n * 512;
+    if(sdc_defrag_copy(&src, &dst, buffer, len)) {
+      printf("Defrag: copy failed at sector %lu\r\n", (unsigned long)done);
+      sdc_lock();
+      f_close(&dst);
+      goto out;
+    }
+    done += n;
+    
+    if(!(done % DEFRAG_SYNC) && done < sectors) {
+      sdc_lock();
+      f_sync(&dst);
+      sdc_defrag_journal(fname, &src, done);
+      sdc_unlock();
+    }
+  }
+  if(progress) progress(data, 100);
+
+  sdc_lock();
+  copied = f_close(&dst) == FR_OK;
+  
+ out:
+  f_close(&src);
+  if(copied && sdc_defrag_journal(fname, &src, DEFRAG_SWAP) == 0)
+    ret = sdc_defrag_swap(fname);
+  sdc_unlock();
+  free(buffer);
+
+  // re-insert the image
+  for(int i=0;i<MAX_DRIVES;i++) {
+    if(used & (1<<i)) {
+      char *n = strdup(name);
+      sdc_image_open(i, n);
+      free(n);
+    }
+  }
+  
+  return ret;
+}
+
 sdc_dir_t *sdc_readdir(int drive, char *name, const char *ext) {
   static sdc_dir_t sdc_dir = { 0, NULL };
 
@@ -455,6 +1283,7 @@ sdc_dir_t *sdc_readdir(int drive, char *name, const char *ext) {
     dir->files[dir->len].name = strdup(fno->fname);
     dir->files[dir->len].len = fno->fsize;
     dir->files[dir->len].is_dir = (fno->fattrib & AM_DIR)?1:0;
+    dir->files[dir->len].frags = 0;
     dir->len++;
   }
   
@@ -561,6 +1390,7 @@ int sdc_init(spi_t *p_spi) {
   printf("---- SDC init ----\r\n");
 
   if(fs_init() == 0) {
+    sdc_defrag_recover();
 
 #if 0  // do some file system level write tests
     DIR dir;
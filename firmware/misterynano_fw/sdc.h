@@ -14,6 +14,7 @@ typedef struct {
   char *name;
   unsigned long len;
   int is_dir;
+  int frags;      // number of fragments, 0 if not yet known, -1 if unknown
 } sdc_dir_entry_t;
 
 typedef struct {
@@ -24,6 +25,11 @@ typedef struct {
 int sdc_init(spi_t *spi);
 int sdc_image_open(int drive, char *name);
 sdc_dir_t *sdc_readdir(int drive, char *name, const char *exts);
+int sdc_image_fragments(int drive, const char *name);
+int sdc_image_defrag(int drive, const char *name, void (*progress)(void *, int), void *data);
+void sdc_set_overlays(int enable);
+int sdc_overlay_commit(void);
+int sdc_overlay_discard(void);
 int sdc_handle_event(void);
 int sdc_is_ready(void);
 void sdc_lock(void);
@@ -31,5 +37,7 @@ void sdc_unlock(void);
 char *sdc_get_image_name(int drive);
 char *sdc_get_cwd(int drive);
 void sdc_set_default(int drive, const char *name);
+// the caller holds the sdc lock
+void sdc_extcache_drop(const char *name);
 
 #endif // SDC_H
@@ -18,6 +18,7 @@
 #include "sysctrl.h"
 
 #include "menu.h"
+#include "osd.h"
 
 u8g2_t u8g2;
 
@@ -153,6 +154,22 @@ int sdc_image_open(int drive, char *name) {
   return 0;
 }
 
+int sdc_image_fragments(int drive, const char *name) {
+  return 0;
+}
+
+int sdc_image_defrag(int drive, const char *name, void (*progress)(void *, int), void *data) {
+  return -1;
+}
+
+int sdc_overlay_commit(void) {
+  return 0;
+}
+
+int sdc_overlay_discard(void) {
+  return 0;
+}
+
 sdc_dir_t *sdc_readdir(int drive, char *name, const char *exts) {
   static sdc_dir_t sdc_dir = { 0, NULL };
 
@@ -177,6 +194,7 @@ sdc_dir_t *sdc_readdir(int drive, char *name, const char *exts) {
       
     dir->files[dir->len].name = strdup(fno->fname);
     dir->files[dir->len].is_dir = (fno->fattrib & AM_DIR)?1:0;
+    dir->files[dir->len].frags = 0;
     dir->len++;
   }
 
@@ -39,6 +39,7 @@ extern struct bflb_device_s *gpio;
 // #define BITBANG
 
 static TaskHandle_t spi_task_handle;
+static spi_t *spi_bus = NULL;
 void spi_isr(uint8_t pin) {
   if (pin == SPI_PIN_IRQ) {
     // disable further interrupts until thread has processed the current message
@@ -126,8 +127,10 @@ spi_t *spi_init(void) {
   bflb_gpio_reset(gpio, SPI_PIN_MOSI); // MOSI low
 #endif  
 
-  // semaphore to access the spi bus
-  spi.sem = xSemaphoreCreateMutex();
+  // semaphores to hand the spi bus to waiting tasks
+  spi.busy = false;
+  for(int i=0;i<SPI_PRIOS;i++)
+    spi.grant[i] = xSemaphoreCreateCounting(255, 0);
 
   xTaskCreate(spi_task, (char *)"spi_task", 512, &spi, configMAX_PRIORITIES-2, &spi_task_handle);
 
@@ -140,17 +143,40 @@ spi_t *spi_init(void) {
 
   printf("IRQ enabled\r\n");
   
+  spi_bus = &spi;
   return &spi;
 }
 
-// spi may be used by different threads. Thus begin and end are using
-// semaphores
+// spi may be used by different threads. Once the bus is released it
+// is handed to the waiting task with the highest priority. Long
+// transfers are split into chunks by the users, so e.g. hid events
+// don't have to wait for entire sectors to be transferred
 
-void spi_begin(spi_t *spi) {
-  xSemaphoreTake(spi->sem, 0xffffffffUL); // wait forever
+void spi_begin_prio(spi_t *spi, unsigned char prio) {
+  uint64_t start = bflb_mtimer_get_time_us();
+  bool wait;
+  
+  taskENTER_CRITICAL();
+  wait = spi->busy;
+  if(wait) spi->waiting[prio]++;
+  else     spi->busy = true;
+  taskEXIT_CRITICAL();
+
+  // spi_end() will pass the bus to us
+  if(wait) xSemaphoreTake(spi->grant[prio], portMAX_DELAY);
+
+  unsigned long us = bflb_mtimer_get_time_us() - start;
+  spi->stat[prio].count++;
+  spi->stat[prio].wait_us += us;
+  if(us > spi->stat[prio].max_us) spi->stat[prio].max_us = us;
+  
   bflb_gpio_reset(gpio, SPI_PIN_CSN);
 }
 
+void spi_begin(spi_t *spi) {
+  spi_begin_prio(spi, SPI_PRIO_HOUSEKEEPING);
+}
+
 unsigned char spi_tx_u08(spi_t *spi, unsigned char b) {
 #ifndef BITBANG
   return bflb_spi_poll_send(spi->dev, b);
@@ -178,6 +204,43 @@ unsigned char spi_tx_u08(spi_t *spi, unsigned char b) {
 }
 
 void spi_end(spi_t *spi) {
+  int next = -1;
+  
   bflb_gpio_set(gpio, SPI_PIN_CSN);
-  xSemaphoreGive(spi->sem);
+
+  // the bus stays busy if it's handed over to a waiting task
+  taskENTER_CRITICAL();
+  for(int i=0;i<SPI_PRIOS && next < 0;i++)
+    if(spi->waiting[i]) next = i;
+  
+  if(next >= 0) spi->waiting[next]--;
+  else          spi->busy = false;
+  taskEXIT_CRITICAL();
+
+  if(next >= 0) xSemaphoreGive(spi->grant[next]);
 }
+
+#ifdef CONFIG_SHELL
+#include <string.h>
+#include "shell.h"
+
+// console command to show the bus wait times per priority
+static int cmd_spistat(int argc, char **argv) {
+  static const char *names[] = { "input", "disk", "osd", "housekeeping" };
+  spi_t *spi = spi_bus;
+  if(!spi) return -1;
+  
+  for(int i=0;i<SPI_PRIOS;i++) {
+    printf("%-12s: %lu transfers, avg %lu us, max %lu us\r\n", names[i], spi->stat[i].count,
+	   spi->stat[i].count?(unsigned long)(spi->stat[i].wait_us / spi->stat[i].count):0,
+	   spi->stat[i].max_us);
+
+    if(argc > 1 && !strcmp(argv[1], "reset"))
+      memset(&spi->stat[i], 0, sizeof(spi->stat[i]));
+  }
+  
+  return 0;
+}
+
+SHELL_CMD_EXPORT_ALIAS(cmd_spistat, spistat, spistat [reset] show spi bus wait times);
+#endif
@@ -4,6 +4,7 @@
 #ifndef SDL
 #include <FreeRTOS.h>
 #include <semphr.h>
+#include <stdbool.h>
 #endif
 
 #define SPI_TARGET_SYS    0   // system control target
@@ -20,6 +21,8 @@
 #define SPI_HID_MOUSE     2
 #define SPI_HID_JOYSTICK  3
 #define SPI_HID_GET_DB9   4
+#define SPI_HID_BATCH     5   // list of keyboard, mouse and joystick records
+#define SPI_HID_IRQ       6   // read interrupt sources, arm vbl interrupt
 
 #define SPI_TARGET_OSD    2   // on-screen-display
 #define SPI_OSD_ENABLE    1
@@ -31,16 +34,36 @@
 #define SPI_SDC_MCU_READ  3   // read sector into MCU (e.g. for dir listing)
 #define SPI_SDC_INSERTED  4   // inform core that some disk image has been insered
 #define SPI_SDC_MCU_WRITE 5   // write sector from MCU
+#define SPI_SDC_CONTINUE  6   // continue a transfer split into chunks
+#define SPI_SDC_EXTENTS   7   // upload image extent table to core
+#define SPI_SDC_CORE_DATA 8   // send sector data for a core request
+
+// bus users are served by priority rather than in order
+#define SPI_PRIO_INPUT    0   // hid events and interrupt handling
+#define SPI_PRIO_DISK     1   // sd card requests of core and MCU
+#define SPI_PRIO_OSD      2   // on-screen-display updates
+#define SPI_PRIO_HOUSEKEEPING 3   // leds, status, settings
+#define SPI_PRIOS         4
 
 typedef struct {
 #ifndef SDL
   struct bflb_device_s *dev;
-  SemaphoreHandle_t sem;
+  bool busy;                          // bus is owned by some task
+  unsigned char waiting[SPI_PRIOS];   // tasks waiting per priority
+  SemaphoreHandle_t grant[SPI_PRIOS]; // hands the bus to a waiting task
+
+  // time tasks had to wait for the bus
+  struct {
+    unsigned long count;
+    unsigned long long wait_us;
+    unsigned long max_us;
+  } stat[SPI_PRIOS];
 #endif
 } spi_t;
   
 spi_t *spi_init(void);
 void spi_begin(spi_t *spi);
+void spi_begin_prio(spi_t *spi, unsigned char prio);
 unsigned char spi_tx_u08(spi_t *spi, unsigned char b);
 void spi_end(spi_t *spi);
 
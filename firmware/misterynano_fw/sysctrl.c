@@ -5,6 +5,7 @@
 */
 
 #include "sysctrl.h"
+#include "sdc.h"
 #include "bflb_wdg.h"
 
 unsigned char core_id = 0;
@@ -79,7 +80,10 @@ void sys_set_val(spi_t *spi, char id, uint8_t value) {
 }
 
 unsigned char sys_irq_ctrl(spi_t *spi, unsigned char ack) {
-  sys_begin(spi, SPI_SYS_IRQ_CTRL);
+  // interrupts are mostly hid events, so don't let them wait
+  spi_begin_prio(spi, SPI_PRIO_INPUT);
+  spi_tx_u08(spi, SPI_TARGET_SYS);
+  spi_tx_u08(spi, SPI_SYS_IRQ_CTRL);
   spi_tx_u08(spi, ack);
   unsigned char ret = spi_tx_u08(spi, 0);
   spi_end(spi);  
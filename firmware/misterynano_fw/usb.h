@@ -1,10 +1,22 @@
 #ifndef USB_H
 #define USB_H
 
+#include <stdint.h>
 #include "spi.h"
 #include "osd.h"
 
 extern void usb_host(spi_t *);
 extern void usb_register_osd(osd_t *);
+extern void usb_mouse_sync(unsigned char);
+
+// device classes with individual polling intervals
+#define USB_POLL_KEYBOARD  0
+#define USB_POLL_MOUSE     1
+#define USB_POLL_PAD       2
+#define USB_POLL_CLASSES   3
+
+extern void usb_poll_interval(int, unsigned char);
+extern int usb_poll_device_set(uint16_t, uint16_t, unsigned char);
+extern int usb_poll_device_get(int, uint16_t *, uint16_t *, unsigned char *);
 
 #endif // USB_H
@@ -7,616 +7,568 @@
 #include "usb.h"
 #include "usbh_core.h"
 #include "usbh_hid.h"
+#include "usbh_xbox.h"
 #include "bflb_gpio.h"
 #include "hidparser.h"
 #include "hid.h"
 
-#include "sysctrl.h"   // for core_id
+#define MAX_REPORT_SIZE  64
 
-// Enabling RATE_CHECK will count the number of USB events per
-// device and do an estimate in the effective event rate.
-// #define RATE_CHECK
-
-#include "menu.h"    // for event codes
-
-// queue to send messages to OSD thread
-extern QueueHandle_t xQueue;
-
-#define MAX_REPORT_SIZE   8
-#define XBOX_REPORT_SIZE 20
+// number of vid:pid specific polling interval overrides
+#define MAX_POLL_DEVICES  8
 
 #define STATE_NONE      0 
-#define STATE_DETECTED  1 
 #define STATE_RUNNING   2
 #define STATE_FAILED    3
 
+// hot plug events sent from the usb stack to the usb task
+#define EVENT_HID_RUN   0
+#define EVENT_HID_STOP  1
+#define EVENT_XBOX_RUN  2
+#define EVENT_XBOX_STOP 3
+
+struct usb_event_S {
+  uint8_t type;
+  uint8_t index;
+  void *class;
+};
+
 extern struct bflb_device_s *gpio;
 
+// polling interval and achieved event rate of a device
+struct usb_poll_S {
+  int class;                  // USB_POLL_KEYBOARD, ...
+  uint8_t interval;           // endpoint's own bInterval
+  uint8_t ms;                 // interval in use, 0 = device default
+  TickType_t rate_start;
+  unsigned long rate_events;
+  unsigned short rate;        // events/sec during the last second
+};
+
+// polling intervals in ms per device class, 0 = device default
+static uint8_t poll_class[USB_POLL_CLASSES];
+
+// ... and for individual devices, overriding the class
+static struct {
+  uint16_t vid, pid;
+  uint8_t ms;
+} poll_device[MAX_POLL_DEVICES];
+
+// state shared by hid and xbox clients. Only the client thread submits
+// urbs. The lock keeps the usb stack from tearing a device down while
+// an urb is being submitted
+struct usb_client_S {
+  int index;
+  int state;
+  struct usbh_hubport *hport;
+  struct usb_endpoint_descriptor *intin;
+  struct usb_endpoint_descriptor ep;  // intin with the interval in use
+  struct usbh_urb * volatile urb;   // NULL once the device is gone
+  uint8_t *buffer;
+  volatile int nbytes;              // result of the last urb
+  struct usb_config *usb;
+  SemaphoreHandle_t sem;            // urb done or device gone
+  SemaphoreHandle_t lock;
+  volatile bool running;            // client thread is alive
+  struct usb_poll_S poll;
+};
+
 static struct usb_config {
-  osd_t *osd;  
   spi_t *spi;
   unsigned js_map;   // map of joysticks
+  TaskHandle_t mouse_task;
+  QueueHandle_t event_queue;
   
   struct xbox_info_S {
-    int index;
-    int state;
-    struct usbh_hid *class;
-    uint8_t *buffer;
-    struct usb_config *usb;
-    SemaphoreHandle_t sem;
-    TaskHandle_t task_handle;    
-    unsigned char last_state;
-    unsigned char js_index;
-#ifdef RATE_CHECK
-    TickType_t rate_start;
-    unsigned long rate_events;
-#endif    
+    struct usb_client_S client;
+    struct usbh_xbox *class;
+    struct hid_xbox_state_S input;
   } xbox_info[CONFIG_USBHOST_MAX_XBOX_CLASS];
     
   struct hid_info_S {
-    int index;
-    int state;
+    struct usb_client_S client;
     struct usbh_hid *class;
-    uint8_t *buffer;
-    int nbytes;
-    hid_report_t report;
-    struct usb_config *usb;
-    SemaphoreHandle_t sem;
-    TaskHandle_t task_handle;    
-#ifdef RATE_CHECK
-    TickType_t rate_start;
-    unsigned long rate_events;
-#endif    
-    union {
-      struct hid_kbd_state_S keyboard;
-      struct hid_mouse_state_S mouse;
-      struct hid_joystick_state_S joystick;
-    };
+    hid_reports_t reports;
+    struct hid_state_S input[MAX_REPORTS];
   } hid_info[CONFIG_USBHOST_MAX_HID_CLASS];
 } usb_config;
   
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t hid_buffer[CONFIG_USBHOST_MAX_HID_CLASS][MAX_REPORT_SIZE];
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t xbox_buffer[CONFIG_USBHOST_MAX_XBOX_CLASS][XBOX_REPORT_SIZE];
 
-// include the keyboard mappings
-#include "atari_st.h"
-#include "c64.h"
-#include "vic20.h"
-#include "amiga.h"
-#include "a2600.h"
-
-const unsigned char *keymap[] = {
-  NULL,             // id 0: unknown core
-  keymap_atarist,   // id 1: atari st
-  keymap_c64,       // id 2: c64
-  keymap_vic20,     // id 3: vic20
-  keymap_amiga,     // id 4: amiga
-  keymap_a2600      // id 5: a2600
-};
+void usbh_client_callback(void *arg, int nbytes) {
+  struct usb_client_S *client = (struct usb_client_S *)arg;
 
-const unsigned char *modifier[] = {
-  NULL,             // id 0: unknown core
-  modifier_atarist, // id 1: atari st
-  modifier_c64,     // id 2: c64
-  modifier_vic20,   // id 3: vic20
-  modifier_amiga,   // id 4: amiga
-  modifier_a2600    // id 5: a2600
-};
+  client->nbytes = nbytes;
+  xSemaphoreGiveFromISR(client->sem, NULL);
+}  
+
+// the joystick map is rebuilt from all running devices whenever a
+// device comes or goes and is then replaced in one go
+static void usbh_js_rebuild(struct usb_config *usb) {
+  unsigned map = 0;
+  
+  for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++)
+    if(usb->hid_info[i].client.state == STATE_RUNNING)
+      for(int r=0;r<usb->hid_info[i].reports.reports;r++)
+	if(usb->hid_info[i].reports.report[r].type == REPORT_TYPE_JOYSTICK)
+	  map |= 1<<usb->hid_info[i].input[r].joystick.js_index;
 
-void kbd_tx(spi_t *spi, unsigned char byte) {
-  printf("KBD: %02x\r\n", byte);
+  for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++)
+    if(usb->xbox_info[i].client.state == STATE_RUNNING)
+      map |= 1<<usb->xbox_info[i].input.js_index;
 
-  spi_begin(spi);
-  spi_tx_u08(spi, SPI_TARGET_HID);
-  spi_tx_u08(spi, SPI_HID_KEYBOARD);
-  spi_tx_u08(spi, byte);
-  spi_end(spi);
+  usb->js_map = map;
 }
 
-// the c64 core can use the numerical pad on the keyboard to
-// emulate a joystick
-void kbd_num2joy(spi_t *spi, char state, unsigned char code) {
-  static unsigned char kbd_joy_state = 0;
-  static unsigned char kbd_joy_state_last = 0;
-  
-  // mapping:
-  // keycode 5a = KP 2 = down
-  // keycode 5c = KP 4 = left
-  // keycode 5e = KP 6 = right
-  // keycode 60 = KP 8 = up
-  // keycode 62 = KP 0 = fire
-  // keycode 63 = KP . and delete = 2nd trigger button
-  // keycode 44 = F11 = Restore Key
-  // keycode 4b = Page Up = Tape Play Key
-  
-  if(state == 0)
-    // start parsing a new set of keys
-    kbd_joy_state = 0;
-  else if(state == 1) {
-    // collect key/btn states
-    if(code == 0x5e) kbd_joy_state |= 0x01;
-    if(code == 0x5c) kbd_joy_state |= 0x02;
-    if(code == 0x5a) kbd_joy_state |= 0x04;
-    if(code == 0x60) kbd_joy_state |= 0x08;
-    if(code == 0x62) kbd_joy_state |= 0x10;
-    if(code == 0x63) kbd_joy_state |= 0x20;
-    if(code == 0x44) kbd_joy_state |= 0x40;
-    if(code == 0x4b) kbd_joy_state |= 0x80;
-  } else if(state == 2) {
-    // submit if state has changed
-    if(kbd_joy_state != kbd_joy_state_last) {
-      
-      printf("KP Joy: %02x\r\n", kbd_joy_state);
-  
-      spi_begin(spi);
-      spi_tx_u08(spi, SPI_TARGET_HID);
-      spi_tx_u08(spi, SPI_HID_JOYSTICK);
-      spi_tx_u08(spi, 0x80);  // report this as joystick 0x80 as js0-x are USB joysticks
-      spi_tx_u08(spi, kbd_joy_state);
-      spi_end(spi);
-      
-      kbd_joy_state_last = kbd_joy_state;
+// search for free joystick slot
+static unsigned char usbh_js_alloc(struct usb_config *usb) {
+  unsigned char index = 0;
+  while(usb->js_map & (1<<index))
+    index++;
+
+  printf("  -> joystick %d\r\n", index);
+  usb->js_map |= 1<<index;
+  return index;
+}
+
+// check for number of mice and keyboards and update leds
+static void usbh_leds_update(struct usb_config *usb) {
+  int mice = 0, keyboards = 0;  
+  for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
+    if(usb->hid_info[i].client.state == STATE_RUNNING) {
+      for(int r=0;r<usb->hid_info[i].reports.reports;r++) {
+	if(usb->hid_info[i].reports.report[r].type == REPORT_TYPE_MOUSE)    mice++;
+	if(usb->hid_info[i].reports.report[r].type == REPORT_TYPE_KEYBOARD) keyboards++;      
+      }
     }
   }
+
+  extern void set_led(int pin, int on);
+  set_led(GPIO_PIN_27, mice);
+  set_led(GPIO_PIN_28, keyboards);
+}
+
+// interval for a device, a vid:pid override beats the class setting
+static uint8_t usbh_poll_ms(struct usbh_hubport *hport, int class) {
+  for(int i=0;i<MAX_POLL_DEVICES;i++)
+    if(poll_device[i].ms &&
+       poll_device[i].vid == hport->device_desc.idVendor &&
+       poll_device[i].pid == hport->device_desc.idProduct)
+      return poll_device[i].ms;
+
+  return poll_class[class];
 }
+
+// the host controller takes the polling interval from the endpoint
+// descriptor whenever an urb is submitted. The urbs use the client's
+// own copy of the descriptor, so changing its bInterval changes the
+// rate even for devices already running while the device's descriptor
+// stays untouched
+static void usbh_poll_apply(struct usb_client_S *client) {
+  struct usb_poll_S *poll = &client->poll;
+  uint8_t ms = usbh_poll_ms(client->hport, poll->class);
+  if(ms == poll->ms) return;
   
-void kbd_parse(spi_t *spi, hid_report_t *report, struct hid_kbd_state_S *state,
-	       const unsigned char *buffer, int nbytes) {
-  // we expect boot mode packets which are exactly 8 bytes long
-  if(nbytes != 8) return;
+  poll->ms = ms;
+  if(!ms)
+    client->ep.bInterval = poll->interval;
+  else if(client->hport->speed == USB_SPEED_HIGH) {
+    // high speed intervals are 2^(bInterval-1) micro frames
+    uint8_t exp = 1;
+    while(exp < 16 && (1<<(exp-1)) < 8*ms) exp++;
+    client->ep.bInterval = exp;
+  } else
+    client->ep.bInterval = ms;
+
+  printf("Polling interval %d -> %d\r\n", poll->interval, client->ep.bInterval);
+}
+
+static void usbh_poll_start(struct usb_client_S *client, int type) {
+  struct usb_poll_S *poll = &client->poll;
+  client->ep = *client->intin;
+  poll->class = type;
+  poll->interval = client->intin->bInterval;
+  poll->ms = 0;
+  poll->rate = 0;
+  poll->rate_events = 0;
+  poll->rate_start = xTaskGetTickCount();
+  usbh_poll_apply(client);
+}
+
+// count events and update the achieved rate once a second
+static void usbh_poll_event(struct usb_poll_S *poll) {
+  TickType_t now = xTaskGetTickCount();
   
-  // check if modifier have changed
-  if((buffer[0] != state->last_report[0]) && !osd_is_visible(usb_config.osd)) {
-    for(int i=0;i<8;i++) {
-      if(modifier[core_id][i]) {      
-	// modifier released?
-	if((state->last_report[0] & (1<<i)) && !(buffer[0] & (1<<i)))
-	  kbd_tx(spi, 0x80 | modifier[core_id][i]);
-	// modifier pressed?
-	if(!(state->last_report[0] & (1<<i)) && (buffer[0] & (1<<i)))
-	  kbd_tx(spi, modifier[core_id][i]);
-      }
-    }
+  poll->rate_events++;
+  if(now - poll->rate_start >= pdMS_TO_TICKS(1000)) {
+    poll->rate = poll->rate_events * 1000 / ((now - poll->rate_start) * portTICK_PERIOD_MS);
+    poll->rate_events = 0;
+    poll->rate_start = now;
   }
+}
 
-  // prepare for parsing numpad joystick
-  if(core_id == CORE_ID_C64||core_id == CORE_ID_VIC20||core_id == CORE_ID_A2600) kbd_num2joy(spi, 0, 0);
-  
-  // check if regular keys have changed
-  for(int i=0;i<6;i++) {
-    // C64 uses some keys for joystick emulation
-    if(core_id == CORE_ID_C64||core_id == CORE_ID_VIC20||core_id == CORE_ID_A2600) kbd_num2joy(spi, 1, buffer[2+i]);
-    
-    if(buffer[2+i] != state->last_report[2+i]) {
-      // key released?
-      if(state->last_report[2+i] && !osd_is_visible(usb_config.osd))
-	kbd_tx(spi, 0x80 | keymap[core_id][state->last_report[2+i]]);
-      
-      // key pressed?
-      if(buffer[2+i])  {
-	static unsigned long msg;
-	msg = 0;
-
-	// F12 toggles the OSD state. Therefore F12 must never be forwarded
-	// to the core and thus must have an empty entry in the keymap. ESC
-	// can only close the OSD.
-
-	// Caution: Since the OSD closes on the press event, the following
-	// release event will be sent into the core. The core should thus
-	// cope with release events that did not have a press event before
-	if(buffer[2+i] == 0x45 || (osd_is_visible(usb_config.osd) && buffer[2+i] == 0x29))
-	  msg = osd_is_visible(usb_config.osd)?MENU_EVENT_HIDE:MENU_EVENT_SHOW;
-	else {
-	  if(!osd_is_visible(usb_config.osd))
-	    kbd_tx(spi, keymap[core_id][buffer[2+i]]);
-	  else {
-	    // check if cursor up/down or space has been pressed
-	    if(buffer[2+i] == 0x51) msg = MENU_EVENT_DOWN;      
-	    if(buffer[2+i] == 0x52) msg = MENU_EVENT_UP;
-	    if(buffer[2+i] == 0x4e) msg = MENU_EVENT_PGDOWN;      
-	    if(buffer[2+i] == 0x4b) msg = MENU_EVENT_PGUP;
-	    if((buffer[2+i] == 0x2c) || (buffer[2+i] == 0x28))
-	      msg = MENU_EVENT_SELECT;
-	  }
-	}
-	  
-	if(msg)
-	  xQueueSendToBackFromISR(xQueue, &msg,  ( TickType_t ) 0);
-      }
-    }    
+// devices with several report types use the fastest class
+static int usbh_poll_class(hid_reports_t *reports) {
+  int class = USB_POLL_KEYBOARD;
+  for(int r=0;r<reports->reports;r++) {
+    if(reports->report[r].type == REPORT_TYPE_JOYSTICK)
+      class = USB_POLL_PAD;
+    else if(reports->report[r].type == REPORT_TYPE_MOUSE && class != USB_POLL_PAD)
+      class = USB_POLL_MOUSE;
   }
-  memcpy(state->last_report, buffer, 8);
+  return class;
+}
 
-  // check if numpad joystick has changed state and send message if so
-  if(core_id == CORE_ID_C64||core_id == CORE_ID_VIC20 || core_id == CORE_ID_A2600) kbd_num2joy(spi, 2, 0);
+// the endpoint descriptor is only valid as long as the device is there
+static void usbh_poll_update_client(struct usb_client_S *client) {
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  if(client->urb && client->state == STATE_RUNNING)
+    usbh_poll_apply(client);
+  xSemaphoreGive(client->lock);
 }
 
-// collect bits from byte stream and assemble them into a signed word
-static uint16_t collect_bits(const uint8_t *p, uint16_t offset, uint8_t size, bool is_signed) {
-  // mask unused bits of first byte
-  uint8_t mask = 0xff << (offset&7);
-  uint8_t byte = offset/8;
-  uint8_t bits = size;
-  uint8_t shift = offset&7;
-  
-  //  iprintf("0 m:%x by:%d bi=%d sh=%d ->", mask, byte, bits, shift);
-  uint16_t rval = (p[byte++] & mask) >> shift;
-  mask = 0xff;
-  shift = 8-shift;
-  bits -= shift;
+// re-evaluate the intervals of all running devices
+static void usbh_poll_update(void) {
+  for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++)
+    usbh_poll_update_client(&usb_config.hid_info[i].client);
+
+  for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++)
+    usbh_poll_update_client(&usb_config.xbox_info[i].client);
+}
+
+void usb_poll_interval(int class, unsigned char ms) {
+  if(class < 0 || class >= USB_POLL_CLASSES) return;
   
-  // first byte already contained more bits than we need
-  if(shift > size) {
-    // mask unused bits
-    rval &= (1<<size)-1;
-  } else {
-    // further bytes if required
-    while(bits) {
-      mask = (bits<8)?(0xff>>(8-bits)):0xff;
-      rval += (p[byte++] & mask) << shift;
-      shift += 8;
-      bits -= (bits>8)?8:bits;
+  printf("USB poll class %d: %d ms\r\n", class, ms);
+  poll_class[class] = ms;
+  usbh_poll_update();
+}
+
+// set a device specific interval, 0 removes the override
+int usb_poll_device_set(uint16_t vid, uint16_t pid, unsigned char ms) {
+  int free = -1;
+  for(int i=0;i<MAX_POLL_DEVICES;i++) {
+    if(poll_device[i].ms && poll_device[i].vid == vid && poll_device[i].pid == pid) {
+      free = i;
+      break;
     }
+    if(!poll_device[i].ms && free < 0) free = i;
   }
   
-  if(is_signed) {
-    // do sign expansion
-    uint16_t sign_bit = 1<<(size-1);
-    if(rval & sign_bit) {
-      while(sign_bit) {
-	rval |= sign_bit;
-	sign_bit <<= 1;
-      }
+  if(free < 0) return -1;
+  
+  printf("USB poll %04x:%04x: %d ms\r\n", vid, pid, ms);
+  poll_device[free].vid = vid;
+  poll_device[free].pid = pid;
+  poll_device[free].ms = ms;
+  usbh_poll_update();
+  return 0;
+}
+
+// iterate over the device specific intervals, e.g. to save them
+int usb_poll_device_get(int idx, uint16_t *vid, uint16_t *pid, unsigned char *ms) {
+  for(int i=0;i<MAX_POLL_DEVICES;i++) {
+    if(!poll_device[i].ms) continue;
+    if(!idx--) {
+      *vid = poll_device[i].vid;
+      *pid = poll_device[i].pid;
+      *ms = poll_device[i].ms;
+      return 1;
     }
   }
-  
-  return rval;
+  return 0;
 }
 
-void mouse_parse(spi_t *spi, hid_report_t *report, struct hid_mouse_state_S *state,
-		 const unsigned char *buffer, int nbytes) {
-  // we expect at least three bytes:
-  if(nbytes < 3) return;
-  
-  //  printf("MOUSE:"); for(int i=0;i<nbytes;i++) printf(" %02x", buffer[i]); printf("\r\n");
+// submit one urb and wait for it. Returns the number of bytes received
+// (0 if nothing was received) or -1 once the device is gone. The lock
+// keeps the disconnect callback from freeing the urb while it's being
+// submitted
+static int usbh_client_poll(struct usb_client_S *client, const char *name) {
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  if(!client->urb) {
+    xSemaphoreGive(client->lock);
+    return -1;
+  }
+  client->nbytes = 0;
+  int ret = usbh_submit_urb(client->urb);
+  xSemaphoreGive(client->lock);
   
-  // collect info about the two axes
-  int a[2];
-  for(int i=0;i<2;i++) {  
-    bool is_signed = report->joystick_mouse.axis[i].logical.min > 
-      report->joystick_mouse.axis[i].logical.max;
-
-    a[i] = collect_bits(buffer, report->joystick_mouse.axis[i].offset, 
-			report->joystick_mouse.axis[i].size, is_signed);
+  if (ret < 0) {
+    printf("%s client #%d: submit failed\r\n", name, client->index);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    return 0;
   }
 
-  // ... and two buttons
-  uint8_t btns = 0;
-  for(int i=0;i<2;i++)
-    if(buffer[report->joystick_mouse.button[i].byte_offset] & 
-       report->joystick_mouse.button[i].bitmask)
-      btns |= (1<<i);
+  // Wait for result
+  xSemaphoreTake(client->sem, portMAX_DELAY);
+  if(!client->urb) return -1;
 
-  spi_begin(spi);
-  spi_tx_u08(spi, SPI_TARGET_HID);
-  spi_tx_u08(spi, SPI_HID_MOUSE);
-  spi_tx_u08(spi, btns);
-  spi_tx_u08(spi, a[0]);
-  spi_tx_u08(spi, a[1]);
-  spi_end(spi);
+  // the urb failed or was killed, the device is probably about to go away
+  if(client->nbytes < 0) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+    return 0;
+  }
+  
+  return client->nbytes;
 }
 
-void joystick_parse(spi_t *spi, hid_report_t *report, struct hid_joystick_state_S *state,
-		    const unsigned char *buffer, int nbytes) {
-  //  printf("joystick: %d %02x %02x %02x %02x\r\n", nbytes,
-  //  	 buffer[0]&0xff, buffer[1]&0xff, buffer[2]&0xff, buffer[3]&0xff);
+// each HID client gets itws own thread which submits urbs
+// and waits for the interrupt to succeed
+static void usbh_hid_client_thread(void *argument) {
+  struct hid_info_S *hid = (struct hid_info_S *)argument;
+  struct usb_client_S *client = &hid->client;
+  int nbytes;
 
-  // collect info about the two axes
-  int a[2];
-  for(int i=0;i<2;i++) {  
-    bool is_signed = report->joystick_mouse.axis[i].logical.min > 
-      report->joystick_mouse.axis[i].logical.max;
-    
-    a[i] = collect_bits(buffer, report->joystick_mouse.axis[i].offset, 
-			report->joystick_mouse.axis[i].size, is_signed);
-  }
+  printf("HID client #%d: thread started\r\n", client->index);
 
-  // ... and four buttons
-  unsigned char joy = 0;
-  for(int i=0;i<4;i++)
-    if(buffer[report->joystick_mouse.button[i].byte_offset] & 
-       report->joystick_mouse.button[i].bitmask)
-      joy |= (0x10<<i);
-
-  // ... and the eight extra buttons
-  unsigned char btn_extra = 0;
-  for(int i=4;i<12;i++)
-    if(buffer[report->joystick_mouse.button[i].byte_offset] & 
-      report->joystick_mouse.button[i].bitmask) 
-      btn_extra |= (1<<(i-4));
-
-  // map directions to digital
-  if(a[0] > 0xc0) joy |= 0x01;
-  if(a[0] < 0x40) joy |= 0x02;
-  if(a[1] > 0xc0) joy |= 0x04;
-  if(a[1] < 0x40) joy |= 0x08;
-
-  int ax = 0;
-  int ay = 0;
-  ax = a[0];
-  ay = a[1];
-
-  if((joy != state->last_state) ||
-     (ax != state->last_state_x) ||
-     (ay != state->last_state_y) ||
-     (btn_extra != state->last_state_btn_extra)) {
-    state->last_state = joy;
-    state->last_state_x = ax;
-    state->last_state_y = ay;
-    state->last_state_btn_extra = btn_extra;
-
-    printf("JOY%d: %02x A0 %02x A1 %02x B %02x\r\n", state->js_index, joy, ax, ay, btn_extra);
-  
-    spi_begin(spi);
-    spi_tx_u08(spi, SPI_TARGET_HID);
-    spi_tx_u08(spi, SPI_HID_JOYSTICK);
-    spi_tx_u08(spi, state->js_index);
-    spi_tx_u08(spi, joy);
-    spi_tx_u08(spi,ax); // e.g. gamepad X
-    spi_tx_u08(spi,ay); // e.g. gamepad Y
-    spi_tx_u08(spi,btn_extra); // e.g. gamepad extra buttons
-    spi_end(spi);
+  while((nbytes = usbh_client_poll(client, "HID")) >= 0) {
+    if(nbytes > 0) {
+      if(hid_trace) hid_trace_dump("hid", client->index, 'R', client->buffer, nbytes);
+      hid_parse(client->usb->spi, &hid->reports, hid->input, client->buffer, nbytes);
+      usbh_poll_event(&client->poll);
+    }
   }
-}
-
-void rii_joy_parse(struct hid_info_S *hid, const unsigned char *buffer) {
-  unsigned char b = 0;
-  if(buffer[0] == 0xcd && buffer[1] == 0x00) b = 0x10;      // cd == play/pause  -> center
-  if(buffer[0] == 0xe9 && buffer[1] == 0x00) b = 0x08;      // e9 == V+          -> up
-  if(buffer[0] == 0xea && buffer[1] == 0x00) b = 0x04;      // ea == V-          -> down
-  if(buffer[0] == 0xb6 && buffer[1] == 0x00) b = 0x02;      // b6 == skip prev   -> left
-  if(buffer[0] == 0xb5 && buffer[1] == 0x00) b = 0x01;      // b5 == skip next   -> right
 
-  printf("RII Joy: %02x %02x\r\n", 0, b);
-  
-  spi_t *spi = hid->usb->spi;  
-  spi_begin(spi);
-  spi_tx_u08(spi, SPI_TARGET_HID);
-  spi_tx_u08(spi, SPI_HID_JOYSTICK);
-  spi_tx_u08(spi, 0);  // Rii joystick always report as joystick 0
-  spi_tx_u08(spi, b);
-  spi_end(spi);
+  // device has been unplugged
+  printf("HID client #%d: thread stopped\r\n", client->index);
+  client->running = false;
+  vTaskDelete(NULL);
 }
 
-void usbh_hid_callback(void *arg, int nbytes) {
-  struct hid_info_S *hid = (struct hid_info_S *)arg;
+// ... and XBOX clients as well
+static void usbh_xbox_client_thread(void *argument) {
+  struct xbox_info_S *xbox = (struct xbox_info_S *)argument;
+  struct usb_client_S *client = &xbox->client;
+  int nbytes;
 
-  xSemaphoreGiveFromISR(hid->sem, NULL);
-  hid->nbytes = nbytes;
-}  
+  printf("XBOX client #%d: thread started\r\n", client->index);
 
-void usbh_xbox_callback(void *arg, int nbytes) {
-  struct xbox_info_S *xbox = (struct xbox_info_S *)arg;
-  if(nbytes == XBOX_REPORT_SIZE)
-    xSemaphoreGiveFromISR(xbox->sem, NULL);
-}  
+  while((nbytes = usbh_client_poll(client, "XBOX")) >= 0) {
+    if(nbytes == XBOX_REPORT_SIZE) {
+      if(hid_trace) hid_trace_dump("xbox", client->index, 'R', client->buffer, XBOX_REPORT_SIZE);
+      xbox_parse(client->usb->spi, &xbox->input, client->buffer, XBOX_REPORT_SIZE);
+      usbh_poll_event(&client->poll);
+    }
+  }
 
-static void usbh_update(struct usb_config *usb) {
-  // check for active hid devices
+  // device has been unplugged
+  printf("XBOX client #%d: thread stopped\r\n", client->index);
+  client->running = false;
+  vTaskDelete(NULL);
+}
+
+// send the collected mouse movement of all mice to the core
+static void usbh_mouse_flush(struct usb_config *usb) {
+  bool pending = false;
+  
   for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
-    char *dev_str = "/dev/inputX";
-    dev_str[10] = '0' + i;
-    usb->hid_info[i].class = (struct usbh_hid *)usbh_find_class_instance(dev_str);
-    
-    if(usb->hid_info[i].class && usb->hid_info[i].state == STATE_NONE) {
-      printf("NEW HID %d\r\n", i);
-
-      printf("Interval: %d\r\n", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].ep[0].ep_desc.bInterval);
-	 
-      printf("Interface %d\r\n", usb->hid_info[i].class->intf);
-      printf("  class %d\r\n", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceClass);
-      printf("  subclass %d\r\n", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceSubClass);
-      printf("  protocol %d\r\n", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceProtocol);
-	
-      // parse report descriptor ...
-      printf("report descriptor: %p\r\n", usb->hid_info[i].class->report_desc);
-      
-      if(!parse_report_descriptor(usb->hid_info[i].class->report_desc, 128, &usb->hid_info[i].report, NULL)) {
-	usb->hid_info[i].state = STATE_FAILED;   // parsing failed, don't use
-	return;
-      }
-      
-      usb->hid_info[i].state = STATE_DETECTED;
-    }
+    if(usb->hid_info[i].client.state != STATE_RUNNING) continue;
     
-    else if(!usb->hid_info[i].class && usb->hid_info[i].state != STATE_NONE) {
-      printf("HID LOST %d\r\n", i);
-      vTaskDelete( usb->hid_info[i].task_handle );
-      usb->hid_info[i].state = STATE_NONE;
-
-      if(usb->hid_info[i].report.type == REPORT_TYPE_JOYSTICK) {
-	printf("Joystick %d gone\r\n", usb->hid_info[i].joystick.js_index);
-	usb->js_map &= ~(1<<usb->hid_info[i].joystick.js_index);
-      }
-    }
+    for(int r=0;r<usb->hid_info[i].reports.reports;r++)
+      if(usb->hid_info[i].reports.report[r].type == REPORT_TYPE_MOUSE)
+	if(mouse_flush(usb->spi, &usb->hid_info[i].input[r].mouse))
+	  pending = true;
   }
 
-  // check for active xbox devices
-  for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++) {
-    char *dev_str = "/dev/xboxX";
-    dev_str[9] = '0' + i;
-    usb->xbox_info[i].class = (struct usbh_hid *)usbh_find_class_instance(dev_str);
-    
-    if(usb->xbox_info[i].class && usb->xbox_info[i].state == STATE_NONE) {
-      printf("NEW XBOX %d\r\n", i);
-
-      printf("Interval: %d\r\n", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].ep[0].ep_desc.bInterval);
-	 
-      printf("Interface %d\r\n", usb->xbox_info[i].class->intf);
-      printf("  class %d\r\n", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceClass);
-      printf("  subclass %d\r\n", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceSubClass);
-      printf("  protocol %d\r\n", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceProtocol);
-	
-      usb->xbox_info[i].state = STATE_DETECTED;
-    }
+  // more movement than fits into one frame
+  if(pending && hid_mouse_sync == HID_MOUSE_SYNC_VBL && hid_vbl_supported)
+    hid_vbl_arm(usb->spi);
+}
+
+// the mouse thread is woken up by the vbl interrupt or runs at a
+// fixed rate if the core cannot send vbl interrupts
+static void usbh_mouse_thread(void *argument) {
+  struct usb_config *usb = (struct usb_config *)argument;
+
+  while(1) {
+    TickType_t timeout = portMAX_DELAY;
+    if(hid_mouse_sync == HID_MOUSE_SYNC_100HZ) timeout = pdMS_TO_TICKS(10);
+    if(hid_mouse_sync == HID_MOUSE_SYNC_50HZ ||
+       (hid_mouse_sync == HID_MOUSE_SYNC_VBL && !hid_vbl_supported))
+      timeout = pdMS_TO_TICKS(20);
     
-    else if(!usb->xbox_info[i].class && usb->xbox_info[i].state != STATE_NONE) {
-      printf("XBOX %d\r\n", i);
-      vTaskDelete( usb->xbox_info[i].task_handle );
-      usb->xbox_info[i].state = STATE_NONE;
-      
-      printf("Joystick %d gone\r\n", usb->xbox_info[i].js_index);
-      usb->js_map &= ~(1<<usb->xbox_info[i].js_index);
-    }
+    ulTaskNotifyTake(pdTRUE, timeout);
+    usbh_mouse_flush(usb);
   }
+}
 
-  // check for number of mice and keyboards and update leds
-  int mice = 0, keyboards = 0;  
-  for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
-    if(usb->hid_info[i].state == STATE_RUNNING) {
-      if(usb->hid_info[i].report.type == REPORT_TYPE_MOUSE)    mice++;
-      if(usb->hid_info[i].report.type == REPORT_TYPE_KEYBOARD) keyboards++;      
-    }
-  }
+void usb_mouse_sync(unsigned char mode) {
+  printf("Mouse sync %d\r\n", mode);
+  hid_mouse_sync = mode;
 
-  extern void set_led(int pin, int on);
-  set_led(GPIO_PIN_27, mice);
-  set_led(GPIO_PIN_28, keyboards);
+  // wake mouse thread to flush and to adopt to the new mode
+  if(usb_config.mouse_task)
+    xTaskNotifyGive(usb_config.mouse_task);
 }
 
-static void hid_parse(struct hid_info_S *hid) {
-#if 0
-  USB_LOG_RAW("HID%d: ", hid->index);
-  
-  // just dump the report
-  for (size_t i = 0; i < hid->nbytes; i++) 
-    USB_LOG_RAW("0x%02x ", hid->buffer[i]);
-  USB_LOG_RAW("\r\n");
-#endif
-  
-  // the following is a hack for the Rii keyboard/touch combos to use the
-  // left top multimedia pad as a joystick. These special keys are sent
-  // via the mouse/touchpad part
-  if(hid->report.report_id_present &&
-     hid->report.type == REPORT_TYPE_MOUSE &&
-     hid->nbytes == 3 &&
-     hid->buffer[0] != hid->report.report_id) {
-    rii_joy_parse(hid, hid->buffer+1);
-    return;
+// wake the thread of a previous device in this slot, wait a limited
+// time for it to be gone and forget about any wakeup left over from
+// it. Returns false if the thread is still there
+static bool usbh_client_reset(struct usb_client_S *client) {
+  for(int i=0;client->running && i<100;i++) {
+    // the device is gone, the thread only needs to notice
+    if(!client->urb) xSemaphoreGive(client->sem);
+    vTaskDelay(pdMS_TO_TICKS(1));
   }
-  
-  // check and skip report id if present
-  unsigned char *buffer = hid->buffer;
-  if(hid->report.report_id_present) {
-    if(!hid->nbytes || (buffer[0] != hid->report.report_id))
-      return;
-    
-    // skip report id
-    buffer++; hid->nbytes--;
+
+  if(client->running) {
+    printf("Client #%d: previous thread still running\r\n", client->index);
+    return false;
   }
   
-  if(hid->nbytes == hid->report.report_size) {
-    if(hid->report.type == REPORT_TYPE_KEYBOARD)
-      kbd_parse(hid->usb->spi, &hid->report, &hid->keyboard, buffer, hid->nbytes);
-    
-    if(hid->report.type == REPORT_TYPE_MOUSE)
-      mouse_parse(hid->usb->spi, &hid->report, &hid->mouse, buffer, hid->nbytes);
-    
-    if(hid->report.type == REPORT_TYPE_JOYSTICK)
-      joystick_parse(hid->usb->spi, &hid->report, &hid->joystick, buffer, hid->nbytes);
+  while(xSemaphoreTake(client->sem, 0) == pdTRUE);
+  return true;
+}
+
+// claim the slot for the urb of a new device. Returns with the lock
+// held unless the device is already gone again
+static bool usbh_client_claim(struct usb_client_S *client, const char *dev_str, void *class,
+			      struct usbh_hubport *hport, struct usb_endpoint_descriptor *intin,
+			      struct usbh_urb *urb) {
+  if(!usbh_client_reset(client))
+    return false;
+  
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  if(usbh_find_class_instance(dev_str) != class) {
+    xSemaphoreGive(client->lock);
+    return false;
   }
+
+  client->hport = hport;
+  client->intin = intin;
+  client->urb = urb;
+  return true;
 }
 
-static void xbox_parse(struct xbox_info_S *xbox) {
-#if 0
-  USB_LOG_RAW("XBOX%d: ", xbox->index);
+// called from the usb stack's disconnect callback. Returns false if
+// the class instance isn't the one running in this slot
+static bool usbh_client_release(struct usb_client_S *client, struct usbh_urb *urb) {
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  if(client->urb != urb) {
+    xSemaphoreGive(client->lock);
+    return false;
+  }
   
-  // just dump the report
-  for (size_t i = 0; i < 20; i++) 
-    USB_LOG_RAW("0x%02x ", xbox->buffer[i]);
-  USB_LOG_RAW("\r\n");
-#endif
+  // let the client thread terminate itself
+  client->urb = NULL;
+  client->state = STATE_NONE;
+  xSemaphoreGive(client->lock);
+  xSemaphoreGive(client->sem);
+  return true;
+}
 
-  // verify length field
-  if(xbox->buffer[0] != 0 || xbox->buffer[1] != 20)
-    return;
+static void usbh_hid_start(struct usb_config *usb, int i, struct usbh_hid *class) {
+  struct hid_info_S *hid = &usb->hid_info[i];
+  struct usb_client_S *client = &hid->client;
 
-  // the xbox controller sends the direction bits in exactly the
-  // reversed order than we expect ...
-  unsigned char state =
-    ((xbox->buffer[2] & 0x01)<<3) | ((xbox->buffer[2] & 0x02)<<1) |
-    ((xbox->buffer[2] & 0x04)>>1) | ((xbox->buffer[2] & 0x08)>>3) |
-    (xbox->buffer[3] & 0xf0);
+  // the device may already be gone again
+  char dev_str[] = "/dev/inputX";
+  dev_str[10] = '0' + i;
+  if(!usbh_client_claim(client, dev_str, class, class->hport, class->intin, &class->intin_urb))
+    return;
   
-  // submit if state has changed
-  if(state != xbox->last_state) {
-    
-    printf("XBOX Joy%d: %02x\r\n", xbox->js_index, state);
+  hid->class = class;
   
-    spi_t *spi = xbox->usb->spi;  
-    spi_begin(spi);
-    spi_tx_u08(spi, SPI_TARGET_HID);
-    spi_tx_u08(spi, SPI_HID_JOYSTICK);
-    spi_tx_u08(spi, xbox->js_index);
-    spi_tx_u08(spi, state);
-    spi_end(spi);
-    
-    xbox->last_state = state;
+  printf("NEW HID %d\r\n", i);
+  printf("Interval: %d\r\n", class->intin->bInterval);
+  printf("Interface %d\r\n", class->intf);
+  printf("  class %d\r\n", class->hport->config.intf[class->intf].altsetting[0].intf_desc.bInterfaceClass);
+  printf("  subclass %d\r\n", class->hport->config.intf[class->intf].altsetting[0].intf_desc.bInterfaceSubClass);
+  printf("  protocol %d\r\n", class->hport->config.intf[class->intf].altsetting[0].intf_desc.bInterfaceProtocol);
+	
+  // parse report descriptor ...
+  printf("report descriptor: %p\r\n", class->report_desc);
+  if(hid_trace) hid_trace_dump("hid", i, 'D', class->report_desc, 128);
+      
+  if(!parse_report_descriptors(class->report_desc, 128, &hid->reports)) {
+    client->state = STATE_FAILED;   // parsing failed, don't use
+    xSemaphoreGive(client->lock);
+    return;
   }
-}
 
-// each HID client gets itws own thread which submits urbs
-// and waits for the interrupt to succeed
-static void usbh_hid_client_thread(void *argument) {
-  struct hid_info_S *hid = (struct hid_info_S *)argument;
+  printf("NEW HID device %d\r\n", i);
 
-  printf("HID client #%d: thread started\r\n", hid->index);
+  // forget about the state of a previous device in this slot
+  memset(hid->input, 0, sizeof(hid->input));
 
-  while(1) {
-    int ret = usbh_submit_urb(&hid->class->intin_urb);
-    if (ret < 0)
-      printf("HID client #%d: submit failed\r\n", hid->index);
-    else {
-      // Wait for result
-      xSemaphoreTake(hid->sem, 0xffffffffUL);
-      if(hid->nbytes > 0) hid_parse(hid);
-      hid->nbytes = 0;
-    }      
-
-#ifdef RATE_CHECK
-    hid->rate_events++;
-    if(!(hid->rate_events % 100)) {
-     float ms_since_start = (xTaskGetTickCount() - hid->rate_start) * portTICK_PERIOD_MS;
-     printf("Rate = %f events/sec\r\n",  1000 * hid->rate_events /  ms_since_start);
-    }    
-#endif
+  hid_reports_t *reports = &hid->reports;
+  int len = 0;
+  for(int r=0;r<reports->reports;r++) {
+    printf("  report %d: type %d\r\n", reports->report[r].report_id, reports->report[r].type);
+	  
+    if( reports->report[r].type == REPORT_TYPE_JOYSTICK )
+      hid->input[r].joystick.js_index = usbh_js_alloc(usb);
+
+    // the urb has to take the largest report
+    if(reports->report[r].report_size > len)
+      len = reports->report[r].report_size;
   }
+	  
+#if 0
+  // set report protocol 1 if subclass != BOOT_INTF
+  // CherryUSB doesn't report the InterfaceSubClass (HID_BOOT_INTF_SUBCLASS)
+  // we thus set boot protocol on keyboards
+  if( hid->reports.report[0].type == REPORT_TYPE_KEYBOARD ) {	
+    // /* 0x0 = boot protocol, 0x1 = report protocol */
+    printf("setting boot protocol\r\n");
+    ret = usbh_hid_set_protocol(class, HID_PROTOCOL_BOOT);
+    if (ret < 0) {
+      printf("failed\r\n");
+      client->state = STATE_FAILED;  // failed
+      xSemaphoreGive(client->lock);
+      return;
+    }
+  }
+#endif
+
+  // setup urb
+  if(reports->report_id_present) len++;
+  if(len > MAX_REPORT_SIZE) len = MAX_REPORT_SIZE;
+  usbh_poll_start(client, usbh_poll_class(reports));
+  usbh_int_urb_fill(&class->intin_urb, class->hport, &client->ep, client->buffer,
+		    len, 0, usbh_client_callback, client);
+
+  client->state = STATE_RUNNING; 
+  client->running = true;
+  xSemaphoreGive(client->lock);
+	
+  // start a new thread for the new device
+  xTaskCreate(usbh_hid_client_thread, (char *)"hid_task", 1024,
+	      hid, configMAX_PRIORITIES-3, NULL);
 }
 
-// ... and XBOX clients as well
-static void usbh_xbox_client_thread(void *argument) {
-  struct xbox_info_S *xbox = (struct xbox_info_S *)argument;
+static void usbh_xbox_start(struct usb_config *usb, int i, struct usbh_xbox *class) {
+  struct xbox_info_S *xbox = &usb->xbox_info[i];
+  struct usb_client_S *client = &xbox->client;
 
-  printf("XBOX client #%d: thread started\r\n", xbox->index);
+  char dev_str[] = "/dev/xboxX";
+  dev_str[9] = '0' + i;
+  if(!usbh_client_claim(client, dev_str, class, class->hport, class->intin, &class->intin_urb))
+    return;
+  
+  xbox->class = class;
+  
+  printf("NEW XBOX %d\r\n", i);
+  printf("Interval: %d\r\n", class->intin->bInterval);
+  printf("Interface %d\r\n", class->intf);
+  if(hid_trace) hid_trace_dump("xbox", i, 'D', NULL, 0);
 
-  while(1) {
-    int ret = usbh_submit_urb(&xbox->class->intin_urb);
-    if (ret < 0)
-      printf("XBOX client #%d: submit failed\r\n", xbox->index);
-    else {
-      // Wait for result
-      xSemaphoreTake(xbox->sem, 0xffffffffUL);
-      xbox_parse(xbox);
-    }      
-
-#ifdef RATE_CHECK
-    xbox->rate_events++;
-    if(!(xbox->rate_events % 100)) {
-     float ms_since_start = (xTaskGetTickCount() - xbox->rate_start) * portTICK_PERIOD_MS;
-     printf("Rate = %f events/sec\r\n",  1000 * xbox->rate_events /  ms_since_start);
-    }    
-#endif
-  }
+  memset(&xbox->input, 0, sizeof(xbox->input));
+  xbox->input.js_index = usbh_js_alloc(usb);
+	
+  // setup urb
+  usbh_poll_start(client, USB_POLL_PAD);
+  usbh_int_urb_fill(&class->intin_urb, class->hport, &client->ep, client->buffer,
+		    XBOX_REPORT_SIZE, 0, usbh_client_callback, client);
+
+  client->state = STATE_RUNNING; 
+  client->running = true;
+  xSemaphoreGive(client->lock);
+
+  // start a new thread for the new device
+  xTaskCreate(usbh_xbox_client_thread, (char *)"xbox_task", 2048,
+	      xbox, configMAX_PRIORITIES-3, NULL);
 }
 
 static void usbh_hid_thread(void *argument) {
@@ -632,101 +584,150 @@ static void usbh_hid_thread(void *argument) {
   spi_tx_u08(usb->spi, SPI_TARGET_HID);
   spi_tx_u08(usb->spi, SPI_HID_STATUS);
   spi_tx_u08(usb->spi, 0x00);
-  printf("HID status #0: %02x\r\n", spi_tx_u08(usb->spi, 0x00));
-  printf("HID status #1: %02x\r\n", spi_tx_u08(usb->spi, 0x00));
+  unsigned char version = spi_tx_u08(usb->spi, 0x00);
+  unsigned char subversion = spi_tx_u08(usb->spi, 0x00);
   spi_end(usb->spi);
+  printf("HID status #0: %02x\r\n", version);
+  printf("HID status #1: %02x\r\n", subversion);
 
-  while (1) {
-    usbh_update(usb);
-
-    for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
-      if(usb->hid_info[i].state == STATE_DETECTED) {
-	printf("NEW HID device %d\r\n", i);
-	usb->hid_info[i].state = STATE_RUNNING; 
-
-	if( usb->hid_info[i].report.type == REPORT_TYPE_JOYSTICK ) {	
-	  // search for free joystick slot
-	  usb->hid_info[i].joystick.js_index = 0;
-	  while(usb->js_map & (1<<usb->hid_info[i].joystick.js_index))
-	    usb->hid_info[i].joystick.js_index++;
-	  
-	  printf("  -> joystick %d\r\n", usb->hid_info[i].joystick.js_index);
-	  usb->js_map |= 1<<usb->hid_info[i].joystick.js_index;
-	}
-	  
-#if 0
-	// set report protocol 1 if subclass != BOOT_INTF
-	// CherryUSB doesn't report the InterfaceSubClass (HID_BOOT_INTF_SUBCLASS)
-	// we thus set boot protocol on keyboards
-	if( usb->hid_info[i].report.type == REPORT_TYPE_KEYBOARD ) {	
-	  // /* 0x0 = boot protocol, 0x1 = report protocol */
-	  printf("setting boot protocol\r\n");
-	  ret = usbh_hid_set_protocol(usb->hid_info[i].class, HID_PROTOCOL_BOOT);
-	  if (ret < 0) {
-	    printf("failed\r\n");
-	    usb->hid_info[i].state = STATE_FAILED;  // failed
-	    continue;
-	  }
-	}
-#endif
+  // hid version 1.1 introduced batched events
+  hid_batch_supported = (version > 1) || (version == 1 && subversion >= 1);
+  printf("HID batch %ssupported\r\n", hid_batch_supported?"":"not ");
 
-	// setup urb
-	usbh_int_urb_fill(&usb->hid_info[i].class->intin_urb,
-			  usb->hid_info[i].class->hport,
-			  usb->hid_info[i].class->intin, usb->hid_info[i].buffer,
-			  usb->hid_info[i].report.report_size + (usb->hid_info[i].report.report_id_present ? 1:0),
-			  0, usbh_hid_callback, &usb->hid_info[i]);
+  // hid version 1.2 introduced the vbl interrupt
+  hid_vbl_supported = (version > 1) || (version == 1 && subversion >= 2);
+  printf("HID vbl %ssupported\r\n", hid_vbl_supported?"":"not ");
+  xTaskNotifyGive(usb->mouse_task);
 
-#ifdef RATE_CHECK
-	usb->hid_info[i].rate_start = xTaskGetTickCount();
-	usb->hid_info[i].rate_events = 0;
-#endif
-	
-	// start a new thread for the new device
-	xTaskCreate(usbh_hid_client_thread, (char *)"hid_task", 1024,
-		    &usb->hid_info[i], configMAX_PRIORITIES-3, &usb->hid_info[i].task_handle );
-      }
-    }
+  while (1) {
+    struct usb_event_S event;
     
-    for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++) {
-      if(usb->xbox_info[i].state == STATE_DETECTED) {
-	printf("NEW XBOX device %d\r\n", i);
-	usb->xbox_info[i].state = STATE_RUNNING; 
-
-	// search for free joystick slot
-	usb->xbox_info[i].js_index = 0;
-	while(usb->js_map & (1<<usb->xbox_info[i].js_index))
-	  usb->xbox_info[i].js_index++;
-
-	printf("  -> joystick %d\r\n", usb->xbox_info[i].js_index);
-	usb->js_map |= 1<<usb->xbox_info[i].js_index;
-	
-	// setup urb
-	usbh_int_urb_fill(&usb->xbox_info[i].class->intin_urb,
-			  usb->xbox_info[i].class->hport,
-			  usb->xbox_info[i].class->intin, usb->xbox_info[i].buffer,
-			  XBOX_REPORT_SIZE,
-			  0, usbh_xbox_callback, &usb->xbox_info[i]);
-	
-#ifdef RATE_CHECK
-	usb->xbox_info[i].rate_start = xTaskGetTickCount();
-	usb->xbox_info[i].rate_events = 0;
-#endif
-
-	// start a new thread for the new device
-	xTaskCreate(usbh_xbox_client_thread, (char *)"xbox_task", 2048,
-		    &usb->xbox_info[i], configMAX_PRIORITIES-3, &usb->xbox_info[i].task_handle );
-      }
+    // sleep until the usb stack reports a device change
+    if(xQueueReceive(usb->event_queue, &event, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    switch(event.type) {
+    case EVENT_HID_RUN:  usbh_hid_start(usb, event.index, event.class);  break;
+    case EVENT_XBOX_RUN: usbh_xbox_start(usb, event.index, event.class); break;
+    case EVENT_HID_STOP:
+      printf("HID LOST %d\r\n", event.index);
+      break;
+    case EVENT_XBOX_STOP:
+      printf("XBOX LOST %d\r\n", event.index);
+      break;
     }
 
-    // this thread only handles new devices and thus doesn't have to run very
-    // often
-    vTaskDelay(pdMS_TO_TICKS(100));
+    usbh_js_rebuild(usb);
+    usbh_leds_update(usb);
   }
 }
 
+// callbacks from the usb stack's hub thread. Setup is done by the
+// usb task while teardown happens right here as the class instance
+// is freed once these return
+void usbh_hid_run(struct usbh_hid *hid_class) {
+  struct usb_event_S event = { EVENT_HID_RUN, hid_class->minor, hid_class };
+  if(hid_class->minor < CONFIG_USBHOST_MAX_HID_CLASS)
+    xQueueSendToBack(usb_config.event_queue, &event, 0);
+}
+
+void usbh_hid_stop(struct usbh_hid *hid_class) {
+  struct usb_event_S event = { EVENT_HID_STOP, hid_class->minor, NULL };
+  if(hid_class->minor >= CONFIG_USBHOST_MAX_HID_CLASS) return;
+
+  struct hid_info_S *hid = &usb_config.hid_info[hid_class->minor];
+  if(!usbh_client_release(&hid->client, &hid_class->intin_urb)) return;
+  hid->class = NULL;
+  
+  xQueueSendToBack(usb_config.event_queue, &event, 0);
+}
+
+void usbh_xbox_run(struct usbh_xbox *xbox_class) {
+  struct usb_event_S event = { EVENT_XBOX_RUN, xbox_class->minor, xbox_class };
+  if(xbox_class->minor < CONFIG_USBHOST_MAX_XBOX_CLASS)
+    xQueueSendToBack(usb_config.event_queue, &event, 0);
+}
+
+void usbh_xbox_stop(struct usbh_xbox *xbox_class) {
+  struct usb_event_S event = { EVENT_XBOX_STOP, xbox_class->minor, NULL };
+  if(xbox_class->minor >= CONFIG_USBHOST_MAX_XBOX_CLASS) return;
+
+  struct xbox_info_S *xbox = &usb_config.xbox_info[xbox_class->minor];
+  if(!usbh_client_release(&xbox->client, &xbox_class->intin_urb)) return;
+  xbox->class = NULL;
+  
+  xQueueSendToBack(usb_config.event_queue, &event, 0);
+}
+
+#ifdef CONFIG_SHELL
+#include "shell.h"
+
+// console command to capture descriptors and reports of real devices
+// for later replay on the PC
+static int cmd_hidtrace(int argc, char **argv) {
+  if(argc > 1) hid_trace = !strcmp(argv[1], "on");
+  printf("HID trace %s\r\n", hid_trace?"on":"off");
+
+  if(!hid_trace) return 0;
+  
+  // devices already running won't report their descriptors again
+  for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
+    struct hid_info_S *hid = &usb_config.hid_info[i];
+    xSemaphoreTake(hid->client.lock, portMAX_DELAY);
+    if(hid->client.urb && hid->client.state == STATE_RUNNING)
+      hid_trace_dump("hid", i, 'D', hid->class->report_desc, 128);
+    xSemaphoreGive(hid->client.lock);
+  }
+
+  for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++)
+    if(usb_config.xbox_info[i].client.state == STATE_RUNNING)
+      hid_trace_dump("xbox", i, 'D', NULL, 0);
+  
+  return 0;
+}
+
+SHELL_CMD_EXPORT_ALIAS(cmd_hidtrace, hidtrace, hidtrace [on|off] dump usb hid traffic);
+
+static void usbpoll_show(const char *name, struct usb_client_S *client) {
+  struct usb_poll_S *poll = &client->poll;
+
+  xSemaphoreTake(client->lock, portMAX_DELAY);
+  if(client->urb && client->state == STATE_RUNNING)
+    printf("%s%d %04x:%04x: bInterval %d, %s%d ms, %d events/sec\r\n", name, client->index,
+	   client->hport->device_desc.idVendor, client->hport->device_desc.idProduct,
+	   poll->interval, poll->ms?"":"default ", poll->ms?poll->ms:poll->interval, poll->rate);
+  xSemaphoreGive(client->lock);
+}
+
+// console command to list the achieved event rates and to set
+// device specific polling intervals
+static int cmd_usbpoll(int argc, char **argv) {
+  if(argc > 2) {
+    unsigned int vid, pid;
+    char *end;
+    long ms = strtol(argv[2], &end, 10);
+    if(sscanf(argv[1], "%x:%x", &vid, &pid) != 2 ||
+       *end || ms < 1 || ms > 255 ||
+       usb_poll_device_set(vid, pid, ms) != 0) {
+      printf("usage: usbpoll [vid:pid ms], ms = 1..255\r\n");
+      return -1;
+    }
+  }
+  
+  for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++)
+    usbpoll_show("hid", &usb_config.hid_info[i].client);
+
+  for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++)
+    usbpoll_show("xbox", &usb_config.xbox_info[i].client);
+  
+  return 0;
+}
+
+SHELL_CMD_EXPORT_ALIAS(cmd_usbpoll, usbpoll, usbpoll [vid:pid ms] show event rates and set polling interval);
+#endif
+
 void usb_register_osd(osd_t *osd) {
-  usb_config.osd = osd;
+  hid_register_osd(osd);
 }
 
 void usb_host(spi_t *spi) {
@@ -734,38 +735,70 @@ void usb_host(spi_t *spi) {
 
   printf("init usb hid host\r\n");
 
-  usbh_initialize(0, USB_BASE);
-  
   usb_config.spi = spi;
-  usb_config.osd = NULL;
   usb_config.js_map = 0;   // no joysticks yet
   
   // initialize all HID info entries
   for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
-    usb_config.hid_info[i].index = i;
-    usb_config.hid_info[i].state = 0;
-    usb_config.hid_info[i].buffer = hid_buffer[i];      
-    usb_config.hid_info[i].usb = &usb_config;
-    usb_config.hid_info[i].sem = xSemaphoreCreateBinary();
+    struct usb_client_S *client = &usb_config.hid_info[i].client;
+    client->index = i;
+    client->state = STATE_NONE;
+    client->urb = NULL;
+    client->running = false;
+    client->buffer = hid_buffer[i];      
+    client->usb = &usb_config;
+    client->sem = xSemaphoreCreateBinary();
+    client->lock = xSemaphoreCreateMutex();
   }
   
   // initialize all XBOX info entries
   for(int i=0;i<CONFIG_USBHOST_MAX_XBOX_CLASS;i++) {
-    usb_config.xbox_info[i].index = i;
-    usb_config.xbox_info[i].state = 0;
-    usb_config.xbox_info[i].buffer = xbox_buffer[i];      
-    usb_config.xbox_info[i].usb = &usb_config;
-    usb_config.xbox_info[i].sem = xSemaphoreCreateBinary();
+    struct usb_client_S *client = &usb_config.xbox_info[i].client;
+    client->index = i;
+    client->state = STATE_NONE;
+    client->urb = NULL;
+    client->running = false;
+    client->buffer = xbox_buffer[i];      
+    client->usb = &usb_config;
+    client->sem = xSemaphoreCreateBinary();
+    client->lock = xSemaphoreCreateMutex();
   }
 
+  // device changes are reported by the usb stack as soon as a device
+  // has been enumerated
+  usb_config.event_queue = xQueueCreate(8, sizeof(struct usb_event_S));
+
+  xTaskCreate(usbh_mouse_thread, (char *)"mouse_task", 512, &usb_config, configMAX_PRIORITIES-3, &usb_config.mouse_task);
   xTaskCreate(usbh_hid_thread, (char *)"usb_task", 2048, &usb_config, configMAX_PRIORITIES-3, &usb_handle);
+
+  // start the stack only once everything is ready to receive its callbacks
+  usbh_initialize(0, USB_BASE);
 }
 
 // hid event triggered by FPGA
 void hid_handle_event(void) {
   spi_t *spi = usb_config.spi;
+  unsigned char pending = 0x01;   // older cores only report db9 changes
+
+  if(hid_vbl_supported) {
+    spi_begin_prio(spi, SPI_PRIO_INPUT);
+    spi_tx_u08(spi, SPI_TARGET_HID);
+    spi_tx_u08(spi, SPI_HID_IRQ);
+    spi_tx_u08(spi, 0x00);
+    pending = spi_tx_u08(spi, 0x00);
+    spi_end(spi);
+  }
+
+  // vertical blank: let the mouse thread send the collected movement
+  if(pending & 0x02) {
+    hid_vbl_event(spi);
+    xTaskNotifyGive(usb_config.mouse_task);
+  }
+
+  if(!(pending & 0x01))
+    return;
   
-  spi_begin(spi);
+  spi_begin_prio(spi, SPI_PRIO_INPUT);
   spi_tx_u08(spi, SPI_TARGET_HID);
   spi_tx_u08(spi, SPI_HID_GET_DB9);
   spi_tx_u08(spi, 0x00);
@@ -0,0 +1,483 @@
+//
+// vimage.c - compressed disk images served by the MCU
+//
+// The core can only read uncompressed images from the card. MSA images
+// are thus decoded by the MCU track by track whenever the core requests
+// a sector, and the sector data is sent to the core directly. The last
+// few decoded tracks are kept, as the core usually reads all sectors of
+// a track in a row.
+//
+// gzip and zip archives are inflated once into a scratch file on the
+// card, which is then mounted read-only like a regular image. The
+// scratch file is checked against the archive's crc and reused as long
+// as the archive doesn't change.
+//
+
+#include "vimage.h"
+#include "inflate.h"
+#include "sdc.h"
+#include <ff.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MSA_MAGIC      0x0e0f
+#define VIMAGE_TRACKS  4      // number of decoded tracks kept
+
+#define SCRATCH_FILE   CARD_MOUNTPOINT "/.vimage"
+
+static struct {
+  FIL fil;
+  DWORD *tracks;      // file offset of each track record, NULL if not open
+  int records;        // number of track records in the file
+  int spt, sides, start;
+} msa[MAX_DRIVES];
+
+static struct {
+  int valid, drive, record;
+  unsigned long used;
+  unsigned char *data;
+  unsigned long size;
+} track[VIMAGE_TRACKS];
+
+static unsigned long track_clock = 0;
+
+static unsigned short get_u16be(const unsigned char *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static unsigned short get_u16le(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_u32le(const unsigned char *p) {
+  return get_u16le(p) | ((unsigned long)get_u16le(p+2) << 16);
+}
+
+static int vimage_pread(FIL *fp, FSIZE_t ofs, void *buf, UINT len) {
+  UINT br;
+  return f_lseek(fp, ofs) != FR_OK || f_read(fp, buf, len, &br) != FR_OK || br != len;
+}
+
+int vimage_type(const char *name) {
+  const char *dot = strrchr(name, '.');
+  if(!dot) return VIMAGE_NONE;
+
+  if(!strcasecmp(dot, ".msa")) return VIMAGE_MSA;
+  if(!strcasecmp(dot, ".gz"))  return VIMAGE_GZIP;
+  if(!strcasecmp(dot, ".zip")) return VIMAGE_ZIP;
+  return VIMAGE_NONE;
+}
+
+// ------------------------------ MSA images ------------------------------
+
+void vimage_close(int drive) {
+  if(!msa[drive].tracks) return;
+
+  f_close(&msa[drive].fil);
+  free(msa[drive].tracks);
+  msa[drive].tracks = NULL;
+
+  for(int i=0;i<VIMAGE_TRACKS;i++)
+    if(track[i].drive == drive)
+      track[i].valid = 0;
+}
+
+int vimage_is_open(int drive) {
+  return msa[drive].tracks != NULL;
+}
+
+long vimage_open(int drive, const char *name) {
+  unsigned char hdr[10];
+
+  vimage_close(drive);
+
+  if(f_open(&msa[drive].fil, name, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return -1;
+
+  // header: magic, sectors per track, sides - 1, first and last track
+  if(vimage_pread(&msa[drive].fil, 0, hdr, sizeof(hdr)) ||
+     get_u16be(hdr) != MSA_MAGIC || !get_u16be(hdr+2) || get_u16be(hdr+2) > 64 ||
+     get_u16be(hdr+4) > 1 || get_u16be(hdr+6) > get_u16be(hdr+8) || get_u16be(hdr+8) > 255) {
+    printf("%s: not a MSA image\r\n", name);
+    f_close(&msa[drive].fil);
+    return -1;
+  }
+
+  msa[drive].spt = get_u16be(hdr+2);
+  msa[drive].sides = get_u16be(hdr+4) + 1;
+  msa[drive].start = get_u16be(hdr+6);
+  int end = get_u16be(hdr+8);
+  msa[drive].records = (end - msa[drive].start + 1) * msa[drive].sides;
+
+  // each track record starts with its length, so the records have to
+  // be walked once to find them
+  DWORD *tracks = malloc(msa[drive].records * sizeof(DWORD));
+  if(!tracks) {
+    f_close(&msa[drive].fil);
+    return -1;
+  }
+
+  DWORD ofs = sizeof(hdr);
+  for(int i=0;i<msa[drive].records;i++) {
+    unsigned char len[2];
+    if(vimage_pread(&msa[drive].fil, ofs, len, sizeof(len))) {
+      printf("%s: truncated at track record %d\r\n", name, i);
+      free(tracks);
+      f_close(&msa[drive].fil);
+      return -1;
+    }
+    tracks[i] = ofs;
+    ofs += sizeof(len) + get_u16be(len);
+  }
+  msa[drive].tracks = tracks;
+
+  printf("MSA %d sectors, %d sides, tracks %d-%d\r\n", msa[drive].spt,
+	 msa[drive].sides, msa[drive].start, end);
+
+  // the image always starts with track 0, missing tracks read as zero
+  return (long)(end + 1) * msa[drive].sides * msa[drive].spt * 512;
+}
+
+// decode a track record. Records shorter than a track are run length
+// encoded with 0xe5 followed by the byte and a 16 bit count
+static int msa_decode(int drive, int record, unsigned char *data) {
+  FIL *fp = &msa[drive].fil;
+  unsigned long size = msa[drive].spt * 512;
+  unsigned char hdr[2];
+
+  if(vimage_pread(fp, msa[drive].tracks[record], hdr, sizeof(hdr)))
+    return -1;
+
+  UINT len = get_u16be(hdr), br;
+  if(len == size)
+    return f_read(fp, data, size, &br) != FR_OK || br != size;
+
+  unsigned char *src = malloc(len);
+  if(!src) return -1;
+  if(f_read(fp, src, len, &br) != FR_OK || br != len) {
+    free(src);
+    return -1;
+  }
+
+  unsigned long o = 0;
+  for(UINT i=0;i<len && o<size;) {
+    if(src[i] == 0xe5 && i+3 < len) {
+      unsigned int cnt = get_u16be(src+i+2);
+      while(cnt-- && o<size) data[o++] = src[i+1];
+      i += 4;
+    } else
+      data[o++] = src[i++];
+  }
+  if(o < size) memset(data+o, 0, size-o);
+
+  free(src);
+  return 0;
+}
+
+int vimage_read(int drive, unsigned long lba, unsigned char *buffer) {
+  unsigned long size = msa[drive].spt * 512;
+  long record = lba / msa[drive].spt - msa[drive].start * msa[drive].sides;
+
+  if(!msa[drive].tracks || record < 0 || record >= msa[drive].records) {
+    memset(buffer, 0, 512);
+    return 0;
+  }
+
+  // find the track or replace the least recently used one
+  int t, lru = 0;
+  for(t=0;t<VIMAGE_TRACKS;t++) {
+    if(track[t].valid && track[t].drive == drive && track[t].record == record)
+      break;
+    if(!track[t].valid || (track[lru].valid && track[t].used < track[lru].used))
+      lru = t;
+  }
+
+  if(t == VIMAGE_TRACKS) {
+    t = lru;
+    track[t].valid = 0;
+    if(track[t].size < size) {
+      free(track[t].data);
+      track[t].data = malloc(size);
+      track[t].size = track[t].data?size:0;
+    }
+
+    if(!track[t].data || msa_decode(drive, record, track[t].data)) {
+      printf("MSA: track record %ld failed\r\n", record);
+      return -1;
+    }
+
+    track[t].valid = 1;
+    track[t].drive = drive;
+    track[t].record = record;
+  }
+
+  track[t].used = ++track_clock;
+  memcpy(buffer, track[t].data + (lba % msa[drive].spt) * 512, 512);
+  return 0;
+}
+
+// --------------------------- gzip and zip archives ---------------------------
+
+// identifies the archive the scratch file was extracted from
+typedef struct {
+  DWORD sclust;
+  DWORD size;
+  WORD fdate, ftime;
+  WORD len;     // length of path incl. terminating 0, path follows header
+} vimage_id_t;
+
+typedef struct {
+  FIL *src, *dst;
+  unsigned long left;   // compressed bytes left
+  unsigned long crc;    // crc-32 of the data written so far
+} extract_t;
+
+// crc-32 as used by gzip and zip, four bits at a time
+static unsigned long vimage_crc32(unsigned long crc, const unsigned char *buf, int len) {
+  static const unsigned long tab[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+  };
+
+  crc = ~crc & 0xffffffff;
+  while(len--) {
+    crc ^= *buf++;
+    crc = (crc >> 4) ^ tab[crc & 15];
+    crc = (crc >> 4) ^ tab[crc & 15];
+  }
+  return ~crc & 0xffffffff;
+}
+
+static int extract_read(void *ctx, unsigned char *buf, int len) {
+  extract_t *x = (extract_t*)ctx;
+  UINT br = 0;
+
+  if((unsigned long)len > x->left) len = x->left;
+  sdc_lock();
+  if(f_read(x->src, buf, len, &br) != FR_OK) br = 0;
+  sdc_unlock();
+
+  x->left -= br;
+  return br;
+}
+
+static int extract_write(void *ctx, const unsigned char *buf, int len) {
+  extract_t *x = (extract_t*)ctx;
+  UINT bw;
+
+  x->crc = vimage_crc32(x->crc, buf, len);
+
+  sdc_lock();
+  FRESULT res = f_write(x->dst, buf, len, &bw);
+  sdc_unlock();
+
+  return res != FR_OK || bw != (UINT)len;
+}
+
+// locate the compressed data in the archive and leave the file pointer
+// there. Returns the compression method (0 = stored, 8 = deflate) or -1
+static int vimage_archive(FIL *fp, int type, unsigned long *csize, unsigned long *usize,
+			  unsigned long *crc) {
+  unsigned char buf[46];
+
+  if(type == VIMAGE_GZIP) {
+    if(vimage_pread(fp, 0, buf, 10) || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8)
+      return -1;
+
+    // skip the optional extra field, file name, comment and header crc
+    unsigned char flags = buf[3];
+    FSIZE_t ofs = 10;
+    if(flags & 4) {
+      if(vimage_pread(fp, ofs, buf, 2)) return -1;
+      ofs += 2 + get_u16le(buf);
+    }
+    for(int f=8;f<=16;f<<=1) {
+      if(!(flags & f)) continue;
+      do {
+	if(vimage_pread(fp, ofs++, buf, 1)) return -1;
+      } while(buf[0]);
+    }
+    if(flags & 2) ofs += 2;
+
+    // crc and size of the uncompressed data are stored at the end
+    if(f_size(fp) < ofs + 8 || vimage_pread(fp, f_size(fp) - 8, buf, 8))
+      return -1;
+    *crc = get_u32le(buf);
+    *usize = get_u32le(buf+4);
+    *csize = f_size(fp) - ofs - 8;
+    return f_lseek(fp, ofs) == FR_OK?8:-1;
+  }
+
+  // zip: the end of central directory record is searched in the last
+  // bytes only, so archive comments must not be longer than 256 bytes
+  UINT tlen = (f_size(fp) < 22+256)?f_size(fp):22+256;
+  unsigned char *tail = malloc(tlen);
+  if(!tail || vimage_pread(fp, f_size(fp) - tlen, tail, tlen)) {
+    free(tail);
+    return -1;
+  }
+
+  int e = tlen - 22;
+  while(e >= 0 && get_u32le(tail+e) != 0x06054b50) e--;
+  if(e < 0) {
+    free(tail);
+    return -1;
+  }
+  int entries = get_u16le(tail+e+10);
+  FSIZE_t ofs = get_u32le(tail+e+16);
+  free(tail);
+
+  // use the first file, skipping directories
+  while(entries--) {
+    if(vimage_pread(fp, ofs, buf, 46) || get_u32le(buf) != 0x02014b50)
+      return -1;
+
+    int nlen = get_u16le(buf+28);
+    unsigned char last;
+    if(!nlen || vimage_pread(fp, ofs + 46 + nlen - 1, &last, 1))
+      return -1;
+
+    if(last != '/') {
+      if(get_u16le(buf+8) & 1) return -1;     // encrypted
+      int method = get_u16le(buf+10);
+      *crc = get_u32le(buf+16);
+      *csize = get_u32le(buf+20);
+      *usize = get_u32le(buf+24);
+
+      // the data follows the local header
+      ofs = get_u32le(buf+42);
+      if(vimage_pread(fp, ofs, buf, 30) || get_u32le(buf) != 0x04034b50)
+	return -1;
+      ofs += 30 + get_u16le(buf+26) + get_u16le(buf+28);
+      return f_lseek(fp, ofs) == FR_OK?method:-1;
+    }
+
+    ofs += 46 + nlen + get_u16le(buf+30) + get_u16le(buf+32);
+  }
+
+  return -1;
+}
+
+static int vimage_id_match(const char *idname, const vimage_id_t *id, const char *name) {
+  FIL f;
+  vimage_id_t hdr;
+  UINT br;
+
+  if(f_open(&f, idname, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return 0;
+
+  char path[id->len];
+  int match = f_read(&f, &hdr, sizeof(hdr), &br) == FR_OK && br == sizeof(hdr) &&
+    !memcmp(&hdr, id, sizeof(hdr)) &&
+    f_read(&f, path, id->len, &br) == FR_OK && br == id->len && !strcmp(path, name);
+
+  f_close(&f);
+  return match;
+}
+
+const char *vimage_extract(int drive, const char *name) {
+  static char scratch[sizeof(SCRATCH_FILE)+2];
+  char idname[sizeof(scratch)+3];
+  sprintf(scratch, "%s%d", SCRATCH_FILE, drive);
+  sprintf(idname, "%s.id", scratch);
+
+  FIL src, dst;
+  FILINFO fno;
+  vimage_id_t id;
+  UINT bw;
+
+  sdc_lock();
+  if(f_stat(name, &fno) != FR_OK || f_open(&src, name, FA_OPEN_EXISTING | FA_READ) != FR_OK) {
+    sdc_unlock();
+    return NULL;
+  }
+
+  memset(&id, 0, sizeof(id));
+  id.sclust = src.obj.sclust;
+  id.size = f_size(&src);
+  id.fdate = fno.fdate;
+  id.ftime = fno.ftime;
+  id.len = strlen(name) + 1;
+
+  // the archive has been extracted before and hasn't changed since
+  if(vimage_id_match(idname, &id, name) && f_stat(scratch, &fno) == FR_OK) {
+    f_close(&src);
+    sdc_unlock();
+    printf("%s: using %s\r\n", name, scratch);
+    return scratch;
+  }
+
+  // an interrupted extraction must not be taken for a complete one
+  f_unlink(idname);
+
+  unsigned long csize = 0, usize = 0, crc = 0;
+  int method = vimage_archive(&src, vimage_type(name), &csize, &usize, &crc);
+  if((method != 0 && method != 8) ||
+     f_open(&dst, scratch, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+    printf("%s: unsupported archive\r\n", name);
+    f_close(&src);
+    sdc_unlock();
+    return NULL;
+  }
+
+  // the scratch file gets the same time stamp each time, so a link
+  // table cached for a previous archive must not be used for it
+  sdc_extcache_drop(scratch);
+
+  // a contiguous scratch file can be translated by the core itself
+  if(f_expand(&dst, usize, 1) != FR_OK)
+    printf("%s: no contiguous space for %lu bytes\r\n", scratch, usize);
+  sdc_unlock();
+
+  printf("Extracting %s, %lu -> %lu bytes\r\n", name, csize, usize);
+
+  // the sdc is only locked for the individual file accesses, so other
+  // drives are still being served meanwhile
+  extract_t x = { &src, &dst, csize, 0 };
+  unsigned char *window = malloc(INFLATE_WINDOW);
+  int ok = 0;
+  unsigned long total = 0;
+
+  if(window && method == 8) {
+    inflate_t *s = malloc(sizeof(inflate_t));
+    if(s) {
+      s->read = extract_read;
+      s->write = extract_write;
+      s->ctx = &x;
+      s->window = window;
+      ok = !inflate_run(s);
+      total = s->total;
+      free(s);
+    }
+  } else if(window) {
+    int len;
+    ok = 1;
+    while(ok && (len = extract_read(&x, window, INFLATE_WINDOW)) > 0) {
+      ok = !extract_write(&x, window, len);
+      total += len;
+    }
+  }
+  free(window);
+
+  sdc_lock();
+  if(ok && x.crc != crc)
+    printf("%s: crc %08lx, expected %08lx\r\n", name, x.crc, crc);
+  ok = ok && total == usize && x.crc == crc && f_close(&dst) == FR_OK;
+  f_close(&src);
+
+  if(ok) {
+    FIL f;
+    if(f_open(&f, idname, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK) {
+      f_write(&f, &id, sizeof(id), &bw);
+      f_write(&f, name, id.len, &bw);
+      f_close(&f);
+    }
+  } else {
+    printf("%s: extraction failed\r\n", name);
+    f_close(&dst);
+  }
+  sdc_unlock();
+
+  return ok?scratch:NULL;
+}
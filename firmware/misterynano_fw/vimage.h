@@ -0,0 +1,25 @@
+//
+// vimage.h - compressed disk images served by the MCU
+//
+
+#ifndef VIMAGE_H
+#define VIMAGE_H
+
+#define VIMAGE_NONE  0   // regular image, read by the core itself
+#define VIMAGE_MSA   1   // decoded by the MCU on every request
+#define VIMAGE_GZIP  2   // inflated into a scratch file on the card
+#define VIMAGE_ZIP   3
+
+int vimage_type(const char *name);
+
+// The caller holds the sdc lock for these
+long vimage_open(int drive, const char *name);
+int vimage_read(int drive, unsigned long lba, unsigned char *buffer);
+void vimage_close(int drive);
+int vimage_is_open(int drive);
+
+// returns the name of the scratch file to be mounted instead of the
+// archive or NULL. Locks the sdc itself
+const char *vimage_extract(int drive, const char *name);
+
+#endif // VIMAGE_H
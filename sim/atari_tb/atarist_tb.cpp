@@ -2,22 +2,69 @@
   atarist_tb.cpp
 
   MiSTeryNano verilator testbench
+
+  Usage: atarist_tb [-r checkpoint] [-s ms[,ms...]] [-e ms] [-f format] [-j threads] [-H]
+                    [-T trigger]... [-w pre,post] [-x] [-d] [-t turbo] [-l us]
+    -r  continue the simulation from a checkpoint
+    -s  write checkpoints at the given simulated times
+    -e  stop at the given simulated time
+    -f  frame output into screenshots/: png (default), raw, ffmpeg or none
+    -j  number of png writer threads (default 2)
+    -H  headless, no SDL window. Ctrl-C ends the simulation
+    -T  write a waveform around a trigger, see sim/common/tracetrig.h.
+        Signals are addr (cpu byte address while AS is active), lba
+        (sd_lba while a request is active), sd_rd, sd_wr, sd_busy,
+        sd_done, vsync_n and leds
+    -w  trace window before and after each trigger in ms (default 10,10)
+    -x  stop once all trace windows have been written
+    -d  profile all disk accesses into atarist_tb_disk.csv and a
+        per drive summary in atarist_tb_disk.txt, see sim/common/diskprof.h
+    -t  floppy turbo mode 0 (off) to 3 (8x)
+    -l  latency of every sector request in us before data is delivered,
+        e.g. the MCU translating the sector and the sd card access
+        (default 0)
+
+  Only frames that differ from the previous one are written. The raw
+  stream screenshots/frames.raw contains the frame number, width and
+  height as 32 bit values followed by the ABGR pixels of each frame.
+
+  Checkpoints are named checkpoint_<ms>.ckp and can also be written
+  at any time by pressing F2 in the video window. They contain the
+  verilated model as well as the testbench state and are only valid
+  for the very same build of the testbench.
 */
 
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <signal.h>
 
 #include <SDL.h>
 #include <SDL_image.h>
 
 #include "Vatarist_tb.h"
 #include "verilated.h"
-#include "verilated_fst_c.h"
+#include "verilated_save.h"
+
+#include "tracetrig.h"
+#include "diskprof.h"
+#include "bench.h"
 
 static Vatarist_tb *tb;
-static VerilatedFstC *trace;
+static TraceTrigger *trigger;
+static DiskProfiler *profiler = NULL;
 static double simulation_time;
 
 // #define TOS "tos206de.img"
@@ -34,6 +81,7 @@ static double simulation_time;
 // and then makes a huge pause until
 // 19136.180ms SD ACSI request, sector 0
 // what happens in between?
+// -d lists the code the CPU runs during such gaps in atarist_tb_disk.txt
 
 // PP60.hd
 // 1998.840ms SD ACSI request, sector 64
@@ -49,15 +97,9 @@ static double simulation_time;
 
 // these numbers are for TOS1.04 on a 512kBytes warm boot (ram.img present)
 
-// #define TRACESTART   0.0
-// #define TRACESTART   1.59   // first sector is read from sd card into buffer
-// #define TRACESTART   1.75   // first sector is read from buffer into dma
-// #define TRACESTART   1.81   // first acsi read attempt
-
-#ifdef TRACESTART
-// run for 10ms
-#define TRACEEND     (TRACESTART + 0.1)
-#endif
+// -T time=1590   // first sector is read from sd card into buffer
+// -T time=1750   // first sector is read from buffer into dma
+// -T time=1810   // first acsi read attempt
 
 // image name use to write ram to disk
 #define RAMFILE  "ram.img"  
@@ -65,6 +107,18 @@ static double simulation_time;
 FILE *fdc_a_fd = NULL;
 FILE *acsi_0_fd = NULL;
 
+// image insertion and sector transfer state, part of a checkpoint
+static struct {
+  int insert_counter;
+  int fdc_substate;
+  int fdc_tx_count;
+  int sd_rd;
+  unsigned char sector_buffer[512];
+} disk = { 0, 0, -1, -1 };
+
+// sector request latency in 32 MHz cycles
+static int sd_latency = 0;
+
 /* =============================== video =================================== */
 
 #define MAX_H_RES   (2048+100)  // a little more than 2048 to see how the Atari scales to 2048 in PAL
@@ -74,6 +128,7 @@ SDL_Window*   sdl_window   = NULL;
 SDL_Renderer* sdl_renderer = NULL;
 SDL_Texture*  sdl_texture  = NULL;
 int sdl_cancelled = 0;
+int checkpoint_request = 0;
 
 typedef struct Pixel {  // for SDL texture
     uint8_t a;  // transparency
@@ -107,110 +162,239 @@ void init_video(void) {
   }
 }
 
-// https://stackoverflow.com/questions/34255820/save-sdl-texture-to-file
-void save_texture(SDL_Renderer *ren, SDL_Texture *tex, const char *filename) {
-    SDL_Texture *ren_tex = NULL;
-    SDL_Surface *surf = NULL;
-    int w, h;
-    int format = SDL_PIXELFORMAT_RGBA32;;
-    void *pixels = NULL;
+/* ============================ frame writer =============================== */
+
+// Frames differing from their predecessor are handed through a
+// bounded queue to writer threads, so PNG encoding and file i/o don't
+// stall the simulation. Raw and ffmpeg output are written in order by
+// a single thread.
+
+enum { FRAMES_NONE, FRAMES_PNG, FRAMES_RAW, FRAMES_FFMPEG };
+
+#define FRAME_QUEUE_LEN  8
+#define FRAME_RATE       50   // for the ffmpeg encoder
+
+static int frame_output = FRAMES_PNG;
+static int frame_threads = 2;
+static bool headless = false;
+
+typedef struct {
+  int num, w, h;
+  std::vector<Pixel> pixels;
+} frame_t;
+
+static std::mutex frame_lock;
+static std::condition_variable frame_not_empty, frame_not_full;
+static std::deque<frame_t*> frame_queue;
+static std::vector<std::thread> frame_writers;
+static bool frame_writers_done = false;
+
+static FILE *frame_out = NULL;   // raw stream or ffmpeg pipe
+static int frame_out_w, frame_out_h;
+
+static struct {
+  unsigned long frames;
+  unsigned long duplicates;
+  unsigned long written;
+  unsigned long stalls;    // simulation waited for a free queue entry
+} frame_stats;
+
+static void frame_write(frame_t *f) {
+  if(frame_output == FRAMES_PNG) {
+    char name[32];
+    sprintf(name, "screenshots/frame%04d.png", f->num);
+    SDL_Surface *surf = SDL_CreateRGBSurfaceWithFormatFrom(f->pixels.data(), f->w, f->h, 32,
+		   f->w*sizeof(Pixel), SDL_PIXELFORMAT_RGBA8888);
+    if(!surf) { SDL_Log("Failed creating new surface: %s\n", SDL_GetError()); return; }
+    if(IMG_SavePNG(surf, name) != 0) SDL_Log("Failed saving image: %s\n", SDL_GetError());
+    SDL_FreeSurface(surf);
+  }
 
-    /* Get information about texture we want to save */
-    int st = SDL_QueryTexture(tex, NULL, NULL, &w, &h);
-    if (st != 0) { SDL_Log("Failed querying texture: %s\n", SDL_GetError()); goto cleanup; }
+  else if(frame_output == FRAMES_RAW) {
+    // each frame is preceeded by its number, width and height
+    if(!frame_out) frame_out = fopen("screenshots/frames.raw", "wb");
+    if(!frame_out) { perror("screenshots/frames.raw"); return; }
+    uint32_t hdr[3] = { (uint32_t)f->num, (uint32_t)f->w, (uint32_t)f->h };
+    fwrite(hdr, sizeof(hdr), 1, frame_out);
+    fwrite(f->pixels.data(), sizeof(Pixel), f->pixels.size(), frame_out);
+  }
 
-    // adjust aspect ratio
-    while(w > 2*h) w/=2;
-    
-    ren_tex = SDL_CreateTexture(ren, format, SDL_TEXTUREACCESS_TARGET, w, h);
-    if (!ren_tex) { SDL_Log("Failed creating render texture: %s\n", SDL_GetError()); goto cleanup; }
+  else if(frame_output == FRAMES_FFMPEG) {
+    // start a new video whenever the resolution changes
+    if(frame_out && (f->w != frame_out_w || f->h != frame_out_h)) {
+      pclose(frame_out);
+      frame_out = NULL;
+    }
 
-    /* Initialize our canvas, then copy texture to a target whose pixel data we can access */
-    st = SDL_SetRenderTarget(ren, ren_tex);
-    if (st != 0) { SDL_Log("Failed setting render target: %s\n", SDL_GetError()); goto cleanup; }
+    if(!frame_out) {
+      char cmd[256];
+      sprintf(cmd, "ffmpeg -loglevel error -y -f rawvideo -pix_fmt abgr -s %dx%d -r %d -i - "
+	      "-pix_fmt yuv420p screenshots/frame%04d.mp4", f->w, f->h, FRAME_RATE, f->num);
+      frame_out = popen(cmd, "w");
+      if(!frame_out) { perror("ffmpeg"); return; }
+      frame_out_w = f->w;
+      frame_out_h = f->h;
+    }
+    fwrite(f->pixels.data(), sizeof(Pixel), f->pixels.size(), frame_out);
+  }
+}
 
-    SDL_SetRenderDrawColor(ren, 0x00, 0x00, 0x00, 0x00);
-    SDL_RenderClear(ren);
+static void frame_writer(void) {
+  for(;;) {
+    frame_t *f;
+    {
+      std::unique_lock<std::mutex> lock(frame_lock);
+      frame_not_empty.wait(lock, []{ return frame_writers_done || !frame_queue.empty(); });
+      if(frame_queue.empty()) return;
+      f = frame_queue.front();
+      frame_queue.pop_front();
+      frame_not_full.notify_one();
+    }
 
-    st = SDL_RenderCopy(ren, tex, NULL, NULL);
-    if (st != 0) { SDL_Log("Failed copying texture data: %s\n", SDL_GetError()); goto cleanup; }
+    frame_write(f);
+    delete f;
 
-    /* Create buffer to hold texture data and load it */
-    pixels = malloc(w * h * SDL_BYTESPERPIXEL(format));
-    if (!pixels) { SDL_Log("Failed allocating memory\n"); goto cleanup; }
+    std::lock_guard<std::mutex> lock(frame_lock);
+    frame_stats.written++;
+  }
+}
 
-    st = SDL_RenderReadPixels(ren, NULL, format, pixels, w * SDL_BYTESPERPIXEL(format));
-    if (st != 0) { SDL_Log("Failed reading pixel data: %s\n", SDL_GetError()); goto cleanup; }
+void frame_writer_start(void) {
+  if(frame_output == FRAMES_NONE) return;
+  mkdir("screenshots", 0755);
+  if(frame_output != FRAMES_PNG) frame_threads = 1;
+  for(int i=0;i<frame_threads;i++)
+    frame_writers.push_back(std::thread(frame_writer));
+}
 
-    /* Copy pixel data over to surface */
-    surf = SDL_CreateRGBSurfaceWithFormatFrom(pixels, w, h, SDL_BITSPERPIXEL(format), w * SDL_BYTESPERPIXEL(format), format);
-    if (!surf) { SDL_Log("Failed creating new surface: %s\n", SDL_GetError()); goto cleanup; }
+void frame_writer_stop(void) {
+  {
+    std::lock_guard<std::mutex> lock(frame_lock);
+    frame_writers_done = true;
+  }
+  frame_not_empty.notify_all();
+  for(auto &t : frame_writers) t.join();
+  frame_writers.clear();
+
+  if(frame_out) {
+    if(frame_output == FRAMES_FFMPEG) pclose(frame_out);
+    else                              fclose(frame_out);
+    frame_out = NULL;
+  }
 
-    /* Save result to an image */
-    st = IMG_SavePNG(surf, filename);
-    if (st != 0) { SDL_Log("Failed saving image: %s\n", SDL_GetError()); goto cleanup; }
-    
-    // SDL_Log("Saved texture as PNG to \"%s\" sized %dx%d\n", filename, w, h);
+  printf("Frames: %lu, %lu duplicates, %lu written, %lu queue stalls\n",
+	 frame_stats.frames, frame_stats.duplicates, frame_stats.written, frame_stats.stalls);
+}
 
-cleanup:
-    SDL_FreeSurface(surf);
-    free(pixels);
-    SDL_DestroyTexture(ren_tex);
+// FNV-1a over 32 bit words
+static uint64_t frame_hash(const Pixel *p, size_t n) {
+  const uint32_t *w = (const uint32_t*)p;
+  uint64_t h = 14695981039346656037ull;
+  while(n--) h = (h ^ *w++) * 1099511628211ull;
+  return h;
 }
 
-void capture_video(void) {
-  static int last_hs_n = -1;
-  static int last_vs_n = -1;
-  static int sx = 0;
-  static int sy = 0;
-  static int frame = 0;
-  static int frame_line_len = 0;
+// beam position and frame state, part of a checkpoint
+static struct {
+  int last_hs_n;
+  int last_vs_n;
+  int sx;
+  int sy;
+  int frame;
+  int frame_line_len;
+  uint64_t last_hash;
+} video = { -1, -1, 0, 0, 0, 0, 0 };
+
+// copy a complete frame out of the screenbuffer. Returns false if it
+// equals the previous one
+static bool frame_submit(int w, int h) {
+  frame_stats.frames++;
   
+  // adjust aspect ratio by dropping pixels
+  int step = 1;
+  while(w/step > 2*h) step *= 2;
+
+  frame_t *f = new frame_t;
+  f->num = video.frame;
+  f->w = w/step;
+  f->h = h;
+  f->pixels.resize(f->w * f->h);
+  for(int y=0;y<h;y++) {
+    Pixel *src = &screenbuffer[y*MAX_H_RES];
+    Pixel *dst = &f->pixels[y*f->w];
+    if(step == 1) memcpy(dst, src, f->w*sizeof(Pixel));
+    else for(int x=0;x<f->w;x++) dst[x] = src[x*step];
+  }
+
+  uint64_t hash = frame_hash(f->pixels.data(), f->pixels.size()) ^ (((uint64_t)f->w << 32) | f->h);
+  if(hash == video.last_hash) {
+    frame_stats.duplicates++;
+    delete f;
+    return false;
+  }
+  video.last_hash = hash;
+
+  if(frame_writers.empty()) {
+    delete f;
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock(frame_lock);
+  if(frame_queue.size() >= FRAME_QUEUE_LEN) {
+    frame_stats.stalls++;
+    frame_not_full.wait(lock, []{ return frame_queue.size() < FRAME_QUEUE_LEN; });
+  }
+  frame_queue.push_back(f);
+  frame_not_empty.notify_one();
+  return true;
+}
+
+void capture_video(void) {
   // store pixel
-  if(sx < MAX_H_RES && sy < MAX_V_RES) {  
-    Pixel* p = &screenbuffer[sy*MAX_H_RES + sx];
+  if(video.sx < MAX_H_RES && video.sy < MAX_V_RES) {  
+    Pixel* p = &screenbuffer[video.sy*MAX_H_RES + video.sx];
     p->a = 0xFF;  // transparency
     p->b = tb->b<<2;
     p->g = tb->g<<2;
     p->r = tb->r<<2;
   }
-  sx++;
+  video.sx++;
     
-  if(tb->hsync_n != last_hs_n) {
-    last_hs_n = tb->hsync_n;
+  if(tb->hsync_n != video.last_hs_n) {
+    video.last_hs_n = tb->hsync_n;
 
     // trigger on rising hs edge
     if(tb->hsync_n) {
       // no line in this frame detected, yet
-      if(frame_line_len >= 0) {
-	if(frame_line_len == 0)
-	  frame_line_len = sx;
+      if(video.frame_line_len >= 0) {
+	if(video.frame_line_len == 0)
+	  video.frame_line_len = video.sx;
 	else {
-	  if(frame_line_len != sx) {
-	    printf("frame line length changed from %d to %d\n", frame_line_len, sx);
-	    frame_line_len = -1;	  
+	  if(video.frame_line_len != video.sx) {
+	    printf("frame line length changed from %d to %d\n", video.frame_line_len, video.sx);
+	    video.frame_line_len = -1;	  
 	  }
 	}
       }
       
-      sx = 0;
-      sy++;
+      video.sx = 0;
+      video.sy++;
     }    
   }
 
-  if(tb->vsync_n != last_vs_n) {
-    last_vs_n = tb->vsync_n;
+  if(tb->vsync_n != video.last_vs_n) {
+    video.last_vs_n = tb->vsync_n;
 
     // trigger on rising vs edge
     if(tb->vsync_n) {
-      // draw frame if valid
-      if(frame_line_len > 0) {
+      // draw frame if valid and changed
+      if(video.frame_line_len > 0 && frame_submit(video.frame_line_len, video.sy) && !headless) {
 	
 	// check if current texture matches the frame size
 	if(sdl_texture) {
 	  int w=-1, h=-1;
 	  SDL_QueryTexture(sdl_texture, NULL, NULL, &w, &h);
-	  if(w != frame_line_len || h != sy) {
+	  if(w != video.frame_line_len || h != video.sy) {
 	    SDL_DestroyTexture(sdl_texture);
 	    sdl_texture = NULL;
 	  }
@@ -218,7 +402,7 @@ void capture_video(void) {
 	  
 	if(!sdl_texture) {
 	  sdl_texture = SDL_CreateTexture(sdl_renderer, SDL_PIXELFORMAT_RGBA8888,
-					  SDL_TEXTUREACCESS_TARGET, frame_line_len, sy);
+					  SDL_TEXTUREACCESS_TARGET, video.frame_line_len, video.sy);
 	  if (!sdl_texture) {
 	    printf("Texture creation failed: %s\n", SDL_GetError());
 	    sdl_cancelled = 1;
@@ -231,28 +415,28 @@ void capture_video(void) {
 	  SDL_RenderClear(sdl_renderer);
 	  SDL_RenderCopy(sdl_renderer, sdl_texture, NULL, NULL);
 	  SDL_RenderPresent(sdl_renderer);
-
-	  char name[32];
-	  sprintf(name, "screenshots/frame%04d.png", frame);
-	  save_texture(sdl_renderer, sdl_texture, name);
 	}
       }
 	
       // process SDL events
       SDL_Event event;
-      while( SDL_PollEvent( &event ) ){
+      while( !headless && SDL_PollEvent( &event ) ){
 	if(event.type == SDL_QUIT)
 	  sdl_cancelled = 1;
 	
 	if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)
 	    sdl_cancelled = 1;
+
+	// checkpoint is written by the main loop between two clock cycles
+	if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F2)
+	    checkpoint_request = 1;
       }
       
-      printf("%.3fms frame %d is %dx%d\n", simulation_time*1000, frame, frame_line_len, sy);
+      printf("%.3fms frame %d is %dx%d\n", simulation_time*1000, video.frame, video.frame_line_len, video.sy);
 
-      frame++;
-      frame_line_len = 0;
-      sy = 0;
+      video.frame++;
+      video.frame_line_len = 0;
+      video.sy = 0;
     }    
   }
 }
@@ -319,24 +503,32 @@ void init_mem() {
 void tick(int c) {
   static int old_addr = 0xffffff;
   static uint64_t ticks = 0;
+  static double start_time = -1;
   
   tb->clk_32 = c; 
   tb->eval();
 
-  if(simulation_time == 0)
+  // simulation may start at a checkpoint
+  if(start_time < 0) {
     ticks = GetTickCountMs();
+    start_time = simulation_time;
+  }
   
   // after one simulated millisecond calculate real time */
-  if(simulation_time >= 0.001 && ticks) {
+  if(simulation_time >= start_time + 0.001 && ticks) {
     ticks = GetTickCountMs() - ticks;
     printf("Speed factor = %lu\n", ticks);
     ticks = 0;
   }
   
-  // trace after
-#ifdef TRACESTART
-  if(simulation_time > TRACESTART) trace->dump(1000000000000 * simulation_time);
-#endif
+  trigger->tick(simulation_time);
+  bench_tick(simulation_time);
+
+  // instruction fetches (program space) tell where the CPU spends its time
+  static int last_as_n = 1;
+  if(profiler && !tb->cpu_as_n && last_as_n && (tb->cpu_fc & 3) == 2)
+    profiler->fetch(tb->cpu_a << 1);
+  last_as_n = tb->cpu_as_n;
   // each tick is 1/64 us or 15,625ns as we are simulating a 32 MHz clock
   simulation_time += TICKLEN;
 
@@ -365,10 +557,9 @@ void tick(int c) {
   }
 
   // fake a disk image insertion
-  static int insert_counter = 0;
-  if(insert_counter < 1000) {
+  if(disk.insert_counter < 1000) {
     // check if floppy image can be mounted    
-    if(insert_counter == 100) {
+    if(disk.insert_counter == 100) {
 #ifdef FLOPPY_ST
       printf("FLOPPY: Using image '%s'\n", FLOPPY_ST);
 #endif
@@ -382,7 +573,7 @@ void tick(int c) {
     }
 
     // check if acsi image can be mounted    
-    if(insert_counter == 200) {
+    if(disk.insert_counter == 200) {
 #ifdef ACSI_HD
       printf("ACSI 0: Using image '%s'\n", ACSI_HD);
 #endif
@@ -396,101 +587,249 @@ void tick(int c) {
     }
 
     if(tb->sd_img_size) {  
-      if(insert_counter == 120) tb->sd_img_mounted = 1<<0;
-      if(insert_counter == 220) tb->sd_img_mounted = 1<<2;
-      if(insert_counter == 320) tb->sd_img_mounted = 1<<3;
-      if(insert_counter == 140 || insert_counter == 240 || insert_counter == 340) tb->sd_img_mounted = 0;
-      if(insert_counter == 160 || insert_counter == 260 || insert_counter == 360) tb->sd_img_size = 0;
+      if(disk.insert_counter == 120) tb->sd_img_mounted = 1<<0;
+      if(disk.insert_counter == 220) tb->sd_img_mounted = 1<<2;
+      if(disk.insert_counter == 320) tb->sd_img_mounted = 1<<3;
+      if(disk.insert_counter == 140 || disk.insert_counter == 240 || disk.insert_counter == 340) tb->sd_img_mounted = 0;
+      if(disk.insert_counter == 160 || disk.insert_counter == 260 || disk.insert_counter == 360) tb->sd_img_size = 0;
     }
-    insert_counter++;
+    disk.insert_counter++;
   }
 
   if(c && tb->sd_done)
     tb->sd_done = 0;
 
-  static int fdc_substate = 0;
-  static int fdc_tx_count = -1;
-  static int sd_rd = -1;
-  static unsigned char sector_buffer[512];
-  if(tb->sd_rd != sd_rd) {
+  if(tb->sd_rd != disk.sd_rd) {
     printf("%.3fms SD: sd_rd = %d\n", simulation_time*1000, tb->sd_rd);
-    sd_rd = tb->sd_rd;
+    disk.sd_rd = tb->sd_rd;
+
+    if(profiler && tb->sd_rd)
+      profiler->request(simulation_time, ffs(tb->sd_rd)-1, false, tb->sd_lba);
 
     // floppy read
     if(tb->sd_rd == 1) {
       printf("%.3fms SD FDC request, sector %d\n", simulation_time*1000, tb->sd_lba);
-      if(fdc_tx_count >= 0) printf("Error, fdc transfer still in progress\n");
+      if(disk.fdc_tx_count >= 0) printf("Error, fdc transfer still in progress\n");
       
       tb->sd_busy = 1;      
 
       /* read sector into buffer */
       fseek(fdc_a_fd, tb->sd_lba*512, SEEK_SET);
-      if(fread(sector_buffer, 1, 512, fdc_a_fd) != 512) {  perror("read error"); return; }
-      fdc_substate = 0;
-      fdc_tx_count = 0;
+      if(fread(disk.sector_buffer, 1, 512, fdc_a_fd) != 512) {  perror("read error"); return; }
+      disk.fdc_substate = -sd_latency;
+      disk.fdc_tx_count = 0;
     }
     
     // acsi read
     if(tb->sd_rd == 4) {
       printf("%.3fms SD ACSI request, sector %d\n", simulation_time*1000, tb->sd_lba);
-      if(fdc_tx_count >= 0) printf("Error, fdc transfer still in progress\n");
+      if(disk.fdc_tx_count >= 0) printf("Error, fdc transfer still in progress\n");
       
       tb->sd_busy = 1;      
 
       /* read sector into buffer */
       fseek(acsi_0_fd, tb->sd_lba*512, SEEK_SET);
-      if(fread(sector_buffer, 1, 512, acsi_0_fd) != 512) {  perror("read error"); return; }
-      fdc_substate = 0;
-      fdc_tx_count = 0;
+      if(fread(disk.sector_buffer, 1, 512, acsi_0_fd) != 512) {  perror("read error"); return; }
+      disk.fdc_substate = -sd_latency;
+      disk.fdc_tx_count = 0;
     }
   }
 
+  // writes are not implemented, but they are still profiled
+  static int last_sd_wr = 0;
+  if(profiler && tb->sd_wr != last_sd_wr && tb->sd_wr)
+    profiler->request(simulation_time, ffs(tb->sd_wr)-1, true, tb->sd_lba);
+  last_sd_wr = tb->sd_wr;
+
   // do floppy data transmission
-  if(c && fdc_tx_count >= 0) {
-    if(fdc_substate == 0) {
-      tb->sd_buff_addr = fdc_tx_count;
-      tb->sd_dout = sector_buffer[fdc_tx_count];
+  if(c && disk.fdc_tx_count >= 0) {
+    if(disk.fdc_substate == 0) {
+      tb->sd_buff_addr = disk.fdc_tx_count;
+      tb->sd_dout = disk.sector_buffer[disk.fdc_tx_count];
     }
 
-    else if(fdc_substate == 4) tb->sd_dout_strobe = 1;
-    else if(fdc_substate == 8) tb->sd_dout_strobe = 0;
+    else if(disk.fdc_substate == 4) tb->sd_dout_strobe = 1;
+    else if(disk.fdc_substate == 8) tb->sd_dout_strobe = 0;
 
-    if(fdc_substate == 12) {
-      fdc_tx_count = fdc_tx_count+1;
-      fdc_substate = 0;
+    if(disk.fdc_substate == 12) {
+      disk.fdc_tx_count = disk.fdc_tx_count+1;
+      disk.fdc_substate = 0;
 
       // last byte sent
-      if(fdc_tx_count == 512) {
+      if(disk.fdc_tx_count == 512) {
 	tb->sd_busy = 0;
-	fdc_tx_count = -1;
+	disk.fdc_tx_count = -1;
 	tb->sd_done = 1;
+	if(profiler) profiler->done(simulation_time);
       }
     } else
-      fdc_substate++;
+      disk.fdc_substate++;
 
   }
     
   if(c) capture_video();
 }
 
+/* ============================= checkpoints =============================== */
+
+#define CHECKPOINT_MAGIC "MiSTeryNano atarist_tb checkpoint 1"
+
+void checkpoint_save(const char *name) {
+  VerilatedSave os;
+  os.open(name);
+  if(!os.isOpen()) {
+    printf("%.3fms Unable to write checkpoint %s\n", simulation_time*1000, name);
+    return;
+  }
+
+  std::string magic = CHECKPOINT_MAGIC;
+  uint32_t ramsize = RAMSIZE;
+  os << magic << simulation_time << ramsize;
+  os.write(ram, sizeof(ram));
+
+  // the sector transfer state and the file positions of the images
+  int64_t pos[2] = { fdc_a_fd?ftell(fdc_a_fd):-1, acsi_0_fd?ftell(acsi_0_fd):-1 };
+  os.write(pos, sizeof(pos));
+  os.write(&disk, sizeof(disk));
+
+  // beam position and the part of the frame captured so far
+  int lines = (video.sy < MAX_V_RES)?video.sy+1:MAX_V_RES;
+  os.write(&video, sizeof(video));
+  os.write(screenbuffer, lines*MAX_H_RES*sizeof(Pixel));
+
+  os << *tb;
+  os.close();
+
+  printf("%.3fms Checkpoint written to %s\n", simulation_time*1000, name);
+}
+
+void checkpoint_restore(const char *name) {
+  if(access(name, R_OK) != 0) { perror(name); exit(-1); }
+
+  VerilatedRestore os;
+  os.open(name);
+  if(!os.isOpen()) { perror(name); exit(-1); }
+
+  std::string magic;
+  uint32_t ramsize;
+  os >> magic;
+  if(magic != CHECKPOINT_MAGIC) {
+    printf("%s is not a checkpoint of this testbench\n", name);
+    exit(-1);
+  }
+  os >> simulation_time >> ramsize;
+  if(ramsize != RAMSIZE) {
+    printf("Checkpoint %s was written with %d kBytes ram, not %d\n", name, ramsize, RAMSIZE);
+    exit(-1);
+  }
+  os.read(ram, sizeof(ram));
+
+  int64_t pos[2];
+  os.read(pos, sizeof(pos));
+  if(fdc_a_fd && pos[0] >= 0) fseek(fdc_a_fd, pos[0], SEEK_SET);
+  if(acsi_0_fd && pos[1] >= 0) fseek(acsi_0_fd, pos[1], SEEK_SET);
+  os.read(&disk, sizeof(disk));
+
+  int lines;
+  os.read(&video, sizeof(video));
+  lines = (video.sy < MAX_V_RES)?video.sy+1:MAX_V_RES;
+  os.read(screenbuffer, lines*MAX_H_RES*sizeof(Pixel));
+
+  // this also verifies that the checkpoint matches the verilated model
+  os >> *tb;
+  os.close();
+
+  printf("%.3fms Restored checkpoint %s\n", simulation_time*1000, name);
+  check_ram(-1);
+}
+
 int main(int argc, char **argv) {
+  const char *restore = NULL;
+  std::vector<double> checkpoints;
+  double end_time = -1;
+  std::vector<const char*> triggers;
+  double pre = 0.01, post = 0.01;
+  bool trigger_exit = false;
+  int turbo = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "r:s:e:f:j:HT:w:xdt:l:")) != -1) {
+    switch(opt) {
+    case 'r': restore = optarg; break;
+    case 's':
+      for(char *p = strtok(optarg, ","); p; p = strtok(NULL, ","))
+	checkpoints.push_back(atof(p)/1000);
+      std::sort(checkpoints.begin(), checkpoints.end());
+      break;
+    case 'e': end_time = atof(optarg)/1000; break;
+    case 'f':
+      if(!strcmp(optarg, "none"))        frame_output = FRAMES_NONE;
+      else if(!strcmp(optarg, "png"))    frame_output = FRAMES_PNG;
+      else if(!strcmp(optarg, "raw"))    frame_output = FRAMES_RAW;
+      else if(!strcmp(optarg, "ffmpeg")) frame_output = FRAMES_FFMPEG;
+      else { fprintf(stderr, "Unknown frame format %s\n", optarg); return 1; }
+      break;
+    case 'j': frame_threads = atoi(optarg); break;
+    case 'H': headless = true; break;
+    case 'T': triggers.push_back(optarg); break;
+    case 'w':
+      if(sscanf(optarg, "%lf,%lf", &pre, &post) != 2) {
+	fprintf(stderr, "Trace window must be given as pre,post\n");
+	return 1;
+      }
+      pre /= 1000; post /= 1000;
+      break;
+    case 'x': trigger_exit = true; break;
+    case 'd':
+      profiler = new DiskProfiler("atarist_tb", 32000000);
+      profiler->set_drive(0, "FDC A");
+      profiler->set_drive(1, "FDC B");
+      profiler->set_drive(2, "ACSI 0");
+      profiler->set_drive(3, "ACSI 1");
+      break;
+    case 't':
+      turbo = atoi(optarg);
+      if(turbo < 0 || turbo > 3) {
+	fprintf(stderr, "Floppy turbo must be 0 to 3\n");
+	return 1;
+      }
+      break;
+    case 'l': sd_latency = atof(optarg) * 32; break;
+    default:
+      fprintf(stderr, "Usage: %s [-r checkpoint] [-s ms[,ms...]] [-e ms] [-f format] [-j threads] [-H] [-T trigger]... [-w pre,post] [-x] [-d] [-t turbo] [-l us]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // stop cleanly so ram and pending frames are written
+  signal(SIGINT, [](int) { sdl_cancelled = 1; });
+
   init_mem();  
   
   // Initialize Verilators variables
   Verilated::commandArgs(argc, argv);
   // Verilated::debug(1);
   Verilated::traceEverOn(true);
-  trace = new VerilatedFstC;
-  trace->spTrace()->set_time_unit("1ns");
-  trace->spTrace()->set_time_resolution("1ps");
+  trigger = new TraceTrigger("atarist_tb", pre, post);
   simulation_time = 0;
 
-  init_video();
+  if(!headless) init_video();
+  frame_writer_start();
     
   // Create an instance of our module under test
   tb = new Vatarist_tb;
-  tb->trace(trace, 99);
-  trace->open("atarist_tb.fst");
+  trigger->attach(tb);
+
+  trigger->add_signal("addr",    []{ return tb->cpu_as_n?~0ull:(uint64_t)tb->cpu_a<<1; });
+  trigger->add_signal("lba",     []{ return (tb->sd_rd || tb->sd_wr)?(uint64_t)tb->sd_lba:~0ull; });
+  trigger->add_signal("sd_rd",   []{ return (uint64_t)tb->sd_rd; });
+  trigger->add_signal("sd_wr",   []{ return (uint64_t)tb->sd_wr; });
+  trigger->add_signal("sd_busy", []{ return (uint64_t)tb->sd_busy; });
+  trigger->add_signal("sd_done", []{ return (uint64_t)tb->sd_done; });
+  trigger->add_signal("vsync_n", []{ return (uint64_t)tb->vsync_n; });
+  trigger->add_signal("leds",    []{ return (uint64_t)tb->leds; });
+  for(auto t : triggers)
+    if(!trigger->add(t)) return 1;
 
 #ifdef FLOPPY_ST
   // try to open st floppy image
@@ -512,25 +851,49 @@ int main(int argc, char **argv) {
   tb->sd_busy = 0;      
   tb->sd_done = 0;      
   
-  // apply reset and power-on for a while */
-  tb->resb = 0; tb->porb = 0;
-  for(int i=0;i<100;i++) { tick(1); tick(0); }
-  tb->porb = 1;
-  for(int i=0;i<100;i++) { tick(1); tick(0); }
-  tb->resb = 1;
+  if(restore) {
+    checkpoint_restore(restore);
+    if(profiler) profiler->start(simulation_time);
+  }
+  else {
+    // apply reset and power-on for a while */
+    tb->resb = 0; tb->porb = 0;
+    for(int i=0;i<100;i++) { tick(1); tick(0); }
+    tb->porb = 1;
+    for(int i=0;i<100;i++) { tick(1); tick(0); }
+    tb->resb = 1;
+  }
+
+  // set after the restore as the checkpoint includes all inputs
+  tb->floppy_turbo = turbo;
+
+  // skip checkpoints that are already behind us
+  size_t next_checkpoint = 0;
+  while(next_checkpoint < checkpoints.size() && checkpoints[next_checkpoint] <= simulation_time)
+    next_checkpoint++;
   
   /* run for a while */
   while(!sdl_cancelled
-#ifdef TRACEEND
-	&& simulation_time<TRACEEND
-#endif
+	&& (end_time < 0 || simulation_time < end_time)
+	&& !(trigger_exit && trigger->done())
 	) {
     tick(1);
     tick(0);
-    
+
+    if(checkpoint_request ||
+       (next_checkpoint < checkpoints.size() && simulation_time >= checkpoints[next_checkpoint])) {
+      char name[32];
+      sprintf(name, "checkpoint_%.0f.ckp", simulation_time*1000);
+      checkpoint_save(name);
+
+      checkpoint_request = 0;
+      while(next_checkpoint < checkpoints.size() && checkpoints[next_checkpoint] <= simulation_time)
+	next_checkpoint++;
+    }
   }
   
   printf("stopped after %.3fms\n", 1000*simulation_time);
+  frame_writer_stop();
 
   // write ram to disk to e.g. warmboot on next run
   printf("Writing " RAMFILE "...\n");
@@ -545,5 +908,6 @@ int main(int argc, char **argv) {
   if(fdc_a_fd) fclose(fdc_a_fd);
   if(acsi_0_fd) fclose(acsi_0_fd);
   
-  trace->close();
+  trigger->close();
+  if(profiler) profiler->report();
 }
@@ -5,6 +5,7 @@ module atarist_tb (
         input wire	   clk_32,
         input wire	   porb,
         input wire	   resb,
+        input wire [1:0]   floppy_turbo, // floppy speed up 2^floppy_turbo
 	
         // Video output
         input wire	   mono_detect, // low for monochrome
@@ -45,9 +46,18 @@ module atarist_tb (
         input wire [15:0]  rom_data_out,
 
         // export all LEDs
-        output wire [3:0]  leds
+        output wire [3:0]  leds,
+
+        // CPU bus for the trace triggers and the disk profiler
+        output wire [23:1] cpu_a,
+        output wire	   cpu_as_n,
+        output wire [2:0]  cpu_fc
 );
 
+assign cpu_a = atarist.cpu_a;
+assign cpu_as_n = atarist.cpu_as_n;
+assign cpu_fc = { atarist.cpu_fc2, atarist.cpu_fc1, atarist.cpu_fc0 };
+
 wire [31:0] fdc_lba;
 wire [7:0] fdc_din;   // currently no write support
 
@@ -127,6 +137,7 @@ atarist atarist (
 	.acsi_rd_req(sd_rd[3:2]),
 	.acsi_wr_req(sd_wr[3:2]),
 	.acsi_sd_lba(acsi_lba),
+	.acsi_sd_count(),
  	.acsi_sd_done(acsi_sd_done),
  	.acsi_sd_busy(acsi_sd_busy),
 	.acsi_sd_rd_byte_strobe(acsi_sd_rd_byte_strobe),
@@ -159,6 +170,7 @@ atarist atarist (
         .enable_extra_ram(1'b0),
         .blitter_en(1'b1),
 	.floppy_protected(1'b1), // floppy A/B write protect
+	.floppy_turbo(floppy_turbo),
 	.cubase_en(1'b0),
 
 	// DRAM interface
@@ -0,0 +1,81 @@
+//
+// bench.h - simulation speed measurement for "make bench"
+//
+// Testbenches call bench_tick() with the simulated time in seconds
+// from their tick() function. Nothing happens unless the environment
+// variable SIM_BENCH names a result file. In that case the simulation
+// stops after SIM_BENCH_MS milliseconds of simulated time (or earlier
+// when the testbench ends by itself) and a line
+//
+//   testbench,threads,trace,simulated_ms,wall_s,simulated_ms_per_s
+//
+// is appended to that file. SIM_BENCH_RUN gives the first three
+// columns. See common/bench.mk for the variants being built.
+//
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+  const char *file;
+  double start, end;   // simulated start and end time in seconds
+  double time;         // simulated time so far
+  double wall_start;
+} bench;
+
+static inline double bench_wall(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_report(void) {
+  if(!bench.file) return;
+
+  double wall = bench_wall() - bench.wall_start;
+  const char *run = getenv("SIM_BENCH_RUN");
+
+  FILE *f = fopen(bench.file, "a");
+  if(!f) { perror(bench.file); bench.file = NULL; return; }
+  if(!ftell(f))
+    fprintf(f, "testbench,threads,trace,simulated_ms,wall_s,simulated_ms_per_s\n");
+  fprintf(f, "%s,%.3f,%.3f,%.3f\n", run?run:"unknown,,", bench.time*1000,
+	  wall, wall>0?bench.time*1000/wall:0);
+  fclose(f);
+
+  printf("Bench: %.3fms simulated in %.3fs\n", bench.time*1000, wall);
+  bench.file = NULL;
+}
+
+static inline void bench_tick(double time) {
+  static bool init = false;
+
+  if(!init) {
+    init = true;
+    bench.file = getenv("SIM_BENCH");
+    if(!bench.file) return;
+
+    const char *ms = getenv("SIM_BENCH_MS");
+    bench.start = time;
+    bench.end = time + (ms?atof(ms):10) / 1000;
+    bench.wall_start = bench_wall();
+    atexit(bench_report);
+  }
+
+  if(!bench.file) return;
+  bench.time = time - bench.start;
+
+  // skip any cleanup as e.g. ram images should not be written back
+  if(time >= bench.end) {
+    bench_report();
+    fflush(stdout);
+    _exit(0);
+  }
+}
+
+#endif // BENCH_H
@@ -0,0 +1,36 @@
+#
+# bench.mk - simulation speed benchmark, included by the testbench Makefiles
+#
+# "make bench" builds the testbench once for every thread count and
+# trace setting with full optimization and runs each build for
+# BENCH_MS of simulated time. The results are appended to BENCH_FILE
+# as described in bench.h. The output of each run goes into
+# bench_t<threads>_<trace>.log.
+#
+# The including Makefile builds $(EXE) in $(OBJ_DIR) and honours the
+# THREADS, TRACE, VOPT and MKFLAGS variables. BENCH_ARGS are passed
+# to every run and BENCH_TRACE_ARGS only to runs with trace enabled.
+#
+
+BENCH_THREADS ?= 1 2 4 8
+BENCH_TRACE ?= off on
+BENCH_MS ?= 10
+BENCH_FILE ?= $(CURDIR)/bench.csv
+BENCH_NAME = $(notdir $(CURDIR))
+
+bench: $(BENCH_DEPS)
+	@for t in $(BENCH_THREADS); do for tr in $(BENCH_TRACE); do \
+	  v=bench_t$${t}_$$tr; \
+	  if [ $$tr = on ]; then flag=--trace; args="$(BENCH_TRACE_ARGS)"; else flag=; args=; fi; \
+	  $(MAKE) --no-print-directory EXE=$$v OBJ_DIR=obj_$$v THREADS=$$t TRACE=$$flag \
+	    VOPT=-O3 MKFLAGS="OPT_FAST=-O3 OPT_SLOW=-O2" $$v || exit 1; \
+	  echo "Running $(BENCH_NAME) with $$t threads, trace $$tr"; \
+	  SIM_BENCH=$(BENCH_FILE) SIM_BENCH_MS=$(BENCH_MS) SIM_BENCH_RUN="$(BENCH_NAME),$$t,$$tr" \
+	    ./$$v $(BENCH_ARGS) $$args > $$v.log 2>&1 || \
+	    echo "$(BENCH_NAME),$$t,$$tr,,,failed" >> $(BENCH_FILE); \
+	done; done
+
+bench-clean:
+	rm -rf obj_bench_t* bench_t*
+
+.PHONY: bench bench-clean
@@ -0,0 +1,180 @@
+//
+// diskprof.cpp - disk access profiler for the verilator testbenches
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "diskprof.h"
+
+DiskProfiler::DiskProfiler(const char *name, double clock) :
+  name(name), clock(clock) {
+  for(int i=0;i<DRIVES;i++) {
+    char str[16];
+    snprintf(str, sizeof(str), "drive %d", i);
+    drive_name[i] = str;
+  }
+
+  last_pc = 0;
+  fetches = 0;
+  start(0);
+}
+
+void DiskProfiler::set_drive(int drive, const char *name) {
+  if(drive >= 0 && drive < DRIVES) drive_name[drive] = name;
+}
+
+void DiskProfiler::start(double time) {
+  start_time = time;
+  active = -1;
+  for(int i=0;i<DRIVES;i++) {
+    last_end[i] = -1;
+    last_lba[i] = 0;
+  }
+  pc_samples.clear();
+}
+
+// close the request in service. A request still open when the next
+// one starts has never been completed
+void DiskProfiler::finish(double time) {
+  if(active < 0) return;
+
+  access_S &a = accesses[active];
+  a.service = (time >= 0)?time - a.time:-1;
+  last_end[a.drive] = (time >= 0)?time:a.time;
+  active = -1;
+}
+
+void DiskProfiler::request(double time, int drive, bool write, uint32_t lba) {
+  if(drive < 0 || drive >= DRIVES) return;
+  finish(-1);
+
+  access_S a;
+  a.time = time;
+  a.service = -1;
+  a.gap = time - ((last_end[drive] >= 0)?last_end[drive]:start_time);
+  a.lba = lba;
+  a.pc = last_pc;
+  a.drive = drive;
+  a.write = write;
+  a.sequential = last_end[drive] >= 0 && lba == last_lba[drive] + 1;
+
+  // the most frequently fetched address since the previous request
+  a.gap_pc = last_pc;
+  uint32_t max = 0;
+  for(auto &s : pc_samples)
+    if(s.second > max) { max = s.second; a.gap_pc = s.first; }
+  pc_samples.clear();
+
+  last_lba[drive] = lba;
+  active = accesses.size();
+  accesses.push_back(a);
+}
+
+void DiskProfiler::done(double time) {
+  finish(time);
+}
+
+void DiskProfiler::write_csv(void) {
+  std::string fname = name + "_disk.csv";
+  FILE *f = fopen(fname.c_str(), "w");
+  if(!f) { perror(fname.c_str()); return; }
+
+  fprintf(f, "time_ms,drive,op,lba,service_us,service_cycles,gap_ms,sequential,pc,gap_pc\n");
+  for(auto &a : accesses) {
+    fprintf(f, "%.6f,%s,%s,%u,", a.time*1000, drive_name[a.drive].c_str(),
+	    a.write?"write":"read", a.lba);
+    if(a.service >= 0) fprintf(f, "%.3f,%.0f,", a.service*1e6, a.service*clock);
+    else               fprintf(f, ",,");
+    fprintf(f, "%.6f,%d,0x%06x,0x%06x\n", a.gap*1000, a.sequential, a.pc, a.gap_pc);
+  }
+  fclose(f);
+}
+
+void DiskProfiler::write_summary(void) {
+  std::string fname = name + "_disk.txt";
+  FILE *f = fopen(fname.c_str(), "w");
+  if(!f) { perror(fname.c_str()); return; }
+
+  // gap histogram buckets, upper limits in seconds
+  static const double limit[] = { 10e-6, 100e-6, 1e-3, 10e-3, 100e-3, 1, -1 };
+  static const char *label[] = { "< 10us", "< 100us", "< 1ms", "< 10ms", "< 100ms", "< 1s", ">= 1s" };
+  const int buckets = sizeof(limit)/sizeof(limit[0]);
+
+  fprintf(f, "Disk access profile, %lu requests\n", accesses.size());
+
+  for(int d=0;d<DRIVES;d++) {
+    std::vector<const access_S*> acc;
+    for(auto &a : accesses)
+      if(a.drive == d) acc.push_back(&a);
+    if(acc.empty()) continue;
+
+    unsigned long writes = 0, unfinished = 0, sequential = 0, runs = 0;
+    unsigned long run = 0, longest_run = 0;
+    uint32_t longest_lba = 0, run_lba = 0;
+    double run_start = 0, longest_time = 0;
+    double service = 0, gaps = 0;
+    unsigned long hist[buckets] = { 0 };
+
+    for(auto a : acc) {
+      if(a->write) writes++;
+      if(a->service >= 0) service += a->service;
+      else                unfinished++;
+      gaps += a->gap;
+
+      // a run is a series of requests of consecutive sectors
+      if(a->sequential) { sequential++; run++; }
+      else              { run = 1; run_lba = a->lba; run_start = a->time; }
+      if(run == 2) runs++;
+      if(run > longest_run) {
+	longest_run = run;
+	longest_lba = run_lba;
+	longest_time = a->time + ((a->service >= 0)?a->service:0) - run_start;
+      }
+
+      int b = 0;
+      while(limit[b] >= 0 && a->gap >= limit[b]) b++;
+      hist[b]++;
+    }
+
+    unsigned long done = acc.size() - unfinished;
+    fprintf(f, "\n%s: %lu requests, %lu reads, %lu writes\n", drive_name[d].c_str(),
+	    acc.size(), acc.size()-writes, writes);
+    fprintf(f, "  service: %.3fms total", service*1000);
+    if(done) fprintf(f, ", %.1fus or %.0f cycles average", service*1e6/done, service*clock/done);
+    if(unfinished) fprintf(f, ", %lu never completed", unfinished);
+    fprintf(f, "\n  gaps:    %.3fms total\n", gaps*1000);
+    fprintf(f, "  sequential: %lu requests in %lu runs, longest run %lu sectors from lba %u",
+	    sequential, runs, longest_run, longest_lba);
+    // the longest run is usually a multi sector transfer, so its
+    // throughput tells how fast the disk path can stream
+    if(longest_run > 1 && longest_time > 0)
+      fprintf(f, " at %.1f kB/s", longest_run * 512 / longest_time / 1000);
+    fprintf(f, "\n");
+
+    unsigned long max = *std::max_element(hist, hist+buckets);
+    fprintf(f, "  gap histogram:\n");
+    for(int b=0;b<buckets;b++)
+      fprintf(f, "    %-8s %6lu %s\n", label[b], hist[b],
+	      std::string(max?(hist[b]*40+max-1)/max:0, '#').c_str());
+
+    std::sort(acc.begin(), acc.end(),
+	      [](const access_S *a, const access_S *b) { return a->gap > b->gap; });
+    if(acc.size() > TOP_STALLS) acc.resize(TOP_STALLS);
+
+    fprintf(f, "  longest gaps:\n");
+    fprintf(f, "        gap ms       at ms        lba   request pc   busiest pc in gap\n");
+    for(auto a : acc)
+      fprintf(f, "    %10.3f  %10.3f  %9u     0x%06x            0x%06x\n",
+	      a->gap*1000, a->time*1000, a->lba, a->pc, a->gap_pc);
+  }
+  fclose(f);
+
+  printf("Disk access profile written to %s\n", fname.c_str());
+}
+
+void DiskProfiler::report(void) {
+  write_csv();
+  write_summary();
+}
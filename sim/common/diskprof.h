@@ -0,0 +1,89 @@
+//
+// diskprof.h - disk access profiler for the verilator testbenches
+//
+// Records every sector request the core issues to the SD card side
+// with its simulated time, drive, direction, LBA, service time and
+// the gap since the previous request of the same drive. The CPU
+// program counter is sampled from the instruction fetches so that
+// long gaps can be attributed to the code the CPU ran meanwhile.
+//
+// At the end <name>_disk.csv contains one line per request and
+// <name>_disk.txt a summary per drive with sequential runs and the
+// throughput of the longest one, a gap histogram and the longest stalls.
+//
+// Usage:
+//   DiskProfiler prof("atarist_tb", 32000000);
+//   prof.set_drive(0, "FDC A");
+//   ...
+//   prof.fetch(pc);                           // on instruction fetches
+//   prof.request(time, drive, write, lba);    // request starts
+//   prof.done(time);                          // request serviced
+//   ...
+//   prof.report();
+//
+
+#ifndef DISKPROF_H
+#define DISKPROF_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+class DiskProfiler {
+public:
+  enum { DRIVES = 4, TOP_STALLS = 10 };
+
+  // clock is the system clock used to express service times in cycles
+  DiskProfiler(const char *name, double clock);
+
+  void set_drive(int drive, const char *name);
+
+  // profiling starts at the given time, e.g. after a checkpoint restore
+  void start(double time);
+
+  // called with the address of every instruction fetch
+  void fetch(uint32_t pc) {
+    last_pc = pc;
+    if(!(++fetches & 63)) pc_samples[pc]++;
+  }
+
+  void request(double time, int drive, bool write, uint32_t lba);
+  void done(double time);
+
+  // write csv and text report
+  void report(void);
+
+private:
+  struct access_S {
+    double time;        // start of the request
+    double service;     // time until done, < 0 if never completed
+    double gap;         // since the end of the previous request of this drive
+    uint32_t lba;
+    uint32_t pc;        // last instruction fetch when the request was issued
+    uint32_t gap_pc;    // most frequent instruction fetch during the gap
+    uint8_t drive;
+    bool write;
+    bool sequential;    // lba follows the previous request of this drive
+  };
+
+  std::string name;
+  double clock;
+  std::string drive_name[DRIVES];
+
+  std::vector<access_S> accesses;
+  int active;                 // index of the request in service or -1
+  double start_time;
+  double last_end[DRIVES];    // end of the last request per drive, < 0 if none
+  uint32_t last_lba[DRIVES];
+
+  uint32_t last_pc;
+  uint32_t fetches;
+  std::unordered_map<uint32_t, uint32_t> pc_samples;
+
+  void finish(double time);
+  void write_csv(void);
+  void write_summary(void);
+};
+
+#endif // DISKPROF_H
@@ -0,0 +1,433 @@
+//
+// sdcard.cpp - behavioural SD card model for the verilator testbenches
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sdcard.h"
+
+#define OCR  0xc0ff8000  // not busy, CCS=1(SDHC card), all voltage, not dual-voltage card
+#define RCA  0x0013
+
+// card status returned with R1: ready for data, transfer state
+#define CARD_STATUS  0x00000900
+
+// total cid respose is 136 bits / 17 bytes
+static const uint8_t cid[16] = "\x3f" "\x02TMS" "A08G" "\x14\x39\x4a\x67" "\xc7\x00";
+
+uint16_t SdCard::crc16_table[256];
+
+SdCard::SdCard(const char *name, bool rw) : writable(rw) {
+  // CRC16 CCITT, polynomial x^16 + x^12 + x^5 + 1
+  if(!crc16_table[1]) {
+    for(int i=0;i<256;i++) {
+      uint16_t crc = i << 8;
+      for(int b=0;b<8;b++)
+	crc = (crc & 0x8000)?((crc << 1) ^ 0x1021):(crc << 1);
+      crc16_table[i] = crc;
+    }
+  }
+
+  fd = open(name, writable?O_RDWR:O_RDONLY);
+  if(fd < 0) { perror(name); exit(-1); }
+
+  struct stat st;
+  fstat(fd, &st);
+  image_size = st.st_size;
+
+  image = (uint8_t*)mmap(NULL, image_size, PROT_READ | (writable?PROT_WRITE:0),
+			 MAP_SHARED, fd, 0);
+  if(image == MAP_FAILED) { perror("mmap()"); exit(-1); }
+
+  // defaults match the previous testbench models
+  for(int i=0;i<64;i++) timing.response[i] = 0;
+  timing.read_access = 0;
+  timing.read_gap = 8;
+  timing.write_ack = 68;
+  timing.write_busy = 114;
+
+  memset(&stats, 0, sizeof(stats));
+  verbose = 0;
+
+  bus4 = false;
+  hs_mode = false;
+  last_was_acmd = false;
+  cmd_in = ~0ull;
+  cmd_pos = dat_pos = 0;
+  rx_state = RX_IDLE;
+  xfer = XFER_NONE;
+}
+
+SdCard::~SdCard() {
+  munmap(image, image_size);
+  close(fd);
+}
+
+void SdCard::set_response_latency(int cmd, int clocks) {
+  for(int i=0;i<64;i++)
+    if(cmd < 0 || cmd == i)
+      timing.response[i] = clocks;
+}
+
+// CRC7 with polynomial x^7 + x^3 + 1. Returns the crc in the upper
+// seven bits with the end bit set
+uint8_t SdCard::crc7(const uint8_t *data, int len) {
+  uint8_t crc = 0;
+  while(len--) {
+    crc ^= *data++;
+    for(int i=0;i<8;i++) {
+      if(crc & 0x80) crc ^= 0x89;
+      crc <<= 1;
+    }
+  }
+  return crc | 1;
+}
+
+uint16_t SdCard::crc16(uint16_t crc, uint8_t byte) {
+  return (crc << 8) ^ crc16_table[(crc >> 8) ^ byte];
+}
+
+// In 4 bit mode each data line has its own crc. Each byte contributes
+// two bits to each line, so four bytes make up one byte per line
+void SdCard::data_crc(const uint8_t *data, int len, uint16_t *crc) const {
+  static uint8_t spread[256];   // bit c+4 and c of a byte at 2c+1 and 2c
+  if(!spread[0xff]) {
+    for(int b=0;b<256;b++)
+      for(int c=0;c<4;c++)
+	spread[b] |= (((b >> (c+4)) & 1) << (2*c+1)) | (((b >> c) & 1) << (2*c));
+  }
+
+  if(!bus4) {
+    crc[0] = 0;
+    for(int i=0;i<len;i++) crc[0] = crc16(crc[0], data[i]);
+    return;
+  }
+
+  for(int c=0;c<4;c++) crc[c] = 0;
+  for(int i=0;i<len;i+=4) {
+    uint8_t s0 = spread[data[i]], s1 = spread[data[i+1]];
+    uint8_t s2 = spread[data[i+2]], s3 = spread[data[i+3]];
+    for(int c=0;c<4;c++) {
+      uint8_t v = (((s0 >> 2*c) & 3) << 6) | (((s1 >> 2*c) & 3) << 4) |
+	(((s2 >> 2*c) & 3) << 2) | ((s3 >> 2*c) & 3);
+      crc[c] = crc16(crc[c], v);
+    }
+  }
+}
+
+void SdCard::respond_bytes(const uint8_t *data, int len) {
+  cmd_tx.clear();
+  cmd_pos = 0;
+  for(int i=0;i<len;i++)
+    for(int b=7;b>=0;b--)
+      cmd_tx.push_back((data[i] >> b) & 1);
+}
+
+// R1 type response, R3 is sent with index 63
+void SdCard::respond(uint8_t cmd, uint32_t arg) {
+  uint8_t r[6] = { cmd, (uint8_t)(arg >> 24), (uint8_t)(arg >> 16),
+		   (uint8_t)(arg >> 8), (uint8_t)arg, 0 };
+  r[5] = crc7(r, 5);
+  respond_bytes(r, 6);
+}
+
+// prepare a data block incl. start bit, crc and end bit
+void SdCard::send_block(const uint8_t *data, int len, int delay) {
+  uint16_t crc[4];
+  data_crc(data, len, crc);
+
+  dat_tx.clear();
+  dat_pos = 0;
+  dat_tx.reserve(delay + 2*len + 18);
+  dat_tx.insert(dat_tx.end(), delay, 15);
+
+  if(bus4) {
+    dat_tx.push_back(0);
+    for(int i=0;i<len;i++) {
+      dat_tx.push_back(data[i] >> 4);
+      dat_tx.push_back(data[i] & 15);
+    }
+    for(int i=0;i<16;i++)
+      dat_tx.push_back(((crc[0] >> (15-i)) & 1) | (((crc[1] >> (15-i)) & 1) << 1) |
+		       (((crc[2] >> (15-i)) & 1) << 2) | (((crc[3] >> (15-i)) & 1) << 3));
+  } else {
+    // only DAT0 is used
+    dat_tx.push_back(14);
+    for(int i=0;i<len;i++)
+      for(int b=7;b>=0;b--)
+	dat_tx.push_back(14 | ((data[i] >> b) & 1));
+    for(int i=0;i<16;i++)
+      dat_tx.push_back(14 | ((crc[0] >> (15-i)) & 1));
+  }
+  dat_tx.push_back(15);
+}
+
+bool SdCard::send_sector(uint32_t sector, int delay) {
+  static const uint8_t empty[512] = { 0 };
+
+  if((uint64_t)sector * 512 + 512 > image_size) {
+    stats.range_errors++;
+    if(verbose) printf("SD: read beyond end of image, sector %u\n", sector);
+    send_block(empty, 512, delay);
+    return false;
+  }
+
+  send_block(image + (uint64_t)sector * 512, 512, delay);
+  stats.sectors_read++;
+  return true;
+}
+
+// a complete block has been received
+void SdCard::receive_done(void) {
+  uint16_t crc[4], s_crc[4] = { 0, 0, 0, 0 };
+  data_crc(rx_buf.data(), rx_len, crc);
+
+  // the crcs follow the data
+  int lines = bus4?4:1;
+  for(int i=0;i<16;i++) {
+    uint8_t v = rx_buf[rx_len + i];
+    for(int c=0;c<lines;c++)
+      s_crc[c] = (s_crc[c] << 1) | ((v >> c) & 1);
+  }
+
+  bool ok = !memcmp(crc, s_crc, lines * sizeof(uint16_t));
+  if(!ok) {
+    stats.crc_errors++;
+    printf("SD: write crc mismatch in sector %u\n", xfer_sector);
+  } else if((uint64_t)xfer_sector * 512 + 512 > image_size) {
+    stats.range_errors++;
+    if(verbose) printf("SD: write beyond end of image, sector %u\n", xfer_sector);
+  } else {
+    if(writable) memcpy(image + (uint64_t)xfer_sector * 512, rx_buf.data(), 512);
+    stats.sectors_written++;
+  }
+  xfer_sector++;
+
+  // crc status token on DAT0 (start bit, 010 ok or 101 error, end bit)
+  // followed by the busy time
+  uint8_t token = ok?0x05:0x0b;
+  dat_tx.clear();
+  dat_pos = 0;
+  dat_tx.insert(dat_tx.end(), timing.write_ack, 15);
+  for(int b=4;b>=0;b--)
+    dat_tx.push_back(14 | ((token >> b) & 1));
+  dat_tx.insert(dat_tx.end(), timing.write_busy, 14);
+  dat_tx.push_back(15);
+  stats.busy_clocks += timing.write_busy;
+
+  rx_state = RX_BUSY;
+}
+
+void SdCard::command(uint8_t cmd, uint32_t arg) {
+  stats.commands++;
+  stats.command[cmd]++;
+
+  if(verbose)
+    printf("SD: %cCMD %2d, ARG %08x\n", last_was_acmd?'A':' ', cmd, arg);
+
+  cmd_tx.clear();
+  cmd_pos = 0;
+
+  switch(cmd) {
+  case 0:  // Go Idle State
+    bus4 = false;
+    hs_mode = false;
+    xfer = XFER_NONE;
+    rx_state = RX_IDLE;
+    break;
+
+  case 2: { // Send CID
+    uint8_t r[17];
+    memcpy(r, cid, 16);
+    r[16] = crc7(r, 16);
+    respond_bytes(r, 17);
+  } break;
+
+  case 3:  // Send Relative Address
+    respond(3, RCA << 16);
+    break;
+
+  case 6:
+    if(last_was_acmd) {
+      // set bus width
+      bus4 = (arg & 3) == 2;
+      if(verbose) printf("SD: bus width %d\n", bus4?4:1);
+      respond(6, CARD_STATUS);
+    } else {
+      // switch function. Only group 1 (access mode) function 1
+      // (high speed) is supported
+      int fn = arg & 15;
+      bool ok = fn == 0 || fn == 1 || fn == 15;
+      if((arg & 0x80000000) && fn == 1) hs_mode = true;
+
+      uint8_t status[64];
+      memset(status, 0, sizeof(status));
+      status[1] = 100;                   // max current 100mA
+      for(int g=0;g<6;g++)               // function 0 supported in all groups
+	status[3+2*g] = 0x01;
+      status[13] = 0x03;                 // group 1 supports function 1
+      status[16] = ok?(fn == 15?(hs_mode?1:0):fn):15;
+      status[17] = 1;                    // data structure version
+
+      respond(6, CARD_STATUS);
+      send_block(status, 64, timing.read_access);
+    }
+    break;
+
+  case 7:  // select card
+    respond(7, CARD_STATUS);
+    break;
+
+  case 8:  // Send Interface Condition Command
+    respond(8, arg);
+    break;
+
+  case 12: // stop transmission
+    dat_tx.clear();
+    dat_pos = 0;
+    xfer = XFER_NONE;
+    if(rx_state == RX_WAIT) rx_state = RX_IDLE;
+    respond(12, CARD_STATUS);
+    break;
+
+  case 13: // send status
+    respond(13, CARD_STATUS);
+    break;
+
+  case 16: // set block len (should be 512)
+    if(arg != 512) printf("SD: unsupported block len %u\n", arg);
+    respond(16, CARD_STATUS);
+    break;
+
+  case 17: // read single block
+  case 18: // read multiple blocks
+    respond(cmd, CARD_STATUS);
+    xfer = (cmd == 17)?XFER_READ:XFER_READ_MULTI;
+    xfer_sector = arg;
+    send_sector(xfer_sector++, timing.read_access);
+    break;
+
+  case 24: // write single block
+  case 25: // write multiple blocks
+    respond(cmd, CARD_STATUS);
+    xfer = (cmd == 24)?XFER_WRITE:XFER_WRITE_MULTI;
+    xfer_sector = arg;
+    rx_state = RX_WAIT;
+    break;
+
+  case 41: // Send Host Capacity Support
+    respond(63, OCR);
+    break;
+
+  case 55: // Application Specific Command
+    respond(55, CARD_STATUS | 0x20);
+    break;
+
+  default:
+    // illegal commands aren't answered
+    cmd_tx.clear();
+    printf("SD: unexpected %sCMD %d\n", last_was_acmd?"A":"", cmd);
+  }
+
+  // delay the response by the configured number of clocks
+  if(!cmd_tx.empty())
+    cmd_tx.insert(cmd_tx.begin(), timing.response[cmd], 1);
+
+  last_was_acmd = cmd == 55;
+}
+
+void SdCard::clock(uint8_t sdcmd, uint8_t sddat, uint8_t &sdcmd_in, uint8_t &sddat_in) {
+  stats.clocks++;
+
+  // ---- receive data written by the host ----
+  if(rx_state == RX_WAIT) {
+    if(!(sddat & 1)) {
+      rx_state = RX_DATA;
+      rx_len = 512;
+      rx_cnt = 0;
+      rx_buf.assign(rx_len + 16, 0);
+    }
+  } else if(rx_state == RX_DATA) {
+    if(bus4) {
+      // two nibbles per byte followed by 16 crc nibbles
+      if(rx_cnt < 2*rx_len) {
+	if(rx_cnt & 1) rx_buf[rx_cnt/2] |= sddat & 15;
+	else           rx_buf[rx_cnt/2] = (sddat & 15) << 4;
+      } else
+	rx_buf[rx_len + rx_cnt - 2*rx_len] = sddat & 15;
+
+      if(++rx_cnt == 2*rx_len + 16)
+	receive_done();
+    } else {
+      if(rx_cnt < 8*rx_len)
+	rx_buf[rx_cnt/8] |= (sddat & 1) << (7 - (rx_cnt & 7));
+      else
+	rx_buf[rx_len + rx_cnt - 8*rx_len] = sddat & 1;
+
+      if(++rx_cnt == 8*rx_len + 16)
+	receive_done();
+    }
+  }
+
+  cmd_in = ((cmd_in << 1) | (sdcmd & 1)) & 0xffffffffffffull;
+
+  // ---- data lines ----
+  if(dat_pos == dat_tx.size()) {
+    // continue a multi block read
+    if(xfer == XFER_READ_MULTI)
+      send_sector(xfer_sector++, timing.read_gap);
+    else if(xfer == XFER_READ)
+      xfer = XFER_NONE;
+
+    // write has finished
+    if(rx_state == RX_BUSY) {
+      if(xfer == XFER_WRITE_MULTI)
+	rx_state = RX_WAIT;
+      else {
+	rx_state = RX_IDLE;
+	xfer = XFER_NONE;
+      }
+    }
+  }
+
+  sddat_in = (dat_pos < dat_tx.size())?dat_tx[dat_pos++]:15;
+
+  // ---- command line ----
+  sdcmd_in = (cmd_pos < cmd_tx.size())?cmd_tx[cmd_pos++]:1;
+
+  // check if bit 47 is 0, 46 is 1 and 0 is 1
+  if( !(cmd_in & (1ull<<47)) && (cmd_in & (1ull<<46)) && (cmd_in & 1)) {
+    uint8_t c[5] = { (uint8_t)(cmd_in >> 40), (uint8_t)(cmd_in >> 32),
+		     (uint8_t)(cmd_in >> 24), (uint8_t)(cmd_in >> 16),
+		     (uint8_t)(cmd_in >> 8) };
+    uint8_t cmd = c[0] & 0x3f;
+    uint32_t arg = (cmd_in >> 8) & 0xffffffff;
+
+    if((cmd_in & 0xff) == crc7(c, 5))
+      command(cmd, arg);
+    else {
+      stats.crc_errors++;
+      printf("SD: CMD %02x, ARG %08x, CRC7 %02x != %02x!!\n", cmd, arg,
+	     (unsigned)(cmd_in & 0xff), crc7(c, 5));
+    }
+
+    cmd_in = ~0ull;
+  }
+}
+
+void SdCard::print_stats(void) const {
+  printf("SD card: %lu commands, %lu sectors read, %lu sectors written\n",
+	 stats.commands, stats.sectors_read, stats.sectors_written);
+  printf("SD card: %llu clocks, %llu busy, %lu crc errors, %lu range errors%s\n",
+	 stats.clocks, stats.busy_clocks, stats.crc_errors, stats.range_errors,
+	 hs_mode?", high speed":"");
+  for(int i=0;i<64;i++)
+    if(stats.command[i])
+      printf("  CMD%-2d: %lu\n", i, stats.command[i]);
+}
@@ -0,0 +1,108 @@
+//
+// sdcard.h - behavioural SD card model for the verilator testbenches
+//
+// The model is clocked on every rising edge of the SD clock and
+// implements the native SD bus protocol as used by sd_rw.v: card
+// initialization, 1 and 4 bit data transfers, single and multi block
+// reads and writes (CMD17/18/24/25 and CMD12) and the CMD6 high speed
+// switch. The card contents are a memory mapped image file, so writes
+// end up in the image unless it has been opened read-only. Written
+// data is then only checked and dropped.
+//
+// Usage:
+//   SdCard sd("sd.img");
+//   ...
+//   if(rising edge of tb->sdclk)
+//     sd.clock(tb->sdcmd, tb->sddat, tb->sdcmd_in, tb->sddat_in);
+//   ...
+//   sd.print_stats();
+//
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class SdCard {
+public:
+  // all times are in SD clocks
+  struct timing_S {
+    int response[64];   // from end of command to start of response (Ncr)
+    int read_access;    // from read command to the first data block (Nac)
+    int read_gap;       // between two blocks of a multi block read
+    int write_ack;      // from end of written data to the crc status token
+    int write_busy;     // card busy after a block has been written
+  } timing;
+
+  struct stats_S {
+    unsigned long commands;
+    unsigned long command[64];   // per command index, ACMDs included
+    unsigned long crc_errors;    // commands and data blocks
+    unsigned long sectors_read;
+    unsigned long sectors_written;
+    unsigned long range_errors;  // accesses beyond the image
+    unsigned long long clocks;
+    unsigned long long busy_clocks;
+  } stats;
+
+  int verbose;
+
+  SdCard(const char *image, bool writable = true);
+  ~SdCard();
+
+  // set the response time of one or all (cmd < 0) commands
+  void set_response_latency(int cmd, int clocks);
+
+  // process one rising edge of the sd clock. sdcmd/sddat are the
+  // lines driven by the host, sdcmd_in/sddat_in those driven by the card
+  void clock(uint8_t sdcmd, uint8_t sddat, uint8_t &sdcmd_in, uint8_t &sddat_in);
+
+  uint64_t size(void) const { return image_size; }
+  bool high_speed(void) const { return hs_mode; }
+  void print_stats(void) const;
+
+private:
+  uint8_t *image;
+  uint64_t image_size;
+  int fd;
+  bool writable;
+
+  bool bus4;           // ACMD6 selected the 4 bit bus
+  bool hs_mode;        // CMD6 switched to high speed
+  bool last_was_acmd;
+  uint64_t cmd_in;     // command shift register
+
+  // bits still to be sent on the cmd line
+  std::vector<uint8_t> cmd_tx;
+  size_t cmd_pos;
+
+  // values still to be sent on the data lines
+  std::vector<uint8_t> dat_tx;
+  size_t dat_pos;
+
+  // data reception (writes)
+  enum { RX_IDLE, RX_WAIT, RX_DATA, RX_BUSY } rx_state;
+  std::vector<uint8_t> rx_buf;
+  int rx_cnt;          // nibbles or bits received
+  int rx_len;          // length of block in bytes
+
+  // current transfer
+  enum { XFER_NONE, XFER_READ, XFER_READ_MULTI, XFER_WRITE, XFER_WRITE_MULTI } xfer;
+  uint32_t xfer_sector;
+
+  static uint16_t crc16_table[256];
+  static uint8_t crc7(const uint8_t *data, int len);
+  static uint16_t crc16(uint16_t crc, uint8_t byte);
+  void data_crc(const uint8_t *data, int len, uint16_t *crc) const;
+
+  void command(uint8_t cmd, uint32_t arg);
+  void respond(uint8_t cmd, uint32_t arg);
+  void respond_bytes(const uint8_t *data, int len);
+  void send_block(const uint8_t *data, int len, int delay);
+  bool send_sector(uint32_t sector, int delay);
+  void receive_done(void);
+};
+
+#endif // SDCARD_H
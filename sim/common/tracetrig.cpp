@@ -0,0 +1,206 @@
+//
+// tracetrig.cpp - runtime triggered waveform capture for the verilator testbenches
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracetrig.h"
+
+#if VM_TRACE
+
+bool TraceTrigger::SegmentFile::open(const std::string &name) {
+  segments.push_back({ now, std::string() });
+  return true;
+}
+
+ssize_t TraceTrigger::SegmentFile::write(const char *bufp, ssize_t len) {
+  segments.back().data.append(bufp, len);
+  return len;
+}
+
+TraceTrigger::TraceTrigger(const char *name, double pre, double post) :
+  name(name), pre(pre), post(post) {
+
+  // keep about four segments of history
+  segment_len = pre / 4;
+
+  trace = new VerilatedVcdC(&file);
+  trace->spTrace()->set_time_unit("1ns");
+  trace->spTrace()->set_time_resolution("1ps");
+
+  opened = dumping = capturing = false;
+  window_end = 0;
+  windows = 0;
+}
+
+TraceTrigger::~TraceTrigger() {
+  delete trace;
+}
+
+void TraceTrigger::add_signal(const char *name, std::function<uint64_t(void)> get) {
+  signals.push_back({ name, get });
+}
+
+bool TraceTrigger::add(const char *expr) {
+  trigger_S t = { expr, TRIG_VALUE, -1, 0, 0, false };
+  std::string sig;
+
+  const char *eq = strchr(expr, '=');
+  if(!strncmp(expr, "rise:", 5))      { t.type = TRIG_RISE; sig = expr+5; }
+  else if(!strncmp(expr, "fall:", 5)) { t.type = TRIG_FALL; sig = expr+5; }
+  else if(eq) {
+    char *end;
+    sig = std::string(expr, eq-expr);
+    if(sig == "time") {
+      t.type = TRIG_TIME;
+      t.value = strtod(eq+1, &end) * 1e9;  // ms to ps
+    } else
+      t.value = strtoull(eq+1, &end, 0);
+    if(end == eq+1 || *end) {
+      fprintf(stderr, "Trigger %s: invalid value\n", expr);
+      return false;
+    }
+  } else {
+    fprintf(stderr, "Trigger %s: expected time=, <signal>=, rise: or fall:\n", expr);
+    return false;
+  }
+
+  if(t.type != TRIG_TIME) {
+    for(size_t i=0;i<signals.size();i++)
+      if(signals[i].name == sig)
+	t.signal = i;
+
+    if(t.signal < 0) {
+      fprintf(stderr, "Trigger %s: unknown signal %s. Known signals are:", expr, sig.c_str());
+      for(auto &s : signals) fprintf(stderr, " %s", s.name.c_str());
+      fprintf(stderr, "\n");
+      return false;
+    }
+    t.last = signals[t.signal].get();
+  }
+
+  triggers.push_back(t);
+  return true;
+}
+
+// the in memory history is only needed while a signal trigger is
+// armed or a time trigger is about to fire
+bool TraceTrigger::history_needed(double time) const {
+  for(auto &t : triggers) {
+    if(t.fired) continue;
+    if(t.type != TRIG_TIME || t.value <= (time + pre) * 1e12)
+      return true;
+  }
+  return false;
+}
+
+// every segment starts with the VCD header and a full dump, so any
+// of them can be the first one of a window
+void TraceTrigger::start_segment(double time) {
+  file.now = time;
+  if(!opened) {
+    trace->open((name + ".vcd").c_str());
+    opened = true;
+  } else
+    trace->openNext(false);
+}
+
+void TraceTrigger::write_window(void) {
+  trace->flush();
+
+  char fname[64];
+  snprintf(fname, sizeof(fname), "%s_%d.vcd", name.c_str(), windows++);
+  FILE *f = fopen(fname, "wb");
+  if(!f) { perror(fname); return; }
+
+  bool first = true;
+  for(auto &s : file.segments) {
+    const char *data = s.data.data();
+    size_t len = s.data.size();
+
+    // only the first segment keeps its header
+    if(!first) {
+      const char *hdr = strstr(data, "$enddefinitions $end");
+      const char *body = hdr?strchr(hdr, '\n'):NULL;
+      if(body) {
+	len -= body+1-data;
+	data = body+1;
+      }
+    }
+    fwrite(data, 1, len, f);
+    first = false;
+  }
+  fclose(f);
+
+  printf("Trace window written to %s\n", fname);
+}
+
+void TraceTrigger::tick(double time) {
+  if(triggers.empty()) return;
+
+  uint64_t ps = 1e12 * time;
+  for(auto &t : triggers) {
+    if(t.fired) continue;
+
+    bool fire = false;
+    if(t.type == TRIG_TIME)
+      fire = ps >= t.value;
+    else {
+      uint64_t v = signals[t.signal].get();
+      if(v != t.last) {
+	if(t.type == TRIG_VALUE) fire = v == t.value;
+	if(t.type == TRIG_RISE)  fire = !t.last;
+	if(t.type == TRIG_FALL)  fire = !v;
+	t.last = v;
+      }
+    }
+
+    if(fire) {
+      printf("%.3fms Trigger %s\n", time*1000, t.expr.c_str());
+      t.fired = true;
+      if(time + post > window_end) window_end = time + post;
+      capturing = true;
+    }
+  }
+
+  if(!capturing && (pre <= 0 || !history_needed(time))) {
+    dumping = false;
+    return;
+  }
+
+  // start over after a gap or rotate the history
+  if(!dumping) {
+    start_segment(time);
+    file.segments.erase(file.segments.begin(), file.segments.end()-1);
+    dumping = true;
+  } else if(!capturing && time - file.segments.back().start >= segment_len) {
+    start_segment(time);
+    while(file.segments.size() > 1 && file.segments[1].start <= time - pre)
+      file.segments.pop_front();
+  }
+
+  trace->dump(ps);
+
+  if(capturing && time >= window_end) {
+    write_window();
+    capturing = false;
+    dumping = false;
+  }
+}
+
+bool TraceTrigger::done(void) const {
+  if(capturing) return false;
+  for(auto &t : triggers)
+    if(!t.fired) return false;
+  return true;
+}
+
+void TraceTrigger::close(void) {
+  if(capturing) write_window();
+  if(opened) trace->close();
+  capturing = dumping = false;
+}
+
+#endif // VM_TRACE
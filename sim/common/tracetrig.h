@@ -0,0 +1,141 @@
+//
+// tracetrig.h - runtime triggered waveform capture for the verilator testbenches
+//
+// Instead of dumping a fixed time window set at compile time, the
+// waveform is written around trigger events given at runtime:
+//
+//   time=<ms>          simulated time reached
+//   <signal>=<value>   signal changes to value (decimal or 0x hex)
+//   rise:<signal>      signal changes from zero to non-zero
+//   fall:<signal>      signal changes from non-zero to zero
+//
+// Signals are registered by the testbench under a short name. While
+// waiting for a trigger the trace is kept in memory as a ring of
+// self-contained VCD segments covering the pre-trigger time. When a
+// trigger fires, tracing continues for the post-trigger time and the
+// whole window is written to <name>_<n>.vcd. Each trigger fires once.
+//
+// Usage:
+//   TraceTrigger trig("atarist_tb", 0.010, 0.010);
+//   trig.add_signal("sd_rd", []{ return tb->sd_rd; });
+//   trig.add("sd_rd=4");
+//   trig.attach(tb);
+//   ...
+//   trig.tick(simulation_time);   // after every eval()
+//   ...
+//   trig.close();
+//
+// Models built without --trace get a stub which ignores all triggers.
+//
+
+#ifndef TRACETRIG_H
+#define TRACETRIG_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+
+#if VM_TRACE
+#include "verilated_vcd_c.h"
+
+class TraceTrigger {
+public:
+  // pre and post trigger times in seconds
+  TraceTrigger(const char *name, double pre, double post);
+  ~TraceTrigger();
+
+  void add_signal(const char *name, std::function<uint64_t(void)> get);
+
+  // parse and arm a trigger expression. Returns false on errors
+  bool add(const char *expr);
+  bool armed(void) const { return !triggers.empty(); }
+
+  // all triggers have fired and their windows have been written
+  bool done(void) const;
+
+  VerilatedVcdC *vcd(void) { return trace; }
+  template <class T> void attach(T *model) { model->trace(trace, 99); }
+
+  // to be called with the current simulation time in seconds
+  // after each evaluation of the model
+  void tick(double time);
+
+  // write a window still being captured
+  void close(void);
+
+private:
+  enum { TRIG_TIME, TRIG_VALUE, TRIG_RISE, TRIG_FALL };
+
+  struct signal_S {
+    std::string name;
+    std::function<uint64_t(void)> get;
+  };
+
+  struct trigger_S {
+    std::string expr;
+    int type;
+    int signal;        // index into signals
+    uint64_t value;    // or time in ps
+    uint64_t last;
+    bool fired;
+  };
+
+  // VCD output going into a list of memory segments
+  class SegmentFile : public VerilatedVcdFile {
+  public:
+    struct segment_S {
+      double start;
+      std::string data;
+    };
+    std::deque<segment_S> segments;
+    double now;
+
+    bool open(const std::string &name) override;
+    void close(void) override {}
+    ssize_t write(const char *bufp, ssize_t len) override;
+  };
+
+  std::string name;
+  double pre, post;
+  double segment_len;
+
+  std::vector<signal_S> signals;
+  std::vector<trigger_S> triggers;
+
+  SegmentFile file;
+  VerilatedVcdC *trace;
+  bool opened;         // trace file has been opened once
+  bool dumping;        // trace is currently being dumped
+  bool capturing;      // a trigger has fired
+  double window_end;
+  int windows;         // number of windows written
+
+  bool history_needed(double time) const;
+  void start_segment(double time);
+  void write_window(void);
+};
+
+#else // VM_TRACE
+
+#include <stdio.h>
+
+class TraceTrigger {
+public:
+  TraceTrigger(const char *, double, double) { }
+
+  void add_signal(const char *, std::function<uint64_t(void)>) { }
+  bool add(const char *expr) {
+    fprintf(stderr, "Trigger %s ignored, built without --trace\n", expr);
+    return true;
+  }
+  bool armed(void) const { return false; }
+  bool done(void) const { return true; }
+  template <class T> void attach(T *) { }
+  void tick(double) { }
+  void close(void) { }
+};
+
+#endif // VM_TRACE
+#endif // TRACETRIG_H
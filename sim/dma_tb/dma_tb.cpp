@@ -0,0 +1,218 @@
+//
+// dma_tb.cpp - ACSI read ahead of the Atari ST DMA controller
+//
+// The CPU side sends ACSI read(6) commands through the dma registers,
+// the SD card and the ram side are emulated cycle by cycle. The SD
+// card delivers sectors much faster than the ram accepts them, so the
+// next sector is always fetched while the current one is drained.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Vdma.h"
+#include "verilated.h"
+#if VM_TRACE
+#include "verilated_vcd_c.h"
+#endif
+
+static Vdma *tb;
+#if VM_TRACE
+static VerilatedVcdC *trace;
+#endif
+static double simulation_time;
+static unsigned long cycle;
+
+#define TICKLEN   (1.0/64000000)
+
+#define RAM_WORDS  (16*256)   // room for more sectors than requested
+
+// emulated SD card
+static int sd_state, sd_delay, sd_addr;
+static unsigned long sd_lba;
+static int sd_sectors;        // sectors requested by the dma
+
+// emulated ram
+static unsigned short ram[RAM_WORDS];
+static int ram_words, ram_wait;
+
+static unsigned char sd_data(unsigned long lba, int addr) {
+  return (addr + 7*lba) ^ (addr >> 8);
+}
+
+void tick(int c) {
+  tb->clk = c;
+  tb->eval();
+
+#if VM_TRACE
+  trace->dump(1000000000000 * simulation_time);
+#endif
+  simulation_time += TICKLEN;
+}
+
+// drive the inputs for the next rising clock edge
+static void peripherals(void) {
+  // 8 MHz bus cycles
+  tb->clk_en = (cycle & 3) == 0;
+
+  // SD card: accept the request, deliver one byte per clock, done
+  tb->sd_done = 0;
+  tb->sd_rd_byte_strobe = 0;
+  switch(sd_state) {
+  case 0:
+    if(tb->acsi_rd_req) {
+      sd_lba = tb->acsi_lba;
+      sd_sectors++;
+      sd_delay = 20;
+      sd_state = 1;
+    }
+    break;
+
+  case 1:
+    if(!--sd_delay) {
+      tb->sd_busy = 1;
+      sd_addr = 0;
+      sd_state = 2;
+    }
+    break;
+
+  case 2:
+    tb->sd_rd_byte_strobe = 1;
+    tb->sd_byte_addr = sd_addr;
+    tb->sd_rd_byte = sd_data(sd_lba, sd_addr);
+    if(++sd_addr == 512) sd_state = 3;
+    break;
+
+  case 3:
+    tb->sd_busy = 0;
+    tb->sd_done = 1;
+    sd_state = 0;
+    break;
+  }
+
+  // ram: accept one word every 8 clocks while the dma owns the bus
+  tb->rdy_i = 0;
+  if(tb->rdy_o && !tb->cpu_sel) {
+    if(++ram_wait == 8) {
+      tb->rdy_i = 1;
+      if(ram_words < RAM_WORDS)
+	ram[ram_words] = tb->cpu_dout;
+      ram_words++;
+      ram_wait = 0;
+    }
+  }
+}
+
+void run(int ticks) {
+  for(int i=0;i<ticks;i++) {
+    peripherals();
+    tick(1);
+    tick(0);
+    cycle++;
+  }
+}
+
+static void cpu_write(int a1, unsigned short data) {
+  tb->cpu_a1 = a1;
+  tb->cpu_din = data;
+  tb->cpu_rw = 0;
+  tb->cpu_sel = 1;
+  do run(1); while(!tb->rdy_o);
+  tb->cpu_sel = 0;
+  run(8);
+}
+
+// read length sectors from lba with the dma sector count set to scnt.
+// Only scnt sectors are to be fetched and written to ram
+static int read_test(unsigned long lba, int length, int scnt) {
+  printf("Reading %d sectors from %lu with sector count %d ... ", length, lba, scnt);
+
+  sd_sectors = 0;
+  ram_words = 0;
+
+  cpu_write(1, 0x100);   // toggle the direction to reset the fifo
+  cpu_write(1, 0x000);   // read
+  cpu_write(1, 0x010);   // sector count register
+  cpu_write(0, scnt);
+
+  // read(6) to target 0
+  unsigned char cmd[6] = { 0x08, (unsigned char)(lba >> 16), (unsigned char)(lba >> 8),
+			   (unsigned char)lba, (unsigned char)length, 0x00 };
+  cpu_write(1, 0x008);   // ACSI, A1 low
+  cpu_write(0, cmd[0]);
+  cpu_write(1, 0x00a);   // A1 high
+  for(int i=1;i<6;i++)
+    cpu_write(0, cmd[i]);
+
+  // the dma raises the irq once the transfer is done
+  int timeout = 4096 * (scnt + 2);
+  while(!tb->acsi_irq && --timeout) run(1);
+
+  // further sectors must not be requested afterwards
+  run(4096);
+
+  if(!timeout) {
+    printf("FAILED, no irq after %d sectors, %d words\n", sd_sectors, ram_words);
+    return 1;
+  }
+
+  if(sd_sectors != scnt || ram_words != 256*scnt) {
+    printf("FAILED, %d sectors requested, %d words written\n", sd_sectors, ram_words);
+    return 1;
+  }
+
+  for(int i=0;i<ram_words;i++) {
+    unsigned long s = lba + i/256;
+    int addr = 2*(i%256);
+    unsigned short exp = (sd_data(s, addr) << 8) | sd_data(s, addr+1);
+    if(ram[i] != exp) {
+      printf("FAILED, word %d is %04x, expected %04x\n", i, ram[i], exp);
+      return 1;
+    }
+  }
+
+  printf("ok\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  // Initialize Verilators variables
+  Verilated::commandArgs(argc, argv);
+  Verilated::traceEverOn(true);
+#if VM_TRACE
+  trace = new VerilatedVcdC;
+  trace->spTrace()->set_time_unit("1ns");
+  trace->spTrace()->set_time_resolution("1ps");
+#endif
+  simulation_time = 0;
+
+  // Create an instance of our module under test
+  tb = new Vdma;
+
+#if VM_TRACE
+  tb->trace(trace, 99);
+  trace->open("dma_tb.vcd");
+#endif
+
+  tb->reset = 1; run(10); tb->reset = 0; run(10);
+
+  // mount a 1MB image as target 0
+  tb->img_size = 1024*1024;
+  tb->img_mounted = 1; run(1); tb->img_mounted = 0; run(10);
+
+  int failed = 0;
+  if(read_test(10, 4, 4)) failed++;
+
+  // the command asks for more sectors than the dma sector count
+  if(read_test(20, 4, 2)) failed++;
+  if(read_test(30, 8, 3)) failed++;
+  if(read_test(40, 2, 1)) failed++;
+
+#if VM_TRACE
+  trace->close();
+#endif
+
+  if(failed) printf("%d test(s) FAILED\n", failed);
+  return failed?1:0;
+}
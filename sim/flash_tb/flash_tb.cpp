@@ -5,10 +5,16 @@
 
 #include "Vflash.h"
 #include "verilated.h"
+#if VM_TRACE
 #include "verilated_vcd_c.h"
+#endif
+
+#include "bench.h"
 
 static Vflash *tb;
+#if VM_TRACE
 static VerilatedVcdC *trace;
+#endif
 static double simulation_time;
 
 #define TICKLEN   (1.0/64000000)
@@ -29,7 +35,10 @@ void tick(int c) {
   if(simulation_time == 0)
     ticks = GetTickCountMs();
 
+#if VM_TRACE
   trace->dump(1000000000000 * simulation_time);
+#endif
+  bench_tick(simulation_time);
   simulation_time += TICKLEN;
 }
 
@@ -44,16 +53,20 @@ int main(int argc, char **argv) {
   // Initialize Verilators variables
   Verilated::commandArgs(argc, argv);
   Verilated::traceEverOn(true);
+#if VM_TRACE
   trace = new VerilatedVcdC;
   trace->spTrace()->set_time_unit("1ns");
   trace->spTrace()->set_time_resolution("1ps");
+#endif
   simulation_time = 0;
   
   // Create an instance of our module under test
   tb = new Vflash;
 	
+#if VM_TRACE
   tb->trace(trace, 99);
   trace->open("flash.vcd");
+#endif
 
   tb->resetn = 0;
   tb->cs = 0;
@@ -74,5 +87,7 @@ int main(int argc, char **argv) {
 
   run(10000);
   
+#if VM_TRACE
   trace->close();
+#endif
 }
@@ -1,70 +1,32 @@
 #include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
 
 #include "Vfloppy_tb.h"
 #include "verilated.h"
+#if VM_TRACE
 #include "verilated_vcd_c.h"
+#endif
 
 #include <ff.h>
 #include <diskio.h>
 
+#include "sdcard.h"
+#include "bench.h"
+
 FATFS fs;
 
 static Vfloppy_tb *tb;
+#if VM_TRACE
 static VerilatedVcdC *trace;
+#endif
 static double simulation_time;
+static SdCard *sd;
 
 #define TICKLEN   (1.0/64000000)
 
-// Calculate CRC7
-// It's a 7 bit CRC with polynomial x^7 + x^3 + 1
-// input:
-//   crcIn - the CRC before (0 for first step)
-//   data - byte for CRC calculation
-// return: the new CRC7
-uint8_t CRC7_one(uint8_t crcIn, uint8_t data) {
-  const uint8_t g = 0x89;
-  uint8_t i;
-
-  crcIn ^= data;
-  for (i = 0; i < 8; i++) {
-    if (crcIn & 0x80) crcIn ^= g;
-    crcIn <<= 1;
-  }
-  
-  return crcIn;
-}
-
-// Calculate CRC16 CCITT
-// It's a 16 bit CRC with polynomial x^16 + x^12 + x^5 + 1
-// input:
-//   crcIn - the CRC before (0 for rist step)
-//   data - byte for CRC calculation
-// return: the CRC16 value
-uint16_t CRC16_one(uint16_t crcIn, uint8_t data) {
-  crcIn  = (uint8_t)(crcIn >> 8)|(crcIn << 8);
-  crcIn ^=  data;
-  crcIn ^= (uint8_t)(crcIn & 0xff) >> 4;
-  crcIn ^= (crcIn << 8) << 4;
-  crcIn ^= ((crcIn & 0xff) << 4) << 1;
-  
-  return crcIn;
-}
-
-uint8_t getCRC(unsigned char cmd, unsigned long arg) {
-  uint8_t CRC = CRC7_one(0, cmd);
-  for (int i=0; i<4; i++) CRC = CRC7_one(CRC, ((unsigned char*)(&arg))[3-i]);
-  return CRC;
-}
-
-uint8_t getCRC_bytes(unsigned char *data, int len) {
-  uint8_t CRC = 0;
-  while(len--) CRC = CRC7_one(CRC, *data++);
-  return CRC;  
-}
-  
 void hexdump(void *data, int size) {
   int i, b2c;
   int n=0;
@@ -87,21 +49,6 @@ void hexdump(void *data, int size) {
   }
 }
 
-unsigned long long reply(unsigned char cmd, unsigned long arg) {
-  unsigned long r = 0;
-  r |= ((unsigned long long)cmd) << 40;
-  r |= ((unsigned long long)arg) << 8;
-  r |= getCRC(cmd, arg);
-  r |= 1;
-  return r;
-}
-
-#define OCR  0xc0ff8000  // not busy, CCS=1(SDHC card), all voltage, not dual-voltage card
-#define RCA  0x0013
-
-// total cid respose is 136 bits / 17 bytes
-unsigned char cid[17] = "\x3f" "\x02TMS" "A08G" "\x14\x39\x4a\x67" "\xc7\x00\xe4";
-
 static uint64_t GetTickCountMs() {
   struct timespec ts;
   
@@ -111,278 +58,26 @@ static uint64_t GetTickCountMs() {
 
 void tick(int c) {
   static uint64_t ticks = 0;
-  static unsigned long sector = 0xffffffff;
-  static unsigned long long flen;
-  static FILE *fd = NULL;
-  static uint8_t sector_data[520];   // 512 bytes + four 16 bit crcs
-  static long long cmd_in = -1;
-  static long long cmd_out = -1;
-  static unsigned char *cmd_ptr = 0;
-  static int cmd_bits = 0;
-  static unsigned char *dat_ptr = 0;
-  static int dat_bits = 0;
-  static int last_was_acmd = 0;
-  static int write_count = 0;
-  static int write_expect = 0;
 
   tb->clk = c; 
   tb->eval();
 
   static int last_sdclk = -1;
-  
   if(tb->sdclk != last_sdclk) {
     // rising sd card clock edge
-    if(tb->sdclk) {
-      
-      // write postamble (ack + busy)
-      int ack_start = 580;
-      int busy_end  = 700;
-      int ack_token = 0b00101000;  // start bit 0, ack ok 010, stopbit 1, busy 000
-      if(write_count < 512) {
-	static unsigned char rbuf[520];
-         if(write_expect < 0) {
-          // wait for first data != 15
-          if(!(tb->sddat & 1))
-            write_expect = 1024+16;  // 1024 * 4 bit + 4 * 16 bit crc
-          
-	 } else if(write_expect > 0) {
-	   if((write_expect-1)&1)
-	     rbuf[519-((write_expect-1)/2)] = tb->sddat << 4;
-	   else
-	     rbuf[519-((write_expect-1)/2)] |= tb->sddat;
-	   
-	   //printf("Write %d %s = %x\n", (write_expect-1)/2,
-	   //	  ((write_expect-1)&1)?"hi":"lo",
-	   //	  rbuf[519-((write_expect-1)/2)]);
-	   
-	   write_expect--;
-	   if(write_expect == 0) {
-
-	    printf("Data written to card:\n");
-	    hexdump(rbuf, 512);
-	    
-            // done with data. verify checksum
-            unsigned short crc[4] = { 0,0,0,0 };
-            unsigned char dbits[4];
-            for(int i=0;i<512;i++) {
-              // calculate the crc for each data line seperately
-              for(int c=0;c<4;c++) {
-                if((i & 3) == 0) dbits[c] = 0;
-                dbits[c] = (dbits[c] << 2) |
-                  ((rbuf[i]&(0x10<<c))?2:0) | ((rbuf[i]&(0x01<<c))?1:0);      
-                if((i & 3) == 3) crc[c] = CRC16_one(crc[c], dbits[c]);
-              }
-            }
-
-            printf("WR DATA CRC = %04x/%04x/%04x/%04x\n",
-                   crc[0], crc[1], crc[2], crc[3]);
-
-            // extract sent crc from last 8 bytes
-            unsigned short s_crc[4] = { 0,0,0,0 };
-            for(int i=0;i<16;i++) {
-              int nibble = (rbuf[512+i/2] >> ((i&1)?0:4)) & 15;
-              s_crc[0] = (s_crc[0] << 1)|((nibble&1)?1:0);
-              s_crc[1] = (s_crc[1] << 1)|((nibble&2)?1:0);
-              s_crc[2] = (s_crc[2] << 1)|((nibble&4)?1:0);
-              s_crc[3] = (s_crc[3] << 1)|((nibble&8)?1:0);            
-            }
-            
-            printf("WR SENT CRC = %04x/%04x/%04x/%04x\n",
-                   s_crc[0], s_crc[1], s_crc[2], s_crc[3]);
-
-            write_count = 512;
-          }
-	}
- 	
-        // printf("WRITE %d = %d\n", write_count, tb->sddat);
-      } else if(write_count < busy_end) {
-        if(write_count < ack_start) tb->sddat_in = 15;
-        else if(write_count < ack_start+8)
-          tb->sddat_in = (ack_token & (0x80>>(write_count-ack_start)))?1:0;
-        else if(write_count < busy_end-1) tb->sddat_in = 0;
-        else                              tb->sddat_in = 15;
-
-        write_count++;
-      }
-    
-      cmd_in = ((cmd_in << 1) | tb->sdcmd) & 0xffffffffffffll;
-      
-      // sending 4 bits
-      if(dat_ptr && dat_bits) {
-        if(dat_bits == 128*8 + 16 + 1 + 1) {
-          // card sends start bit
-          tb->sddat_in = 0;
-          printf("READ-4 START\n");
-        } else if(dat_bits > 1) {
-          if(dat_bits == 128*8 + 16 + 1) printf("READ DATA START\n");
-          if(dat_bits == 1) printf("READ DATA END\n");
-          int nibble = dat_bits&1;   // 1: high nibble, 0: low nibble
-          if(nibble) tb->sddat_in = (*dat_ptr >> 4)&15;
-          else       tb->sddat_in = *dat_ptr++ & 15;
-        } else
-	  tb->sddat_in = 15;
-	
-        dat_bits--;
-      }
-      
-      if(cmd_ptr && cmd_bits) {
-        int bit = 7-((cmd_bits-1) & 7);
-        tb->sdcmd_in = (*cmd_ptr & (0x80>>bit))?1:0;
-        if(bit == 7) cmd_ptr++;
-        cmd_bits--;
-      } else {      
-        tb->sdcmd_in = (cmd_out & (1ll<<47))?1:0;
-        cmd_out = (cmd_out << 1)|1;
-      }
+    if(tb->sdclk)
+      sd->clock(tb->sdcmd, tb->sddat, tb->sdcmd_in, tb->sddat_in);
 
-      // check if bit 47 is 0, 46 is 1 and 0 is 1
-      if( !(cmd_in & (1ll<<47)) && (cmd_in & (1ll<<46)) && (cmd_in & (1ll<<0))) {
-        unsigned char cmd  = (cmd_in >> 40) & 0x7f;
-        unsigned long arg  = (cmd_in >>  8) & 0xffffffff;
-        unsigned char crc7 = cmd_in & 0xfe;
-
-        // r1 reply:
-        // bit 7 - 0
-        // bit 6 - parameter error
-        // bit 5 - address error
-        // bit 4 - erase sequence error
-        // bit 3 - com crc error
-        // bit 2 - illegal command
-        // bit 1 - erase reset
-        // bit 0 - in idle state
-
-        if(crc7 == getCRC(cmd, arg)) {
-          printf("%cCMD %2d, ARG %08lx\n", last_was_acmd?'A':' ', cmd & 0x3f, arg);
-          switch(cmd & 0x3f) {
-          case 0:  // Go Idle State
-            break;
-          case 8:  // Send Interface Condition Command
-            cmd_out = reply(8, arg);
-            break;
-          case 55: // Application Specific Command
-            cmd_out = reply(55, 0);
-            break;
-          case 41: // Send Host Capacity Support
-            cmd_out = reply(63, OCR);
-            break;
-          case 2:  // Send CID
-            cid[16] = getCRC_bytes(cid, 16) | 1;  // Adjust CRC
-            cmd_ptr = cid;
-            cmd_bits = 136;
-            break;
-           case 3:  // Send Relative Address
-            cmd_out = reply(3, (RCA<<16) | 0);  // status = 0
-            break;
-          case 7:  // select card
-            cmd_out = reply(7, 0);    // may indicate busy          
-            break;
-          case 6:  // set bus width
-            printf("Set bus width to %ld\n", arg);
-            cmd_out = reply(6, 0);
-            break;
-          case 16: // set block len (should be 512)
-            printf("Set block len to %ld\n", arg);
-            cmd_out = reply(16, 0);    // ok
-            break;
-          case 17:  // read block
-            printf("Request to read single block %ld\n", arg);
-            cmd_out = reply(17, 0);    // ok
-
-            // load sector
-            {
-	      // check for floppy data request
-	      if(!fd) {
-		fd = fopen("sd.img", "rb");
-		if(!fd) { perror("OPEN ERROR"); exit(-1); }
-		fseek(fd, 0, SEEK_END);
-		flen = ftello(fd);
-		printf("Image size is %lld\n", flen);
-		fseek(fd, 0, SEEK_SET);
-	      }
-	      
-              fseek(fd, 512 * arg, SEEK_SET);
-              int items = fread(sector_data, 2, 256, fd);
-              if(items != 256) perror("fread()");
-
-	      // for(int i=0;i<16;i++) printf("%02x ", sector_data[i]);
-              // printf("\n");
-            }
-            {
-              unsigned short crc[4] = { 0,0,0,0 };
-              unsigned char dbits[4];
-              for(int i=0;i<512;i++) {
-                // calculate the crc for each data line seperately
-                for(int c=0;c<4;c++) {
-                  if((i & 3) == 0) dbits[c] = 0;
-                  dbits[c] = (dbits[c] << 2) | ((sector_data[i]&(0x10<<c))?2:0) | ((sector_data[i]&(0x01<<c))?1:0);      
-                  if((i & 3) == 3) crc[c] = CRC16_one(crc[c], dbits[c]);
-                }
-              }
-
-              printf("CRC = %04x/%04x/%04x/%04x\n", crc[0], crc[1], crc[2], crc[3]);
-
-              // append crc's to sector_data
-              for(int i=0;i<8;i++) sector_data[512+i] = 0;
-              for(int i=0;i<16;i++) {
-                int crc_nibble =
-                  ((crc[0] & (0x8000 >> i))?1:0) +
-                  ((crc[1] & (0x8000 >> i))?2:0) +
-                  ((crc[2] & (0x8000 >> i))?4:0) +
-                  ((crc[3] & (0x8000 >> i))?8:0);
-
-                sector_data[512+i/2] |= (i&1)?(crc_nibble):(crc_nibble<<4);
-              }
-            }
-            dat_ptr = sector_data;
-            dat_bits = 128*8 + 16 + 1 + 1;
-	    break;
-            
-          case 24:  // write block
-            printf("Request to write single block %ld\n", arg);
-            write_count = 0;
-	    write_expect = -1;  
-            cmd_out = reply(24, 0);    // ok
-            break;
-            
-          default:
-            printf("unexpected command\n");
-          }
-
-          last_was_acmd = (cmd & 0x3f) == 55;
-          
-          cmd_in = -1;
-        } else
-          printf("CMD %02x, ARG %08lx, CRC7 %02x != %02x!!\n", cmd, arg, crc7, getCRC(cmd, arg));         
-      }      
-    }      
     last_sdclk = tb->sdclk;
   }
-  
-
       
   if(simulation_time == 0)
     ticks = GetTickCountMs();
 
-#if 0 // now obsolete sd_fake interface
-  static int last_rdreq = 0;
-  if(c && tb->rdreq) {
-    int s = tb->rdaddr / 256;
-    if(s != sector) {
-      printf("Loading sector %d\n", s);
-      fseek(fd, 512 * s, SEEK_SET);
-      fread(sector_data, 2, 256, fd);
-      sector = s;
-    }
-    
-    //    if(last_rdreq == 0) printf("Read word 0x%lx sector %ld/%ld\n", tb->rdaddr, tb->rdaddr/256, tb->rdaddr & 255);
-    if(tb->rdaddr < flen/2) tb->rddata = sector_data[tb->rdaddr & 255];
-    else                    tb->rddata = 0xa5a5;
-
-  }
-  last_rdreq = tb->rdreq;
-#endif
-  
+#if VM_TRACE
   trace->dump(1000000000000 * simulation_time);
+#endif
+  bench_tick(simulation_time);
   simulation_time += TICKLEN;
 }
 
@@ -574,7 +269,41 @@ void mcu_write_sector(unsigned long sector, unsigned char *buffer) {
   wait_ms(1);
 }
 
+// upload the extents of the image like the firmware does, so the
+// core translates sectors itself and the MCU doesn't have to
+static bool extents = false;
+
+void mcu_tx_u32(unsigned long v) {
+  for(int i=0;i<4;i++) mcu_write_byte((v >> 8*(3-i))&0xff, 0);
+}
+
+void upload_extents(void) {
+  if(!fil.cltbl) return;
+
+  mcu_write_byte(0x07, 1);  // command byte 7, start byte
+  mcu_write_byte(0, 0);     // drive A:
+  unsigned char size = mcu_write_byte(0, 0);
+  unsigned char check = mcu_write_byte(0, 0);
+  printf("Core extent table size %d\n", size);
+  if((unsigned char)~size != check) return;
+
+  unsigned long lba = 0;
+  int n = 0;
+  for(DWORD *tbl = fil.cltbl + 1; *tbl && n < size-1; tbl += 2, n++) {
+    printf("extent %d: lba %lu = %lu\n", n, lba, clst2sect(tbl[1]));
+    mcu_tx_u32(lba);
+    mcu_tx_u32(clst2sect(tbl[1]));
+    lba += tbl[0] * fs.csize;
+  }
+  mcu_tx_u32((fil.obj.objsize + 511) / 512);
+  mcu_tx_u32(0);
+  extents = true;
+}
+
 void mcu_poll(int quiet) {
+  // the core translates all requests itself
+  if(extents) return;
+  
   // MCU requests sd card status
   unsigned char status = mcu_write_byte(0x01, 1);  
   unsigned char request = mcu_write_byte(0, 0);
@@ -691,6 +420,33 @@ void write_sector(int track, int sec) {
 #endif
 }
 
+// read all sectors of one side of a track like TOS does and report the
+// simulated time it took. The MCU is polled all the time as the track
+// cache of the fdc requests several sectors in a row
+void read_track(int track, int spt) {
+  double start = simulation_time;
+
+  cpu_write(1, track);
+  for(int sec=1;sec<=spt;sec++) {
+    cpu_write(2, sec);
+    cpu_write(0, 0x88);  // read sector, spinup
+
+    int i = 0;
+    while(!tb->irq) {
+      mcu_poll(1);
+      if(tb->drq) {
+	cpu_read(3);
+	i++;
+      }
+    }
+    int status = cpu_read(0);
+    if(i != 512 || (status & 0x1c))
+      printf("READ_SECTOR %d/%d failed, read %d bytes, status = %x\n", track, sec, i, status);
+  }
+
+  printf("track %d: %d sectors in %.3fms\n", track, spt, (simulation_time - start)*1000);
+}
+
 int MSC_disk_status() {
   // printf("MSC_disk_status()\n");
   return 0;
@@ -762,21 +518,55 @@ int fs_init() {
 }
 
 int main(int argc, char **argv) {
+  bool track_bench = false;
+  bool use_extents = false;
+  int turbo = 0;
+
   // Initialize Verilators variables
   Verilated::commandArgs(argc, argv);
+
+  int c;
+  while((c = getopt(argc, argv, "bt:x")) != -1) {
+    switch(c) {
+    case 'b':
+      track_bench = true;
+      break;
+    case 't':
+      turbo = atoi(optarg) & 3;
+      break;
+    case 'x':
+      use_extents = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-b] [-t turbo] [-x]\n", argv[0]);
+      fprintf(stderr, "  -b        measure the time to read whole tracks\n");
+      fprintf(stderr, "  -t turbo  floppy runs 2^turbo times faster\n");
+      fprintf(stderr, "  -x        upload the extent table, the core translates sectors itself\n");
+      return -1;
+    }
+  }
   Verilated::traceEverOn(true);
+#if VM_TRACE
   trace = new VerilatedVcdC;
   trace->spTrace()->set_time_unit("1ns");
   trace->spTrace()->set_time_resolution("1ps");
+#endif
   simulation_time = 0;
   
   // Create an instance of our module under test
   tb = new Vfloppy_tb;
+
+  // the test doesn't modify the image
+  sd = new SdCard("sd.img", false);
+  sd->verbose = 1;
 	
+#if VM_TRACE
   tb->trace(trace, 99);
   trace->open("floppy_tb.vcd");
+#endif
 
   tb->reset = 0;
+  tb->turbo = turbo;
   tb->cpu_addr = 0;
   tb->cpu_sel = 0;
   tb->cpu_rw = 1;
@@ -812,6 +602,7 @@ int main(int argc, char **argv) {
   // inside the sd card image on root level
   printf("Opening disk_a.st\n");  
   fs_prepare((char*)"/sd/disk_a.st");
+  if(use_extents) upload_extents();
   
 #if 1
   printf("RESTORE\n");
@@ -821,8 +612,17 @@ int main(int argc, char **argv) {
 
   wait_ms(40);
 
-  // read_sector(0, 3);  
-  write_sector(0, 3);  
+  if(track_bench) {
+    // the second read of a track shows the effect of the track cache
+    sd->verbose = 0;
+    for(int track=0;track<2;track++) {
+      read_track(track, 9);
+      read_track(track, 9);
+    }
+  } else {
+    // read_sector(0, 3);  
+    write_sector(0, 3);  
+  }
 
   wait_ms(10);
   
@@ -830,6 +630,10 @@ int main(int argc, char **argv) {
   run(10000);
 #endif
 #endif
+
+  sd->print_stats();
   
+#if VM_TRACE
   trace->close();
+#endif
 }
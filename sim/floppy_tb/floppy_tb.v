@@ -1,7 +1,10 @@
-module floppy_tb(
+module floppy_tb #(
+  parameter TRACK_CACHE = 1'b1
+) (
   input 	   clk,
   input 	   reset,
   output 	   clk8m_en,
+  input [1:0] 	   turbo,
 
   // fdc interface		 
   input [1:0] 	   cpu_addr,
@@ -40,7 +43,7 @@ wire [8:0] sd_byte_index;
 wire	   sd_rd_byte_strobe;
 wire	   sd_busy, sd_done; 
   
-fdc1772 #( .FD_NUM(1'b1) ) fdc1772 
+fdc1772 #( .FD_NUM(1'b1), .TRACK_CACHE(TRACK_CACHE) ) fdc1772 
 (
  .clkcpu(clk), // system cpu clock.
  .clk8m_en(cnt_8mhz == 2'd2),
@@ -51,6 +54,7 @@ fdc1772 #( .FD_NUM(1'b1) ) fdc1772
  .floppy_reset(reset),
  .floppy_step(),
  .floppy_motor(1'b1),   // not used in ST
+ .floppy_turbo(turbo),
  .floppy_ready(),
  
  // interrupts
@@ -107,6 +111,7 @@ sd_card #(
     .rstart({1'b0,sd_rd}), 
     .wstart({1'b0,sd_wr}), 
     .rsector(sd_lba),
+    .rcount(16'd1),
     .rbusy(sd_busy),
     .rdone(sd_done),
 		 
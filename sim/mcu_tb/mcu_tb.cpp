@@ -0,0 +1,696 @@
+//
+// mcu_tb.cpp - MCU-in-the-loop co-simulation
+//
+// The firmware's sdc.c, sysctrl.c, menu.c, osd_u8g2.c, hid.c and
+// hidparser.c run natively and talk via a bit banged SPI to the
+// verilated mcu_spi, sysctrl, hid and sd_card. The SD card is a
+// behavioural model backed by an image file. This runs the real disk
+// and input paths end to end:
+//
+//   - boot like main.c: FPGA detection, sdc_init() and menu_init()
+//     which mounts the SD card and disk_a.st through the firmware
+//   - the floppy controller reads sectors which are requested from
+//     the MCU via interrupt and compared to what FatFs reads
+//   - an optional usb hid trace as captured by "hidtrace on" is
+//     replayed through the parsers into hid.v
+//
+// Usage: mcu_tb [-i sd.img] [-c core_id] [-n sectors] [-r trace.log] [-p] [-t]
+//   -i  sd card image (default sd.img)
+//   -c  core id reported to the firmware (default 1, Atari ST)
+//   -n  number of floppy sectors to read (default 9)
+//   -r  replay usb hid trace
+//   -p  also dispatch interrupts between any two SPI transfers as
+//       the preempting SPI task would on the device
+//   -t  write mcu_tb.vcd
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <ctype.h>
+
+#include "Vmcu_tb.h"
+#include "verilated.h"
+#if VM_TRACE
+#include "verilated_vcd_c.h"
+#endif
+
+#include "sdcard.h"
+#include "bench.h"
+
+extern "C" {
+#include <ff.h>
+#include "spi.h"
+#include "sysctrl.h"
+#include "sdc.h"
+#include "menu.h"
+#include "hid.h"
+#include "usb.h"
+#include "timers.h"
+#include "queue.h"
+#include "bflb_wdg.h"
+}
+
+static Vmcu_tb *tb;
+#if VM_TRACE
+static VerilatedVcdC *trace = NULL;
+#endif
+static double simulation_time;
+static uint64_t cycles = 0;
+
+#define TICKLEN   (1.0/64000000)
+#define CLK_MHZ   32
+
+// SPI clock is 8 MHz. The FPGA needs a few cycles between two bytes
+// to bring the received byte into its clock domain
+#define SPI_HALF_BIT  2
+#define SPI_BYTE_GAP  8
+
+// a video frame is 20ms with the vbl being active for the first ms
+#define VBL_PERIOD    (20*1000*CLK_MHZ)
+#define VBL_LEN       (1000*CLK_MHZ)
+
+static const char *image_name = "sd.img";
+static bool preempt = false;
+static SdCard *sd;
+
+static struct {
+  unsigned long transfers[4];
+  unsigned long bytes[4];
+  unsigned long interrupts;
+} stats;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void hexdump(void *data, int size) {
+  int i, b2c;
+  int n=0;
+  char *ptr = (char*)data;
+
+  if(!size) return;
+
+  while(size>0) {
+    printf("%04x: ", n);
+
+    b2c = (size>16)?16:size;
+    for(i=0;i<b2c;i++)      printf("%02x ", 0xff&ptr[i]);
+    printf("  ");
+    for(i=0;i<(16-b2c);i++) printf("   ");
+    for(i=0;i<b2c;i++)      printf("%c", isprint(ptr[i])?ptr[i]:'.');
+    printf("\n");
+    ptr  += b2c;
+    size -= b2c;
+    n    += b2c;
+  }
+}
+
+// --------------------------- simulation ----------------------------
+
+static void tick(int c) {
+  static int last_sdclk = -1;
+
+  tb->clk = c;
+  tb->eval();
+
+  // rising sd card clock edge
+  if(tb->sdclk != last_sdclk) {
+    if(tb->sdclk) sd->clock(tb->sdcmd, tb->sddat, tb->sdcmd_in, tb->sddat_in);
+    last_sdclk = tb->sdclk;
+  }
+
+#if VM_TRACE
+  if(trace) trace->dump(1000000000000 * simulation_time);
+#endif
+  bench_tick(simulation_time);
+  simulation_time += TICKLEN;
+}
+
+static void run(int n) {
+  for(int i=0;i<n;i++) {
+    tb->vbl = (cycles % VBL_PERIOD) < VBL_LEN;
+    tick(1);
+    tick(0);
+    cycles++;
+  }
+}
+
+static void wait_clk8() {
+  run(1);
+  while(!tb->clk8m_en) run(1);
+}
+
+// ------------------------- firmware glue ---------------------------
+
+extern "C" {
+  QueueHandle_t xQueue;
+}
+
+static spi_t spi;
+static menu_t *menu = NULL;
+static int spi_target = -1;
+static bool spi_owned = false;
+static bool irq_busy = false;
+static bool mouse_flush_pending = false;
+
+// the spi task of the firmware. Interrupts are only dispatched if
+// the firmware wouldn't be blocked by the bus or the sdc mutex
+static void irq_poll(void) {
+  if(tb->mcu_intn || irq_busy || spi_owned || cosim_locks)
+    return;
+
+  irq_busy = true;
+  unsigned char pending = sys_irq_ctrl(&spi, 0xff);
+  if(pending) {
+    stats.interrupts++;
+    sys_handle_interrupts(pending);
+  }
+  irq_busy = false;
+}
+
+static void mouse_frame(void);
+
+// let the simulation run while the firmware waits
+static void wait_cycles(uint64_t n) {
+  uint64_t end = cycles + n;
+  while(cycles < end) {
+    uint64_t ms = cycles / (1000*CLK_MHZ);
+    run(CLK_MHZ);   // one us
+    if(cycles / (1000*CLK_MHZ) != ms)
+      cosim_timers_run(cosim_ms());
+
+    irq_poll();
+
+    // the mouse thread flushes after the vbl interrupt
+    if(mouse_flush_pending && !irq_busy && !spi_owned) {
+      mouse_flush_pending = false;
+      mouse_frame();
+    }
+  }
+}
+
+static void wait_ms(int ms) {
+  wait_cycles((uint64_t)ms*1000*CLK_MHZ);
+}
+
+static void wait_ns(int ns) {
+  wait_cycles((CLK_MHZ*ns)/1000);
+}
+
+extern "C" void cosim_delay_ms(TickType_t ms) {
+  wait_ms(ms);
+}
+
+extern "C" TickType_t cosim_ms(void) {
+  return cycles / (1000*CLK_MHZ);
+}
+
+extern "C" void spi_begin_prio(spi_t *spi, unsigned char prio) {
+  if(spi_owned) printf("COSIM: nested spi_begin()\n");
+  spi_owned = true;
+  spi_target = -1;
+
+  tb->mcu_csn = 0;
+  run(SPI_BYTE_GAP);
+}
+
+extern "C" void spi_begin(spi_t *spi) {
+  spi_begin_prio(spi, SPI_PRIO_HOUSEKEEPING);
+}
+
+// SPI MODE1: data is set up on the rising and sampled on the falling edge
+extern "C" unsigned char spi_tx_u08(spi_t *spi, unsigned char b) {
+  unsigned char in = 0;
+
+  if(spi_target < 0) {
+    spi_target = b;
+    if(spi_target < 4) stats.transfers[spi_target]++;
+  } else if(spi_target < 4)
+    stats.bytes[spi_target]++;
+
+  for(int i=7;i>=0;i--) {
+    tb->mcu_mosi = (b >> i) & 1;
+    tb->mcu_sclk = 1;
+    run(SPI_HALF_BIT);
+    in = (in << 1) | tb->mcu_miso;
+    tb->mcu_sclk = 0;
+    run(SPI_HALF_BIT);
+  }
+  run(SPI_BYTE_GAP);
+
+  return in;
+}
+
+extern "C" void spi_end(spi_t *spi) {
+  tb->mcu_csn = 1;
+  run(SPI_BYTE_GAP);
+  spi_owned = false;
+
+  if(preempt) irq_poll();
+}
+
+// usb_host.c isn't part of the co-simulation. These are the parts the
+// firmware needs from it
+extern "C" void usb_mouse_sync(unsigned char mode) {
+  hid_mouse_sync = mode;
+}
+
+extern "C" void usb_poll_interval(int cl, unsigned char ms) { }
+
+extern "C" int usb_poll_device_set(uint16_t vid, uint16_t pid, unsigned char ms) {
+  return -1;
+}
+
+extern "C" int usb_poll_device_get(int idx, uint16_t *vid, uint16_t *pid, unsigned char *ms) {
+  return -1;
+}
+
+extern "C" void hid_handle_event(void) {
+  unsigned char pending = 0x01;
+
+  if(hid_vbl_supported) {
+    spi_begin_prio(&spi, SPI_PRIO_INPUT);
+    spi_tx_u08(&spi, SPI_TARGET_HID);
+    spi_tx_u08(&spi, SPI_HID_IRQ);
+    spi_tx_u08(&spi, 0x00);
+    pending = spi_tx_u08(&spi, 0x00);
+    spi_end(&spi);
+  }
+
+  if(pending & 0x02) {
+    hid_vbl_event();
+    mouse_flush_pending = true;
+  }
+
+  if(!(pending & 0x01))
+    return;
+
+  spi_begin_prio(&spi, SPI_PRIO_INPUT);
+  spi_tx_u08(&spi, SPI_TARGET_HID);
+  spi_tx_u08(&spi, SPI_HID_GET_DB9);
+  spi_tx_u08(&spi, 0x00);
+  uint8_t db9 = spi_tx_u08(&spi, 0x00);
+  spi_end(&spi);
+
+  printf("DB9: %02x\n", db9);
+}
+
+static void osd_timer(TimerHandle_t timer) {
+  static long msg = -1;
+  xQueueSendToBack(xQueue, &msg, 0);
+}
+
+// the osd task of the firmware
+static void menu_events(void) {
+  long cmd;
+  if(!menu) return;
+  while(xQueueReceive(xQueue, &cmd, 0))
+    menu_do(menu, cmd);
+}
+
+// --------------------------- boot --------------------------------
+
+static double boot_ms[3];
+
+static int boot(unsigned char core) {
+  int timeout = 500;
+  int fpga_ok;
+
+  // main.c
+  do {
+    fpga_ok = sys_status_is_valid(&spi);
+    if(!fpga_ok) {
+      wait_ms(10);
+      timeout--;
+    }
+  } while(timeout && !fpga_ok);
+
+  if(!timeout) {
+    printf("FPGA not ready\n");
+    return -1;
+  }
+
+  boot_ms[0] = cosim_ms();
+  printf("FPGA ready after %.3fms\n", boot_ms[0]);
+
+  // the generic sysctrl.v reports core id 0
+  core_id = core;
+
+  sys_set_val(&spi, 'R', 3);
+  sys_set_rgb(&spi, 0x000040);
+
+  // usb_host.c
+  spi_begin_prio(&spi, SPI_PRIO_INPUT);
+  spi_tx_u08(&spi, SPI_TARGET_HID);
+  spi_tx_u08(&spi, SPI_HID_STATUS);
+  spi_tx_u08(&spi, 0x00);
+  unsigned char version = spi_tx_u08(&spi, 0x00);
+  unsigned char subversion = spi_tx_u08(&spi, 0x00);
+  spi_end(&spi);
+
+  printf("HID version %d.%d\n", version, subversion);
+  hid_batch_supported = (version > 1) || (version == 1 && subversion >= 1);
+  hid_vbl_supported = (version > 1) || (version == 1 && subversion >= 2);
+
+  // spi_task
+  double start = cosim_ms();
+  sdc_init(&spi);
+  boot_ms[1] = cosim_ms() - start;
+  if(!sdc_is_ready()) {
+    printf("SD card not ready\n");
+    return -1;
+  }
+
+  // osd_task
+  start = cosim_ms();
+  sys_set_leds(&spi, 0x00);
+  menu = menu_init(&spi);
+  menu_do(menu, 0);
+  menu->osd->timer = xTimerCreate("OSD timer", pdMS_TO_TICKS(40), pdTRUE,
+				  NULL, osd_timer);
+  boot_ms[2] = cosim_ms() - start;
+
+  return 0;
+}
+
+// ------------------------- floppy disk ------------------------------
+
+static void cpu_write(int reg, int val) {
+  wait_clk8();
+
+  tb->cpu_addr = reg;
+  tb->cpu_sel = 1;
+  tb->cpu_rw = 0;
+  tb->cpu_din = val;
+
+  wait_clk8();
+  tb->cpu_sel = 0;
+}
+
+static int cpu_read(int reg) {
+  wait_clk8();
+
+  tb->cpu_addr = reg;
+  tb->cpu_sel = 1;
+  tb->cpu_rw = 1;
+
+  wait_clk8();
+  tb->cpu_sel = 0;
+
+  return tb->cpu_dout;
+}
+
+static int fdc_sectors = 0;
+static int fdc_errors = 0;
+static double fdc_ms = 0;
+
+// read a sector via the fdc and compare it with the same sector read
+// by the MCU via FatFs
+static void fdc_read_sector(int track, int sec) {
+  unsigned char buffer[1024];
+  unsigned char ref[512];
+  int i = 0;
+
+  double start = cosim_ms();
+  cpu_write(1, track);
+  cpu_write(2, sec);
+  cpu_write(0, 0x88);  // read sector, spinup
+
+  wait_ns(1000);
+
+  while(!tb->irq) {
+    wait_ns(100);
+    if(tb->drq) {
+      int data = cpu_read(3);
+      if(i < 1024) buffer[i] = data;
+      i++;
+    }
+  }
+  int status = cpu_read(0);
+  double ms = cosim_ms() - start;
+  fdc_ms += ms;
+  fdc_sectors++;
+
+  FIL fil;
+  UINT br = 0;
+  sdc_lock();
+  if(f_open(&fil, (char*)CARD_MOUNTPOINT "/disk_a.st", FA_OPEN_EXISTING | FA_READ) == FR_OK) {
+    f_lseek(&fil, (track * 18 + sec - 1) * 512);
+    f_read(&fil, ref, 512, &br);
+    f_close(&fil);
+  }
+  sdc_unlock();
+
+  bool ok = (i == 512) && !(status & 0x1c) && (br == 512) && !memcmp(buffer, ref, 512);
+  printf("FDC: track %d sector %d, %d bytes, status %02x, %.3fms %s\n",
+	 track, sec, i, status, ms, ok?"ok":"MISMATCH");
+
+  if(!ok) {
+    fdc_errors++;
+    hexdump(buffer, i<512?i:512);
+  }
+}
+
+static void fdc_test(int sectors) {
+  cpu_write(0, 0x0b);  // Restore, Motor on, 6ms
+  while(cpu_read(0) & 0x01) wait_ms(1);
+
+  for(int s=0;s<sectors;s++) {
+    fdc_read_sector(0, 1 + s % 9);
+    menu_events();
+  }
+}
+
+// ------------------------- hid replay ------------------------------
+
+#define MAX_DEVICES  8
+#define MAX_LINE     1024
+
+static struct device_S {
+  char name[16];
+  bool is_xbox;
+  bool usable;
+  hid_reports_t reports;
+  struct hid_state_S state[MAX_REPORTS];
+  struct hid_xbox_state_S xbox;
+} devices[MAX_DEVICES];
+
+static int devices_num = 0;
+static unsigned js_map = 0;
+
+static struct device_S *device_get(const char *name) {
+  for(int i=0;i<devices_num;i++)
+    if(!strcmp(devices[i].name, name))
+      return &devices[i];
+
+  if(devices_num == MAX_DEVICES) return NULL;
+
+  struct device_S *dev = &devices[devices_num++];
+  memset(dev, 0, sizeof(*dev));
+  snprintf(dev->name, sizeof(dev->name), "%s", name);
+  dev->is_xbox = !strncmp(name, "xbox", 4);
+  return dev;
+}
+
+static unsigned char js_alloc(void) {
+  unsigned char idx = 0;
+  while(js_map & (1<<idx)) idx++;
+  js_map |= 1<<idx;
+  return idx;
+}
+
+static void mouse_frame(void) {
+  bool pending = false;
+
+  for(int i=0;i<devices_num;i++) {
+    if(devices[i].is_xbox || !devices[i].usable) continue;
+
+    for(int r=0;r<devices[i].reports.reports;r++)
+      if(devices[i].reports.report[r].type == REPORT_TYPE_MOUSE)
+	if(mouse_flush(&spi, &devices[i].state[r].mouse))
+	  pending = true;
+  }
+
+  if(pending && hid_mouse_sync == HID_MOUSE_SYNC_VBL && hid_vbl_supported)
+    hid_vbl_arm(&spi);
+}
+
+static void hid_outputs(void) {
+  static uint32_t last[7];
+  static bool first = true;
+  uint32_t cur[7] = { tb->mouse, tb->joystick0, tb->joystick1,
+		      tb->keyboard[0], tb->keyboard[1], tb->keyboard[2],
+		      tb->keyboard[3] & 0xffffff };
+
+  if(first || memcmp(cur, last, sizeof(cur))) {
+    printf("HID: mouse %02x joy0 %02x joy1 %02x kbd %06x%08x%08x%08x\n",
+	   cur[0], cur[1], cur[2], cur[6], cur[5], cur[4], cur[3]);
+    memcpy(last, cur, sizeof(cur));
+    first = false;
+  }
+}
+
+static int hid_replay(const char *name) {
+  char line[MAX_LINE];
+  int reports = 0;
+
+  FILE *file = fopen(name, "r");
+  if(!file) {
+    perror(name);
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), file)) {
+    char dname[16], type;
+    int n;
+
+    char *p = strchr(line, '@');
+    if(!p || sscanf(p+1, "%15s %c%n", dname, &type, &n) != 2)
+      continue;
+    p += 1+n;
+
+    unsigned char data[MAX_LINE/3];
+    int len = 0;
+    unsigned int byte;
+    while(len < (int)sizeof(data) && sscanf(p, "%x%n", &byte, &n) == 1) {
+      data[len++] = byte;
+      p += n;
+    }
+
+    struct device_S *dev = device_get(dname);
+    if(!dev) continue;
+
+    if(type == 'D') {
+      if(dev->is_xbox) {
+	dev->usable = true;
+	dev->xbox.js_index = js_alloc();
+      } else if((dev->usable = parse_report_descriptors(data, len, &dev->reports))) {
+	for(int r=0;r<dev->reports.reports;r++)
+	  if(dev->reports.report[r].type == REPORT_TYPE_JOYSTICK)
+	    dev->state[r].joystick.js_index = js_alloc();
+      }
+      printf("%s: descriptor %susable\n", dev->name, dev->usable?"":"not ");
+    }
+
+    if(type == 'R' && dev->usable) {
+      if(dev->is_xbox) xbox_parse(&spi, &dev->xbox, data, len);
+      else             hid_parse(&spi, &dev->reports, dev->state, data, len);
+      reports++;
+
+      // usb full speed devices report at most every ms
+      wait_ms(1);
+      hid_outputs();
+      menu_events();
+    }
+  }
+
+  fclose(file);
+
+  // give the last vbl a chance to flush mouse movement
+  wait_ms(20);
+  hid_outputs();
+  return reports;
+}
+
+// ----------------------------------------------------------------
+
+int main(int argc, char **argv) {
+  unsigned char core = CORE_ID_ATARI_ST;
+  const char *replay = NULL;
+  int sectors = 9;
+  int opt;
+
+  Verilated::commandArgs(argc, argv);
+
+  while((opt = getopt(argc, argv, "i:c:n:r:pt")) != -1) {
+    switch(opt) {
+    case 'i': image_name = optarg; break;
+    case 'c': core = atoi(optarg); break;
+    case 'n': sectors = atoi(optarg); break;
+    case 'r': replay = optarg; break;
+    case 'p': preempt = true; break;
+    case 't':
+#if VM_TRACE
+      Verilated::traceEverOn(true);
+      trace = new VerilatedVcdC;
+      trace->spTrace()->set_time_unit("1ns");
+      trace->spTrace()->set_time_resolution("1ps");
+#else
+      fprintf(stderr, "Built without --trace, -t ignored\n");
+#endif
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-i sd.img] [-c core_id] [-n sectors] [-r trace.log] [-p] [-t]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  sd = new SdCard(image_name);
+  simulation_time = 0;
+
+  tb = new Vmcu_tb;
+#if VM_TRACE
+  if(trace) {
+    tb->trace(trace, 99);
+    trace->open("mcu_tb.vcd");
+  }
+#endif
+
+  spi.dev = bflb_device_get_by_name("spi0");
+  xQueue = xQueueCreate(10, sizeof(long));
+
+  tb->reset = 0;
+  tb->mcu_csn = 1;
+  tb->mcu_sclk = 0;
+  tb->mcu_mosi = 0;
+  tb->cpu_addr = 0;
+  tb->cpu_sel = 0;
+  tb->cpu_rw = 1;
+  tb->cpu_din = 0;
+  tb->db9 = 0;
+  tb->sdcmd_in = 1; tb->sddat_in = 15;  // inputs of sd card
+
+  run(10);
+  tb->reset = 1;
+
+  double wall = now();
+  int errors = 0;
+
+  if(boot(core) != 0)
+    errors++;
+  else {
+    if(sectors) fdc_test(sectors);
+    errors += fdc_errors;
+
+    if(replay && hid_replay(replay) < 0)
+      errors++;
+  }
+
+  wall = now() - wall;
+
+  printf("==== statistics ====\n");
+  printf("simulated %.3fms in %.3fs wall time, %.3f simulated ms/s\n",
+	 simulation_time*1000, wall, simulation_time*1000/wall);
+  printf("boot: fpga ready %.0fms, sdc_init %.0fms, menu_init %.0fms\n",
+	 boot_ms[0], boot_ms[1], boot_ms[2]);
+  const char *targets[] = { "sys", "hid", "osd", "sdc" };
+  for(int i=0;i<4;i++)
+    printf("spi %s: %lu transfers, %lu bytes\n", targets[i], stats.transfers[i], stats.bytes[i]);
+  printf("interrupts: %lu, watchdog resets requested: %d\n",
+	 stats.interrupts, cosim_wdg_resets);
+  sd->print_stats();
+  if(fdc_sectors)
+    printf("fdc: %d sectors, %.3fms/sector, %d errors\n",
+	   fdc_sectors, fdc_ms / fdc_sectors, fdc_errors);
+
+#if VM_TRACE
+  if(trace) trace->close();
+#endif
+  delete sd;
+
+  return errors?1:0;
+}
@@ -0,0 +1,252 @@
+//
+// mcu_tb.v - MCU-in-the-loop co-simulation
+//
+// The FPGA side of the MCU interface as used in misterynano.sv. The
+// SPI pins are driven by the firmware's sdc.c, sysctrl.c, menu.c and
+// hid.c running natively in mcu_tb.cpp. A floppy controller acts as
+// the core side requester of sd card sectors.
+//
+
+module mcu_tb(
+  input		   clk,
+  input		   reset,
+  output	   clk8m_en,
+
+  // spi interface to the MCU
+  input		   mcu_csn,
+  input		   mcu_sclk,
+  input		   mcu_mosi,
+  output	   mcu_miso,
+  output	   mcu_intn,
+
+  // fdc interface
+  input [1:0]	   cpu_addr,
+  input		   cpu_sel,
+  input		   cpu_rw,
+  input [7:0]	   cpu_din,
+  output [7:0]	   cpu_dout,
+  output	   irq,
+  output	   drq,
+
+  // hid outputs, keyboard matrix flattened
+  input		   vbl,
+  input [5:0]	   db9,
+  output [5:0]	   mouse,
+  output [119:0]   keyboard,
+  output [7:0]	   joystick0,
+  output [7:0]	   joystick1,
+
+  // a few of the values controlled by the OSD
+  output [1:0]	   leds,
+  output [23:0]	   color,
+  output [1:0]	   system_reset,
+  output [1:0]	   system_floppy_wprot,
+
+  output	   sdclk,
+  output	   sdcmd,
+  input		   sdcmd_in,
+  output [3:0]	   sddat,
+  input [3:0]	   sddat_in
+);
+
+reg [1:0] cnt_8mhz;
+always @(posedge clk)
+  cnt_8mhz <= cnt_8mhz + 2'd1;
+
+assign clk8m_en = cnt_8mhz == 2'd0;
+
+wire       mcu_sys_strobe;
+wire       mcu_hid_strobe;
+wire       mcu_osd_strobe;
+wire       mcu_sdc_strobe;
+wire       mcu_start;
+wire [7:0] mcu_data_out;
+wire [7:0] sys_data_out;
+wire [7:0] hid_data_out;
+wire [7:0] sdc_data_out;
+wire [7:0] osd_data_out = 8'h55;
+
+mcu_spi mcu (
+        .clk(clk),
+        .reset(!reset),
+
+        .spi_io_ss(mcu_csn),
+        .spi_io_clk(mcu_sclk),
+        .spi_io_din(mcu_mosi),
+        .spi_io_dout(mcu_miso),
+
+        .mcu_sys_strobe(mcu_sys_strobe),
+        .mcu_hid_strobe(mcu_hid_strobe),
+        .mcu_osd_strobe(mcu_osd_strobe),
+        .mcu_sdc_strobe(mcu_sdc_strobe),
+        .mcu_start(mcu_start),
+        .mcu_dout(mcu_data_out),
+        .mcu_sys_din(sys_data_out),
+        .mcu_hid_din(hid_data_out),
+        .mcu_osd_din(osd_data_out),
+        .mcu_sdc_din(sdc_data_out)
+        );
+
+wire [7:0] int_ack;
+wire hid_int;
+wire hid_iack = int_ack[1];
+wire [7:0] hid_keyboard[14:0];
+
+genvar i;
+generate
+  for(i=0;i<15;i=i+1) begin : kbd
+    assign keyboard[8*i+7:8*i] = hid_keyboard[i];
+  end
+endgenerate
+
+hid hid (
+        .clk(clk),
+        .reset(!reset),
+
+        .data_in_strobe(mcu_hid_strobe),
+        .data_in_start(mcu_start),
+        .data_in(mcu_data_out),
+        .data_out(hid_data_out),
+
+        .db9_port(db9),
+        .irq(hid_int),
+        .iack(hid_iack),
+        .vbl(vbl),
+
+        .mouse(mouse),
+        .keyboard(hid_keyboard),
+        .joystick0(joystick0),
+        .joystick1(joystick1)
+         );
+
+wire sdc_int;
+wire sdc_iack = int_ack[3];
+wire [1:0] system_floppy_turbo;
+
+sysctrl sysctrl (
+        .clk(clk),
+        .reset(!reset),
+
+        .data_in_strobe(mcu_sys_strobe),
+        .data_in_start(mcu_start),
+        .data_in(mcu_data_out),
+        .data_out(sys_data_out),
+
+        .port_status(32'h00000000),
+        .port_out_available(8'd0),
+        .port_out_strobe(),
+        .port_out_data(8'h00),
+        .port_in_available(8'd0),
+        .port_in_strobe(),
+        .port_in_data(),
+
+        .system_chipset(),
+        .system_memory(),
+        .system_video(),
+        .system_reset(system_reset),
+        .system_scanlines(),
+        .system_volume(),
+        .system_wide_screen(),
+        .system_floppy_wprot(system_floppy_wprot),
+        .system_floppy_turbo(system_floppy_turbo),
+        .system_cubase_en(),
+        .system_port_mouse(),
+        .system_tos_slot(),
+
+        .int_out_n(mcu_intn),
+        .int_in( { 4'b0000, sdc_int, 1'b0, hid_int, 1'b0 }),
+        .int_ack( int_ack ),
+
+        .buttons( 2'b00 ),
+        .leds(leds),
+        .color(color)
+         );
+
+wire	    sd_rd;   // fdc requests sector read
+wire	    sd_wr;   // fdc requests sector write
+wire [7:0]  sd_rd_data;
+wire [7:0]  sd_wr_data;
+wire [31:0] sd_lba;
+wire [8:0]  sd_byte_index;
+wire	    sd_rd_byte_strobe;
+wire	    sd_busy, sd_done;
+wire [31:0] sd_img_size;
+wire [3:0]  sd_img_mounted;
+
+fdc1772 #( .FD_NUM(1'b1) ) fdc1772
+(
+ .clkcpu(clk),
+ .clk8m_en(cnt_8mhz == 2'd2),
+
+ .floppy_drive(1'b0),
+ .floppy_side(1'b1),
+ .floppy_reset(reset),
+ .floppy_step(),
+ .floppy_motor(1'b1),
+ .floppy_turbo(system_floppy_turbo),
+ .floppy_ready(),
+
+ .irq(irq),
+ .drq(drq),
+
+ .cpu_addr(cpu_addr),
+ .cpu_sel(cpu_sel),
+ .cpu_rw(cpu_rw),
+ .cpu_din(cpu_din),
+ .cpu_dout(cpu_dout),
+
+ // image information as reported by the MCU via sd_card
+ .img_type(3'd1),
+ .img_mounted(sd_img_mounted[0]),
+ .img_wp(system_floppy_wprot[0]),
+ .img_ds(1'd0),
+ .img_size(sd_img_size),
+
+ .sd_lba(sd_lba),
+ .sd_rd(sd_rd),
+ .sd_wr(sd_wr),
+ .sd_ack(sd_busy),
+ .sd_buff_addr(sd_byte_index),
+ .sd_dout(sd_rd_data),
+ .sd_din(sd_wr_data),
+ .sd_dout_strobe(sd_rd_byte_strobe)
+);
+
+sd_card #(
+    .CLK_DIV(3'd1),
+    .SIMULATE(1'b1)
+) sd_card (
+    .rstn(reset),
+    .clk(clk),
+
+    .sdclk(sdclk),
+    .sdcmd(sdcmd),
+    .sdcmd_in(sdcmd_in),
+    .sddat(sddat),
+    .sddat_in(sddat_in),
+
+    .data_strobe(mcu_sdc_strobe),
+    .data_start(mcu_start),
+    .data_in(mcu_data_out),
+    .data_out(sdc_data_out),
+
+    .image_size(sd_img_size),
+    .image_mounted(sd_img_mounted),
+
+    .irq(sdc_int),
+    .iack(sdc_iack),
+
+    .rstart({3'b000,sd_rd}),
+    .wstart({3'b000,sd_wr}),
+    .rsector(sd_lba),
+    .rcount(16'd1),
+    .rbusy(sd_busy),
+    .rdone(sd_done),
+
+    .inbyte(sd_wr_data),
+    .outen(sd_rd_byte_strobe),
+    .outaddr(sd_byte_index),
+    .outbyte(sd_rd_data)
+);
+
+endmodule
@@ -0,0 +1,42 @@
+//
+// FreeRTOS.h - single threaded FreeRTOS replacement for mcu_tb
+//
+// The firmware runs as one thread inside the testbench. Delays
+// advance the simulated FPGA instead of waiting and blocking calls
+// return immediately.
+//
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE             0
+#define pdTRUE              1
+#define pdPASS              1
+#define pdFAIL              0
+#define pdMS_TO_TICKS(x)    ((TickType_t)(x))
+#define portTICK_PERIOD_MS  1
+#define portMAX_DELAY       0xffffffffUL
+#define portYIELD_FROM_ISR(x) (void)(x)
+#define configASSERT(x)
+
+// provided by the testbench: run the simulation for the given
+// number of milliseconds and return the simulated time
+void cosim_delay_ms(TickType_t ms);
+TickType_t cosim_ms(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FREERTOS_H
@@ -0,0 +1,30 @@
+//
+// bflb.c - bouffalo sdk replacement for mcu_tb
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bflb_core.h"
+#include "bflb_wdg.h"
+
+int cosim_wdg_resets = 0;
+
+static struct bflb_device_s devices[] = {
+  { "spi0" }, { "gpio" }, { "watchdog" }, { NULL }
+};
+
+struct bflb_device_s *bflb_device_get_by_name(const char *name) {
+  for(struct bflb_device_s *dev = devices; dev->name; dev++)
+    if(!strcmp(dev->name, name))
+      return dev;
+
+  return NULL;
+}
+
+void bflb_wdg_init(struct bflb_device_s *dev, const struct bflb_wdg_config_s *config) { }
+
+void bflb_wdg_start(struct bflb_device_s *dev) {
+  printf("COSIM: watchdog reset requested\n");
+  cosim_wdg_resets++;
+}
@@ -0,0 +1,30 @@
+//
+// bflb_core.h - bouffalo sdk device replacement for mcu_tb
+//
+
+#ifndef BFLB_CORE_H
+#define BFLB_CORE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bflb_device_s {
+  const char *name;
+  uint32_t reg_base;
+  uint8_t irq_num;
+  uint8_t idx;
+  uint8_t sub_idx;
+  uint8_t dev_type;
+  void *user_data;
+};
+
+struct bflb_device_s *bflb_device_get_by_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BFLB_CORE_H
@@ -0,0 +1,10 @@
+//
+// bflb_gpio.h - bouffalo sdk gpio replacement for mcu_tb
+//
+
+#ifndef BFLB_GPIO_H
+#define BFLB_GPIO_H
+
+#include "bflb_core.h"
+
+#endif // BFLB_GPIO_H
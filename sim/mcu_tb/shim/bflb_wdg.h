@@ -0,0 +1,39 @@
+//
+// bflb_wdg.h - bouffalo sdk watchdog replacement for mcu_tb
+//
+// Starting the watchdog doesn't reset anything. The testbench counts
+// the resets the firmware requested instead.
+//
+
+#ifndef BFLB_WDG_H
+#define BFLB_WDG_H
+
+#include "bflb_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WDG_CLKSRC_BCLK  0
+#define WDG_CLKSRC_32K   1
+
+#define WDG_MODE_INTERRUPT  0
+#define WDG_MODE_RESET      1
+
+struct bflb_wdg_config_s {
+  uint8_t clock_source;
+  uint8_t clock_div;
+  uint16_t comp_val;
+  uint8_t mode;
+};
+
+void bflb_wdg_init(struct bflb_device_s *dev, const struct bflb_wdg_config_s *config);
+void bflb_wdg_start(struct bflb_device_s *dev);
+
+extern int cosim_wdg_resets;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BFLB_WDG_H
@@ -0,0 +1,156 @@
+//
+// freertos.c - single threaded FreeRTOS replacement for mcu_tb
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "queue.h"
+#include "timers.h"
+
+int cosim_locks = 0;
+
+// ------------------------------ semaphores ------------------------------
+
+static SemaphoreHandle_t sem_create(int mutex, int max, int initial) {
+  SemaphoreHandle_t sem = malloc(sizeof(*sem));
+  sem->mutex = mutex;
+  sem->max = max;
+  sem->count = initial;
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  return sem_create(1, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) {
+  return sem_create(0, max, initial);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout) {
+  // nobody else could ever give it, so an unavailable semaphore
+  // is either a firmware bug or a missing testbench feature
+  if(!sem->count) {
+    printf("COSIM: semaphore %p not available\n", sem);
+    return pdFALSE;
+  }
+
+  sem->count--;
+  if(sem->mutex) cosim_locks++;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  if(sem->count == sem->max)
+    return pdFALSE;
+
+  sem->count++;
+  if(sem->mutex) cosim_locks--;
+  return pdTRUE;
+}
+
+// -------------------------------- queues --------------------------------
+
+struct cosim_queue_S {
+  UBaseType_t len, size;
+  UBaseType_t rd, wr, used;
+  unsigned char *data;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t size) {
+  QueueHandle_t queue = malloc(sizeof(*queue));
+  memset(queue, 0, sizeof(*queue));
+  queue->len = len;
+  queue->size = size;
+  queue->data = malloc(len * size);
+  return queue;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t timeout) {
+  if(queue->used == queue->len)
+    return pdFALSE;
+
+  memcpy(queue->data + queue->wr * queue->size, item, queue->size);
+  queue->wr = (queue->wr + 1) % queue->len;
+  queue->used++;
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t timeout) {
+  // waiting forever can't be satisfied with only one thread. Finite
+  // timeouts let the simulation run, so interrupts and timers may
+  // still fill the queue
+  if(timeout == portMAX_DELAY) timeout = 0;
+
+  while(!queue->used && timeout--)
+    cosim_delay_ms(1);
+
+  if(!queue->used)
+    return pdFALSE;
+
+  memcpy(item, queue->data + queue->rd * queue->size, queue->size);
+  queue->rd = (queue->rd + 1) % queue->len;
+  queue->used--;
+  return pdTRUE;
+}
+
+// -------------------------------- timers --------------------------------
+
+#define MAX_TIMERS  8
+
+struct cosim_timer_S {
+  const char *name;
+  TickType_t period;
+  UBaseType_t reload;
+  TimerCallbackFunction_t callback;
+  int active;
+  TickType_t expires;
+};
+
+static struct cosim_timer_S timers[MAX_TIMERS];
+static int timers_num = 0;
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload,
+			   void *id, TimerCallbackFunction_t callback) {
+  if(timers_num == MAX_TIMERS) return NULL;
+
+  TimerHandle_t timer = &timers[timers_num++];
+  timer->name = name;
+  timer->period = period;
+  timer->reload = reload;
+  timer->callback = callback;
+  timer->active = 0;
+  return timer;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait) {
+  timer->active = 1;
+  timer->expires = cosim_ms() + timer->period;
+  return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait) {
+  timer->active = 0;
+  return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait) {
+  timer->period = period;
+  return xTimerStart(timer, wait);
+}
+
+void cosim_timers_run(TickType_t now) {
+  for(int i=0;i<timers_num;i++) {
+    TimerHandle_t timer = &timers[i];
+    if(!timer->active || (int32_t)(now - timer->expires) < 0)
+      continue;
+
+    if(timer->reload) timer->expires += timer->period;
+    else              timer->active = 0;
+
+    timer->callback(timer);
+  }
+}
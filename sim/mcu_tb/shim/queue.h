@@ -0,0 +1,26 @@
+//
+// queue.h - single threaded FreeRTOS replacement for mcu_tb
+//
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cosim_queue_S *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t size);
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t timeout);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t timeout);
+
+#define xQueueSendToBackFromISR(q, i, w)  xQueueSendToBack(q, i, 0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // QUEUE_H
@@ -0,0 +1,35 @@
+//
+// semphr.h - single threaded FreeRTOS replacement for mcu_tb
+//
+
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cosim_sem_S {
+  int mutex;
+  int count;
+  int max;
+} *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+
+// number of mutexes currently taken. The testbench doesn't dispatch
+// interrupts while this is non-zero as the firmware's interrupt
+// handling would block on them
+extern int cosim_locks;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SEMPHR_H
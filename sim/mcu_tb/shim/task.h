@@ -0,0 +1,19 @@
+//
+// task.h - single threaded FreeRTOS replacement for mcu_tb
+//
+
+#ifndef TASK_H
+#define TASK_H
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+
+// there's only one thread, so nothing can interrupt it
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+
+#define vTaskDelay(t)        cosim_delay_ms(t)
+#define xTaskGetTickCount()  cosim_ms()
+
+#endif // TASK_H
@@ -0,0 +1,33 @@
+//
+// timers.h - single threaded FreeRTOS replacement for mcu_tb
+//
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cosim_timer_S *TimerHandle_t;
+typedef TimerHandle_t xTimerHandle;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload,
+			   void *id, TimerCallbackFunction_t callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait);
+
+#define xTimerReset(t, w)  xTimerStart(t, w)
+
+// called by the testbench whenever simulated time has advanced
+void cosim_timers_run(TickType_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TIMERS_H
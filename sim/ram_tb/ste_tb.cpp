@@ -1,14 +1,29 @@
+/*
+  ste_tb.cpp
+
+  Usage: ste_tb [-T trigger]... [-w pre,post] [-e ms]
+    -T  write a waveform around a trigger, see sim/common/tracetrig.h.
+        Signals are addr (cpu address while AS is active), halted_n,
+        berr_n, mfpint_n and vsync_n. Default is time=200
+    -w  trace window before and after each trigger in ms (default 0,100)
+    -e  stop at the given simulated time (default 300)
+*/
+
 #include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <vector>
 
 #include "Vste_tb.h"
 #include "verilated.h"
-#include "verilated_vcd_c.h"
+
+#include "tracetrig.h"
+#include "bench.h"
 
 static Vste_tb *tb;
-static VerilatedVcdC *trace;
+static TraceTrigger *trigger;
 static double simulation_time;
 static int tos_is_192k = 0;
 
@@ -16,10 +31,6 @@ static int tos_is_192k = 0;
 
 #define TICKLEN   (1.0/64000000)
 
-// run for 100ms
-#define TRACESTART   .2
-#define TRACEEND     (TRACESTART + 0.1)
-
 static uint64_t GetTickCountMs() {
   struct timespec ts;
   
@@ -65,10 +76,8 @@ void tick(int c) {
     ticks = 0;
   }
   
-  // trace after
-#ifdef TRACESTART
-  if(simulation_time > TRACESTART) trace->dump(1000000000000 * simulation_time);
-#endif
+  trigger->tick(simulation_time);
+  bench_tick(simulation_time);
   simulation_time += TICKLEN;
   
   // each tick is 1/64 us ot 15,625ns as we are simulating a 32 MHz clock
@@ -179,6 +188,29 @@ void dump() {
 }
 
 int main(int argc, char **argv) {
+  std::vector<const char*> triggers;
+  double pre = 0, post = 0.1;
+  double end_time = 0.3;
+  int opt;
+
+  while((opt = getopt(argc, argv, "T:w:e:")) != -1) {
+    switch(opt) {
+    case 'T': triggers.push_back(optarg); break;
+    case 'w':
+      if(sscanf(optarg, "%lf,%lf", &pre, &post) != 2) {
+	fprintf(stderr, "Trace window must be given as pre,post\n");
+	return 1;
+      }
+      pre /= 1000; post /= 1000;
+      break;
+    case 'e': end_time = atof(optarg)/1000; break;
+    default:
+      fprintf(stderr, "Usage: %s [-T trigger]... [-w pre,post] [-e ms]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(triggers.empty()) triggers.push_back("time=200");
+
   initrom();  
   initram();
   
@@ -186,17 +218,22 @@ int main(int argc, char **argv) {
   Verilated::commandArgs(argc, argv);
   // Verilated::debug(1);
   Verilated::traceEverOn(true);
-  trace = new VerilatedVcdC;
-  trace->spTrace()->set_time_unit("1ns");
-  trace->spTrace()->set_time_resolution("1ps");
+  trigger = new TraceTrigger("ste_tb", pre, post);
   simulation_time = 0;
   
   // Create an instance of our module under test
   tb = new Vste_tb;
   tb->tos192k = tos_is_192k;
   
-  tb->trace(trace, 99);
-  trace->open("ste_tb.vcd");
+  trigger->attach(tb);
+
+  trigger->add_signal("addr",     []{ return tb->AS_N?~0ull:(uint64_t)tb->A; });
+  trigger->add_signal("halted_n", []{ return (uint64_t)tb->HALTED_N; });
+  trigger->add_signal("berr_n",   []{ return (uint64_t)tb->BERR_N; });
+  trigger->add_signal("mfpint_n", []{ return (uint64_t)tb->MFPINT_N; });
+  trigger->add_signal("vsync_n",  []{ return (uint64_t)tb->VSYNC_N; });
+  for(auto t : triggers)
+    if(!trigger->add(t)) return 1;
   
   // apply reset and power-on for a while */
   tb->resb = 0; tb->porb = 0;
@@ -204,11 +241,7 @@ int main(int argc, char **argv) {
   tb->resb = 1; tb->porb = 1;
   
   /* run for a while */
-  while(
-#ifdef TRACEEND
-	simulation_time<TRACEEND &&
-#endif
-	tb->HALTED_N) {
+  while(simulation_time < end_time && tb->HALTED_N) {
     tick(1);
     tick(0);
     
@@ -221,7 +254,7 @@ int main(int argc, char **argv) {
   
   dump();
   
-  trace->close();
+  trigger->close();
   
   /* dump ram content to disk */
   FILE *rd = fopen("ramdump.bin", "wb");
@@ -1,16 +1,23 @@
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
 #include "Vste_tb.h"
 #include "verilated.h"
+#if VM_TRACE
 #include "verilated_vcd_c.h"
+#endif
+#include "bench.h"
 
 // #define MONO
 // #define NTSC  // undef for PAL
+// #define SDRAM_LOG  // print every single sdram read and write
 
 static Vste_tb *tb;
+#if VM_TRACE
 static VerilatedVcdC *trace;
+#endif
 static int tickcount;
 
 static unsigned char ram[4*1024*1024];
@@ -41,12 +48,175 @@ void initrom() {
   fclose(file);
 }
 
+/* ============================= sdram model =============================== */
+
+// The sdram controller runs one access per ST bus slot of 8 clk32
+// cycles. The model decodes the commands on the sdram pins, serves
+// reads and writes from ram[] and accounts each cycle to the client
+// of the access in progress or as idle. A bank conflict is an
+// activate of the same bank as the directly preceding access which
+// thus couldn't be overlapped by a pipelined controller.
+
+#define SDRAM_SLOT  8
+
+enum { CLIENT_CPU, CLIENT_VIDEO, CLIENT_REFRESH, CLIENT_LOADER, CLIENT_IDLE, CLIENTS };
+static const char *client_name[CLIENTS] = { "cpu", "video/dma", "refresh", "loader", "idle" };
+
+struct sdram_stats_S {
+  uint64_t cycles[CLIENTS];
+  uint64_t reads, writes, refreshes, conflicts;
+};
+
+static struct {
+  int busy;             // cycles left of the current access
+  int client;           // client of the current access
+  int bank;             // bank of the last activate
+  int addr;             // byte address of the current access
+  int hs_n, vs_n;
+  int line, frame;
+  int worst_line;       // line with the least idle cycles in this frame
+  uint64_t worst_idle;
+  struct sdram_stats_S total, frm, ln;
+  FILE *lines;          // per line statistics
+} sdram = { 0, CLIENT_IDLE, -1, 0, 1, 1, 0, 0, -1, 0 };
+
+static uint64_t sdram_sum(const struct sdram_stats_S *s) {
+  uint64_t sum = 0;
+  for(int i=0;i<CLIENTS;i++) sum += s->cycles[i];
+  return sum;
+}
+
+static void sdram_add(struct sdram_stats_S *d, const struct sdram_stats_S *s) {
+  for(int i=0;i<CLIENTS;i++) d->cycles[i] += s->cycles[i];
+  d->reads += s->reads;
+  d->writes += s->writes;
+  d->refreshes += s->refreshes;
+  d->conflicts += s->conflicts;
+}
+
+static void sdram_print(const char *name, const struct sdram_stats_S *s) {
+  uint64_t sum = sdram_sum(s);
+  if(!sum) return;
+
+  printf("%s: %lu cycles, %.1f%% used (", name, sum, 100.0*(sum-s->cycles[CLIENT_IDLE])/sum);
+  for(int i=0;i<CLIENT_IDLE;i++)
+    printf("%s%s %.1f%%", i?", ":"", client_name[i], 100.0*s->cycles[i]/sum);
+  printf("), %lu reads, %lu writes, %lu refreshes, %lu bank conflicts\n",
+	 s->reads, s->writes, s->refreshes, s->conflicts);
+}
+
+static void sdram_line_end(void) {
+  uint64_t sum = sdram_sum(&sdram.ln);
+
+  if(sdram.lines && sum) {
+    fprintf(sdram.lines, "%d,%d,%lu", sdram.frame, sdram.line, sum);
+    for(int i=0;i<CLIENTS;i++) fprintf(sdram.lines, ",%lu", sdram.ln.cycles[i]);
+    fprintf(sdram.lines, ",%lu\n", sdram.ln.conflicts);
+  }
+
+  // the worst line tells how much is left for e.g. blitter bursts
+  if(sum >= SDRAM_SLOT && (sdram.worst_line < 0 || sdram.ln.cycles[CLIENT_IDLE] < sdram.worst_idle)) {
+    sdram.worst_line = sdram.line;
+    sdram.worst_idle = sdram.ln.cycles[CLIENT_IDLE];
+  }
+
+  sdram_add(&sdram.frm, &sdram.ln);
+  memset(&sdram.ln, 0, sizeof(sdram.ln));
+  sdram.line++;
+}
+
+static void sdram_frame_end(void) {
+  sdram_line_end();
+
+  if(sdram_sum(&sdram.frm)) {
+    char name[16];
+    sprintf(name, "Frame %d", sdram.frame);
+    sdram_print(name, &sdram.frm);
+    printf("  %d lines, worst line %d with %lu idle cycles\n",
+	   sdram.line, sdram.worst_line, sdram.worst_idle);
+  }
+
+  sdram_add(&sdram.total, &sdram.frm);
+  memset(&sdram.frm, 0, sizeof(sdram.frm));
+  sdram.frame++;
+  sdram.line = 0;
+  sdram.worst_line = -1;
+}
+
+static void sdram_clock(void) {
+  if(!sdram.lines) {
+    sdram.lines = fopen("sdram_lines.csv", "w");
+    if(sdram.lines) fprintf(sdram.lines, "frame,line,cycles,cpu,video,refresh,loader,idle,conflicts\n");
+  }
+
+  // ST video timing
+  if(tb->st_vsync_n && !sdram.vs_n)      sdram_frame_end();
+  else if(tb->st_hsync_n && !sdram.hs_n) sdram_line_end();
+  sdram.hs_n = tb->st_hsync_n;
+  sdram.vs_n = tb->st_vsync_n;
+
+  if(!tb->sd_cs) {
+    // activate
+    if(!tb->sd_ras && tb->sd_cas && tb->sd_we) {
+      sdram.addr = (tb->sd_ba<<21) + (tb->sd_addr<<10);
+      if(tb->sd_ba == sdram.bank) sdram.ln.conflicts++;
+      sdram.bank = tb->sd_ba;
+      sdram.client = tb->ram_client;
+      sdram.busy = SDRAM_SLOT;
+    }
+
+    // auto refresh
+    if(!tb->sd_ras && !tb->sd_cas && tb->sd_we) {
+      sdram.ln.refreshes++;
+      sdram.client = CLIENT_REFRESH;
+      sdram.busy = SDRAM_SLOT;
+    }
+
+    // read or write
+    if(tb->sd_ras && !tb->sd_cas) {
+      int addr = sdram.addr + ((tb->sd_addr&0xff)<<2);
+
+      if(!tb->sd_we) {
+	sdram.ln.writes++;
+#ifdef SDRAM_LOG
+	printf("WRITE %x = %x\n", addr, tb->sd_data);
+#endif
+	if(!(tb->sd_dqm & 1)) ram[addr+3] = (tb->sd_data >>  0) & 0xff;
+	if(!(tb->sd_dqm & 2)) ram[addr+2] = (tb->sd_data >>  8) & 0xff;
+	if(!(tb->sd_dqm & 4)) ram[addr+1] = (tb->sd_data >> 16) & 0xff;
+	if(!(tb->sd_dqm & 8)) ram[addr+0] = (tb->sd_data >> 24) & 0xff;
+      } else {
+	sdram.ln.reads++;
+	tb->sd_data_in = (ram[addr+0]<<24)+(ram[addr+1]<<16)+(ram[addr+2]<<8)+(ram[addr+3]<<0);
+#ifdef SDRAM_LOG
+	printf("READ %x = %x\n", addr, tb->sd_data_in);
+#endif
+      }
+    }
+  }
+
+  if(sdram.busy) {
+    sdram.ln.cycles[sdram.client]++;
+    sdram.busy--;
+  } else
+    sdram.ln.cycles[CLIENT_IDLE]++;
+}
+
+static void sdram_report(void) {
+  sdram_frame_end();
+  sdram_print("SDRAM total", &sdram.total);
+  if(sdram.lines) fclose(sdram.lines);
+}
+
 void tick(int c) {
   tb->clk32 = c;
   tb->flash_clk = c;
 
   tb->eval();
-  trace->dump(tickcount++);
+#if VM_TRACE
+  trace->dump(tickcount);
+#endif
+  bench_tick(tickcount++ * (1.0/64000000));
 
   // input [7:0]  dir_chr,
   
@@ -101,31 +271,7 @@ void tick(int c) {
   }
   spi_clk = tb->flash_clk;
   
-  // emulate SDRAM
-  if(c && !tb->sd_cs) {
-    static int addr;
-    
-    if(!tb->sd_ras && tb->sd_cas) {
-      addr = (tb->sd_ba<<21) + (tb->sd_addr<<10);
-    }
-    
-    if(tb->sd_ras && !tb->sd_cas) {
-      addr += (tb->sd_addr&0xff)<<2;
-      
-      // handle writes
-      if(!tb->sd_we) {
-	printf("WRITE %x = %x\n", addr, tb->sd_data);
-	if(!(tb->sd_dqm & 1)) ram[addr+3] = (tb->sd_data >>  0) & 0xff;
-	if(!(tb->sd_dqm & 2)) ram[addr+2] = (tb->sd_data >>  8) & 0xff;
-	if(!(tb->sd_dqm & 4)) ram[addr+1] = (tb->sd_data >> 16) & 0xff;
-	if(!(tb->sd_dqm & 8)) ram[addr+0] = (tb->sd_data >> 24) & 0xff;
-      } else {
-	// handle reads
-	tb->sd_data_in = (ram[addr+0]<<24)+(ram[addr+1]<<16)+(ram[addr+2]<<8)+(ram[addr+3]<<0);
-	printf("READ %x = %x\n", addr, tb->sd_data_in);
-      }
-    }
-  }
+  if(c) sdram_clock();
 }
 
 void dump() {
@@ -193,15 +339,19 @@ int main(int argc, char **argv) {
   // Initialize Verilators variables
   Verilated::commandArgs(argc, argv);
   Verilated::traceEverOn(true);
+#if VM_TRACE
   trace = new VerilatedVcdC;
+#endif
   tickcount = 0;
 
   memset(ram, 0x55, 4*1024*1024);
   
   // Create an instance of our module under test
   tb = new Vste_tb;
+#if VM_TRACE
   tb->trace(trace, 99);
   trace->open("gstmcu.vcd");
+#endif
 
 #ifdef MONO
   tb->mono_detect = 0;  // 1 - color, 0 - mono
@@ -264,5 +414,9 @@ int main(int argc, char **argv) {
   for(int i=0;i<10000;i++) {
     tick(1); tick(0);
   }
+  sdram_report();
+
+#if VM_TRACE
   trace->close();
+#endif
 }
@@ -114,7 +114,13 @@ module ste_tb (
 
     output [5:0]  led,
 
-    output	  bus_free
+    output	  bus_free,
+
+    // source of the current sdram access and ST video timing for
+    // the sdram statistics of the testbench
+    output [1:0]  ram_client,
+    output	  st_hsync_n,
+    output	  st_vsync_n
    );
 
 assign led = { !flash_ready, 2'b11, mspi_cs, !flash_cs, !flash_busy };
@@ -574,6 +580,16 @@ wire [15:0] sdram_din =
 	    (!atari_reset_n)?flash_doutD:
 	    16'h55aa;
 
+// 0=cpu, 1=video/dma (gstmcu address phase), 2=refresh, 3=flash loader
+assign ram_client =
+     (!atari_reset_n)?2'd3:
+     REF?2'd2:
+     gstmcu.addrselb?2'd1:
+     2'd0;
+
+assign st_hsync_n = st_hs_n;
+assign st_vsync_n = st_vs_n;
+
 sdram sdram (
         .clk(clk32),
 	.reset_n(porb),
@@ -2,7 +2,9 @@
 /*       Atari ST/STe/Mega STe core         */
 /********************************************/
 
-module atarist (
+module atarist #(
+	parameter TRACK_CACHE = 1'b0  // keep whole floppy tracks in block RAM
+) (
 	// System clocks / reset / settings
 	input wire 		   clk_32,
 	input wire 		   porb,
@@ -46,6 +48,7 @@ module atarist (
 	output [1:0] 	   acsi_rd_req,
 	output [1:0] 	   acsi_wr_req,
 	output [31:0] 	   acsi_sd_lba,
+	output [15:0] 	   acsi_sd_count,
  	input 			   acsi_sd_done,
  	input 			   acsi_sd_busy,
 	input 			   acsi_sd_rd_byte_strobe,
@@ -80,6 +83,7 @@ module atarist (
     input wire 		   enable_extra_ram,
     input wire 		   blitter_en,
     input [1:0] 	   floppy_protected, // floppy A/B write protect
+    input [1:0] 	   floppy_turbo,     // floppy speed up 2^floppy_turbo
 	input 			   cubase_en,
 				
 	// DRAM interface
@@ -877,6 +881,7 @@ dma dma (
 	.acsi_rd_req  ( acsi_rd_req                 ),
 	.acsi_wr_req  ( acsi_wr_req                 ),
 	.acsi_lba     ( acsi_sd_lba                 ),
+	.acsi_count   ( acsi_sd_count               ),
  	.sd_done      ( acsi_sd_done                ),
  	.sd_busy      ( acsi_sd_busy                ),
 	.sd_rd_byte_strobe ( acsi_sd_rd_byte_strobe ),
@@ -912,7 +917,7 @@ wire [1:0] floppy_sel_exclusive = (floppy_sel == 2'b00)?2'b10:floppy_sel;
 // -> waits for spin up, but no index pulses
 // Fix: Floppy should generate index pulses even without disk inserted
    
-fdc1772 fdc1772 (
+fdc1772 #( .TRACK_CACHE(TRACK_CACHE) ) fdc1772 (
 	.clkcpu         ( clk_32           ), // system cpu clock.
 	.clk8m_en       ( mhz8_en1         ),
 
@@ -922,6 +927,7 @@ fdc1772 fdc1772 (
 	.floppy_reset   ( ~peripheral_reset),
     .floppy_step    (                  ),
     .floppy_motor   ( 1'b0             ),  // unused in ST
+	.floppy_turbo   ( floppy_turbo     ),
 
 	// interrupts
 	.irq            ( fdc_irq          ),
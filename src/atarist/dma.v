@@ -66,6 +66,7 @@ module dma (
 	output [1:0] 	  acsi_rd_req,       // read request for two ACSI targets
 	output reg [1:0]  acsi_wr_req,       // write request for two ACSI targets
 	output [31:0] 	  acsi_lba,          // logical block to read or write
+	output [15:0] 	  acsi_count,        // number of blocks of the command from acsi_lba on
  	input 			  sd_busy,           // SD is busy (has accepted read or write request)
  	input 			  sd_done,           // SD is done (data has been read or written)
 	input 			  sd_rd_byte_strobe, // SD has read a byte to be stored in ACSI buffer
@@ -160,11 +161,16 @@ end
 // sector buffer to receive data from SD card at full
 // speed and to be able to receive it via DMA at
 // a reduced speed. This buffer is currently only used
-// for ACSI. Floppy has it's own buffer
-reg [7:0] buffer [512];
+// for ACSI. Floppy has it's own buffer. Reads use both
+// halves: While one sector is being drained into the DMA
+// fifo, the next one of a multi sector command is already
+// fetched from SD card into the other half. Writes only
+// use the first half
+reg [7:0] buffer [1024];
 
 // number of blocks requested by ACSI
 wire [15:0] acsi_length;
+assign acsi_count = acsi_length;
 
 reg [2:0] acsi_io_state;   
 reg [31:0] acsi_image_size[2];
@@ -186,11 +192,11 @@ end
 
 always @(posedge clk) begin
    // waiting for SD card to deliver the sector
-   if(acsi_io_state == READ_WAIT4SD && sd_rd_byte_strobe)
-      buffer[sd_byte_addr] <= sd_rd_byte;
+   if(acsi_rd_fetch == FETCH_WAIT4SD && sd_rd_byte_strobe)
+      buffer[{acsi_sd_half, sd_byte_addr}] <= sd_rd_byte;
 
    if(acsi_io_state == WRITE_WAIT4SD)
-	  sd_wr_byte <= buffer[sd_byte_addr];   	  
+	  sd_wr_byte <= buffer[{1'b0, sd_byte_addr}];   	  
 end
    
 // select signal for the acsi controller access (write only, status comes from io controller)
@@ -199,6 +205,7 @@ wire [7:0] acsi_dout;
 
 // state machine to copy from sector buffer into fifo
 reg [8:0] acsi_io_counter;
+reg [8:0] acsi_rd_counter;
 reg [15:0] acsi_read_data;   
 reg acsi_read_strobe;   
 reg acsi_write_strobe;   
@@ -211,23 +218,44 @@ reg acsi_request_next;
 // arived in the buffer
 wire [1:0] acsi_wr_req_int;  
    
-// states of the ACSI read/write state machine
+// states of the ACSI write state machine
 localparam [2:0] IDLE            = 3'd0,
-                 READ_WAIT4SD    = 3'd1,
-                 READING         = 3'd2,
-                 READ_WAIT4DMA   = 3'd3,
-                 READ_CHECK_NEXT = 3'd4,
                  WRITING         = 3'd5,
                  WRITE_START_SD  = 3'd6,
                  WRITE_WAIT4SD   = 3'd7;
 
-// TODO: narrow this more
-wire acsi_is_reading = acsi_io_state >= READ_WAIT4SD && acsi_io_state <= READ_CHECK_NEXT;
+// states of the ACSI read ahead
+localparam [1:0] FETCH_IDLE      = 2'd0,
+                 FETCH_NEXT      = 2'd1,   // next sector requested from acsi
+                 FETCH_WAIT4SD   = 2'd2;
+
+reg [1:0] acsi_rd_fetch;
+reg       acsi_rd_run;       // a read command is being processed
+reg       acsi_sd_half;      // buffer half the SD card reads into
+reg       acsi_dma_half;     // buffer half drained into the fifo
+reg [1:0] acsi_half_full;
+reg       acsi_draining;
+reg [1:0] acsi_in_fifo;      // sectors in the fifo not completely written to ram yet
+reg       sector_strobeD;
+
+// sectors fetched but not yet in ram
+wire [7:0] acsi_rd_pending = { 6'd0, acsi_in_fifo } + acsi_half_full[0] + acsi_half_full[1];
+
+// another sector is to be fetched if the command requests more and
+// if the DMA sector counter is not yet covered by the sectors fetched
+wire acsi_fetch_more = acsi_rd_run && acsi_length > 1 && dma_scnt > acsi_rd_pending;
+
+wire acsi_is_reading = acsi_rd_run;
 wire acsi_is_writing = acsi_io_state >= WRITING && acsi_io_state <= WRITE_WAIT4SD; 
 
 wire [3:0] fifo_fill = fifo_wptr - fifo_rptr;   
 wire fifo_is_full = (fifo_fill == 15);  
 
+// the last word of a sector leaves the buffer. The sector is counted
+// into the fifo in the same cycle its buffer half is freed, so
+// acsi_rd_pending never drops in between
+wire acsi_sector_to_fifo = acsi_draining && acsi_rd_counter == 9'd511 && !fifo_is_full;
+
 // ACSI DMA state machine, reveiving data from SD card and writing it via DMA    
 always @(posedge clk) begin
    if (reset) begin
@@ -245,9 +273,6 @@ always @(posedge clk) begin
       
       case(acsi_io_state)
         IDLE: begin
-           if(acsi_rd_req)
-			 acsi_io_state <= READ_WAIT4SD;
-		   
            if(acsi_wr_req_int) begin
 			  acsi_io_state <= WRITING;
               acsi_io_counter <= 9'd0;
@@ -260,7 +285,7 @@ always @(posedge clk) begin
 			   if((!acsi_io_counter[3:0] && fifo_fill == 8) || 
 				  ( acsi_io_counter[3:0] && fifo_fill)) begin
 				 
-				  buffer[acsi_io_counter] <= fifo_data_out[15:8];			   
+				  buffer[{1'b0, acsi_io_counter}] <= fifo_data_out[15:8];			   
 				  acsi_io_counter <= acsi_io_counter + 9'd1;
 
 				  // write strobe causes the fifo read pointer to increase.
@@ -273,7 +298,7 @@ always @(posedge clk) begin
 			   // give fifo one extra cycle after the strobe to deliver data
 			   if(!acsi_write_strobe) begin
 			   
-				  buffer[acsi_io_counter] <= fifo_data_out[7:0];
+				  buffer[{1'b0, acsi_io_counter}] <= fifo_data_out[7:0];
 				  acsi_io_counter <= acsi_io_counter + 9'd1;
 			   
 				  if(acsi_io_counter == 9'd511) begin
@@ -309,56 +334,100 @@ always @(posedge clk) begin
               acsi_io_state <= IDLE;
            end
 		end
-		
-        READ_WAIT4SD:
-             if(sd_done) begin
-                // sd card has delivered data, so
-                // push it into the DMA fifo
-                acsi_io_state <= READING;
-                acsi_io_counter <= 9'd0;
-             end
-		
-        READING: begin
-            if(!acsi_io_counter[0]) begin
-                // read upper byte from sector buffer. Two bytes
-                // are needed since the fifo is 16 bit
-                acsi_read_data[15:8] <= buffer[acsi_io_counter];
-                acsi_io_counter <= acsi_io_counter + 9'd1;
-            end else begin
-                // read lower byte
-                acsi_read_data[7:0] <= buffer[acsi_io_counter];
-
-                // trigger strobe and continue  if fifo is not full
-                if(!fifo_is_full) begin
-                    acsi_read_strobe <= 1'b1;	      
-                    acsi_io_counter <= acsi_io_counter + 9'd1;
-
-                    if(acsi_io_counter == 9'd511) acsi_io_state <= READ_WAIT4DMA;
-                end
-            end // else: !if(!acsi_io_counter[0])
-        end // case: READING
-		
-        READ_WAIT4DMA:
-            // all data sent into fifo, wait for last dma transfer to end
-            if(sector_strobe)
-                acsi_io_state <= READ_CHECK_NEXT;
-		
-        READ_CHECK_NEXT: begin
-            // check if sector counter has reached 0 or the last requested
-		    // sector has been sent
-            if(dma_scnt != 0 && acsi_length > 1)
+
+        default:
+            acsi_io_state <= IDLE;
+      endcase
+
+      // ---------------- read ahead from SD card ----------------
+      case(acsi_rd_fetch)
+        FETCH_IDLE:
+            if(acsi_rd_req) begin
+                // first sector of a read command
+                acsi_rd_run <= 1'b1;
+                acsi_rd_fetch <= FETCH_WAIT4SD;
+            end else if(acsi_fetch_more && !acsi_half_full[acsi_sd_half]) begin
                 // request next read request and increase lba
                 acsi_request_next <= 1'b1;
-            else
-                // request acsi to raise interrupt, so core CPU knows
-                // that the transfer has ended
-                acsi_dma_done <= 1'b1;
+                acsi_rd_fetch <= FETCH_NEXT;
+            end
 
-            // return to idle state
-            acsi_io_state <= IDLE;
-        end
+        FETCH_NEXT:
+            if(acsi_rd_req)
+                acsi_rd_fetch <= FETCH_WAIT4SD;
+
+        FETCH_WAIT4SD:
+            if(sd_done) begin
+                // sd card has delivered data, so it can
+                // be pushed into the DMA fifo
+                acsi_half_full[acsi_sd_half] <= 1'b1;
+                acsi_sd_half <= !acsi_sd_half;
+                acsi_rd_fetch <= FETCH_IDLE;
+            end
+
+        default:
+            acsi_rd_fetch <= FETCH_IDLE;
       endcase
+
+      // ---------------- drain buffer into fifo -----------------
+      if(!acsi_draining) begin
+         if(acsi_half_full[acsi_dma_half]) begin
+            acsi_draining <= 1'b1;
+            acsi_rd_counter <= 9'd0;
+         end
+      end else begin
+         if(!acsi_rd_counter[0]) begin
+            // read upper byte from sector buffer. Two bytes
+            // are needed since the fifo is 16 bit
+            acsi_read_data[15:8] <= buffer[{acsi_dma_half, acsi_rd_counter}];
+            acsi_rd_counter <= acsi_rd_counter + 9'd1;
+         end else begin
+            // read lower byte
+            acsi_read_data[7:0] <= buffer[{acsi_dma_half, acsi_rd_counter}];
+
+            // trigger strobe and continue  if fifo is not full
+            if(!fifo_is_full) begin
+               acsi_read_strobe <= 1'b1;	      
+               acsi_rd_counter <= acsi_rd_counter + 9'd1;
+
+               // this half is free again for the next sector
+               if(acsi_sector_to_fifo) begin
+                  acsi_draining <= 1'b0;
+                  acsi_half_full[acsi_dma_half] <= 1'b0;
+                  acsi_dma_half <= !acsi_dma_half;
+               end
+            end
+         end
+      end
+
+      // count sectors between fifo and ram
+      sector_strobeD <= sector_strobe;
+      if(acsi_sector_to_fifo) begin
+         if(!(sector_strobe && acsi_in_fifo != 2'd0))
+            acsi_in_fifo <= acsi_in_fifo + 2'd1;
+      end else if(sector_strobe && acsi_in_fifo != 2'd0)
+         acsi_in_fifo <= acsi_in_fifo - 2'd1;
+
+      // The sector counter is valid one cycle after a sector has been
+      // written to ram. Request acsi to raise interrupt, so core CPU
+      // knows that the transfer has ended
+      if(acsi_rd_run && sector_strobeD && acsi_rd_pending == 8'd0 && !acsi_draining &&
+         acsi_rd_fetch == FETCH_IDLE && !acsi_fetch_more) begin
+         acsi_dma_done <= 1'b1;
+         acsi_rd_run <= 1'b0;
+      end
    end // else: !if(reset)
+
+   // a cpu reset of the dma fifo starts over
+   if (reset || fifo_reset) begin
+      acsi_rd_fetch <= FETCH_IDLE;
+      acsi_rd_run <= 1'b0;
+      acsi_sd_half <= 1'b0;
+      acsi_dma_half <= 1'b0;
+      acsi_half_full <= 2'b00;
+      acsi_draining <= 1'b0;
+      acsi_in_fifo <= 2'd0;
+   end
 end
 
 acsi acsi(
@@ -28,6 +28,7 @@ module fdc1772 (
 	output           floppy_step,
 	input            floppy_motor,
 	output           floppy_ready,
+	input      [1:0] floppy_turbo, // 0 - authentic timing, 1/2/3 - 2/4/8 times faster
 
 	// interrupts
 	output reg       irq,
@@ -61,6 +62,7 @@ parameter FD_NUM           = 2;    // number of supported floppies
 parameter MODEL            = 2;    // 0 - wd1770, 1 - fd1771, 2 - wd1772, 3 = wd1773/fd1793
 parameter EXT_MOTOR        = 1'b0; // != 0 if motor is controlled externally by floppy_motor
 parameter INVERT_HEAD_RA   = 1'b0; // != 0 - invert head in READ_ADDRESS reply
+parameter TRACK_CACHE      = 1'b0; // != 0 - buffer whole tracks of double density .st images
 
 localparam IMG_ARCHIE      = 0;
 localparam IMG_ST          = 1;
@@ -181,7 +183,7 @@ end
 always @(*) begin
 	case (fd_type)
 	IMG_ARCHIE:    sd_lba = {(16'd0 + (fd_spt*track[6:0]) << fd_doubleside) + (floppy_side ? 5'd0 : fd_spt) + sector[5:0], s_odd };
-	IMG_ST:        sd_lba = ((fd_spt*track[6:0]) << fd_doubleside) + (floppy_side ? 6'd0 : fd_spt) + sector[5:0] - 1'd1;
+	IMG_ST:        sd_lba = ((fd_spt*track[6:0]) << fd_doubleside) + (sd_fill ? fill_slot : (floppy_side ? 6'd0 : fd_spt) + sector[5:0] - 1'd1);
 	IMG_PLUSD_IMG: sd_lba = (floppy_side ? 16'd0 : 16'd800) + fd_spt*track[6:0] + sector[5:0] - 1'd1;
 	IMG_BBC:       sd_lba = (((fd_spt*track[6:0]) << fd_doubleside) + (floppy_side ? 5'd0 : fd_spt) + sector[5:0]) >> 1;
 	IMG_TI99:      sd_lba = (fd_spt*(floppy_side ? track[5:0] : 79-track[5:0]) + sector[5:0]) >> 1;
@@ -309,6 +311,7 @@ generate
 			// control signals into floppy
 			.select      ( fd_any && fdn == i ),
 			.motor_on    ( fd_motor           ),
+			.turbo       ( turbo              ),
 			.step_in     ( step_in            ),
 			.step_out    ( step_out           ),
 
@@ -335,6 +338,38 @@ generate
 endgenerate
 
 
+// ------------------------------ turbo mode -------------------------------
+// In turbo mode the disk spins 2, 4 or 8 times faster and the step rates
+// and delays shrink by the same factor. Copy protections often read raw
+// tracks or sector ids or poll the index bit of the status register to
+// measure the disk rotation. Once any of this is seen, turbo stays off
+// until the next reset or disk change.
+reg        turbo_off;
+reg  [5:0] index_polls;
+wire [1:0] turbo = turbo_off ? 2'd0 : floppy_turbo;
+wire [3:0] turbo_step = 4'd1 << turbo;
+
+always @(posedge clkcpu) begin
+	reg indexD;
+
+	indexD <= fd_index;
+	if (!floppy_reset || |img_mounted) begin
+		turbo_off <= 1'b0;
+		index_polls <= 6'd0;
+	end else begin
+		// read track and read address
+		if (cmd_rx && (cmd[7:4] == 4'b1110 || cmd[7:4] == 4'b1100)) turbo_off <= 1'b1;
+
+		// TOS reads the status once in a while to detect disk changes,
+		// polling it many times per rotation means waiting for the index
+		if (indexD && !fd_index) index_polls <= 6'd0;
+		else if (cpu_rw_cmdstatus && cpu_rw && (cmd_type_1 || cmd_type_4)) begin
+			if (&index_polls) turbo_off <= 1'b1;
+			else index_polls <= index_polls + 6'd1;
+		end
+	end
+end
+
 // -------------------------------------------------------------------------
 // ----------------------- internal state machines -------------------------
 // -------------------------------------------------------------------------
@@ -435,12 +470,16 @@ always @(posedge clkcpu) begin
 		end
 
 		 // step rate timer
-		if(step_rate_cnt != 0) 
-			step_rate_cnt <= step_rate_cnt - 16'd1;
+		if(step_rate_cnt > turbo_step) 
+			step_rate_cnt <= step_rate_cnt - turbo_step;
+		else
+			step_rate_cnt <= 20'd0;
 
 		// delay timer
-		if(delay_cnt != 0) 
-			delay_cnt <= delay_cnt - 1'd1;
+		if(delay_cnt > turbo_step) 
+			delay_cnt <= delay_cnt - turbo_step;
+		else
+			delay_cnt <= 24'd0;
 
 		// just received a new command
 		if(cmd_rx) begin
@@ -586,12 +625,13 @@ always @(posedge clkcpu) begin
 							// wait 5 rotations (1 sec) before setting RNF
 							sector_not_found <= 1'b1;
 							delay_cnt <= 24'd1000 * CLK_EN;
-						end else if (sd_state == SD_IDLE) begin
+						end else if ((sd_state == SD_IDLE || sd_state == SD_FILL) && !sd_read_req && !sd_write_req) begin
+							// a background fill of the track cache doesn't delay cached sectors
 							case (data_transfer_state)
 
 							2'b00: if (fifo_cpuptr == 0) begin
-								// SD Card phase
-								sd_card_read <= 1;
+								// SD Card phase, skipped if the track is in the cache
+								sd_card_read <= !cache_hit;
 								data_transfer_state <= 2'b01;
 							end
 
@@ -630,7 +670,7 @@ always @(posedge clkcpu) begin
                                 // wait 5 rotations (1 sec) before setting RNF
                                 sector_not_found <= 1'b1;
                                 delay_cnt <= 24'd1000 * CLK_EN;
-                            end else if (sd_state == SD_IDLE) begin
+                            end else if (sd_state == SD_IDLE && !sd_read_req && !sd_write_req) begin
                                 case (data_transfer_state)
                                 2'b00: begin
                                     // pre-read phase
@@ -733,28 +773,54 @@ reg data_transfer_done;
 // 0.5/1 kB buffer used to receive a sector as fast as possible from from the io
 // controller. The internal transfer afterwards then runs at 250000 Bit/s
 reg  [10:0] fifo_cpuptr;
-reg  [9:0] fifo_cpuptr_adj;
+reg  [13:0] fifo_cpuptr_adj;
 wire [7:0] fifo_q;
 reg        s_odd; //odd sector
-reg  [9:0] fifo_sdptr;
+reg  [13:0] fifo_sdptr;
+
+// With TRACK_CACHE the buffer grows to 16kB and holds all sectors of
+// both sides of one track of a double density .st image, one sector
+// per slot. A sector read on another track fetches the requested
+// sector first, the remaining sectors of the track are then read in
+// the background while the SD card is otherwise idle. Written sectors
+// end up in their slot and are written through to the SD card.
+wire       cache_on = TRACK_CACHE && fd_type == IMG_ST && fd_sector_size_code == 2 && fd_spt <= 11;
+wire [4:0] cache_slot = (floppy_side ? 5'd0 : fd_spt[4:0]) + sector[4:0] - 5'd1;
+wire [4:0] cache_slots = fd_doubleside ? { fd_spt[3:0], 1'b0 } : fd_spt[4:0];
+wire [21:0] cache_mask = ~(22'h3fffff << cache_slots);
+reg [21:0] cache_valid;  // one bit per slot
+reg        cache_active;
+reg [WIDX:0] cache_fdn;
+reg  [6:0] cache_track;
+wire       cache_tag = cache_active && cache_fdn == fdn && cache_track == track[6:0];
+wire       cache_hit = cache_on && cache_tag && cache_valid[cache_slot];
+wire       cache_fill = cache_on && cache_tag && !(&(cache_valid | ~cache_mask));
+reg        sd_fill;    // reading a sector into the cache in the background
+reg  [4:0] fill_slot;
 
 always @(*) begin
-	if (fd_sector_size_code == 3)
-		fifo_sdptr = { s_odd, sd_buff_addr };
+	if (cache_on)
+		fifo_sdptr = { sd_fill ? fill_slot : cache_slot, sd_buff_addr };
+	else if (fd_sector_size_code == 3)
+		fifo_sdptr = { 4'd0, s_odd, sd_buff_addr };
 	else
-		fifo_sdptr = { 1'b0, sd_buff_addr };
+		fifo_sdptr = { 5'd0, sd_buff_addr };
 
-	if (fd_sector_size_code == 1)
-		fifo_cpuptr_adj = { 1'b0, (fd_spt[0] & (track[0] ^ !floppy_side)) ^ sector[0] ^ fd_sector_base, fifo_cpuptr[7:0] };
+	if (cache_on)
+		fifo_cpuptr_adj = { cache_slot, fifo_cpuptr[8:0] };
+	else if (fd_sector_size_code == 1)
+		fifo_cpuptr_adj = { 5'd0, (fd_spt[0] & (track[0] ^ !floppy_side)) ^ sector[0] ^ fd_sector_base, fifo_cpuptr[7:0] };
 	else
-		fifo_cpuptr_adj = fifo_cpuptr[9:0];
+		fifo_cpuptr_adj = { 4'd0, fifo_cpuptr[9:0] };
 end
 
 reg data_in_strobe;
 reg [7:0] data_in;
 
-`ifdef VERILATOR
-fdc1772_dpram #(8, 10) fifo
+generate
+if (TRACK_CACHE) begin :cache
+
+fdc1772_dpram #(8, 14) fifo
 (
 	.clock(clkcpu),
 
@@ -768,13 +834,31 @@ fdc1772_dpram #(8, 10) fifo
 	.wren_b(data_in_strobe),
 	.q_b(fifo_q)
 );
+
+end else begin :nocache
+
+`ifdef VERILATOR
+fdc1772_dpram #(8, 10) fifo
+(
+	.clock(clkcpu),
+
+	.address_a(fifo_sdptr[9:0]),
+	.data_a(sd_dout),
+	.wren_a(sd_dout_strobe & sd_ack),
+	.q_a(sd_din),
+
+	.address_b(fifo_cpuptr_adj[9:0]),
+	.data_b(data_in),
+	.wren_b(data_in_strobe),
+	.q_b(fifo_q)
+);
 `else
 fdc_dpram fifo
 (
     .clka(clkcpu),
     .reseta(1'b0),
     .cea(1'b1),
-    .ada(fifo_sdptr),
+    .ada(fifo_sdptr[9:0]),
     .wrea(sd_dout_strobe & sd_ack),
     .dina(sd_dout),
     .ocea(1'b1),
@@ -783,7 +867,7 @@ fdc_dpram fifo
     .clkb(clkcpu),
     .resetb(1'b0),
     .ceb(1'b1),
-    .adb(fifo_cpuptr_adj),
+    .adb(fifo_cpuptr_adj[9:0]),
     .wreb(data_in_strobe),
     .dinb(data_in),
     .oceb(1'b1),
@@ -791,14 +875,20 @@ fdc_dpram fifo
 );
 `endif
 
+end
+endgenerate
+
 // ------------------ SD card control ------------------------
 localparam SD_IDLE = 0;
 localparam SD_READ = 1;
 localparam SD_WRITE = 2;
+localparam SD_FILL = 3;
 
 reg [1:0] sd_state;
 reg       sd_card_write;
 reg       sd_card_read;
+reg       sd_read_req;
+reg       sd_write_req;
 
 always @(posedge clkcpu) begin
 	reg sd_ackD;
@@ -810,23 +900,64 @@ always @(posedge clkcpu) begin
 	sd_ackD <= sd_ack;
 	if (sd_ack) {sd_rd, sd_wr} <= 0;
 
+	// requests wait for a background fill to finish
+	if (~sd_card_readD & sd_card_read) sd_read_req <= 1'b1;
+	if (~sd_card_writeD & sd_card_write) sd_write_req <= 1'b1;
+
 	case (sd_state)
 	SD_IDLE:
 	begin
 		s_odd <= 1'b0;
-		if (~sd_card_readD & sd_card_read) begin
+		sd_fill <= 1'b0;
+		if (sd_read_req) begin
+			sd_read_req <= 1'b0;
 			sd_rd[fdn] <= 1;
 			sd_state <= SD_READ;
+
+			// a read on another track starts caching that track
+			if (cache_on && !cache_tag) begin
+				cache_valid <= 22'd0;
+				cache_active <= 1'b1;
+				cache_fdn <= fdn;
+				cache_track <= track[6:0];
+				fill_slot <= 5'd0;
+			end
 		end
-		else if (~sd_card_writeD & sd_card_write) begin
+		else if (sd_write_req) begin
+			sd_write_req <= 1'b0;
 			sd_wr[fdn] <= 1;
 			sd_state <= SD_WRITE;
+
+			// the written sector has replaced a slot of the cached track
+			if (cache_on && cache_tag) cache_valid[cache_slot] <= 1'b1;
+			else cache_active <= 1'b0;
 		end
+		else if (cache_fill && !(busy && cmd[7:5] == 3'b101)) begin
+			// look for the next slot still missing. Not while a sector is
+			// being written as the fill could replace the written data
+			if (fill_slot >= cache_slots)
+				fill_slot <= 5'd0;
+			else if (cache_valid[fill_slot])
+				fill_slot <= fill_slot + 5'd1;
+			else begin
+				sd_fill <= 1'b1;
+				sd_rd[fdn] <= 1;
+				sd_state <= SD_FILL;
+			end
+		end
+	end
+
+	SD_FILL:
+	if (sd_ackD & ~sd_ack) begin
+		// the head may have moved meanwhile
+		if (cache_on && cache_tag) cache_valid[fill_slot] <= 1'b1;
+		sd_state <= SD_IDLE;
 	end
 
 	SD_READ:
 	if (sd_ackD & ~sd_ack) begin
 		if (s_odd || fd_sector_size_code != 3) begin
+			if (cache_on && cache_tag) cache_valid[cache_slot] <= 1'b1;
 			sd_state <= SD_IDLE;
 		end else begin
 			s_odd <= 1;
@@ -846,6 +977,9 @@ always @(posedge clkcpu) begin
 
 	default: ;
 	endcase
+
+	// a new image or a reset invalidates the cache
+	if (|img_mounted || !floppy_reset) cache_active <= 1'b0;
 end
 
 // -------------------- CPU data read/write -----------------------
@@ -1088,7 +1222,6 @@ end
 
 endmodule
 
-`ifdef VERILATOR
 module fdc1772_dpram #(parameter DATAWIDTH=8, ADDRWIDTH=9)
 (
 	input                   clock,
@@ -1125,4 +1258,3 @@ always @(posedge clock) begin
 end
 
 endmodule
-`endif
@@ -24,6 +24,7 @@ module floppy (
 
 	input        select,
 	input        motor_on,
+	input  [1:0] turbo,          // spin 2^turbo times faster
 	input        step_in,
 	input        step_out,
 
@@ -131,7 +132,7 @@ always @(posedge clk) begin
 	step_outD <= step_out;
 
 	if(clk8m_en && step_busy != 0)
-		step_busy <= step_busy - 18'd1;
+		step_busy <= (step_busy > (20'd1 << turbo)) ? step_busy - (20'd1 << turbo) : 20'd0;
 
 	if(select) begin
 		// rising edge of step signal starts step
@@ -309,18 +310,20 @@ end
 // Generate a data clock from the system clock. This depends on motor
 // speed and reaches the full rate when the disk rotates at 300RPM. No
 // valid data can be read until the disk has reached it's full speed.
+// In turbo mode the disk rotates 2^turbo times faster.
 reg data_clk;
 reg data_clk_en;
 reg [31:0] clk_cnt;
+wire [31:0] turbo_rate = rate << turbo;
 always @(posedge clk) begin
 	data_clk_en <= 0;
 	if(clk8m_en) begin
-		if(clk_cnt + rate > CLK_EN*1000/2) begin
-			clk_cnt <= clk_cnt - (CLK_EN*1000/2 - rate);
+		if(clk_cnt + turbo_rate > CLK_EN*1000/2) begin
+			clk_cnt <= clk_cnt - (CLK_EN*1000/2 - turbo_rate);
 			data_clk <= !data_clk;
 			if (~data_clk) data_clk_en <= 1;
 		end else
-			clk_cnt <= clk_cnt + rate;
+			clk_cnt <= clk_cnt + turbo_rate;
 	end
 end
 
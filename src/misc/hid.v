@@ -18,6 +18,10 @@ module hid (
   output reg	  irq,
   input			  iack,
 
+  // vertical blank of the core's video, used to let the MCU
+  // sync mouse movement to the video frames
+  input           vbl,
+
   // output HID data received from USB
   output [5:0]     mouse,
   output reg [7:0] keyboard[14:0],
@@ -37,14 +41,43 @@ reg [14:0] mouse_div;
 reg [3:0] state;
 reg [7:0] command;  
 reg [7:0] device;   // used for joystick
+
+// batch command: a list of records, each starting with a header
+// byte holding the record's command in the upper and its payload
+// length in the lower nibble
+reg [3:0] rec_type;
+reg [3:0] rec_len;
+reg [3:0] rec_idx;
+
+// keyboard, mouse and joystick data is processed the same way
+// whether it arrives as a single command or as a batch record
+wire       in_batch = (command == 8'd5);
+wire [7:0] cmd      = in_batch?{ 4'h0, rec_type }:command;
+wire [3:0] idx      = in_batch?rec_idx:state;
+wire       payload  = !in_batch || (rec_len != 4'd0);
    
 reg [7:0] mouse_x_cnt;
 reg [7:0] mouse_y_cnt;
 
+// add signed mouse movement, saturating instead of wrapping
+function [7:0] sat_add(input [7:0] a, input [7:0] b);
+   reg [8:0] sum;
+   begin
+      sum = { a[7], a } + { b[7], b };
+      sat_add = (sum[8] != sum[7])?(sum[8]?8'h81:8'h7f):sum[7:0];
+   end
+endfunction
+
 reg irq_enable;
 reg [5:0] db9_portD;
 reg [5:0] db9_portD2;
 
+// interrupt sources to be read by the MCU via CMD 6
+reg irq_db9;
+reg irq_vbl;
+reg vbl_armed;   // one shot vbl interrupt requested by MCU
+reg [1:0] vblD;
+
 // translate incoming HID key codes into
 // Atari ST key matrix positions
 wire [2:0] kbd_row;
@@ -62,6 +95,9 @@ always @(posedge clk) begin
       mouse_div <= 15'd0;
       irq <= 1'b0;
       irq_enable <= 1'b0;
+      irq_db9 <= 1'b0;
+      irq_vbl <= 1'b0;
+      vbl_armed <= 1'b0;
 
       // reset entire keyboard to 1's
       keyboard[ 0] <= 8'hff; keyboard[ 1] <= 8'hff; keyboard[ 2] <= 8'hff;
@@ -81,50 +117,88 @@ always @(posedge clk) begin
             // irq_enable prevents further interrupts until
             // the db9 state has actually been read by the MCU
             irq <= 1'b1;
+            irq_db9 <= 1'b1;
             irq_enable <= 1'b0;
         end
       end
 
+      // raise interrupt on start of vertical blank if requested
+      vblD <= { vblD[0], vbl };
+      if(vbl_armed && vblD == 2'b01) begin
+          irq <= 1'b1;
+          irq_vbl <= 1'b1;
+          vbl_armed <= 1'b0;
+      end
+
       if(iack) irq <= 1'b0;      // iack clears interrupt
 
       if(data_in_strobe) begin      
         if(data_in_start) begin
             state <= 4'd0;
             command <= data_in;
+            rec_len <= 4'd0;
         end else begin
             if(state != 4'd15) state <= state + 4'd1;
 	    
             // CMD 0: status data
             if(command == 8'd0) begin
                 if(state == 4'd0) data_out <= 8'h01;   // version 1
-                if(state == 4'd1) data_out <= 8'h00;   // subversion 0
+                if(state == 4'd1) data_out <= 8'h02;   // subversion 2: CMD 5 and 6 supported
             end
-	   
-            // CMD 1: keyboard data
-            if(command == 8'd1) begin
-	       // kbd_column and kbd_row are derived from data_in
-               if(state == 4'd0) keyboard[kbd_column][kbd_row] <= data_in[7]; 
+
+            // CMD 5: batch of keyboard, mouse and joystick records
+            if(in_batch) begin
+                if(rec_len == 4'd0) begin
+                    // record header
+                    rec_type <= data_in[7:4];
+                    rec_len <= data_in[3:0];
+                    rec_idx <= 4'd0;
+                end else begin
+                    rec_len <= rec_len - 4'd1;
+                    rec_idx <= rec_idx + 4'd1;
+                end
             end
+
+            if(payload) begin
+                // CMD 1: keyboard data
+                if(cmd == 8'd1) begin
+                    // kbd_column and kbd_row are derived from data_in
+                    if(idx == 4'd0) keyboard[kbd_column][kbd_row] <= data_in[7]; 
+                end
 	       
-            // CMD 2: mouse data
-            if(command == 8'd2) begin
-                if(state == 4'd0) mouse_btns <= data_in[1:0];
-                if(state == 4'd1) mouse_x_cnt <= mouse_x_cnt + data_in;
-                if(state == 4'd2) mouse_y_cnt <= mouse_y_cnt + data_in;
+                // CMD 2: mouse data
+                if(cmd == 8'd2) begin
+                    if(idx == 4'd0) mouse_btns <= data_in[1:0];
+                    if(idx == 4'd1) mouse_x_cnt <= sat_add(mouse_x_cnt, data_in);
+                    if(idx == 4'd2) mouse_y_cnt <= sat_add(mouse_y_cnt, data_in);
+                end
+
+                // CMD 3: receive digital joystick data
+                if(cmd == 8'd3) begin
+                    if(idx == 4'd0) device <= data_in;
+                    if(idx == 4'd1) begin
+                        if(device == 8'd0) joystick0 <= data_in;
+                        if(device == 8'd1) joystick1 <= data_in;
+                    end 
+                end
             end
 
-            // CMD 3: receive digital joystick data
-            if(command == 8'd3) begin
-                if(state == 4'd0) device <= data_in;
-                if(state == 4'd1) begin
-                    if(device == 8'd0) joystick0 <= data_in;
-                    if(device == 8'd1) joystick1 <= data_in;
-                end 
+            // CMD 6: read interrupt sources, bit 0 of the first byte arms
+            // the vbl interrupt (also as batch record). Only a plain read
+            // clears the vbl source, the db9 source is cleared by CMD 4
+            if(command == 8'd6 && state == 4'd0) begin
+                data_out <= { 6'b000000, irq_vbl, irq_db9 };
+                if(!data_in[0] && irq_vbl) irq_vbl <= 1'b0;
             end
+            if(cmd == 8'd6 && payload && idx == 4'd0 && data_in[0])
+                vbl_armed <= 1'b1;
 
             // CMD 4: send digital joystick data to MCU
             if(command == 8'd4) begin
-                if(state == 4'd0) irq_enable <= 1'b1;    // (re-)enable interrupt
+                if(state == 4'd0) begin
+                    irq_enable <= 1'b1;    // (re-)enable interrupt
+                    irq_db9 <= 1'b0;
+                end
                 data_out <= {2'b00, db9_portD };               
             end
 
@@ -6,10 +6,20 @@
 // it can internally read and write at any rate. This file also has a 512
 // byte sector buffer to allow the same for the MCU communicating via SPI.
 //
+// The MCU may upload the list of extents of each mounted image. Requests
+// of the core are then translated into physical sectors right here and
+// the MCU is only involved for images with more fragments than fit into
+// the table.
+//
+// The MCU may also answer requests itself, e.g. for compressed images it
+// decodes. The sector data is then sent into the local buffer and passed
+// on to the core as if it had been read from the card.
+//
 
 module sd_card # (
     parameter [2:0] CLK_DIV = 3'd2,
-    parameter       SIMULATE = 0
+    parameter       SIMULATE = 0,
+    parameter       EXT_BITS = 4      // 2^EXT_BITS extent table entries per image
 ) (
     // rstn active-low, 1:working, 0:reset
     input			  rstn,
@@ -52,10 +62,12 @@ module sd_card # (
     // directly tied to the sd card. Now this goes to the MCU via the
     // MCU interface as the MCU translates sector numbers from those
     // the core tries to use to physical ones inside the file system
-    // of the sd card
+    // of the sd card. If the MCU has uploaded an extent table for the
+    // requesting image, this is done locally instead
     input [3:0]		  rstart, // up to four different sources can request data 
     input [3:0]		  wstart, 
     input [31:0]	  rsector,
+    input [15:0]	  rcount, // number of consecutive sectors that will follow rsector
     output			  rbusy,
     output			  rdone,
 
@@ -83,12 +95,27 @@ reg [31:0] lsector;
 
 // local buffer to hold one sector to be forwarded to the MCU
 reg [8:0]  mcu_tx_cnt;
+reg		   mcu_tx_ahead;   // a byte has been fetched ahead for the MCU
    
 // only export outen if the resulting data is for the core
 wire louten;  
 
+// sector data sent by the MCU for the core
+reg		   fill_en;
+reg [8:0]  fill_addr;
+reg		   fill_last;
+reg		   fill_done;
+reg		   fill_run;
+reg		   fill_cmd;   // CMD 8 is being continued via CMD 6
+wire [8:0] loutaddr;
+wire [7:0] loutbyte;
+wire	   lrdone;
+
 // drive outen only if the core reads data for itself
-assign outen = (state == CORE_IO && rstart_int)?louten:1'b0;   
+assign outen = ((state == CORE_IO && rstart_int) || hw_state == HW_IO)?louten:fill_en;   
+assign outaddr = fill_en?fill_addr:loutaddr;
+assign outbyte = fill_en?doutb:loutbyte;
+assign rdone = lrdone || fill_done;
    
 // Keep track of current sector destination. We cannot use the command
 // directly as the MCU may alter this during sector transfer
@@ -97,7 +124,9 @@ localparam [2:0] IDLE         = 3'd0,
                  MCU_READ_TX  = 3'd2,   // transmit to MCU for read
                  MCU_WRITE_SD = 3'd3,   // write to SD
                  MCU_WRITE_RX = 3'd4,   // receive from MCU for write
-                 CORE_IO      = 3'd5;   // core itself does SD card IO
+                 CORE_IO      = 3'd5,   // core itself does SD card IO
+                 CORE_FILL_RX = 3'd6,   // receive sector data for the core from MCU
+                 CORE_FILL_TX = 3'd7;   // pass that data on to the core
 
 reg [2:0] state; 
 wire [7:0] inbyte_int;  
@@ -107,6 +136,53 @@ wire rstart_any = {|{rstart}};
 wire wstart_any = {|{wstart}};
 wire start_any = rstart_any || wstart_any;
 
+// image requesting, the lowest one wins
+wire [1:0] start_drive = (rstart[0] || wstart[0])?2'd0:
+                         (rstart[1] || wstart[1])?2'd1:
+                         (rstart[2] || wstart[2])?2'd2:2'd3;
+
+// ---------------------- extent tables ------------------------
+// Each entry holds the first sector of an extent within the image and
+// the physical sector it starts at on the sd card. The extent ends where
+// the next entry begins. The last entry only marks the end of the image.
+reg [63:0] ext_table [0:(4<<EXT_BITS)-1];
+reg [63:0] ext_q;   
+reg		   ext_we;   
+reg [EXT_BITS+1:0] ext_waddr;
+reg [63:0] ext_wdata;   
+reg [EXT_BITS:0] ext_count [0:3];  // entries incl. end marker, 0 = no table
+reg [EXT_BITS:0] ext_wr_idx;
+reg [2:0]  ext_byte;   
+reg [1:0]  ext_drive;   
+
+// translation of core requests by extent table lookup
+localparam [2:0] HW_IDLE      = 3'd0,
+                 HW_WAIT      = 3'd1,   // wait for sd card to become available
+                 HW_READ      = 3'd2,   // read next table entry
+                 HW_CHECK     = 3'd3,   // check table entry
+                 HW_IO        = 3'd4;   // sd card transfers sector for the core
+
+reg [2:0]  hw_state;
+reg [1:0]  hw_drive;
+reg [EXT_BITS-1:0] hw_idx;
+reg		   hw_rw;             // core wants to write
+reg		   hw_found;
+reg [31:0] hw_sector;
+reg [31:0] hw_lsector;
+reg		   hw_fallback;       // table doesn't cover the request, let the MCU handle it
+reg		   hw_startD;
+
+// MCU requests that have to wait for the table driven transfer to end
+reg		   mcu_rpending;
+reg		   mcu_wpending;
+wire	   hw_busy = (hw_state != HW_IDLE) && (hw_state != HW_WAIT);
+wire	   mcu_pending = mcu_rpending || mcu_wpending;   
+
+always @(posedge clk) begin
+   if(ext_we) ext_table[ext_waddr] <= ext_wdata;
+   ext_q <= ext_table[{hw_drive, hw_idx}];
+end
+
 wire [7:0] doutb;
 reg  dinb_we;
 
@@ -115,9 +191,9 @@ sector_dpram #(8, 9) buffer
 (
 	.clock(clk),
 
-	.address_a(outaddr),
-	.wren_a((state == MCU_READ_SD) && louten),
-	.data_a(outbyte),
+	.address_a(loutaddr),
+	.wren_a((state == MCU_READ_SD) && !hw_busy && louten),
+	.data_a(loutbyte),
 	.q_a(inbyte_int),
 
 	.address_b(mcu_tx_cnt),
@@ -130,9 +206,9 @@ sector_dpram buffer(
     .clka(clk),
     .reseta(1'b0), 
     .cea(1'b1), 					
-    .ada(outaddr), 
-    .wrea((state == MCU_READ_SD) && louten), 
-    .dina(outbyte),
+    .ada(loutaddr), 
+    .wrea((state == MCU_READ_SD) && !hw_busy && louten), 
+    .dina(loutbyte),
     .ocea(1'b1), 
     .douta(inbyte_int),
 					
@@ -156,8 +232,12 @@ always @(posedge clk) begin
    end else begin
       startD <= start_any;
 	  
-      // rising edge of rstart_any raises interrupt
-      if(start_any && !startD)
+      // rising edge of rstart_any raises interrupt unless the
+      // request can be translated via the extent table
+      if(start_any && !startD && (ext_count[start_drive] == 0 || hw_state != HW_IDLE))
+        irq <= 1'b1;
+
+      if(hw_fallback)
         irq <= 1'b1;
 	  
       // iack clears interrupt
@@ -178,22 +258,127 @@ always @(posedge clk) begin
       image_mounted <= 4'b0000;
       state <= IDLE;      
 	  dinb_we <=1'b0;
+	  ext_we <= 1'b0;
+	  ext_count[0] <= 0;
+	  ext_count[1] <= 0;
+	  ext_count[2] <= 0;
+	  ext_count[3] <= 0;
+	  hw_state <= HW_IDLE;
+	  hw_fallback <= 1'b0;
+	  hw_startD <= 1'b0;
+	  mcu_rpending <= 1'b0;
+	  mcu_wpending <= 1'b0;
+	  mcu_tx_ahead <= 1'b0;
+	  fill_en <= 1'b0;
+	  fill_last <= 1'b0;
+	  fill_done <= 1'b0;
+	  fill_run <= 1'b0;
+	  fill_cmd <= 1'b0;
    end else begin
       image_mounted <= 4'b0000;
+	  ext_we <= 1'b0;
+	  hw_fallback <= 1'b0;
+	  hw_startD <= start_any;
+
+	  // translate core requests via the extent table
+	  case(hw_state)
+		HW_IDLE:
+		  if(start_any && !hw_startD && ext_count[start_drive] != 0) begin
+			 hw_drive <= start_drive;
+			 hw_rw <= wstart_any;
+			 hw_state <= HW_WAIT;
+		  end
+
+		HW_WAIT:
+		  // the MCU may still be using the sd card or passing data to the core
+		  if(!rstart_int && !wstart_int && !mcu_pending && state != CORE_FILL_TX) begin
+			 hw_sector <= rsector;
+			 hw_idx <= 0;
+			 hw_found <= 1'b0;
+			 hw_state <= HW_READ;
+		  end
+
+		HW_READ:
+		  // table entry is valid in the next cycle
+		  hw_state <= HW_CHECK;
+
+		HW_CHECK:
+		  if(hw_idx == ext_count[hw_drive]-1'd1 || ext_q[63:32] > hw_sector) begin
+			 // end marker or first extent behind the requested sector
+			 if(rstart_int || wstart_int)
+			   // MCU has started its own transfer in the meantime
+			   hw_state <= HW_WAIT;
+			 else if(hw_found && ext_q[63:32] > hw_sector) begin
+				rstart_int <= !hw_rw;
+				wstart_int <= hw_rw;
+				hw_state <= HW_IO;
+			 end else begin
+				hw_fallback <= 1'b1;
+				hw_state <= HW_IDLE;
+			 end
+		  end else begin
+			 // sector is in this extent or behind it
+			 hw_found <= 1'b1;
+			 hw_lsector <= ext_q[31:0] + (hw_sector - ext_q[63:32]);
+			 hw_idx <= hw_idx + 1'd1;
+			 hw_state <= HW_READ;
+		  end
+
+		HW_IO:
+		  if(lrdone) hw_state <= HW_IDLE;
+
+		default:
+		  hw_state <= HW_IDLE;
+	  endcase
 
       // done from sd reader acknowledges/clears start
-      if(rdone) begin
+      if(lrdone) begin
 		 rstart_int <= 1'b0;
 		 wstart_int <= 1'b0;
       end
+
+	  // start MCU requests that had to wait for the table driven transfer
+	  if(mcu_pending && !hw_busy) begin
+		 rstart_int <= mcu_rpending;
+		 wstart_int <= mcu_wpending;
+		 mcu_rpending <= 1'b0;
+		 mcu_wpending <= 1'b0;
+	  end
+	  
+	  // pass the sector data received from the MCU to the core once a
+	  // table driven transfer has ended. The buffer output is valid one
+	  // cycle after the address
+	  fill_en <= 1'b0;
+	  fill_last <= 1'b0;
+	  fill_done <= fill_last;
+	  if(state == CORE_FILL_TX) begin
+		 if(!fill_run) begin
+			if(!hw_busy) begin
+			   fill_run <= 1'b1;
+			   mcu_tx_cnt <= 9'd0;
+			end
+		 end else begin
+			fill_en <= 1'b1;
+			fill_addr <= mcu_tx_cnt;
+			mcu_tx_cnt <= mcu_tx_cnt + 9'd1;
+			if(mcu_tx_cnt == 9'd511) begin
+			   fill_run <= 1'b0;
+			   fill_last <= 1'b1;
+			   state <= IDLE;
+			end
+		 end
+	  end
 	  
 	  // buffer writing is triggered via dinb_we
 	  dinb_we <=1'b0;
 	  if(dinb_we) begin
 		 if(mcu_tx_cnt < 9'd511)
 		   mcu_tx_cnt <= mcu_tx_cnt + 9'd1;
+		 else if(state == CORE_FILL_RX) 
+		   state <= CORE_FILL_TX;
 		 else begin
-			wstart_int <= 1'b1;
+			if(hw_busy) mcu_wpending <= 1'b1;
+			else        wstart_int <= 1'b1;
 			state <= MCU_WRITE_SD;
 		 end
 	  end
@@ -205,9 +390,20 @@ always @(posedge clk) begin
 			// differentiate between the two reads
 			if(data_in == 8'd2 || data_in == 8'd3)
               state <= (data_in == 8'd3)?MCU_READ_SD:CORE_IO;
+
+			if(data_in != 8'd6)
+			  fill_cmd <= 1'b0;
+
+			// the read transfer is always one byte ahead as the last
+			// strobe of the previous chunk already fetched the next byte.
+			// If the data only became ready with that strobe, nothing
+			// has been fetched yet
+			if(data_in == 8'd6 && state == MCU_READ_TX && mcu_tx_ahead)
+			  mcu_tx_cnt <= mcu_tx_cnt - 9'd1;
 			
 			byte_cnt <= 4'd0;	    
-			data_out <= { card_stat, card_type, rbusy, 1'b0 };
+			// bit 0 indicates support for CMD 6
+			data_out <= { card_stat, card_type, rbusy, 1'b1 };
 		 end else begin
 			// SDC CMD 1: STATUS
 			if(command == 8'd1) begin
@@ -218,6 +414,15 @@ always @(posedge clk) begin
 			   if(byte_cnt == 4'd2) data_out <= rsector[23:16];
 			   if(byte_cnt == 4'd3) data_out <= rsector[15: 8];
 			   if(byte_cnt == 4'd4) data_out <= rsector[ 7: 0];
+			   // the run length allows the MCU to translate the whole
+			   // run at once. Older MCU firmware simply doesn't read it
+			   if(byte_cnt == 4'd5) data_out <= rcount[15: 8];
+			   if(byte_cnt == 4'd6) data_out <= rcount[ 7: 0];
+			   // the write flags and their complement tell the MCU the
+			   // direction, e.g. to redirect writes into an overlay. Older
+			   // cores return the same byte twice
+			   if(byte_cnt == 4'd7) data_out <= { 4'b0000,  wstart };
+			   if(byte_cnt == 4'd8) data_out <= { 4'b1111, ~wstart };
 			end
 			
 			// SDC CMD 2: CORE_RW, CMD 3: MCU_READ
@@ -228,7 +433,7 @@ always @(posedge clk) begin
                // can wait for 0 to be read when waiting for
                // sector data to become available
                if(byte_cnt <= 4'd3) data_out <= 8'hff;
-               else	                data_out <= { 7'd0, rstart_int ||  wstart_int };
+               else	                data_out <= { 7'd0, rstart_int ||  wstart_int || mcu_pending };
 			   
                if(byte_cnt == 4'd0) lsector[31:24] <= data_in;
                if(byte_cnt == 4'd1) lsector[23:16] <= data_in;
@@ -236,9 +441,15 @@ always @(posedge clk) begin
                if(byte_cnt == 4'd3) begin 
                   lsector[ 7: 0] <= data_in;
 				  
-				  // distinguish between read and write
-				  if(rstart_any || command == 8'd3) rstart_int <= 1'b1;
-				  if(wstart_any) wstart_int <= 1'b1;
+				  // distinguish between read and write. The table driven
+				  // translation may be using the sd card right now
+				  if(hw_busy) begin
+					 if(rstart_any || command == 8'd3) mcu_rpending <= 1'b1;
+					 if(wstart_any) mcu_wpending <= 1'b1;
+				  end else begin
+					 if(rstart_any || command == 8'd3) rstart_int <= 1'b1;
+					 if(wstart_any) wstart_int <= 1'b1;
+				  end
                end
 			   
                // MCU has requested a sector. Start returning data once it arrives
@@ -247,14 +458,16 @@ always @(posedge clk) begin
                     // has thus been set and all data has arrived, so
                     // rstart_int is reset again, then start mcu transfer
                     if(byte_cnt >= 4'd4) begin
-                        if(!rstart_int) begin
+                        if(!rstart_int && !mcu_rpending) begin
                             state <= MCU_READ_TX;
                             mcu_tx_cnt <= 9'd0;
+                            mcu_tx_ahead <= 1'b0;
                         end
 				  
                         if(state == MCU_READ_TX) begin
                             data_out <= doutb;					 
                             mcu_tx_cnt <= mcu_tx_cnt + 9'd1;
+                            mcu_tx_ahead <= 1'b1;
                         end
                     end
                 end	       
@@ -270,8 +483,11 @@ always @(posedge clk) begin
 			   if(byte_cnt == 4'd3) image_size[15:8]  <= data_in;
 			   if(byte_cnt == 4'd4) begin 
 				  image_size[7:0]   <= data_in;
-				  if(image_target <= 8'd3)  // images 0..3 are supported
+				  if(image_target <= 8'd3) begin  // images 0..3 are supported
 					image_mounted[image_target] <= 1'b1;
+					// a new image needs a new extent table
+					ext_count[image_target[1:0]] <= 0;
+				  end
 			   end
 			end
 			
@@ -288,7 +504,7 @@ always @(posedge clk) begin
                end
 			   
 			   // send "busy" while transfer is still in progress
-			   data_out <= rbusy?8'h01:8'h00; 
+			   data_out <= (rbusy || mcu_wpending)?8'h01:8'h00; 
 			   
 			   // data transfer from MCU to buffer
 			   if(!wstart_int && state == MCU_WRITE_RX) begin	  
@@ -302,6 +518,101 @@ always @(posedge clk) begin
 			   end
 			end
 			
+			// SDC CMD 6: CONTINUE
+			if(command == 8'd6) begin
+			   // MCU continues a transfer it has split into several SPI
+			   // transactions to not block the bus for other targets. The
+			   // first byte after the command is a dummy
+			   if(state == CORE_IO)
+				 data_out <= { 7'd0, rstart_int || wstart_int };
+			   
+			   if(state == MCU_READ_SD) begin
+				  data_out <= { 7'd0, rstart_int || mcu_rpending };
+				  if(!rstart_int && !mcu_rpending) begin
+					 state <= MCU_READ_TX;
+					 mcu_tx_cnt <= 9'd0;
+					 mcu_tx_ahead <= 1'b0;
+				  end
+			   end
+			   
+			   if(state == MCU_READ_TX) begin
+				  // the MCU hasn't seen the ready yet if the data became
+				  // ready on the last strobe of the previous chunk. Report
+				  // it again before returning the first byte
+				  if(byte_cnt == 4'd0 && !mcu_tx_ahead)
+					data_out <= 8'h00;
+				  else begin
+					 data_out <= doutb;
+					 mcu_tx_cnt <= mcu_tx_cnt + 9'd1;
+					 mcu_tx_ahead <= 1'b1;
+				  end
+			   end
+
+			   if(state == MCU_WRITE_RX && !wstart_int && byte_cnt != 4'd0)
+				 dinb_we <= 1'b1;
+			   
+			   if(state == MCU_WRITE_SD)
+				 data_out <= (rbusy || mcu_wpending)?8'h01:8'h00; 
+
+			   if(state == CORE_FILL_RX && byte_cnt != 4'd0)
+				 dinb_we <= 1'b1;
+			   
+			   if(fill_cmd)
+				 data_out <= (state == CORE_FILL_RX || state == CORE_FILL_TX)?8'h01:8'h00;
+			end
+			
+			// SDC CMD 7: EXTENTS
+			if(command == 8'd7) begin
+			   // MCU uploads the extent table of an image. The table
+			   // size and its complement are returned in the two
+			   // bytes after the image number, so the MCU can tell
+			   // whether the table fits. Each entry is sent as 32 bit
+			   // image sector followed by the 32 bit physical sector
+			   if(byte_cnt == 4'd0) begin
+				  ext_drive <= data_in[1:0];
+				  ext_count[data_in[1:0]] <= 0;
+				  ext_wr_idx <= 0;
+				  ext_byte <= 3'd0;
+				  data_out <= 8'd1 << EXT_BITS;
+			   end
+			   if(byte_cnt == 4'd1) data_out <= ~(8'd1 << EXT_BITS);
+			   if(byte_cnt >= 4'd3) begin
+				  ext_wdata <= { ext_wdata[55:0], data_in };
+				  // byte_cnt stops at 15, so count the entry bytes separately
+				  ext_byte <= ext_byte + 3'd1;
+				  if(ext_byte == 3'd7) begin
+					 if(!ext_wr_idx[EXT_BITS]) begin
+						ext_we <= 1'b1;
+						ext_waddr <= { ext_drive, ext_wr_idx[EXT_BITS-1:0] };
+						ext_wr_idx <= ext_wr_idx + 1'd1;
+						ext_count[ext_drive] <= ext_wr_idx + 1'd1;
+					 end else
+					   // table too small, the MCU has to translate
+					   ext_count[ext_drive] <= 0;
+				  end
+			   end
+			end
+			
+			// SDC CMD 8: CORE_DATA
+			if(command == 8'd8) begin
+			   // MCU answers the core's request itself. If the first byte
+			   // is 0, then 512 bytes of sector data follow, which are passed
+			   // to the core like data read from the card. A 1 completes
+			   // the request without data, e.g. to ignore a write. The
+			   // first reply tells the MCU that the command is supported,
+			   // the following ones are 1 until the core has the data
+			   if(byte_cnt == 4'd0) begin
+				  data_out <= 8'h5a;
+				  mcu_tx_cnt <= 9'd0;
+				  fill_cmd <= 1'b1;
+				  if(data_in == 8'd0) state <= CORE_FILL_RX;
+				  if(data_in == 8'd1) fill_done <= 1'b1;
+			   end else begin
+				  data_out <= (state == CORE_FILL_RX || state == CORE_FILL_TX)?8'h01:8'h00;
+				  if(state == CORE_FILL_RX) dinb_we <= 1'b1;
+			   end
+			end
+			
 			if(byte_cnt != 4'd15) byte_cnt <= byte_cnt + 4'd1;    
          end
       end
@@ -337,17 +648,19 @@ sd_rw #(.CLK_DIV(CLK_DIV), .SIMULATE(SIMULATE)) sd_rw (
    .card_stat(card_stat),
    .card_type(card_type),
 
-   // lsector is the translated rsector into the file on the FAT fs
+   // lsector is the translated rsector into the file on the FAT fs. A
+   // sector translated via extent table doesn't touch lsector as the MCU
+   // may be sending its own request meanwhile
    .rstart( rstart_int ), 
    .wstart( wstart_int ), 
-   .sector( lsector ),
+   .sector( (hw_state == HW_IO)?hw_lsector:lsector ),
    .rbusy( rbusy ),
-   .rdone( rdone ),
+   .rdone( lrdone ),
 
-   .inbyte((state == CORE_IO)?inbyte:inbyte_int),
+   .inbyte((state == CORE_IO || hw_state == HW_IO)?inbyte:inbyte_int),
    .outen(louten),
-   .outaddr(outaddr),
-   .outbyte(outbyte)
+   .outaddr(loutaddr),
+   .outbyte(loutbyte)
 );
 
 endmodule // sd_card
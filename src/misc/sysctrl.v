@@ -44,6 +44,7 @@ module sysctrl (
   output reg [1:0]  system_volume,
   output reg	    system_wide_screen,
   output reg [1:0]  system_floppy_wprot,
+  output reg [1:0]  system_floppy_turbo,
   output reg	    system_cubase_en,
   output reg [1:0]  system_port_mouse,
   output reg	    system_tos_slot
@@ -116,6 +117,7 @@ always @(posedge clk) begin
       system_volume <= 2'b00;       // mute
       system_wide_screen <= 1'b0;   // normal video 
       system_floppy_wprot <= 2'b00; // floppy not write protected
+      system_floppy_turbo <= 2'b00; // authentic floppy timing
       system_cubase_en <= 1'b0;     // no cubase dongle
       system_port_mouse <= 2'b00;   // mouse on usb -> db9 joystick
       system_tos_slot <= 1'b0;      // primary tos slot
@@ -205,6 +207,8 @@ always @(posedge clk) begin
                     if(id == "W") system_wide_screen <= data_in[0];
                     // Value "P": floppy write protecion None(0), A(1), B(2) both(3)
                     if(id == "P") system_floppy_wprot <= data_in[1:0];
+                    // Value "D": floppy speed normal(0), turbo 2x(1), 4x(2) or 8x(3)
+                    if(id == "D") system_floppy_turbo <= data_in[1:0];
                     // Value "Q": enable (1) or disable (0) Cubase dongle(s)
                     if(id == "Q") system_cubase_en <= data_in[0];
                     // Value "J": USB Mouse(0), DB9/Atari ST(1) or DB9/Amiga(2)
@@ -5,7 +5,9 @@
     to different top levels exposing different signals.
 */
 
-module misterynano (
+module misterynano #(
+  parameter TRACK_CACHE = 1'b0  // floppy track cache, needs 16kB of block RAM
+) (
   input			clk,
 `ifdef EFINIX
   // with efinix, all plls are toplevel
@@ -144,6 +146,7 @@ wire [1:0] system_scanlines;
 wire [1:0] system_volume;
 wire       system_wide_screen;
 wire [1:0] system_floppy_wprot;
+wire [1:0] system_floppy_turbo;
 wire       system_cubase_en;
 wire [1:0] system_port_mouse;
 wire       system_tos_slot;
@@ -380,6 +383,7 @@ hid hid (
         .db9_port( db9_joy ),
         .irq( hid_int ),
         .iack( hid_iack ),
+        .vbl( !st_vs_n ),
 
         .mouse(hid_mouse),
         .keyboard(keyboard),
@@ -432,6 +436,7 @@ sysctrl sysctrl (
         .system_volume(system_volume),
         .system_wide_screen(system_wide_screen),
         .system_floppy_wprot(system_floppy_wprot),
+        .system_floppy_turbo(system_floppy_turbo),
         .system_port_mouse(system_port_mouse),
         .system_tos_slot(system_tos_slot),
         
@@ -468,6 +473,7 @@ reg         sd_ready;
 wire [1:0] 	acsi_rd_req;
 wire [1:0] 	acsi_wr_req;
 wire [31:0] acsi_lba;
+wire [15:0] acsi_count;
 wire acsi_sd_done = sd_done;
 wire acsi_sd_busy = sd_busy;
 wire acsi_sd_rd_byte_strobe = sd_rd_byte_strobe;
@@ -476,7 +482,9 @@ wire [7:0] acsi_sd_wr_byte;
 wire [8:0] acsi_sd_byte_addr = sd_byte_index;
 `endif
    
-atarist atarist (
+atarist #(
+    .TRACK_CACHE(TRACK_CACHE)
+) atarist (
     .clk_32(clk32),
     .resb(!system_reset[0] && !reset && !por && ram_ready && flash_ready && sd_ready),       // user reset button
     .porb(!por),
@@ -531,6 +539,7 @@ atarist atarist (
 	.acsi_rd_req( ),
 	.acsi_wr_req( ),
 	.acsi_sd_lba( ),
+	.acsi_sd_count( ),
  	.acsi_sd_done(1'b0),
  	.acsi_sd_busy(1'b0),
 	.acsi_sd_rd_byte_strobe(1'b0),
@@ -541,6 +550,7 @@ atarist atarist (
 	.acsi_rd_req(acsi_rd_req),
 	.acsi_wr_req(acsi_wr_req),
 	.acsi_sd_lba(acsi_lba),
+	.acsi_sd_count(acsi_count),
  	.acsi_sd_done(acsi_sd_done),
  	.acsi_sd_busy(acsi_sd_busy),
 	.acsi_sd_rd_byte_strobe(acsi_sd_rd_byte_strobe),
@@ -569,6 +579,7 @@ atarist atarist (
     .ste(system_chipset >= 2'd2),           // STE (2)
     .enable_extra_ram(system_memory),       // enable extra ram
     .floppy_protected(system_floppy_wprot), // floppy write protection
+    .floppy_turbo(system_floppy_turbo),     // faster floppy timing
     .cubase_en(system_cubase_en),           // enable cubase dongles
 
     // interface to sdram
@@ -726,12 +737,14 @@ sd_card #(
     .rstart( { 2'b00, sd_rd } ), 
     .wstart( { 2'b00, sd_wr } ),
     .rsector( sd_lba ),
+    .rcount( 16'd1 ),
     .inbyte(sd_wr_data),
 `else
     // user read sector command interface (sync with clk32)
     .rstart( { acsi_rd_req, sd_rd} ), 
     .wstart( { acsi_wr_req, sd_wr } ), 
     .rsector( is_acsi?acsi_lba:sd_lba),
+    .rcount( is_acsi?acsi_count:16'd1),
     .inbyte(is_acsi?acsi_sd_wr_byte:sd_wr_data),
 `endif
 
@@ -162,7 +162,8 @@ assign i2s_bclk = clk_audio;
 assign i2s_lrck = por?1'b0:audio_bit_cnt[4];
 assign i2s_din = por?1'b0:audio[i2s_lrck][15-audio_bit_cnt[3:0]];
    
-misterynano misterynano (
+// plenty of block RAM for the floppy track cache
+misterynano #( .TRACK_CACHE(1'b1) ) misterynano (
   .clk   ( clk ),           // 50MHz clock uses e.g. for the flash pll
 
   .reset ( !reset_n ),